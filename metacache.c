@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metacache.h"
+
+struct metacache_item {
+    struct metacache_item *chain;   // next in the bucket
+    struct metacache_item *newer;
+    struct metacache_item *older;
+    uint64_t hash;
+    struct metacache_entry entry;
+    char path[];
+};
+
+// FNV-1a, then mixed so both halves are usable for the filter
+static uint64_t hash_path(const char *path) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+int metacache_init(struct metacache *mc, size_t capacity, uint64_t filter_bits) {
+    memset(mc, 0, sizeof(*mc));
+    if (capacity == 0) return 0;
+
+    size_t per_shard = (capacity + METACACHE_SHARDS - 1) / METACACHE_SHARDS;
+    size_t buckets = 1;
+    while (buckets < per_shard) buckets <<= 1;
+    for (int i = 0; i < METACACHE_SHARDS; i++) {
+        struct metacache_shard *shard = &mc->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->buckets = calloc(buckets, sizeof(shard->buckets[0]));
+        if (!shard->buckets) return -1;
+        shard->mask = buckets - 1;
+        shard->capacity = per_shard;
+    }
+
+    mc->filter_bits = (filter_bits + 63) & ~63ULL;
+    mc->filter = calloc(mc->filter_bits / 64, sizeof(uint64_t));
+    if (!mc->filter) return -1;
+    return 0;
+}
+
+static struct metacache_shard *shard_for(struct metacache *mc, uint64_t hash) {
+    return &mc->shards[hash >> 60 & (METACACHE_SHARDS - 1)];
+}
+
+static struct metacache_item *find(struct metacache_shard *shard, const char *path, uint64_t hash) {
+    struct metacache_item *item = shard->buckets[hash & shard->mask];
+    while (item && (item->hash != hash || strcmp(item->path, path) != 0)) item = item->chain;
+    return item;
+}
+
+static void lru_unlink(struct metacache_shard *shard, struct metacache_item *item) {
+    if (item->newer) item->newer->older = item->older; else shard->newest = item->older;
+    if (item->older) item->older->newer = item->newer; else shard->oldest = item->newer;
+}
+
+static void lru_push(struct metacache_shard *shard, struct metacache_item *item) {
+    item->newer = NULL;
+    item->older = shard->newest;
+    if (shard->newest) shard->newest->newer = item; else shard->oldest = item;
+    shard->newest = item;
+}
+
+static void remove_item(struct metacache_shard *shard, struct metacache_item *item) {
+    struct metacache_item **link = &shard->buckets[item->hash & shard->mask];
+    while (*link != item) link = &(*link)->chain;
+    *link = item->chain;
+    lru_unlink(shard, item);
+    shard->count--;
+    free(item);
+}
+
+// The entry for path, created (evicting the oldest if the shard is full) if
+// it is missing. Called with the shard locked; NULL if memory runs out.
+static struct metacache_item *find_or_add(struct metacache_shard *shard, const char *path,
+                                          uint64_t hash) {
+    struct metacache_item *item = find(shard, path, hash);
+    if (item) {
+        lru_unlink(shard, item);
+        lru_push(shard, item);
+        return item;
+    }
+
+    if (shard->count >= shard->capacity) remove_item(shard, shard->oldest);
+    size_t len = strlen(path);
+    item = calloc(1, sizeof(*item) + len + 1);
+    if (!item) return NULL;
+    memcpy(item->path, path, len + 1);
+    item->hash = hash;
+    item->chain = shard->buckets[hash & shard->mask];
+    shard->buckets[hash & shard->mask] = item;
+    lru_push(shard, item);
+    shard->count++;
+    return item;
+}
+
+// Double hashing: bit i is h1 + i * h2
+static void filter_add(struct metacache *mc, uint64_t hash) {
+    uint64_t h1 = hash, h2 = (hash >> 32 | hash << 32) | 1;
+    for (int i = 0; i < METACACHE_HASHES; i++) {
+        uint64_t bit = (h1 + i * h2) % mc->filter_bits;
+        __atomic_fetch_or(&mc->filter[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+    }
+}
+
+static int filter_has(struct metacache *mc, uint64_t hash) {
+    uint64_t h1 = hash, h2 = (hash >> 32 | hash << 32) | 1;
+    for (int i = 0; i < METACACHE_HASHES; i++) {
+        uint64_t bit = (h1 + i * h2) % mc->filter_bits;
+        if (!(__atomic_load_n(&mc->filter[bit / 64], __ATOMIC_RELAXED) & 1ULL << (bit % 64))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int metacache_get(struct metacache *mc, const char *path, struct metacache_entry *entry) {
+    if (!mc->filter) return 0;
+    uint64_t hash = hash_path(path);
+    struct metacache_shard *shard = shard_for(mc, hash);
+    pthread_mutex_lock(&shard->lock);
+    struct metacache_item *item = find(shard, path, hash);
+    if (item) {
+        lru_unlink(shard, item);
+        lru_push(shard, item);
+        *entry = item->entry;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return item != NULL;
+}
+
+void metacache_seen(struct metacache *mc, const char *path, int node, uint64_t size, time_t mtime) {
+    if (!mc->filter) return;
+    uint64_t hash = hash_path(path);
+    filter_add(mc, hash);
+    struct metacache_shard *shard = shard_for(mc, hash);
+    pthread_mutex_lock(&shard->lock);
+    struct metacache_item *item = find_or_add(shard, path, hash);
+    if (item) {
+        item->entry.node = node;
+        item->entry.size = size;
+        if (mtime != 0) item->entry.mtime = mtime;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+uint64_t metacache_stored(struct metacache *mc, const char *path, int node, uint64_t size,
+                          time_t mtime) {
+    if (!mc->filter) return 0;
+    uint64_t version = __atomic_add_fetch(&mc->next_version, 1, __ATOMIC_RELAXED);
+    uint64_t hash = hash_path(path);
+    filter_add(mc, hash);
+    struct metacache_shard *shard = shard_for(mc, hash);
+    pthread_mutex_lock(&shard->lock);
+    struct metacache_item *item = find_or_add(shard, path, hash);
+    if (item) {
+        item->entry.node = node;
+        item->entry.size = size;
+        item->entry.mtime = mtime;
+        item->entry.version = version;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return version;
+}
+
+void metacache_drop(struct metacache *mc, const char *path) {
+    if (!mc->filter) return;
+    uint64_t hash = hash_path(path);
+    struct metacache_shard *shard = shard_for(mc, hash);
+    pthread_mutex_lock(&shard->lock);
+    struct metacache_item *item = find(shard, path, hash);
+    if (item) remove_item(shard, item);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void metacache_expect(struct metacache *mc, const char *path) {
+    if (mc->filter) filter_add(mc, hash_path(path));
+}
+
+void metacache_loaded(struct metacache *mc, int node) {
+    __atomic_fetch_or(&mc->loaded, 1U << node, __ATOMIC_RELEASE);
+}
+
+int metacache_absent(struct metacache *mc, int node, const char *path) {
+    if (!mc->filter || !(__atomic_load_n(&mc->loaded, __ATOMIC_ACQUIRE) & 1U << node)) return 0;
+    return !filter_has(mc, hash_path(path));
+}
@@ -0,0 +1,86 @@
+#ifndef METACACHE_H
+#define METACACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+// What S1 knows about the files on the storage nodes, so routed commands can
+// be checked without a round trip.
+//
+// Entries map a path below ~s1 ("folder/b.pdf") to the node holding it, its
+// size, its mtime and a version S1 bumps every time it stores the file. They
+// are filled in from uploads, listings and downloads and dropped on removes;
+// the least recently used ones make room when a shard is full.
+//
+// Next to the entries is a Bloom filter of every path known to be on a node.
+// Once a node's whole listing has gone into it, a path the filter has never
+// seen is certainly not on that node and S1 can answer for it. Paths are only
+// ever added, so a removed file just costs the round trip again. Like the
+// nodes' own indexes, files put on a node behind S1's back are not seen until
+// S1 restarts.
+//
+// The cache is shared by S1's reactor threads: entries are spread over shards
+// with a lock each, and the filter is updated with atomic operations.
+
+#define METACACHE_SHARDS 16
+#define METACACHE_HASHES 7      // filter bits set per path
+
+struct metacache_entry {
+    int node;               // index of the storage node holding the file
+    uint64_t size;
+    time_t mtime;           // 0 if not known
+    uint64_t version;       // 0 if S1 has not stored the file since it started
+};
+
+struct metacache_item;
+
+struct metacache_shard {
+    pthread_mutex_t lock;
+    struct metacache_item **buckets;
+    size_t mask;                    // buckets - 1
+    struct metacache_item *newest;  // LRU list, most recently used first
+    struct metacache_item *oldest;
+    size_t count;
+    size_t capacity;
+};
+
+struct metacache {
+    struct metacache_shard shards[METACACHE_SHARDS];
+    uint64_t *filter;
+    uint64_t filter_bits;
+    uint32_t loaded;                // bit per node whose listing is in the filter
+    uint64_t next_version;
+};
+
+// Set up a cache for about capacity entries and a filter of filter_bits bits.
+// A capacity of 0 disables both: lookups miss and nothing is known absent.
+// Returns -1 if memory runs out.
+int metacache_init(struct metacache *mc, size_t capacity, uint64_t filter_bits);
+
+// Copy the entry for path to entry. Returns 1 on a hit, 0 on a miss.
+int metacache_get(struct metacache *mc, const char *path, struct metacache_entry *entry);
+
+// Record a file a listing or download showed on node. The version is kept, as
+// is the mtime if mtime is 0.
+void metacache_seen(struct metacache *mc, const char *path, int node, uint64_t size, time_t mtime);
+
+// Record that S1 has stored path on node; returns the file's new version
+uint64_t metacache_stored(struct metacache *mc, const char *path, int node, uint64_t size,
+                          time_t mtime);
+
+// Forget path after it was removed (or found missing)
+void metacache_drop(struct metacache *mc, const char *path);
+
+// Add path to the filter before it is stored, so a lookup racing the store
+// still goes to the node
+void metacache_expect(struct metacache *mc, const char *path);
+
+// Note that every file on node is now in the filter
+void metacache_loaded(struct metacache *mc, int node);
+
+// 1 if path is certainly not on node
+int metacache_absent(struct metacache *mc, int node, const char *path);
+
+#endif
@@ -0,0 +1,935 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "proto.h"
+#include "xfer.h"
+#include "node.h"
+#include "nsindex.h"
+#include "partfile.h"
+#include "shmring.h"
+#include "tar.h"
+#include "uring.h"
+
+#define BUFFER_SIZE 1024
+#define MAX_REQUEST (BUFFER_SIZE + PATH_MAX)    // LIST carries a path and a cursor
+#define LIST_PAGE_SIZE (16 * 1024)              // bytes of a listing sent per frame
+#define MAX_CONNECTIONS 1024    // open connections from S1's reactor threads
+#define MIN_WORKERS 4           // keep a few spare workers even on small machines
+#define MAX_EVENTS 64
+#define MAX_RING_FD 4096        // connections on higher descriptors get no ring
+#define GROUP_WINDOW_US 2000    // longest a group commit waits for other uploads to join
+#define GROUP_MAX 64            // syncs done by one group commit at most
+
+// -d: where an upload has to be before it is acknowledged
+#define DURABLE_NONE   0        // the page cache; lost on power failure
+#define DURABLE_GROUP  1        // the disk, the syncs of concurrent uploads batched
+#define DURABLE_STRICT 2        // the disk, each upload syncing on its own
+
+// Connections with a request ready, waiting for a worker. Each connection is
+// armed with EPOLLONESHOT, so it is queued at most once and the queue can
+// never hold more than MAX_CONNECTIONS entries.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    int fds[MAX_CONNECTIONS];
+    int head;
+    int count;
+    int open_connections;
+} work = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, {0}, 0, 0, 0 };
+
+static const struct node_config *node;
+static int epoll_fd;
+static int storing_workers;     // workers syncing an upload they stored (atomic)
+
+// A file or directory waiting for a group commit to sync it
+struct sync_request {
+    int fd;
+    int dir;            // fsync rather than fdatasync
+    int result;
+};
+
+// Group commit: the first upload to need a sync leads the group. It waits a
+// little for the other uploads being served to join, syncs them all at once
+// and wakes them with their results. Uploads arriving meanwhile form the next
+// group, which one of them leads once this one is done.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t joined;      // a request joined the forming group
+    pthread_cond_t done;        // a group was synced
+    struct sync_request *queue[GROUP_MAX];
+    int count;
+    int leading;                // a group is being formed or synced
+    unsigned long group;        // number of the forming group
+    unsigned long synced;       // groups done
+} commit = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+             {0}, 0, 0, 0, 0 };
+
+static int durability = DURABLE_GROUP;
+
+// The group commit's syncs go to the kernel together through this ring; fd
+// is -1 without one, and the leader syncs the group's files one by one then
+static struct uring commit_ring = { .fd = -1 };
+
+// Shared-memory rings set up by S1, by connection. A connection is only ever
+// served by one worker at a time, so its slot needs no lock.
+static struct shmring *rings[MAX_RING_FD];
+
+// -i uring: each worker moves file payloads with an io_uring of its own
+// (uring.h). fd stays -1 on threads without one, which use the blocking calls.
+static int use_uring;
+static __thread struct uring worker_ring = { .fd = -1 };
+
+static void queue_push(int fd) {
+    pthread_mutex_lock(&work.lock);
+    work.fds[(work.head + work.count) % MAX_CONNECTIONS] = fd;
+    work.count++;
+    pthread_cond_signal(&work.ready);
+    pthread_mutex_unlock(&work.lock);
+}
+
+static int queue_pop(void) {
+    pthread_mutex_lock(&work.lock);
+    while (work.count == 0) {
+        pthread_cond_wait(&work.ready, &work.lock);
+    }
+    int fd = work.fds[work.head];
+    work.head = (work.head + 1) % MAX_CONNECTIONS;
+    work.count--;
+    pthread_mutex_unlock(&work.lock);
+    return fd;
+}
+
+static void close_connection(int fd) {
+    if (fd < MAX_RING_FD && rings[fd]) {
+        shmring_free(rings[fd]);
+        free(rings[fd]);
+        rings[fd] = NULL;
+    }
+    close(fd);
+    pthread_mutex_lock(&work.lock);
+    work.open_connections--;
+    pthread_mutex_unlock(&work.lock);
+}
+
+// Wait for the next request on fd (again)
+static int arm_connection(int fd, int op) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.fd = fd };
+    return epoll_ctl(epoll_fd, op, fd, &ev);
+}
+
+// SHM_RING: map the ring S1 passed with the request (proto.h) for the
+// connection's uploads
+static int attach_ring(int fd, uint32_t req_id, int *fds, int count) {
+    struct shmring *ring = NULL;
+    if (count == 3 && fd < MAX_RING_FD && !rings[fd]) ring = malloc(sizeof(*ring));
+    if (!ring || shmring_attach(ring, fds[0], fds[1], fds[2]) == -1) {
+        if (!ring) {
+            for (int i = 0; i < count; i++) close(fds[i]);
+        }
+        free(ring);
+        fprintf(stderr, "[%s] Could not set up a shared-memory ring\n", node->name);
+        return proto_send_str(fd, PROTO_ERROR, req_id, "RING_FAILED");
+    }
+    rings[fd] = ring;
+    printf("[%s] Shared-memory ring of %zu KB set up\n", node->name, ring->size / 1024);
+    return proto_send_str(fd, PROTO_OK, req_id, "RING_READY");
+}
+
+// Serve one request from a connection: read the request frame and call the
+// handler registered for its type
+static int dispatch_request(int fd) {
+    struct proto_header hdr;
+    char request[MAX_REQUEST];
+    int fds[PROTO_MAX_FDS], count;
+    if (proto_recv_header_fds(fd, &hdr, fds, &count) == -1 ||
+        proto_recv_payload(fd, &hdr, request, sizeof(request)) == -1) {
+        for (int i = 0; i < count; i++) close(fds[i]);
+        // A clean close between requests is the normal end of a connection
+        if (errno != ECONNRESET) {
+            fprintf(stderr, "[%s] Failed to receive request: %s\n", node->name, strerror(errno));
+        }
+        return -1;
+    }
+    if (hdr.type == PROTO_SHM_RING) return attach_ring(fd, hdr.req_id, fds, count);
+    for (int i = 0; i < count; i++) close(fds[i]);
+
+    for (size_t i = 0; i < node->num_handlers; i++) {
+        if (node->handlers[i].type != hdr.type) continue;
+        return node->handlers[i].handle(fd, hdr.req_id, hdr.flags, request);
+    }
+    return proto_send_str(fd, PROTO_ERROR, hdr.req_id, "INVALID_REQUEST");
+}
+
+// Ring setups are answered by the event loop rather than queued: a worker
+// may be needed to set up the very ring the other workers are waiting on.
+// The frame has no payload, so once its header is in it can be read at once.
+static int ring_request(int fd) {
+    unsigned char buf[PROTO_HEADER_SIZE];
+    struct proto_header hdr;
+    if (recv(fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT) != (ssize_t)sizeof(buf) ||
+        proto_decode_header(buf, &hdr) == -1) {
+        return 0;
+    }
+    return hdr.type == PROTO_SHM_RING && hdr.length == 0;
+}
+
+static void *worker_main(void *arg) {
+    (void)arg;
+    if (use_uring && uring_init(&worker_ring, xfer_chunk()) == -1) {
+        fprintf(stderr, "[%s] Worker without io_uring, using blocking I/O: %s\n", node->name, strerror(errno));
+    }
+    while (1) {
+        int fd = queue_pop();
+        if (dispatch_request(fd) == -1) {
+            close_connection(fd);
+        } else if (arm_connection(fd, EPOLL_CTL_MOD) == -1) {
+            // Could not hand the connection back to the event loop for its next request
+            perror("epoll_ctl failed");
+            close_connection(fd);
+        }
+    }
+    return NULL;
+}
+
+// Sync a group's files and directories, all at once; a directory several
+// uploads went to is synced once
+static void sync_group(struct sync_request **group, int count) {
+    struct stat st[GROUP_MAX];
+    int same[GROUP_MAX];        // earlier request for the same directory, -1 if none
+    int fds[GROUP_MAX], datasync[GROUP_MAX], results[GROUP_MAX], member[GROUP_MAX];
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        struct sync_request *r = group[i];
+        same[i] = -1;
+        r->result = fstat(r->fd, &st[i]);
+        for (int j = 0; r->result == 0 && r->dir && j < i && same[i] == -1; j++) {
+            if (group[j]->result == 0 && group[j]->dir && same[j] == -1 &&
+                st[j].st_dev == st[i].st_dev && st[j].st_ino == st[i].st_ino) {
+                same[i] = j;
+            }
+        }
+        if (r->result == 0 && same[i] == -1) {
+            fds[n] = r->fd;
+            datasync[n] = !r->dir;
+            member[n++] = i;
+        }
+    }
+
+    if (n == 0) return;
+    if (commit_ring.fd == -1 || uring_sync(&commit_ring, fds, datasync, results, n) == -1) {
+        for (int k = 0; k < n; k++) {
+            results[k] = datasync[k] ? fdatasync(fds[k]) : fsync(fds[k]);
+        }
+    }
+    for (int k = 0; k < n; k++) group[member[k]]->result = results[k];
+    for (int i = 0; i < count; i++) {
+        if (same[i] != -1) group[i]->result = group[same[i]]->result;
+    }
+}
+
+// Form the next group (commit.lock held), sync it and wake its members
+static void lead_group(void) {
+    commit.leading = 1;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += GROUP_WINDOW_US * 1000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    // Only uploads already being served can join; a lone one goes at once
+    while (commit.count < GROUP_MAX &&
+           commit.count < __atomic_load_n(&storing_workers, __ATOMIC_RELAXED) &&
+           pthread_cond_timedwait(&commit.joined, &commit.lock, &deadline) == 0) {
+    }
+
+    struct sync_request *group[GROUP_MAX];
+    int count = commit.count;
+    unsigned long number = commit.group++;
+    memcpy(group, commit.queue, count * sizeof(group[0]));
+    commit.count = 0;
+    pthread_mutex_unlock(&commit.lock);
+
+    sync_group(group, count);
+
+    pthread_mutex_lock(&commit.lock);
+    commit.synced = number + 1;
+    commit.leading = 0;
+    pthread_cond_broadcast(&commit.done);
+}
+
+// Sync fd with the next group commit
+static int group_sync(int fd, int dir) {
+    struct sync_request r = { fd, dir, 0 };
+    pthread_mutex_lock(&commit.lock);
+    while (commit.count == GROUP_MAX) {
+        pthread_cond_wait(&commit.done, &commit.lock);
+    }
+    commit.queue[commit.count++] = &r;
+    unsigned long number = commit.group;
+    pthread_cond_signal(&commit.joined);
+    while (commit.synced <= number) {
+        if (!commit.leading) {
+            lead_group();
+        } else {
+            pthread_cond_wait(&commit.done, &commit.lock);
+        }
+    }
+    pthread_mutex_unlock(&commit.lock);
+    if (r.result == -1) errno = EIO;
+    return r.result;
+}
+
+// Put a written file's data on disk as far as the -d mode asks
+static int sync_data(int fd) {
+    if (durability == DURABLE_GROUP) return group_sync(fd, 0);
+    return durability == DURABLE_STRICT ? fdatasync(fd) : 0;
+}
+
+// Put the directory entry for path on disk as far as the -d mode asks
+static int sync_entry(const char *path) {
+    if (durability == DURABLE_NONE) return 0;
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash) *slash = '\0';
+    int fd = open(slash ? (dir[0] ? dir : "/") : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    int ret = durability == DURABLE_GROUP ? group_sync(fd, 1) : fsync(fd);
+    close(fd);
+    return ret;
+}
+
+int node_store_file(FILE *fp, const char *tmp, const char *path) {
+    // A group commit waits for the workers counted here to join it
+    __atomic_add_fetch(&storing_workers, 1, __ATOMIC_RELAXED);
+    int ret = fflush(fp) == EOF ? -1 : sync_data(fileno(fp));
+    if (fclose(fp) != 0) ret = -1;
+    if (ret == 0) ret = rename(tmp, path);
+    if (ret == -1) {
+        int err = errno;
+        unlink(tmp);
+        errno = err;
+    } else {
+        // In place now whatever becomes of the sync
+        ret = sync_entry(path) == -1 ? 1 : 0;
+    }
+    __atomic_sub_fetch(&storing_workers, 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
+// The worker's io_uring for a payload of len bytes, NULL if it has none or
+// the payload is too small to be worth one
+static struct uring *payload_uring(uint64_t len) {
+    return worker_ring.fd != -1 && len >= worker_ring.chunk ? &worker_ring : NULL;
+}
+
+// Receive len payload bytes from the socket into fp
+static int recv_payload(int fd, FILE *fp, uint64_t len, int *failed) {
+    struct uring *u = payload_uring(len);
+    off_t pos;
+    if (!u || !fp || *failed || fflush(fp) == EOF || (pos = ftello(fp)) == -1) {
+        return xfer_recv_file(fd, fp, len, failed);
+    }
+    int ret = uring_recv_file(u, fd, fileno(fp), pos, len, failed);
+    if (ret == 1) return xfer_recv_file(fd, fp, len, failed);
+    if (fseeko(fp, pos + len, SEEK_SET) == -1) *failed = 1;
+    return ret;
+}
+
+// Send a frame: head, then len bytes of fp from offset
+static int send_payload(int fd, const unsigned char *head, size_t head_len, FILE *fp,
+                        off_t offset, uint64_t len) {
+    struct uring *u = payload_uring(len);
+    // The header goes out in the same segment as the first file bytes
+    xfer_cork(fd, 1);
+    int ret = send_all(fd, head, head_len);
+    if (ret == 0) ret = u ? uring_send_file(u, fd, fileno(fp), offset, len) : 1;
+    // No ring, or one that could not take this transfer: nothing went out yet
+    if (ret == 1) ret = sendfile_all(fd, fileno(fp), offset, len);
+    xfer_cork(fd, 0);
+    return ret;
+}
+
+int node_send_file(int fd, uint32_t req_id, FILE *fp) {
+    struct stat st;
+    off_t pos = ftello(fp);
+    if (pos == -1 || fstat(fileno(fp), &st) == -1) return -1;
+    uint64_t remaining = st.st_size > pos ? (uint64_t)(st.st_size - pos) : 0;
+
+    unsigned char head[PROTO_HEADER_SIZE];
+    proto_encode_header(head, PROTO_DATA, 0, req_id, remaining);
+    if (send_payload(fd, head, sizeof(head), fp, pos, remaining) == -1) return -1;
+    return fseeko(fp, pos + remaining, SEEK_SET);
+}
+
+int node_send_range(int fd, uint32_t req_id, FILE *fp, uint64_t offset, uint64_t length) {
+    struct stat st;
+    if (fstat(fileno(fp), &st) == -1) return -1;
+    uint64_t size = st.st_size;
+    if (offset > size) {
+        errno = ERANGE;
+        return -1;
+    }
+    if (length == 0 || length > size - offset) length = size - offset;
+
+    unsigned char head[PROTO_HEADER_SIZE + PROTO_RANGE_SIZE];
+    proto_encode_header(head, PROTO_DATA, PROTO_F_RANGE, req_id, PROTO_RANGE_SIZE + length);
+    proto_put_u64(head + PROTO_HEADER_SIZE, size);
+    return send_payload(fd, head, sizeof(head), fp, offset, length);
+}
+
+int node_recv_file(int fd, struct proto_header *hdr, FILE *fp) {
+    struct shmring *ring = fd < MAX_RING_FD ? rings[fd] : NULL;
+    int failed = 0;
+    while (1) {
+        if (hdr->type != PROTO_DATA || ((hdr->flags & PROTO_F_RING) && !ring)) {
+            errno = EPROTO;
+            return -1;
+        }
+        // After a write error keep draining so the connection stays usable
+        if (!(hdr->flags & PROTO_F_RING)) {
+            if (recv_payload(fd, fp, hdr->length, &failed) == -1) return -1;
+        }
+        uint64_t remaining = (hdr->flags & PROTO_F_RING) ? hdr->length : 0;
+        while (remaining > 0) {
+            // Written to the file straight from the shared memory
+            const char *data;
+            if (shmring_wait_data(ring, fd) == -1) return -1;
+            size_t want = shmring_data(ring, &data);
+            if (want > remaining) want = remaining;
+            if (!failed && fp && fwrite(data, 1, want, fp) != want) failed = 1;
+            shmring_consume(ring, want);
+            remaining -= want;
+        }
+        if (!(hdr->flags & PROTO_F_MORE)) {
+            if (failed) errno = EIO;
+            return failed ? -1 : 0;
+        }
+        if (proto_recv_header(fd, hdr) == -1) return -1;
+    }
+}
+
+int node_send_list(int fd, uint32_t req_id, uint16_t flags, struct nsindex *index,
+                   const char *tag, const char *request) {
+    char dir[PATH_MAX], cursor[PATH_MAX] = "";
+    const char *newline = strchr(request, '\n');
+    snprintf(dir, sizeof(dir), "%.*s", newline ? (int)(newline - request) : (int)strlen(request), request);
+    if (newline) snprintf(cursor, sizeof(cursor), "%s", newline + 1);
+
+    size_t tag_len = strlen(tag);
+    if (strncmp(dir, tag, tag_len) != 0 || (dir[tag_len] != '/' && dir[tag_len] != '\0')) {
+        printf("[%s] Invalid LIST path: %s\n", node->name, dir);
+        return proto_send_str(fd, PROTO_ERROR, req_id, "LIST_FAILED:INVALID_PATH");
+    }
+    char prefix[PATH_MAX];
+    nsindex_prefix(dir + tag_len, prefix, sizeof(prefix));
+    // Sizes and times only come with front coding
+    uint16_t format = flags & PROTO_F_FRONT ? flags & (PROTO_F_FRONT | PROTO_F_STAT) : 0;
+
+    // Only one page is ever held; the index is not locked while it is sent
+    char page[LIST_PAGE_SIZE];
+    while (1) {
+        size_t len = nsindex_page(index, prefix, cursor, sizeof(cursor), format, page, sizeof(page));
+        if (proto_send_header(fd, PROTO_DATA, format | (len > 0 ? PROTO_F_MORE : 0), req_id, len) == -1 ||
+            send_all(fd, page, len) == -1) {
+            return -1;
+        }
+        if (len == 0) return 0;
+    }
+}
+
+// Parse an upload session request, "<filename> <destination>" and, if number
+// is given, a number after them. The destination (under tag) is resolved to
+// the directory that holds it. Returns the error to reply with if the request
+// is no good, NULL otherwise.
+static const char *parse_session(const char *tag, const char *request, char *filename,
+                                 char *dir, uint64_t *number) {
+    char destination[PATH_MAX];
+    unsigned long long n = 0;
+    int want = number ? 3 : 2;
+    if (sscanf(request, "%255s %4095s %llu", filename, destination, &n) < want) {
+        return "INVALID_REQUEST";
+    }
+    if (number) *number = n;
+
+    size_t tag_len = strlen(tag);
+    const char *home = getenv("HOME");
+    if (!home || strncmp(destination, tag, tag_len) != 0 ||
+        (destination[tag_len] != '/' && destination[tag_len] != '\0')) {
+        printf("[%s] Invalid upload destination: %s\n", node->name, destination);
+        return "INVALID_PATH";
+    }
+    snprintf(dir, PATH_MAX, "%s/%s%s", home, tag + 1, destination + tag_len);
+    return NULL;
+}
+
+static int send_offset(int fd, uint32_t req_id, uint64_t offset) {
+    char reply[32];
+    snprintf(reply, sizeof(reply), "%llu", (unsigned long long)offset);
+    return proto_send_str(fd, PROTO_OK, req_id, reply);
+}
+
+int node_upload_begin(int fd, uint32_t req_id, const char *tag, const char *request) {
+    char filename[256], dir[PATH_MAX];
+    uint64_t offset;
+    const char *error = parse_session(tag, request, filename, dir, NULL);
+    if (error) return proto_send_str(fd, PROTO_ERROR, req_id, error);
+    if (partfile_begin(dir, filename, &offset) == -1) {
+        fprintf(stderr, "[%s] Failed to start upload of %s: %s\n", node->name, filename, strerror(errno));
+        return proto_send_str(fd, PROTO_ERROR, req_id, "STORE_FAILED");
+    }
+    printf("[%s] Upload session for %s/%s at %llu bytes\n", node->name, dir, filename,
+           (unsigned long long)offset);
+    return send_offset(fd, req_id, offset);
+}
+
+int node_upload_query(int fd, uint32_t req_id, const char *tag, const char *request) {
+    char filename[256], dir[PATH_MAX];
+    uint64_t offset;
+    const char *error = parse_session(tag, request, filename, dir, NULL);
+    if (error) return proto_send_str(fd, PROTO_ERROR, req_id, error);
+    if (partfile_query(dir, filename, &offset) == -1) {
+        return proto_send_str(fd, PROTO_ERROR, req_id, errno == ENOENT ? "NO_SESSION" : "STORE_FAILED");
+    }
+    return send_offset(fd, req_id, offset);
+}
+
+int node_upload_append(int fd, uint32_t req_id, uint16_t flags, const char *tag,
+                       const char *request) {
+    char filename[256], dir[PATH_MAX], reply[64];
+    uint64_t offset;
+
+    // The payload follows the request whatever becomes of it
+    struct proto_header hdr;
+    if (proto_recv_header(fd, &hdr) == -1 || hdr.type != PROTO_DATA) {
+        fprintf(stderr, "[%s] Failed to receive upload data: %s\n", node->name, strerror(errno));
+        return -1;
+    }
+
+    int part = -1;
+    const char *error = parse_session(tag, request, filename, dir, &offset);
+    if (!error) {
+        part = (flags & PROTO_F_RANGE) ? partfile_write(dir, filename, offset)
+                                       : partfile_append(dir, filename, &offset);
+    }
+    if (!error && part == -1) {
+        if (errno == ERANGE) {
+            snprintf(reply, sizeof(reply), "OFFSET_MISMATCH:%llu", (unsigned long long)offset);
+            error = reply;
+        } else {
+            error = errno == ENOENT ? "NO_SESSION" : "STORE_FAILED";
+        }
+    }
+    FILE *fp = part != -1 ? fdopen(part, "wb") : NULL;
+    if (part != -1 && !fp) {
+        close(part);
+        error = "STORE_FAILED";
+    }
+
+    // Drained even without a file, so the connection stays usable
+    int ret = node_recv_file(fd, &hdr, fp);
+    if (ret == -1 && errno != EIO) {
+        fprintf(stderr, "[%s] Failed to receive upload data: %s\n", node->name, strerror(errno));
+        if (fp) fclose(fp);
+        return -1;
+    }
+    if (fp) {
+        offset = ftello(fp);
+        if (fclose(fp) != 0) ret = -1;
+        if (ret == -1) error = "STORE_FAILED";
+    }
+    if (error) return proto_send_str(fd, PROTO_ERROR, req_id, error);
+    return send_offset(fd, req_id, offset);
+}
+
+int node_upload_commit(int fd, uint32_t req_id, struct nsindex *index, const char *tag,
+                       const char *request) {
+    char filename[256], dir[PATH_MAX], path[PATH_MAX], reply[64];
+    uint64_t size;
+    const char *error = parse_session(tag, request, filename, dir, &size);
+    if (error) return proto_send_str(fd, PROTO_ERROR, req_id, error);
+    if (snprintf(path, sizeof(path), "%s/%s", dir, filename) >= (int)sizeof(path)) {
+        printf("[%s] Upload destination too long: %s\n", node->name, dir);
+        return proto_send_str(fd, PROTO_ERROR, req_id, "INVALID_PATH");
+    }
+    __atomic_add_fetch(&storing_workers, 1, __ATOMIC_RELAXED);
+    if (partfile_commit(dir, filename, &size, sync_data) == -1) {
+        __atomic_sub_fetch(&storing_workers, 1, __ATOMIC_RELAXED);
+        if (errno == ERANGE) {
+            snprintf(reply, sizeof(reply), "SIZE_MISMATCH:%llu", (unsigned long long)size);
+            return proto_send_str(fd, PROTO_ERROR, req_id, reply);
+        }
+        fprintf(stderr, "[%s] Failed to commit %s: %s\n", node->name, filename, strerror(errno));
+        return proto_send_str(fd, PROTO_ERROR, req_id, errno == ENOENT ? "NO_SESSION" : "STORE_FAILED");
+    }
+
+    // In place now, so indexed even if it is not on disk yet
+    int durable = sync_entry(path) == 0;
+    int err = errno;
+    __atomic_sub_fetch(&storing_workers, 1, __ATOMIC_RELAXED);
+    if (nsindex_update(index, path) == -1) {
+        fprintf(stderr, "[%s] Failed to index %s\n", node->name, path);
+    }
+    if (!durable) {
+        fprintf(stderr, "[%s] Committed %s but could not sync it: %s\n", node->name, path, strerror(err));
+        return proto_send_str(fd, PROTO_ERROR, req_id, "STORE_NOT_DURABLE");
+    }
+    printf("[%s] Upload committed: %s\n", node->name, path);
+    return proto_send_str(fd, PROTO_OK, req_id, "STORE_SUCCESS");
+}
+
+// Resolve a path under tag that may hold glob patterns to the pattern for
+// the index's keys. Returns -1 if it is not a path to files under tag.
+static int parse_pattern(const char *tag, const char *path, char *pattern, size_t size) {
+    size_t tag_len = strlen(tag);
+    if (strncmp(path, tag, tag_len) != 0 || path[tag_len] != '/') return -1;
+    return nsindex_pattern(path + tag_len, pattern, size);
+}
+
+struct match_list {
+    struct tar_list *list;
+    const char *root;
+    int failed;
+};
+
+static int add_match(const struct nsindex_entry *entry, void *arg) {
+    struct match_list *m = arg;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", m->root, entry->path);
+    if (tar_list_add(m->list, path) == -1) {
+        m->failed = 1;
+        return 1;
+    }
+    return 0;
+}
+
+// Add the files under root matching each line of request (paths under tag)
+// to list. Returns -1 if memory runs out.
+static int collect_matches(struct nsindex *index, const char *tag, const char *root,
+                           const char *request, struct tar_list *list) {
+    struct match_list m = { list, root, 0 };
+    for (const char *line = request; *line && !m.failed; ) {
+        size_t len = strcspn(line, "\n");
+        char path[PATH_MAX], pattern[PATH_MAX];
+        snprintf(path, sizeof(path), "%.*s", (int)len, line);
+        line += len + (line[len] == '\n');
+        if (len == 0) continue;
+        if (parse_pattern(tag, path, pattern, sizeof(pattern)) == -1) {
+            printf("[%s] Invalid path: %s\n", node->name, path);
+            continue;
+        }
+        nsindex_match(index, pattern, add_match, &m);
+    }
+    tar_list_sort(list);
+    return m.failed ? -1 : 0;
+}
+
+// Add a line to a report page, sending the page first if it is full
+static int report_line(int fd, uint32_t req_id, char *page, size_t *len, const char *status,
+                       const char *path) {
+    char line[2 * PATH_MAX];
+    int n = snprintf(line, sizeof(line), "%s %s\n", status, path);
+    if (n >= (int)sizeof(line)) return 0;
+    if (*len + n > LIST_PAGE_SIZE) {
+        if (proto_send_header(fd, PROTO_DATA, PROTO_F_MORE, req_id, *len) == -1 ||
+            send_all(fd, page, *len) == -1) {
+            return -1;
+        }
+        *len = 0;
+    }
+    memcpy(page + *len, line, n);
+    *len += n;
+    return 0;
+}
+
+int node_remove_many(int fd, uint32_t req_id, struct nsindex *index, const char *tag,
+                     const char *request) {
+    char root[PATH_MAX];
+    snprintf(root, sizeof(root), "%s/%s", getenv("HOME"), tag + 1);
+    struct tar_list files = {0};
+    if (collect_matches(index, tag, root, request, &files) == -1) {
+        tar_list_free(&files);
+        return proto_send_str(fd, PROTO_ERROR, req_id, "REMOVE_FAILED");
+    }
+
+    // The report names each file in the node's namespace
+    char page[LIST_PAGE_SIZE];
+    size_t len = 0;
+    int ret = 0;
+    size_t root_len = strlen(root);
+    for (size_t i = 0; i < files.count && ret == 0; i++) {
+        const char *path = files.paths[i];
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), "%s%s", tag, path + root_len);
+        if (remove(path) == 0) {
+            nsindex_update(index, path);
+            printf("[%s] Deleted file: %s\n", node->name, path);
+            ret = report_line(fd, req_id, page, &len, "REMOVE_SUCCESS", name);
+        } else {
+            fprintf(stderr, "[%s] Failed to delete %s: %s\n", node->name, path, strerror(errno));
+            ret = report_line(fd, req_id, page, &len, "REMOVE_FAILED", name);
+        }
+    }
+    tar_list_free(&files);
+    if (ret == 0 && len > 0) {
+        ret = proto_send_header(fd, PROTO_DATA, PROTO_F_MORE, req_id, len);
+        if (ret == 0) ret = send_all(fd, page, len);
+    }
+    if (ret == 0) ret = proto_send_header(fd, PROTO_DATA, 0, req_id, 0);
+    return ret;
+}
+
+int node_download_many(int fd, uint32_t req_id, struct nsindex *index, const char *tag,
+                       const char *request) {
+    char root[PATH_MAX];
+    snprintf(root, sizeof(root), "%s/%s", getenv("HOME"), tag + 1);
+    struct tar_list files = {0};
+    if (collect_matches(index, tag, root, request, &files) == -1) {
+        tar_list_free(&files);
+        return proto_send_str(fd, PROTO_ERROR, req_id, "DOWNLOAD_FAILED");
+    }
+
+    // Members are named as the files are below the root
+    files.strip = strlen(root) + 1;
+    int ret = tar_send(fd, req_id, &files);
+    if (ret == -1) {
+        fprintf(stderr, "[%s] Failed to send files: %s\n", node->name, strerror(errno));
+    } else {
+        printf("[%s] Sent %zu files as one archive\n", node->name, files.count);
+    }
+    tar_list_free(&files);
+    return ret;
+}
+
+int node_pass_file(int fd, uint32_t req_id, uint16_t flags, FILE *fp) {
+    int domain = 0;
+    socklen_t len = sizeof(domain);
+    if (!(flags & PROTO_F_FD) || getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == -1 ||
+        domain != AF_UNIX) {
+        return 0;
+    }
+    return proto_send_fd(fd, req_id, fileno(fp)) == -1 ? -1 : 1;
+}
+
+// Listen on the node's Unix socket, replacing one a previous run left behind.
+// Returns -1 if it could not be set up; the node then serves TCP only.
+static int listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int node_serve(const struct node_config *config, int argc, char *argv[]) {
+    node = config;
+
+    // Options: -w <worker threads>, -x <KB moved per step of a transfer>,
+    //          -i <I/O backend for file payloads: blocking or uring>,
+    //          -d <durability of acknowledged uploads: none, group or strict>
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers < MIN_WORKERS) workers = MIN_WORKERS;
+    const char *usage = "Usage: %s [-w workers] [-x xfer_kb] [-i blocking|uring] [-d none|group|strict]\n";
+    int opt_char;
+    while ((opt_char = getopt(argc, argv, "w:x:i:d:")) != -1) {
+        switch (opt_char) {
+        case 'w':
+            workers = atol(optarg);
+            if (workers < 1) workers = 1;
+            break;
+        case 'x':
+            xfer_set_chunk((size_t)atol(optarg) * 1024);
+            break;
+        case 'i':
+            if (strcmp(optarg, "uring") == 0) {
+                use_uring = 1;
+                break;
+            }
+            if (strcmp(optarg, "blocking") == 0) {
+                use_uring = 0;
+                break;
+            }
+            fprintf(stderr, usage, argv[0]);
+            return -1;
+        case 'd':
+            if (strcmp(optarg, "none") == 0) {
+                durability = DURABLE_NONE;
+                break;
+            }
+            if (strcmp(optarg, "group") == 0) {
+                durability = DURABLE_GROUP;
+                break;
+            }
+            if (strcmp(optarg, "strict") == 0) {
+                durability = DURABLE_STRICT;
+                break;
+            }
+            // fall through
+        default:
+            fprintf(stderr, usage, argv[0]);
+            return -1;
+        }
+    }
+
+    // Zero-copy sends report a vanished peer with SIGPIPE; fail the send instead
+    signal(SIGPIPE, SIG_IGN);
+
+    // Kernels without (enough of) io_uring keep the blocking path
+    struct uring probe;
+    if (use_uring && uring_init(&probe, xfer_chunk()) == -1) {
+        fprintf(stderr, "[%s] io_uring unavailable, using blocking I/O: %s\n", node->name, strerror(errno));
+        use_uring = 0;
+    } else if (use_uring) {
+        uring_free(&probe);
+        printf("[%s] Moving file payloads with io_uring\n", node->name);
+    }
+    if (durability == DURABLE_GROUP && uring_init_sync(&commit_ring) == -1) {
+        printf("[%s] Group commits sync their files one by one (no io_uring: %s)\n", node->name, strerror(errno));
+    }
+    static const char *const durable_names[] = { "in the page cache", "on disk (group commit)", "on disk" };
+    printf("[%s] Acknowledging uploads once they are %s\n", node->name, durable_names[durability]);
+
+    // Create socket
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd == -1) {
+        fprintf(stderr, "[%s] Socket creation failed: %s\n", node->name, strerror(errno));
+        return -1;
+    }
+
+    // Allow port reuse
+    int opt = 1;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        fprintf(stderr, "[%s] setsockopt failed: %s\n", node->name, strerror(errno));
+        close(server_fd);
+        return -1;
+    }
+
+    // Configure server address
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(node->port);
+
+    // Bind socket to port and start listening
+    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        fprintf(stderr, "[%s] Bind failed: %s\n", node->name, strerror(errno));
+        close(server_fd);
+        return -1;
+    }
+    if (listen(server_fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "[%s] Listening failed: %s\n", node->name, strerror(errno));
+        close(server_fd);
+        return -1;
+    }
+
+    epoll_fd = epoll_create1(0);
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = server_fd };
+    if (epoll_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == -1) {
+        fprintf(stderr, "[%s] epoll setup failed: %s\n", node->name, strerror(errno));
+        close(server_fd);
+        return -1;
+    }
+
+    int unix_fd = listen_unix(node->socket_path);
+    ev.data.fd = unix_fd;
+    if (unix_fd != -1 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, unix_fd, &ev) == -1) {
+        close(unix_fd);
+        unix_fd = -1;
+    }
+    if (unix_fd == -1) {
+        fprintf(stderr, "[%s] Unix socket %s unavailable, serving TCP only: %s\n",
+                node->name, node->socket_path, strerror(errno));
+    }
+
+    for (long i = 0; i < workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_main, NULL) != 0) {
+            fprintf(stderr, "[%s] Failed to start worker thread\n", node->name);
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+
+    printf("[%s] Server is listening on port %d with %ld workers...\n", node->name, node->port, workers);
+    if (unix_fd != -1) printf("[%s] Also listening on %s\n", node->name, node->socket_path);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "[%s] epoll_wait failed: %s\n", node->name, strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int listen_fd = events[i].data.fd;
+            if (listen_fd != server_fd && listen_fd != unix_fd) {
+                int fd = events[i].data.fd;
+                if (!ring_request(fd)) {
+                    // Request ready (or the connection closed): a worker finds out
+                    queue_push(fd);
+                } else if (dispatch_request(fd) == -1 || arm_connection(fd, EPOLL_CTL_MOD) == -1) {
+                    close_connection(fd);
+                }
+                continue;
+            }
+
+            // Accept client connection (will be S1 in this case)
+            int client_fd = accept(listen_fd, NULL, NULL);
+            if (client_fd == -1) {
+                fprintf(stderr, "[%s] Accept failed: %s\n", node->name, strerror(errno));
+                continue;
+            }
+
+            pthread_mutex_lock(&work.lock);
+            int full = work.open_connections >= MAX_CONNECTIONS;
+            if (!full) work.open_connections++;
+            pthread_mutex_unlock(&work.lock);
+            if (full) {
+                fprintf(stderr, "[%s] Too many connections, rejecting\n", node->name);
+                close(client_fd);
+                continue;
+            }
+
+            // Uploads and downloads both come over S1's connections
+            xfer_tune(client_fd, XFER_BULK);
+            if (arm_connection(client_fd, EPOLL_CTL_ADD) == -1) {
+                fprintf(stderr, "[%s] epoll_ctl failed: %s\n", node->name, strerror(errno));
+                close_connection(client_fd);
+            }
+        }
+    }
+
+    close(server_fd);
+    if (unix_fd != -1) close(unix_fd);
+    return -1;
+}
@@ -0,0 +1,107 @@
+#ifndef NODE_H
+#define NODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Server core shared by the storage nodes S2, S3 and S4.
+//
+// One event-loop thread accepts S1's connections and waits for requests on
+// them with epoll. A connection with a request ready is handed to a bounded
+// pool of worker threads; the worker reads the request frame, calls the
+// handler registered for its type and then gives the connection back to the
+// event loop. A slow tar or a large transfer therefore only holds up the
+// worker serving it, and S1 can have as many requests in flight on a node as
+// there are workers.
+//
+// Besides its TCP port a node listens on a Unix socket, for an S1 running on
+// the same machine. Connections on either are served alike, except that a
+// download over the Unix socket can hand S1 the open file (node_pass_file)
+// and S1 can give the connection a shared-memory ring for its uploads
+// (PROTO_SHM_RING, answered by the core itself).
+//
+// Handlers run on worker threads and may be called concurrently. They get the
+// request's flags and its payload as a NUL-terminated string, write their
+// reply to fd, and return -1 only when the connection can no longer be used
+// (the reply could not be completed); an ERROR reply still counts as handled.
+//
+// Build each node together with node.c and proto.c, e.g.
+// `gcc -o s2 s2.c node.c nsindex.c partfile.c proto.c shmring.c tar.c uring.c xfer.c -pthread`.
+
+typedef int (*node_handler_fn)(int fd, uint32_t req_id, uint16_t flags, const char *request);
+
+struct node_handler {
+    uint8_t type;           // PROTO_* request type
+    node_handler_fn handle;
+};
+
+struct node_config {
+    const char *name;       // log prefix, e.g. "S2"
+    int port;
+    const char *socket_path;    // Unix socket, e.g. "/tmp/w25_s2.sock"
+    const struct node_handler *handlers;
+    size_t num_handlers;
+};
+
+struct nsindex;
+struct proto_header;
+
+// Answer a DOWNLOAD by passing fp's descriptor to the requester, if it asked
+// for that (PROTO_F_FD in flags) and fd is a Unix socket. Returns 1 if the
+// file was passed, 0 if the caller should send its bytes instead and -1 if
+// the connection failed.
+int node_pass_file(int fd, uint32_t req_id, uint16_t flags, FILE *fp);
+
+// Like proto_recv_file, for an upload payload that may come through the
+// connection's shared-memory ring. Handlers receive uploads with this.
+int node_recv_file(int fd, struct proto_header *hdr, FILE *fp);
+
+// Store an upload written to the temporary file tmp (open as fp, which is
+// closed) as path, and make it as durable as the node's -d mode asks before
+// the handler acknowledges it: none leaves it in the page cache, strict
+// syncs the file and then its directory, and group (the default) does the
+// same with the syncs of concurrent uploads issued together.
+// Returns -1 if the file could not be stored (tmp is then removed), and 1 if
+// it is in place but its directory entry could not be synced: the handler
+// indexes it then, and answers STORE_NOT_DURABLE rather than STORE_FAILED.
+int node_store_file(FILE *fp, const char *tmp, const char *path);
+
+// Like proto_send_file and proto_send_range, through the worker's io_uring
+// when the node runs with -i uring. Handlers send downloads with these.
+int node_send_file(int fd, uint32_t req_id, FILE *fp);
+int node_send_range(int fd, uint32_t req_id, FILE *fp, uint64_t offset, uint64_t length);
+
+// Answer a LIST request ("<dir>" or "<dir>\n<cursor>") from index. dir is in
+// the node's namespace and must start with tag (e.g. "~s2"); only the files
+// under it are listed, relative to it and in byte order. cursor is the last
+// line the requester already has. The listing is streamed in pages, each one
+// DATA frame with PROTO_F_MORE, and ends with an empty DATA frame; flags pick
+// the entry format (PROTO_F_FRONT, PROTO_F_STAT).
+int node_send_list(int fd, uint32_t req_id, uint16_t flags, struct nsindex *index,
+                   const char *tag, const char *request);
+
+// Upload session requests (UPLOAD_BEGIN, _QUERY, _APPEND and _COMMIT, see
+// proto.h) for files under tag, kept in the node's directory for it. A commit
+// adds the file to index, also when it answers STORE_NOT_DURABLE.
+int node_upload_begin(int fd, uint32_t req_id, const char *tag, const char *request);
+int node_upload_query(int fd, uint32_t req_id, const char *tag, const char *request);
+int node_upload_append(int fd, uint32_t req_id, uint16_t flags, const char *tag,
+                       const char *request);
+int node_upload_commit(int fd, uint32_t req_id, struct nsindex *index, const char *tag,
+                       const char *request);
+
+// REMOVE_MANY and DOWNLOAD_MANY (see proto.h) for files under tag, matched
+// against index: each line of request is a path, which may hold glob
+// patterns. A removed file is taken out of index.
+int node_remove_many(int fd, uint32_t req_id, struct nsindex *index, const char *tag,
+                     const char *request);
+int node_download_many(int fd, uint32_t req_id, struct nsindex *index, const char *tag,
+                       const char *request);
+
+// Parse the node's command line (-w <workers>, -x <KB per transfer step>,
+// -i <blocking|uring>, -d <none|group|strict>) and serve forever. Only
+// returns if the server could not be started.
+int node_serve(const struct node_config *config, int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "proto.h"
+#include "nsindex.h"
+
+struct nsindex_node {
+    int leaf;
+    int count;                                      // entries or children in use
+    struct nsindex_node *next;                      // leaves: next leaf in key order
+    struct nsindex_entry entries[NSINDEX_FANOUT];   // leaves
+    char *keys[NSINDEX_FANOUT];                     // inner: lowest key under children[i] (i > 0)
+    struct nsindex_node *children[NSINDEX_FANOUT];  // inner
+};
+
+static struct nsindex_node *node_new(int leaf) {
+    struct nsindex_node *n = calloc(1, sizeof(*n));
+    if (n) n->leaf = leaf;
+    return n;
+}
+
+// First entry of a leaf whose key is >= key
+static int leaf_position(const struct nsindex_node *n, const char *key, int *found) {
+    int lo = 0, hi = n->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(n->entries[mid].path, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *found = lo < n->count && strcmp(n->entries[lo].path, key) == 0;
+    return lo;
+}
+
+// Child of an inner node whose key range holds key
+static int child_position(const struct nsindex_node *n, const char *key) {
+    int lo = 1, hi = n->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(n->keys[mid], key) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+// Split the full child i of parent in two. The parent has room for the new
+// right half, as inserts split full nodes on the way down.
+static int split_child(struct nsindex_node *parent, int i) {
+    struct nsindex_node *child = parent->children[i];
+    struct nsindex_node *right = node_new(child->leaf);
+    if (!right) return -1;
+
+    int half = child->count / 2;
+    int moved = child->count - half;
+    char *separator;
+    if (child->leaf) {
+        separator = strdup(child->entries[half].path);
+        if (!separator) {
+            free(right);
+            return -1;
+        }
+        memcpy(right->entries, child->entries + half, moved * sizeof(child->entries[0]));
+        right->next = child->next;
+        child->next = right;
+    } else {
+        memcpy(right->children, child->children + half, moved * sizeof(child->children[0]));
+        memcpy(right->keys, child->keys + half, moved * sizeof(child->keys[0]));
+        // The right half's lowest key moves up into the parent
+        separator = right->keys[0];
+        right->keys[0] = NULL;
+    }
+    right->count = moved;
+    child->count = half;
+
+    memmove(parent->children + i + 2, parent->children + i + 1,
+            (parent->count - i - 1) * sizeof(parent->children[0]));
+    memmove(parent->keys + i + 2, parent->keys + i + 1,
+            (parent->count - i - 1) * sizeof(parent->keys[0]));
+    parent->children[i + 1] = right;
+    parent->keys[i + 1] = separator;
+    parent->count++;
+    return 0;
+}
+
+static int index_put(struct nsindex *ix, const char *key, uint64_t size, time_t mtime) {
+    if (ix->root->count == NSINDEX_FANOUT) {
+        struct nsindex_node *root = node_new(0);
+        if (!root) return -1;
+        root->children[0] = ix->root;
+        root->count = 1;
+        if (split_child(root, 0) == -1) {
+            free(root);
+            return -1;
+        }
+        ix->root = root;
+    }
+
+    struct nsindex_node *n = ix->root;
+    while (!n->leaf) {
+        int i = child_position(n, key);
+        if (n->children[i]->count == NSINDEX_FANOUT) {
+            if (split_child(n, i) == -1) return -1;
+            if (strcmp(key, n->keys[i + 1]) >= 0) i++;
+        }
+        n = n->children[i];
+    }
+
+    int found;
+    int pos = leaf_position(n, key, &found);
+    if (!found) {
+        char *path = strdup(key);
+        if (!path) return -1;
+        memmove(n->entries + pos + 1, n->entries + pos, (n->count - pos) * sizeof(n->entries[0]));
+        n->entries[pos].path = path;
+        n->count++;
+        ix->count++;
+    }
+    n->entries[pos].size = size;
+    n->entries[pos].mtime = mtime;
+    return 0;
+}
+
+// Leaves emptied by removals are kept; scans step over them
+static void index_remove(struct nsindex *ix, const char *key) {
+    struct nsindex_node *n = ix->root;
+    while (!n->leaf) {
+        n = n->children[child_position(n, key)];
+    }
+    int found;
+    int pos = leaf_position(n, key, &found);
+    if (!found) return;
+    free(n->entries[pos].path);
+    memmove(n->entries + pos, n->entries + pos + 1, (n->count - pos - 1) * sizeof(n->entries[0]));
+    n->count--;
+    ix->count--;
+}
+
+// Same match as find's -name "*<ext>"
+static int has_ext(const char *name, const char *ext) {
+    size_t len = strlen(name), ext_len = strlen(ext);
+    return len >= ext_len && strcmp(name + len - ext_len, ext) == 0;
+}
+
+static int index_dir(struct nsindex *ix, const char *dir, const char *prefix) {
+    DIR *d = opendir(dir);
+    if (!d) return 0;
+
+    int ret = 0;
+    struct dirent *ent;
+    while (ret == 0 && (ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+
+        char path[PATH_MAX], key[PATH_MAX];
+        struct stat st;
+        if (snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name) >= (int)sizeof(path) ||
+            snprintf(key, sizeof(key), "%s%s", prefix, ent->d_name) >= (int)sizeof(key) - 1 ||
+            lstat(path, &st) == -1) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            strcat(key, "/");
+            ret = index_dir(ix, path, key);
+        } else if (S_ISREG(st.st_mode) && has_ext(ent->d_name, ix->ext)) {
+            ret = index_put(ix, key, st.st_size, st.st_mtime);
+        }
+    }
+    closedir(d);
+    return ret;
+}
+
+int nsindex_build(struct nsindex *ix, const char *root, const char *ext) {
+    memset(ix, 0, sizeof(*ix));
+    pthread_rwlock_init(&ix->lock, NULL);
+    ix->ext = ext;
+    ix->root = node_new(1);
+    if (!ix->root) return -1;
+
+    // Keys are taken relative to the resolved root, so later paths that
+    // reach it through a different spelling still match
+    if (realpath(root, ix->root_path) == NULL) {
+        snprintf(ix->root_path, sizeof(ix->root_path), "%s", root);
+    }
+    return index_dir(ix, ix->root_path, "");
+}
+
+// The key for path: its directory resolved like the root, relative to it
+static int index_key(const struct nsindex *ix, const char *path, char *key, size_t size) {
+    const char *slash = strrchr(path, '/');
+    if (!slash || slash[1] == '\0') return -1;
+
+    char dir[PATH_MAX], real[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    if (realpath(dir[0] ? dir : "/", real) == NULL) return -1;
+
+    size_t root_len = strlen(ix->root_path);
+    if (strncmp(real, ix->root_path, root_len) != 0 ||
+        (real[root_len] != '/' && real[root_len] != '\0')) {
+        return -1;
+    }
+    const char *rel = real + root_len;
+    if (*rel == '/') rel++;
+    int len = *rel ? snprintf(key, size, "%s/%s", rel, slash + 1)
+                   : snprintf(key, size, "%s", slash + 1);
+    return len < (int)size ? 0 : -1;
+}
+
+int nsindex_update(struct nsindex *ix, const char *path) {
+    char key[PATH_MAX];
+    // Files outside the root are never listed
+    if (index_key(ix, path, key, sizeof(key)) == -1) return 0;
+
+    struct stat st;
+    int ret = 0;
+    pthread_rwlock_wrlock(&ix->lock);
+    if (lstat(path, &st) == 0 && S_ISREG(st.st_mode) && has_ext(key, ix->ext)) {
+        ret = index_put(ix, key, st.st_size, st.st_mtime);
+    } else {
+        index_remove(ix, key);
+    }
+    pthread_rwlock_unlock(&ix->lock);
+    return ret;
+}
+
+void nsindex_scan(struct nsindex *ix, const char *prefix, const char *after,
+                  nsindex_fn fn, void *arg) {
+    size_t prefix_len = strlen(prefix);
+    const char *start = after ? after : prefix;
+    pthread_rwlock_rdlock(&ix->lock);
+
+    struct nsindex_node *n = ix->root;
+    while (!n->leaf) {
+        n = n->children[child_position(n, start)];
+    }
+    int found;
+    int pos = leaf_position(n, start, &found);
+    if (found && after) pos++;
+    for (; n != NULL; n = n->next, pos = 0) {
+        for (; pos < n->count; pos++) {
+            const struct nsindex_entry *e = &n->entries[pos];
+            if (strncmp(e->path, prefix, prefix_len) != 0 || fn(e, arg) != 0) {
+                pthread_rwlock_unlock(&ix->lock);
+                return;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&ix->lock);
+}
+
+void nsindex_prefix(const char *dir, char *prefix, size_t size) {
+    size_t len = 0;
+    while (*dir != '\0' && len + 2 < size) {
+        while (*dir == '/') dir++;
+        // Skip "." components; ".." cannot climb out of a prefix anyway
+        if (dir[0] == '.' && (dir[1] == '/' || dir[1] == '\0')) {
+            dir++;
+            continue;
+        }
+        while (*dir != '\0' && *dir != '/' && len + 2 < size) {
+            prefix[len++] = *dir++;
+        }
+        if (len > 0 && prefix[len - 1] != '/') prefix[len++] = '/';
+    }
+    prefix[len] = '\0';
+}
+
+int nsindex_pattern(const char *path, char *pattern, size_t size) {
+    nsindex_prefix(path, pattern, size);
+    size_t len = strlen(pattern);
+    if (len == 0) return -1;
+    pattern[len - 1] = '\0';
+    return 0;
+}
+
+struct match {
+    const char *pattern;
+    nsindex_fn fn;
+    void *arg;
+};
+
+static int match_entry(const struct nsindex_entry *entry, void *arg) {
+    struct match *m = arg;
+    if (fnmatch(m->pattern, entry->path, FNM_PATHNAME) != 0) return 0;
+    return m->fn(entry, m->arg);
+}
+
+void nsindex_match(struct nsindex *ix, const char *pattern, nsindex_fn fn, void *arg) {
+    // Only keys starting with the part before the first wildcard can match
+    char prefix[PATH_MAX];
+    size_t len = strcspn(pattern, "*?[\\");
+    snprintf(prefix, sizeof(prefix), "%.*s", (int)len, pattern);
+    struct match m = { pattern, fn, arg };
+    nsindex_scan(ix, prefix, NULL, match_entry, &m);
+}
+
+struct page_fill {
+    size_t prefix_len;
+    uint16_t format;
+    char *cursor;
+    size_t cursor_size;
+    char *buf;
+    size_t size;
+    size_t len;
+};
+
+static int fill_page(const struct nsindex_entry *entry, void *arg) {
+    struct page_fill *fill = arg;
+    const char *line = entry->path + fill->prefix_len;
+    size_t len = strlen(line);
+    if (len >= fill->cursor_size) return 1;
+    // Stop at the first entry that does not fit; the next page starts there
+    size_t n = proto_entry_encode(fill->buf + fill->len, fill->size - fill->len, fill->format,
+                                  fill->cursor, line, entry->size, entry->mtime);
+    if (n == 0) return 1;
+    fill->len += n;
+    memcpy(fill->cursor, line, len + 1);
+    return 0;
+}
+
+size_t nsindex_page(struct nsindex *ix, const char *prefix, char *cursor, size_t cursor_size,
+                    uint16_t format, char *buf, size_t size) {
+    char after[2 * PATH_MAX];
+    snprintf(after, sizeof(after), "%s%s", prefix, cursor);
+    struct page_fill fill = { strlen(prefix), format, cursor, cursor_size, buf, size, 0 };
+    nsindex_scan(ix, prefix, cursor[0] ? after : NULL, fill_page, &fill);
+    return fill.len;
+}
@@ -0,0 +1,81 @@
+#ifndef NSINDEX_H
+#define NSINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+
+// Resident index of the files a storage node holds, used to answer LIST
+// without walking the tree.
+//
+// Entries are keyed by their path relative to the node's root directory
+// ("folder/b.pdf") and kept in a B+tree in byte order, with the leaves linked
+// so a listing is a range scan from the first key with the requested prefix.
+// The index is built once when the node starts and is then kept up to date by
+// the node's own store and remove handlers; files changed behind the node's
+// back are not seen until it restarts.
+//
+// The index is shared by the node's worker threads and guarded by a
+// reader/writer lock, so any number of scans can run at once.
+
+#define NSINDEX_FANOUT 64
+
+struct nsindex_entry {
+    char *path;         // relative to the root
+    uint64_t size;
+    time_t mtime;
+};
+
+struct nsindex_node;
+
+struct nsindex {
+    pthread_rwlock_t lock;
+    struct nsindex_node *root;
+    char root_path[PATH_MAX];   // directory the keys are relative to
+    const char *ext;            // only files with this extension are indexed
+    size_t count;
+};
+
+// Called for each entry of a scan in key order; return non-zero to stop
+typedef int (*nsindex_fn)(const struct nsindex_entry *entry, void *arg);
+
+// Index every file ending in ext under root. Returns -1 if memory runs out.
+int nsindex_build(struct nsindex *ix, const char *root, const char *ext);
+
+// Bring the entry for the file at path (absolute, under the root) in line with
+// the disk after it was stored or removed. Returns -1 if memory runs out.
+int nsindex_update(struct nsindex *ix, const char *path);
+
+// Call fn for every entry whose key starts with prefix, in key order, from
+// the first one after the key after (or from the start if after is NULL)
+void nsindex_scan(struct nsindex *ix, const char *prefix, const char *after,
+                  nsindex_fn fn, void *arg);
+
+// Turn a directory below the root ("folder//sub/.") into the key prefix of
+// the files under it ("folder/sub/"; "" for the root itself)
+void nsindex_prefix(const char *dir, char *prefix, size_t size);
+
+// Turn a path below the root that may hold glob patterns ("logs//*.txt")
+// into the pattern its keys are matched against ("logs/*.txt"). Returns -1
+// if it names the root itself.
+int nsindex_pattern(const char *path, char *pattern, size_t size);
+
+// Call fn for every entry whose key matches pattern (fnmatch(3) with
+// FNM_PATHNAME, so wildcards stop at a '/'), in key order. Only the keys
+// starting with the pattern's literal head are looked at. fn runs with the
+// index locked for reading.
+void nsindex_match(struct nsindex *ix, const char *pattern, nsindex_fn fn, void *arg);
+
+// Write one page of the listing of prefix to buf: the keys after
+// prefix + cursor (from the start if cursor is ""), with the prefix removed,
+// as many as fit. They are written as LIST entries in format (PROTO_F_* bits,
+// see proto.h), the first coded against cursor. cursor is advanced to the last
+// key written, so the next call continues from there; the lock is only held
+// while the page is filled. Returns the bytes written, 0 once the listing is
+// complete.
+size_t nsindex_page(struct nsindex *ix, const char *prefix, char *cursor, size_t cursor_size,
+                    uint16_t format, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "objcache.h"
+
+struct objcache_item {
+    struct objcache_item *chain;    // next in the bucket
+    struct objcache_item *newer;
+    struct objcache_item *older;
+    struct objcache_segment *segment;
+    uint64_t hash;
+    int refs;                       // the cache's own plus one per holder
+    size_t size;
+    char *key;                      // stored after the data
+    char data[];
+};
+
+#define SKETCH_MAX 15               // counters saturate like 4-bit ones
+#define SKETCH_RESET (10 * OBJCACHE_SKETCH_WIDTH)
+
+// FNV-1a, then mixed so both halves are usable for the sketch
+static uint64_t hash_key(const char *key) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+int objcache_init(struct objcache *oc, size_t capacity, size_t max_object) {
+    memset(oc, 0, sizeof(*oc));
+    if (capacity == 0) return 0;
+    oc->shards = calloc(OBJCACHE_SHARDS, sizeof(oc->shards[0]));
+    if (!oc->shards) return -1;
+    oc->max_object = max_object;
+    for (int i = 0; i < OBJCACHE_SHARDS; i++) {
+        pthread_mutex_init(&oc->shards[i].lock, NULL);
+        oc->shards[i].capacity = capacity / OBJCACHE_SHARDS;
+    }
+    return 0;
+}
+
+static struct objcache_shard *shard_for(struct objcache *oc, uint64_t hash) {
+    return &oc->shards[hash >> 60 & (OBJCACHE_SHARDS - 1)];
+}
+
+// ===== Frequency sketch =====
+
+static size_t sketch_slot(uint64_t hash, int row) {
+    uint64_t h2 = (hash >> 32 | hash << 32) | 1;
+    return (hash + row * h2) & (OBJCACHE_SKETCH_WIDTH - 1);
+}
+
+static void sketch_add(struct objcache_shard *shard, uint64_t hash) {
+    for (int row = 0; row < OBJCACHE_SKETCH_DEPTH; row++) {
+        uint8_t *count = &shard->sketch[row][sketch_slot(hash, row)];
+        if (*count < SKETCH_MAX) (*count)++;
+    }
+    // Age every count so files that were popular once do not stay in forever
+    if (++shard->samples >= SKETCH_RESET) {
+        for (int row = 0; row < OBJCACHE_SKETCH_DEPTH; row++) {
+            for (size_t i = 0; i < OBJCACHE_SKETCH_WIDTH; i++) shard->sketch[row][i] >>= 1;
+        }
+        shard->samples /= 2;
+    }
+}
+
+static int sketch_estimate(const struct objcache_shard *shard, uint64_t hash) {
+    int estimate = SKETCH_MAX;
+    for (int row = 0; row < OBJCACHE_SKETCH_DEPTH; row++) {
+        int count = shard->sketch[row][sketch_slot(hash, row)];
+        if (count < estimate) estimate = count;
+    }
+    return estimate;
+}
+
+// ===== Segments =====
+
+static void segment_unlink(struct objcache_item *item) {
+    struct objcache_segment *seg = item->segment;
+    if (item->newer) item->newer->older = item->older; else seg->newest = item->older;
+    if (item->older) item->older->newer = item->newer; else seg->oldest = item->newer;
+    seg->bytes -= item->size;
+    item->segment = NULL;
+}
+
+static void segment_push(struct objcache_segment *seg, struct objcache_item *item) {
+    item->newer = NULL;
+    item->older = seg->newest;
+    if (seg->newest) seg->newest->newer = item; else seg->oldest = item;
+    seg->newest = item;
+    seg->bytes += item->size;
+    item->segment = seg;
+}
+
+static void item_release(struct objcache_item *item) {
+    if (__atomic_sub_fetch(&item->refs, 1, __ATOMIC_ACQ_REL) == 0) free(item);
+}
+
+static struct objcache_item *find(struct objcache_shard *shard, const char *key, uint64_t hash) {
+    struct objcache_item *item = shard->buckets[hash % OBJCACHE_BUCKETS];
+    while (item && (item->hash != hash || strcmp(item->key, key) != 0)) item = item->chain;
+    return item;
+}
+
+static void remove_item(struct objcache_shard *shard, struct objcache_item *item) {
+    struct objcache_item **link = &shard->buckets[item->hash % OBJCACHE_BUCKETS];
+    while (*link != item) link = &(*link)->chain;
+    *link = item->chain;
+    segment_unlink(item);
+    shard->stats.objects--;
+    shard->stats.bytes -= item->size;
+    item_release(item);
+}
+
+// ===== Lookups =====
+
+struct objcache_obj *objcache_get(struct objcache *oc, const char *key) {
+    if (!oc->shards) return NULL;
+    uint64_t hash = hash_key(key);
+    struct objcache_shard *shard = shard_for(oc, hash);
+    pthread_mutex_lock(&shard->lock);
+    sketch_add(shard, hash);
+
+    struct objcache_item *item = find(shard, key, hash);
+    if (!item) {
+        shard->stats.misses++;
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+    shard->stats.hits++;
+
+    // A second hit earns a place in the protected segment; what falls out
+    // of it gets another round in probation
+    segment_unlink(item);
+    segment_push(&shard->protect, item);
+    while (shard->protect.bytes > shard->capacity / 5 * 4 && shard->protect.oldest != item) {
+        struct objcache_item *demoted = shard->protect.oldest;
+        segment_unlink(demoted);
+        segment_push(&shard->probation, demoted);
+    }
+
+    __atomic_add_fetch(&item->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shard->lock);
+    return (struct objcache_obj *)item;
+}
+
+const char *objcache_data(const struct objcache_obj *obj) {
+    return ((const struct objcache_item *)obj)->data;
+}
+
+size_t objcache_size(const struct objcache_obj *obj) {
+    return ((const struct objcache_item *)obj)->size;
+}
+
+void objcache_release(struct objcache_obj *obj) {
+    item_release((struct objcache_item *)obj);
+}
+
+uint64_t objcache_epoch(struct objcache *oc, const char *key) {
+    if (!oc->shards) return 0;
+    struct objcache_shard *shard = shard_for(oc, hash_key(key));
+    pthread_mutex_lock(&shard->lock);
+    uint64_t epoch = shard->epoch;
+    pthread_mutex_unlock(&shard->lock);
+    return epoch;
+}
+
+void objcache_put(struct objcache *oc, const char *key, const char *data, size_t size,
+                  uint64_t epoch) {
+    if (!oc->shards || size > oc->max_object) return;
+    uint64_t hash = hash_key(key);
+    struct objcache_shard *shard = shard_for(oc, hash);
+    if (size > shard->capacity) return;
+
+    // Copy outside the lock; most offers are taken
+    size_t key_len = strlen(key);
+    struct objcache_item *item = malloc(sizeof(*item) + size + key_len + 1);
+    if (!item) return;
+    memset(item, 0, sizeof(*item));
+    item->hash = hash;
+    item->refs = 1;
+    item->size = size;
+    memcpy(item->data, data, size);
+    item->key = item->data + size;
+    memcpy(item->key, key, key_len + 1);
+
+    pthread_mutex_lock(&shard->lock);
+    struct objcache_item *old = find(shard, key, hash);
+    if (epoch != shard->epoch || old) {
+        // Dropped since the copy was fetched, or another download beat us
+        shard->stats.rejects++;
+        pthread_mutex_unlock(&shard->lock);
+        free(item);
+        return;
+    }
+
+    int candidate = sketch_estimate(shard, hash);
+    int first = 1;
+    while (shard->probation.bytes + shard->protect.bytes + size > shard->capacity) {
+        struct objcache_item *victim = shard->probation.oldest;
+        if (!victim) victim = shard->protect.oldest;
+        if (first && candidate <= sketch_estimate(shard, victim->hash)) {
+            shard->stats.rejects++;
+            pthread_mutex_unlock(&shard->lock);
+            free(item);
+            return;
+        }
+        first = 0;
+        remove_item(shard, victim);
+        shard->stats.evictions++;
+    }
+
+    item->chain = shard->buckets[hash % OBJCACHE_BUCKETS];
+    shard->buckets[hash % OBJCACHE_BUCKETS] = item;
+    segment_push(&shard->probation, item);
+    shard->stats.inserts++;
+    shard->stats.objects++;
+    shard->stats.bytes += size;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void objcache_drop(struct objcache *oc, const char *key) {
+    if (!oc->shards) return;
+    uint64_t hash = hash_key(key);
+    struct objcache_shard *shard = shard_for(oc, hash);
+    pthread_mutex_lock(&shard->lock);
+    shard->epoch++;
+    struct objcache_item *item = find(shard, key, hash);
+    if (item) {
+        remove_item(shard, item);
+        shard->stats.invalidations++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void objcache_stats(struct objcache *oc, struct objcache_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!oc->shards) return;
+    for (int i = 0; i < OBJCACHE_SHARDS; i++) {
+        struct objcache_shard *shard = &oc->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->stats.hits;
+        stats->misses += shard->stats.misses;
+        stats->inserts += shard->stats.inserts;
+        stats->rejects += shard->stats.rejects;
+        stats->evictions += shard->stats.evictions;
+        stats->invalidations += shard->stats.invalidations;
+        stats->objects += shard->stats.objects;
+        stats->bytes += shard->stats.bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef OBJCACHE_H
+#define OBJCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Contents of small, frequently downloaded node files, kept in S1's memory so
+// repeat downloads skip the storage node and its disk.
+//
+// The cache is bounded in bytes and split into shards with a lock each. Each
+// shard is a segmented LRU: files enter a probation segment and move to the
+// protected one (at most 80% of the shard) when they are hit again, so a burst
+// of one-off downloads cannot flush the files that keep being asked for. A
+// file only gets in when it has been asked for more often than the file it
+// would push out (TinyLFU), judged by a small count-min sketch of recent
+// requests whose counts are halved now and then so old popularity fades.
+//
+// Uploads and removes drop the path. A download that started before the drop
+// can no longer put its now stale copy in, as every drop bumps its shard's
+// epoch.
+
+#define OBJCACHE_SHARDS 16
+#define OBJCACHE_BUCKETS 1024           // hash buckets per shard
+#define OBJCACHE_SKETCH_DEPTH 4
+#define OBJCACHE_SKETCH_WIDTH 4096      // counters per sketch row and shard
+
+struct objcache_item;
+
+struct objcache_segment {
+    struct objcache_item *newest;
+    struct objcache_item *oldest;
+    size_t bytes;
+};
+
+struct objcache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t rejects;           // not admitted, or stale by the time they were in
+    uint64_t evictions;
+    uint64_t invalidations;
+    size_t objects;
+    size_t bytes;
+};
+
+struct objcache_shard {
+    pthread_mutex_t lock;
+    struct objcache_item *buckets[OBJCACHE_BUCKETS];
+    struct objcache_segment probation;
+    struct objcache_segment protect;
+    size_t capacity;            // bytes
+    uint64_t epoch;             // bumped by every drop
+    uint8_t sketch[OBJCACHE_SKETCH_DEPTH][OBJCACHE_SKETCH_WIDTH];
+    uint32_t samples;           // requests counted since the last halving
+    struct objcache_stats stats;
+};
+
+struct objcache {
+    struct objcache_shard *shards;  // NULL if the cache is disabled
+    size_t max_object;
+};
+
+// A cached file, held by the caller until objcache_release. It stays valid
+// even if it is dropped or evicted meanwhile.
+struct objcache_obj;
+
+// Set up a cache of capacity bytes for files of up to max_object bytes. A
+// capacity of 0 disables it. Returns -1 if memory runs out.
+int objcache_init(struct objcache *oc, size_t capacity, size_t max_object);
+
+// The cached file for key, or NULL on a miss. Either way the request counts
+// towards key's popularity.
+struct objcache_obj *objcache_get(struct objcache *oc, const char *key);
+const char *objcache_data(const struct objcache_obj *obj);
+size_t objcache_size(const struct objcache_obj *obj);
+void objcache_release(struct objcache_obj *obj);
+
+// The epoch to pass to objcache_put for a copy of key fetched from now on
+uint64_t objcache_epoch(struct objcache *oc, const char *key);
+
+// Offer a copy of key's file for the cache. It is taken only if it is small
+// enough, popular enough, and key was not dropped since epoch.
+void objcache_put(struct objcache *oc, const char *key, const char *data, size_t size,
+                  uint64_t epoch);
+
+// Forget key's file after it was stored or removed
+void objcache_drop(struct objcache *oc, const char *key);
+
+// Counters summed over all shards
+void objcache_stats(struct objcache *oc, struct objcache_stats *stats);
+
+#endif
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "partfile.h"
+
+int partfile_mkdirs(const char *dir) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s", dir) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    for (char *p = path + 1; ; p++) {
+        if (*p != '/' && *p != '\0') continue;
+        char c = *p;
+        *p = '\0';
+        if (mkdir(path, 0777) == -1 && errno != EEXIST) return -1;
+        *p = c;
+        if (c == '\0') return 0;
+    }
+}
+
+static int part_path(const char *dir, const char *name, char *path, size_t size) {
+    if (snprintf(path, size, "%s/.%s.part", dir, name) >= (int)size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+int partfile_temp(const char *dir, const char *name, char *tmp, size_t size) {
+    if (snprintf(tmp, size, "%s/.%s.XXXXXX", dir, name) >= (int)size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = mkstemp(tmp);
+    // mkstemp creates the file 0600; give it the mode a plain create would
+    if (fd != -1) fchmod(fd, 0644);
+    return fd;
+}
+
+int partfile_begin(const char *dir, const char *name, uint64_t *offset) {
+    char path[PATH_MAX];
+    if (part_path(dir, name, path, sizeof(path)) == -1 || partfile_mkdirs(dir) == -1) return -1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+    struct stat st;
+    int ret = fstat(fd, &st);
+    close(fd);
+    if (ret == -1) return -1;
+    *offset = st.st_size;
+    return 0;
+}
+
+int partfile_query(const char *dir, const char *name, uint64_t *offset) {
+    char path[PATH_MAX];
+    struct stat st;
+    if (part_path(dir, name, path, sizeof(path)) == -1 || stat(path, &st) == -1) return -1;
+    *offset = st.st_size;
+    return 0;
+}
+
+int partfile_append(const char *dir, const char *name, uint64_t *offset) {
+    char path[PATH_MAX];
+    if (part_path(dir, name, path, sizeof(path)) == -1) return -1;
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (*offset > (uint64_t)st.st_size) {
+        *offset = st.st_size;
+        close(fd);
+        errno = ERANGE;
+        return -1;
+    }
+    if ((*offset < (uint64_t)st.st_size && ftruncate(fd, *offset) == -1) ||
+        lseek(fd, *offset, SEEK_SET) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int partfile_write(const char *dir, const char *name, uint64_t offset) {
+    char path[PATH_MAX];
+    if (part_path(dir, name, path, sizeof(path)) == -1) return -1;
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    if (lseek(fd, offset, SEEK_SET) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int partfile_commit(const char *dir, const char *name, uint64_t *size, int (*sync)(int fd)) {
+    char path[PATH_MAX], target[PATH_MAX];
+    if (part_path(dir, name, path, sizeof(path)) == -1) return -1;
+    if (snprintf(target, sizeof(target), "%s/%s", dir, name) >= (int)sizeof(target)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+
+    // The data must be on disk before the name points at it
+    struct stat st;
+    int ret = fstat(fd, &st);
+    if (ret == 0 && (uint64_t)st.st_size != *size) {
+        *size = st.st_size;
+        errno = ERANGE;
+        ret = -1;
+    }
+    if (ret == 0 && sync) ret = sync(fd);
+    close(fd);
+    if (ret == -1) return -1;
+    return rename(path, target);
+}
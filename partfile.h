@@ -0,0 +1,56 @@
+#ifndef PARTFILE_H
+#define PARTFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Files being uploaded, kept out of sight until they are complete.
+//
+// A plain upload is written to a temporary file next to its destination
+// (".<name>.XXXXXX") and renamed over it once the whole payload is in, so a
+// dropped connection never leaves a truncated file behind.
+//
+// An upload session does the same across connections: its bytes collect in
+// "<dir>/.<name>.part", appended in pieces at the offset the sender has got
+// to, and the part file is renamed to <dir>/<name> on commit. The part file's
+// size is the committed offset, so a sender that lost its connection asks for
+// it and carries on from there. Neither name ends in the file's extension,
+// so indexes, listings and archives never see them.
+//
+// Used by S1 for its own .c files and by the storage nodes for theirs.
+
+// Create dir and any missing parents
+int partfile_mkdirs(const char *dir);
+
+// Create a temporary file for name in dir and return its descriptor, with
+// its path in tmp. Returns -1 on error.
+int partfile_temp(const char *dir, const char *name, char *tmp, size_t size);
+
+// Start the session for name in dir, or pick up the one already there;
+// *offset is set to its committed offset. Returns -1 on error.
+int partfile_begin(const char *dir, const char *name, uint64_t *offset);
+
+// The session's committed offset. Returns -1 (errno ENOENT) if there is no
+// session.
+int partfile_query(const char *dir, const char *name, uint64_t *offset);
+
+// Open the session's part file for writing at offset and return the
+// descriptor. Bytes past offset are dropped, so a sender can rewrite a piece
+// it is unsure of. An offset past the committed one fails with ERANGE and
+// *offset set to the committed one; without a session it fails with ENOENT.
+int partfile_append(const char *dir, const char *name, uint64_t *offset);
+
+// Open the session's part file for writing at offset, wherever that is,
+// leaving the rest of it alone. Lets a sender write pieces out of order or
+// over several connections at once; the part file then has holes until they
+// are all in, so its size no longer tells what the receiver holds. Fails with
+// ENOENT without a session.
+int partfile_write(const char *dir, const char *name, uint64_t offset);
+
+// Make the session's file visible as dir/name, provided it has size bytes;
+// otherwise fail with ERANGE and *size set to what it has. sync (fsync, say)
+// is called on the file first so the name never points at data that is not
+// on disk yet; NULL skips that. Returns -1 on error.
+int partfile_commit(const char *dir, const char *name, uint64_t *size, int (*sync)(int fd));
+
+#endif
@@ -0,0 +1,402 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "proto.h"
+#include "xfer.h"
+
+#define PROTO_CHUNK 8192
+
+static void put_be16(unsigned char *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint16_t get_be16(const unsigned char *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+void proto_put_u64(unsigned char *p, uint64_t v) {
+    put_be32(p, (uint32_t)(v >> 32));
+    put_be32(p + 4, (uint32_t)v);
+}
+
+uint64_t proto_get_u64(const unsigned char *p) {
+    return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+void proto_encode_header(unsigned char *buf, uint8_t type, uint16_t flags,
+                         uint32_t req_id, uint64_t length) {
+    put_be16(buf, PROTO_MAGIC);
+    buf[2] = PROTO_VERSION;
+    buf[3] = type;
+    put_be16(buf + 4, flags);
+    put_be16(buf + 6, 0);
+    put_be32(buf + 8, req_id);
+    proto_put_u64(buf + 12, length);
+}
+
+// Returns -1 if the bytes are not a frame header we understand.
+int proto_decode_header(const unsigned char *buf, struct proto_header *hdr) {
+    if (get_be16(buf) != PROTO_MAGIC || buf[2] != PROTO_VERSION) {
+        return -1;
+    }
+    hdr->version = buf[2];
+    hdr->type = buf[3];
+    hdr->flags = get_be16(buf + 4);
+    hdr->req_id = get_be32(buf + 8);
+    hdr->length = proto_get_u64(buf + 12);
+    return 0;
+}
+
+int proto_send_header(int fd, uint8_t type, uint16_t flags, uint32_t req_id, uint64_t length) {
+    unsigned char buf[PROTO_HEADER_SIZE];
+    proto_encode_header(buf, type, flags, req_id, length);
+    return send_all(fd, buf, sizeof(buf));
+}
+
+// Send a complete single-frame message (header and payload in one write).
+int proto_send(int fd, uint8_t type, uint32_t req_id, const void *payload, size_t len) {
+    if (len <= PROTO_CHUNK) {
+        unsigned char buf[PROTO_HEADER_SIZE + PROTO_CHUNK];
+        proto_encode_header(buf, type, 0, req_id, len);
+        if (len > 0) memcpy(buf + PROTO_HEADER_SIZE, payload, len);
+        return send_all(fd, buf, PROTO_HEADER_SIZE + len);
+    }
+    unsigned char buf[PROTO_HEADER_SIZE];
+    proto_encode_header(buf, type, 0, req_id, len);
+    struct iovec iov[2] = {
+        { .iov_base = buf, .iov_len = sizeof(buf) },
+        { .iov_base = (void *)payload, .iov_len = len },
+    };
+    return xfer_sendv(fd, iov, 2);
+}
+
+int proto_send_str(int fd, uint8_t type, uint32_t req_id, const char *str) {
+    return proto_send(fd, type, req_id, str, strlen(str));
+}
+
+int proto_recv_header(int fd, struct proto_header *hdr) {
+    unsigned char buf[PROTO_HEADER_SIZE];
+    if (recv_all(fd, buf, sizeof(buf)) == -1) return -1;
+    if (proto_decode_header(buf, hdr) == -1) {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+// Discard len payload bytes so the stream stays aligned on frame boundaries.
+int proto_skip(int fd, uint64_t len) {
+    int failed = 0;
+    return xfer_recv_file(fd, NULL, len, &failed);
+}
+
+// Read the payload described by hdr into buf as a NUL-terminated string.
+// Payloads that do not fit are drained and reported as an error.
+int proto_recv_payload(int fd, const struct proto_header *hdr, char *buf, size_t size) {
+    if (hdr->length >= size) {
+        proto_skip(fd, hdr->length);
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (recv_all(fd, buf, hdr->length) == -1) return -1;
+    buf[hdr->length] = '\0';
+    return 0;
+}
+
+int proto_recv_msg(int fd, struct proto_header *hdr, char *buf, size_t size) {
+    if (proto_recv_header(fd, hdr) == -1) return -1;
+    return proto_recv_payload(fd, hdr, buf, size);
+}
+
+// Send the remainder of fp as a single DATA frame whose length is known up front.
+int proto_send_file(int fd, uint32_t req_id, FILE *fp) {
+    struct stat st;
+    if (fstat(fileno(fp), &st) == -1) return -1;
+
+    off_t pos = ftello(fp);
+    uint64_t remaining = st.st_size > pos ? (uint64_t)(st.st_size - pos) : 0;
+    // The header goes out in the same segment as the first file bytes
+    xfer_cork(fd, 1);
+    int ret = proto_send_header(fd, PROTO_DATA, 0, req_id, remaining);
+
+    // The file shrinking under us fails with EIO: the frame can no longer be completed.
+    if (ret == 0) ret = sendfile_all(fd, fileno(fp), pos, remaining);
+    xfer_cork(fd, 0);
+    if (ret == -1) return -1;
+    return fseeko(fp, pos + remaining, SEEK_SET);
+}
+
+// Send length bytes of fp from offset on (all the rest if length is 0) as a
+// ranged DATA frame. An offset past the end fails with ERANGE before anything
+// is sent.
+int proto_send_range(int fd, uint32_t req_id, FILE *fp, uint64_t offset, uint64_t length) {
+    struct stat st;
+    if (fstat(fileno(fp), &st) == -1) return -1;
+    uint64_t size = st.st_size;
+    if (offset > size) {
+        errno = ERANGE;
+        return -1;
+    }
+    if (length == 0 || length > size - offset) length = size - offset;
+
+    unsigned char head[PROTO_HEADER_SIZE + PROTO_RANGE_SIZE];
+    proto_encode_header(head, PROTO_DATA, PROTO_F_RANGE, req_id, PROTO_RANGE_SIZE + length);
+    proto_put_u64(head + PROTO_HEADER_SIZE, size);
+    xfer_cork(fd, 1);
+    int ret = send_all(fd, head, sizeof(head));
+    if (ret == 0) ret = sendfile_all(fd, fileno(fp), offset, length);
+    xfer_cork(fd, 0);
+    return ret;
+}
+
+// Send an empty frame over the Unix socket sock with count descriptors
+// riding along with its header (SCM_RIGHTS)
+int proto_send_fds(int sock, uint8_t type, uint16_t flags, uint32_t req_id, const int *fds, int count) {
+    unsigned char buf[PROTO_HEADER_SIZE];
+    proto_encode_header(buf, type, flags, req_id, 0);
+
+    union {
+        struct cmsghdr hdr;
+        char space[CMSG_SPACE(sizeof(int) * PROTO_MAX_FDS)];
+    } control;
+    if (count < 1 || count > PROTO_MAX_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.space,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * count),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) return -1;
+    // The descriptors went with the first byte; the rest is plain data
+    return send_all(sock, buf + n, sizeof(buf) - n);
+}
+
+// Pass fd as the reply to req_id: an empty DATA frame with PROTO_F_FD
+int proto_send_fd(int sock, uint32_t req_id, int fd) {
+    return proto_send_fds(sock, PROTO_DATA, PROTO_F_FD, req_id, &fd, 1);
+}
+
+// Like proto_recv_header, also taking up to PROTO_MAX_FDS descriptors passed
+// with the header into fds; *count says how many came. Any beyond that are
+// closed.
+int proto_recv_header_fds(int fd, struct proto_header *hdr, int *fds, int *count) {
+    unsigned char buf[PROTO_HEADER_SIZE];
+    size_t have = 0;
+    *count = 0;
+    while (have < sizeof(buf)) {
+        union {
+            struct cmsghdr hdr;
+            char space[CMSG_SPACE(sizeof(int) * PROTO_MAX_FDS)];
+        } control;
+        struct iovec iov = { .iov_base = buf + have, .iov_len = sizeof(buf) - have };
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.space,
+            .msg_controllen = sizeof(control.space),
+        };
+        ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            int got = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < got; i++) {
+                int passed;
+                memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (*count < PROTO_MAX_FDS) {
+                    fds[(*count)++] = passed;
+                } else {
+                    close(passed);
+                }
+            }
+        }
+        if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        have += n;
+    }
+    if (proto_decode_header(buf, hdr) == -1) {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+int proto_parse_download(const char *request, char *path, size_t size,
+                         uint64_t *offset, uint64_t *length) {
+    const char *nl = strchr(request, '\n');
+    size_t len = nl ? (size_t)(nl - request) : strlen(request);
+    snprintf(path, size, "%.*s", (int)len, request);
+    *offset = *length = 0;
+    if (!nl) return 0;
+
+    unsigned long long o, l;
+    int end = 0;
+    if (sscanf(nl + 1, "%llu %llu%n", &o, &l, &end) != 2 || nl[1 + end] != '\0') return -1;
+    *offset = o;
+    *length = l;
+    return 1;
+}
+
+// Write the DATA payload whose first header is hdr (plus any continuation
+// frames) into fp. On return hdr describes the last frame consumed.
+int proto_recv_file(int fd, struct proto_header *hdr, FILE *fp) {
+    int failed = 0;
+    while (1) {
+        if (hdr->type != PROTO_DATA) {
+            errno = EPROTO;
+            return -1;
+        }
+        // After a write error keep draining so the connection stays usable.
+        if (xfer_recv_file(fd, fp, hdr->length, &failed) == -1) return -1;
+        if (!(hdr->flags & PROTO_F_MORE)) {
+            if (failed) errno = EIO;
+            return failed ? -1 : 0;
+        }
+        if (proto_recv_header(fd, hdr) == -1) return -1;
+    }
+}
+
+// Forward a payload (and its continuation frames) from one connection to
+// another, re-tagging it with req_id for the receiving side.
+int proto_relay(int from_fd, int to_fd, struct proto_header *hdr, uint32_t req_id) {
+    while (1) {
+        if (proto_send_header(to_fd, hdr->type, hdr->flags, req_id, hdr->length) == -1 ||
+            xfer_relay(from_fd, to_fd, hdr->length) == -1) {
+            return -1;
+        }
+        if (!(hdr->flags & PROTO_F_MORE)) return 0;
+        if (proto_recv_header(from_fd, hdr) == -1) return -1;
+    }
+}
+
+static size_t put_varint(unsigned char *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+// Bytes used, 0 if the varint is cut off, -1 if it is too long
+static int get_varint(const unsigned char *p, size_t len, uint64_t *v) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < len && i < PROTO_VARINT_MAX; i++) {
+        value |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            *v = value;
+            return i + 1;
+        }
+    }
+    return len < PROTO_VARINT_MAX ? 0 : -1;
+}
+
+size_t proto_entry_encode(char *buf, size_t size, uint16_t format, const char *prev,
+                          const char *path, uint64_t file_size, uint64_t mtime) {
+    if (!(format & PROTO_F_FRONT)) {
+        size_t len = strlen(path);
+        if (len + 1 > size) return 0;
+        memcpy(buf, path, len);
+        buf[len] = '\n';
+        return len + 1;
+    }
+
+    size_t shared = 0;
+    while (prev[shared] != '\0' && prev[shared] == path[shared]) shared++;
+    size_t suffix = strlen(path + shared);
+    unsigned char head[2 * PROTO_VARINT_MAX], tail[2 * PROTO_VARINT_MAX];
+    size_t head_len = put_varint(head, shared);
+    head_len += put_varint(head + head_len, suffix);
+    size_t tail_len = 0;
+    if (format & PROTO_F_STAT) {
+        tail_len = put_varint(tail, file_size);
+        tail_len += put_varint(tail + tail_len, mtime);
+    }
+    if (head_len + suffix + tail_len > size) return 0;
+    memcpy(buf, head, head_len);
+    memcpy(buf + head_len, path + shared, suffix);
+    memcpy(buf + head_len + suffix, tail, tail_len);
+    return head_len + suffix + tail_len;
+}
+
+int proto_entry_decode(const char *buf, size_t len, uint16_t format, char *path, size_t path_size,
+                       uint64_t *file_size, uint64_t *mtime) {
+    *file_size = *mtime = 0;
+    if (!(format & PROTO_F_FRONT)) {
+        const char *nl = len > 0 ? memchr(buf, '\n', len) : NULL;
+        if (nl == NULL) return len < path_size ? 0 : -1;
+        size_t line = nl - buf;
+        if (line >= path_size) return -1;
+        memcpy(path, buf, line);
+        path[line] = '\0';
+        return line + 1;
+    }
+
+    const unsigned char *p = (const unsigned char *)buf;
+    uint64_t shared, suffix;
+    size_t used = 0;
+    int n = get_varint(p, len, &shared);
+    if (n <= 0) return n;
+    used += n;
+    n = get_varint(p + used, len - used, &suffix);
+    if (n <= 0) return n;
+    used += n;
+    if (shared > strlen(path) || suffix >= path_size - shared) return -1;
+    if (len - used < suffix) return 0;
+    const char *suffix_start = buf + used;
+    used += suffix;
+    if (format & PROTO_F_STAT) {
+        n = get_varint(p + used, len - used, file_size);
+        if (n <= 0) return n;
+        used += n;
+        n = get_varint(p + used, len - used, mtime);
+        if (n <= 0) return n;
+        used += n;
+    }
+    // Only now that the whole entry is in can path, the previous one, change
+    memcpy(path + shared, suffix_start, suffix);
+    path[shared + suffix] = '\0';
+    return used;
+}
@@ -0,0 +1,203 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Framed wire protocol shared by w25clients, S1 and the storage nodes S2/S3/S4.
+//
+// Every message is a fixed 20-byte header followed by `length` payload bytes:
+//
+//   magic    u16   PROTO_MAGIC
+//   version  u8    PROTO_VERSION
+//   type     u8    PROTO_* message type
+//   flags    u16   PROTO_F_* bits
+//   reserved u16   zero
+//   req_id   u32   chosen by the requester, echoed on every reply frame
+//   length   u64   payload length in bytes
+//
+// All integers are big-endian. A payload may be split across several frames of
+// the same type and req_id by setting PROTO_F_MORE on every frame but the last,
+// which lets a sender stream data whose total size it does not know up front.
+//
+// Requests and their replies:
+//
+//   UPLOAD   "<filename> <destination>", followed by one DATA payload -> OK / ERROR
+//   DOWNLOAD "<path>" or "<path>\n<offset> <length>"                  -> DATA / ERROR
+//   REMOVE   "<path>"                                                 -> OK / ERROR
+//   TAR      "<filetype>" (".c", ".pdf", ".txt")                      -> DATA / ERROR
+//   LIST     "<path>" or "<path>\n<cursor>"                           -> DATA... / ERROR
+//   STATS    ""                                  -> OK with S1's cache counters (S1 only)
+//   UPLOAD_BEGIN  "<filename> <destination>"                          -> OK "<offset>" / ERROR
+//   UPLOAD_QUERY  "<filename> <destination>"                          -> OK "<offset>" / ERROR
+//   UPLOAD_APPEND "<filename> <destination> <offset>", then one DATA  -> OK "<offset>" / ERROR
+//   UPLOAD_COMMIT "<filename> <destination> <size>"                   -> OK / ERROR
+//   REMOVE_MANY   "<path>\n<path>..."                                -> DATA... / ERROR
+//   DOWNLOAD_MANY "<path>\n<path>..."                                -> DATA... / ERROR
+//   SHM_RING ""  with a ring's descriptors attached (nodes only)      -> OK / ERROR
+//
+// A LIST reply names the files under <path>, relative to it, one per line in
+// byte order. It is sent a page at a time as MORE DATA frames and ends with an
+// empty DATA frame. With a cursor the listing starts after that line, so an
+// interrupted listing can be picked up where it stopped.
+//
+// With PROTO_F_FRONT set on the LIST request the entries are front-coded
+// instead of sent as lines: each is the varint length of the prefix it shares
+// with the entry before it, the varint length of the rest of the path and
+// those bytes. The first entry is coded against the cursor ("" without one).
+// PROTO_F_STAT, only together with PROTO_F_FRONT, adds the file's size and
+// mtime (seconds) as two more varints. Varints are LEB128: 7 bits a byte, low
+// bits first, the top bit set on all but the last byte. The reply's DATA
+// frames carry the format flags the sender used, and an entry may straddle
+// two of them.
+//
+// A DOWNLOAD with a range asks for length bytes from offset on (0 for all
+// the rest). The reply has PROTO_F_RANGE set and its payload starts with the
+// size of the whole file as 8 bytes, followed by the bytes of the range,
+// which stops early at the end of the file. An offset past the end is an
+// ERROR.
+//
+// The UPLOAD_* requests upload a file in pieces over any number of
+// connections (an upload session, see partfile.h). BEGIN starts the session
+// or resumes the one already there and QUERY looks it up (ERROR
+// "NO_SESSION" if there is none); both answer with the committed offset, the
+// number of bytes the receiver holds. APPEND writes its payload at offset,
+// which may be anything up to the committed offset (bytes after it are
+// dropped), and answers with the new committed offset; past it, the ERROR is
+// "OFFSET_MISMATCH:<offset>". COMMIT makes the file visible under its name
+// once it holds size bytes ("SIZE_MISMATCH:<offset>" otherwise).
+//
+// An APPEND with PROTO_F_RANGE set writes its payload at offset wherever
+// that is, keeping the bytes after it, and answers with the offset its piece
+// ends at. It lets a sender move the pieces of one file over several
+// connections at once; until all of them are in the receiver's committed
+// offset means nothing, and it is up to the sender to resend a lost piece.
+//
+// REMOVE_MANY and DOWNLOAD_MANY act on every file named by their lines, each
+// a path that may hold glob patterns: fnmatch(3) with FNM_PATHNAME, so "*"
+// and "?" do not match a '/' ("~s1/logs/*.txt"). A file named more than once
+// is only acted on once, and a path that names no file is simply left out.
+// S1 asks each storage node once, for all of the request's files it can
+// hold.
+//
+// The REMOVE_MANY reply is a report with a line "<status> <path>" for each
+// file: REMOVE_SUCCESS or REMOVE_FAILED. A path S1 cannot send anywhere gets
+// a line too, e.g. "REMOVE_FAILED:INVALID_FILE_TYPE ~s1/a.doc". Like a
+// listing it comes as MORE DATA frames of whole lines and ends with an empty
+// DATA frame.
+//
+// The DOWNLOAD_MANY reply is a tar archive of the files, sent like the TAR
+// reply: each member one MORE DATA frame, then the end of the archive as the
+// final one. Members are named by the files' paths below the root
+// ("logs/a.txt" for ~s1/logs/a.txt).
+//
+// The storage nodes also listen on a Unix socket each, for an S1 on the
+// same machine. Over one, a DOWNLOAD with PROTO_F_FD asks the node to pass
+// the open file instead of its bytes: the reply is an empty DATA frame with
+// PROTO_F_FD set and the descriptor attached to it (SCM_RIGHTS), and the
+// requester reads the file, or the range it wanted, itself. A node that
+// cannot pass the file (over TCP, say) ignores the flag and sends the bytes.
+//
+// SHM_RING gives a Unix socket connection a shared-memory ring (see
+// shmring.h): the memfd holding it and its data and space eventfds, in that
+// order, are attached to the request's header. Once a node has answered OK,
+// a DATA frame on the connection with PROTO_F_RING set carries no payload
+// bytes on the socket; its length bytes are in the ring instead. The other
+// frames, and every reply, still go over the socket. The next request may
+// follow SHM_RING without waiting; the node answers SHM_RING first.
+//
+// OK and ERROR carry a short status string such as "UPLOAD_SUCCESS" or
+// "REMOVE_FAILED". Build every program together with proto.c and xfer.c, e.g.
+// `gcc -o s1 s1.c proto.c xfer.c tar.c nsindex.c metacache.c objcache.c partfile.c shmring.c -pthread`;
+// the storage nodes also need node.c, nsindex.c, partfile.c, shmring.c, tar.c and uring.c, and
+// the client tar.c and -pthread.
+
+#define PROTO_MAGIC       0x5735   // "W5"
+#define PROTO_VERSION     1
+#define PROTO_HEADER_SIZE 20
+
+// Request types
+#define PROTO_UPLOAD   0x01
+#define PROTO_DOWNLOAD 0x02
+#define PROTO_REMOVE   0x03
+#define PROTO_TAR      0x04
+#define PROTO_LIST     0x05
+#define PROTO_STATS    0x06
+#define PROTO_UPLOAD_BEGIN  0x07
+#define PROTO_UPLOAD_APPEND 0x08
+#define PROTO_UPLOAD_QUERY  0x09
+#define PROTO_UPLOAD_COMMIT 0x0a
+#define PROTO_REMOVE_MANY   0x0b
+#define PROTO_DOWNLOAD_MANY 0x0c
+#define PROTO_SHM_RING      0x0d
+
+// Reply / payload types
+#define PROTO_DATA     0x10
+#define PROTO_OK       0x11
+#define PROTO_ERROR    0x12
+
+// Flags
+#define PROTO_F_MORE   0x0001   // another frame of this payload follows
+#define PROTO_F_FRONT  0x0002   // LIST: front-coded entries
+#define PROTO_F_STAT   0x0004   // LIST: entries carry size and mtime
+#define PROTO_F_RANGE  0x0008   // DOWNLOAD reply: part of a file, after the file's size;
+                                // UPLOAD_APPEND: write at offset, out of order
+#define PROTO_F_FD     0x0010   // DOWNLOAD: pass the open file over a Unix socket
+#define PROTO_F_RING   0x0020   // DATA: the payload is in the connection's ring
+
+#define PROTO_MAX_FDS  3        // descriptors passed with one frame at most
+
+#define PROTO_RANGE_SIZE 8      // bytes of file size ahead of a ranged reply's data
+
+#define PROTO_VARINT_MAX 10     // bytes in the longest varint
+
+struct proto_header {
+    uint8_t version;
+    uint8_t type;
+    uint16_t flags;
+    uint32_t req_id;
+    uint64_t length;
+};
+
+void proto_encode_header(unsigned char *buf, uint8_t type, uint16_t flags,
+                         uint32_t req_id, uint64_t length);
+int proto_decode_header(const unsigned char *buf, struct proto_header *hdr);
+
+int proto_send_header(int fd, uint8_t type, uint16_t flags, uint32_t req_id, uint64_t length);
+int proto_send(int fd, uint8_t type, uint32_t req_id, const void *payload, size_t len);
+int proto_send_str(int fd, uint8_t type, uint32_t req_id, const char *str);
+int proto_recv_header(int fd, struct proto_header *hdr);
+int proto_recv_payload(int fd, const struct proto_header *hdr, char *buf, size_t size);
+int proto_recv_msg(int fd, struct proto_header *hdr, char *buf, size_t size);
+int proto_skip(int fd, uint64_t len);
+
+int proto_send_file(int fd, uint32_t req_id, FILE *fp);
+int proto_send_range(int fd, uint32_t req_id, FILE *fp, uint64_t offset, uint64_t length);
+int proto_send_fd(int sock, uint32_t req_id, int fd);
+int proto_send_fds(int sock, uint8_t type, uint16_t flags, uint32_t req_id, const int *fds, int count);
+int proto_recv_header_fds(int fd, struct proto_header *hdr, int *fds, int *count);
+int proto_recv_file(int fd, struct proto_header *hdr, FILE *fp);
+int proto_relay(int from_fd, int to_fd, struct proto_header *hdr, uint32_t req_id);
+
+void proto_put_u64(unsigned char *p, uint64_t v);
+uint64_t proto_get_u64(const unsigned char *p);
+
+// Split a DOWNLOAD payload into the path and the range, if it has one.
+// Returns 1 for a range, 0 for the whole file and -1 if it is malformed.
+int proto_parse_download(const char *request, char *path, size_t size,
+                         uint64_t *offset, uint64_t *length);
+
+// Write the listing entry for path to buf in the given format (PROTO_F_FRONT
+// and PROTO_F_STAT bits; a line without PROTO_F_FRONT), coded against the
+// previous entry prev. Returns its length, or 0 if it does not fit in size.
+size_t proto_entry_encode(char *buf, size_t size, uint16_t format, const char *prev,
+                          const char *path, uint64_t file_size, uint64_t mtime);
+
+// Read the listing entry at the start of buf. path holds the previous entry
+// and is replaced by this one. Returns the bytes the entry took, 0 if buf only
+// holds part of it (path is then left alone) or -1 if it is malformed.
+int proto_entry_decode(const char *buf, size_t len, uint16_t format, char *path, size_t path_size,
+                       uint64_t *file_size, uint64_t *mtime);
+
+#endif
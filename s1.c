@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,93 +6,571 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/timerfd.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <libgen.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
+
+#include "proto.h"
+#include "xfer.h"
+#include "tar.h"
+#include "nsindex.h"
+#include "metacache.h"
+#include "objcache.h"
+#include "partfile.h"
+#include "shmring.h"
 
 #define PORT 5077
 #define S2_PORT 7082
 #define S3_PORT 3032
 #define S4_PORT 2022
-#define MAX_CLIENTS 5
+#define S2_SOCKET "/tmp/w25_s2.sock"
+#define S3_SOCKET "/tmp/w25_s3.sock"
+#define S4_SOCKET "/tmp/w25_s4.sock"
 #define BUFFER_SIZE 1024
 #define MAX_PATH 512
+#define MAX_FILE_PATH (MAX_PATH + 256)   // a directory of MAX_PATH and a file name in it
+#define POOL_MAX 64                // upper bound for -n
+#define DEFAULT_POOL_SIZE 4        // idle connections kept per storage node
+#define DEFAULT_POOL_IDLE_TIMEOUT 30  // seconds before an idle connection is closed
+#define IO_CHUNK (64 * 1024)       // bytes moved per read when streaming a payload
+#define MAX_EVENTS 256             // epoll events handled per wakeup
+#define DEFAULT_LIST_DEADLINE 2000 // ms a node may go quiet during dispfnames
+#define LIST_STREAM_MAX (256 * 1024)   // unmerged listing bytes buffered per source
+#define DEFAULT_CACHE_ENTRIES 65536    // node files whose metadata S1 remembers
+#define CACHE_FILTER_BITS (1 << 24)    // 2 MB negative-lookup filter, ~1% false hits at 1.7M files
+#define DEFAULT_OBJECT_CACHE_MB 64     // memory for hot node files
+#define OBJECT_MAX (1024 * 1024)       // larger files are never kept in memory
+#define FLIGHT_BACKLOG (1024 * 1024)   // bytes a shared fetch may queue for one client
+#define DEFAULT_PIPELINE_DEPTH 16      // requests served at once per client connection
+#define MAX_RING_FD 65536              // node connections on higher descriptors get no ring
+
+// Storage nodes that S1 routes non-.c files to
+struct storage_node {
+    const char *name;   // log name, e.g. "S2"
+    const char *ext;    // file extension stored on the node
+    const char *tag;    // path prefix in the node's namespace, e.g. "~s2"
+    int port;
+    const char *socket_path;    // Unix socket, for a node on the same machine
+};
+
+static const struct storage_node storage_nodes[] = {
+    { "S2", ".pdf", "~s2", S2_PORT, S2_SOCKET },
+    { "S3", ".txt", "~s3", S3_PORT, S3_SOCKET },
+    { "S4", ".zip", "~s4", S4_PORT, S4_SOCKET },
+};
+
+#define NUM_NODES (int)(sizeof(storage_nodes) / sizeof(storage_nodes[0]))
+
+// Request ids for frames S1 sends to the storage nodes
+static __thread uint32_t next_node_req_id = 1;
+
+// Kept-alive connections to each storage node. Every reactor thread owns its
+// own pool, so no locking is needed; connections are borrowed for one
+// request/reply exchange and returned once the reply has been fully read.
+struct pooled_conn {
+    int fd;
+    time_t last_used;
+};
+
+struct node_pool {
+    struct pooled_conn idle[POOL_MAX];
+    int count;
+};
+
+static __thread struct node_pool node_pools[NUM_NODES];
+static int pool_size = DEFAULT_POOL_SIZE;
+static int pool_idle_timeout = DEFAULT_POOL_IDLE_TIMEOUT;
+static int listen_backlog = SOMAXCONN;
+static int list_deadline_ms = DEFAULT_LIST_DEADLINE;
+static struct nsindex local_files;  // S1's own .c files, for dispfnames
+static struct metacache metadata;   // the storage nodes' files
+static size_t cache_entries = DEFAULT_CACHE_ENTRIES;
+static struct objcache objects;     // contents of hot node files
+static size_t object_cache_mb = DEFAULT_OBJECT_CACHE_MB;
+static int pipeline_depth = DEFAULT_PIPELINE_DEPTH;
+static int node_unix;               // reach the nodes over their Unix sockets
+static size_t ring_kb;              // shared-memory ring per node connection, 0 for none
+
+// Rings of the node connections that have one, by descriptor. A connection
+// belongs to one reactor thread, which alone touches its slot.
+static struct shmring *node_rings[MAX_RING_FD];
+static char ring_wanted[MAX_RING_FD];   // Unix connection not offered a ring yet
+
+// Growable byte queue for data waiting to be written to a socket
+struct buf {
+    char *data;
+    size_t len;     // bytes stored
+    size_t off;     // bytes already written
+    size_t cap;
+};
+
+// One epoll loop per thread. Each reactor has its own SO_REUSEPORT listening
+// socket, so the kernel spreads new clients across threads without a shared
+// accept lock, and every session stays on the thread that accepted it.
+struct reactor {
+    int epfd;
+    int listen_fd;
+    struct session *closed;    // sessions freed after the current event batch
+    struct session *ready;     // sessions woken by another session, run after the batch
+};
+
+struct session;
+
+// A session is driven by its current step. Steps do as much non-blocking I/O
+// as they can and return one of these.
+#define STEP_NEXT  1   // state changed, run the next step right away
+#define STEP_WAIT  0   // blocked on a socket; resume on the next epoll event
+#define STEP_CLOSE -1  // drop the session
+
+typedef int (*step_fn)(struct session *s);
+
+// Connection to a storage node borrowed for the current command
+struct backend {
+    int fd;
+    int reused;                 // came from the pool; worth one retry on failure
+    int retried;
+    int failed;                 // no usable reply; on_done reports the error
+    int connect_failed;
+    int relay;                  // pass the reply through instead of collecting it
+    const struct storage_node *node;
+    uint8_t req_type;           // request kept for a retry on a fresh connection
+    uint16_t req_flags;
+    uint32_t req_id;
+    char req_payload[BUFFER_SIZE];
+    FILE *body;                 // sent as a DATA payload after the request
+    uint64_t body_left;
+    struct buf out;             // request bytes not yet sent
+    unsigned char hdr_buf[PROTO_HEADER_SIZE];
+    size_t hdr_len;
+    struct proto_header reply;  // reply header once read
+    int passed_fd;              // file the node passed with its reply, -1 if none
+    struct shmring *ring_offer; // ring offered ahead of the request, answer not read yet
+    char ring_answer[64];
+    size_t ring_have;
+    step_fn on_done;
+};
+
+// dispfnames: one sorted stream of front-coded entries per source, S1's own
+// .c files first and then one LIST reply per storage node, all read at once
+// and merged as they arrive
+struct list_stream {
+    const struct storage_node *node;    // NULL for S1's own files
+    int fd;                     // node connection, -1 once closed
+    int reused;
+    int retried;
+    int done;                   // no more lines will arrive
+    struct buf out;             // LIST request not yet sent
+    unsigned char hdr_buf[PROTO_HEADER_SIZE];
+    size_t hdr_len;
+    uint64_t remaining;         // bytes of the current reply frame left to read
+    uint16_t flags;
+    struct buf lines;           // entries received; lines.off is the next unmerged one
+    char cursor[PATH_MAX];      // last entry merged, which the next one is coded against
+    char page_cursor[PATH_MAX]; // S1's own files: last entry paged in from the index
+    char head[PATH_MAX];        // next entry, decoded once all of it is in
+    uint64_t head_size;
+    uint64_t head_mtime;
+    int head_len;               // its encoded length, 0 until decoded
+    struct timespec deadline;   // dropped if nothing arrives by then
+};
+
+struct listing {
+    struct list_stream streams[NUM_NODES + 1];
+    char prefix[PATH_MAX];      // requested directory as an index key prefix
+    uint16_t format;            // entry format the client asked for
+    char sent[PATH_MAX];        // last entry sent to the client
+    int timer_fd;               // wakes the session at the earliest deadline
+};
+
+// removef and downlf of several paths or glob patterns. Each path goes to
+// every place its files can be: S1 itself for .c files, the node for its
+// type, or all of them when the type is a pattern too. Each place is then
+// asked once for all of its paths, S1 first and the nodes one after the
+// other.
+struct multi {
+    char paths[NUM_NODES + 1][BUFFER_SIZE];    // one per line in each place's namespace; [0] is S1
+    int next;                   // next place to ask
+};
+
+// S1's own files matching a path, collected from its index
+struct local_match {
+    struct tar_list *list;
+    const char *root;
+    int failed;
+};
+
+// A node fetch shared by the sessions of one reactor that ask for the same
+// thing while it is in flight: downlf of one path, downltar of one type. The
+// leader runs the exchange with the node like any other command; every byte
+// it relays is also queued for each follower, re-tagged with its req_id.
+struct flight {
+    struct flight *next;
+    uint8_t type;
+    char request[MAX_PATH];     // node request payload
+    uint64_t epoch;             // object cache epoch of the path when it started
+    struct session *leader;
+    struct session *followers;  // linked through command.next_follower
+    int relaying;               // the reply has started going out
+    int finished;               // and has gone out in full
+    int broken;                 // the node connection failed part way
+    int stalled;                // leader waits for a follower's client to catch up
+};
+
+// Kept per reactor thread, like the node pools, so no locking is needed
+static __thread struct flight *flights;
+
+#define FLIGHT_DONE  1          // follower: the leader relayed the whole reply
+#define FLIGHT_RETRY 2          // follower: no reply to share; ask the node itself
+
+// Per-command state, allocated when a command starts so idle sessions stay small
+struct command {
+    char path[MAX_PATH];        // path argument of the request
+    char filename[256];
+    char destination[256];
+    char filepath[MAX_FILE_PATH];   // local file the command reads or writes
+    char target[MAX_FILE_PATH];     // upload: name filepath gets once it is complete
+    FILE *fp;
+    int pipe[2];                // cut-through upload: client bytes spliced to the node
+    size_t pipe_bytes;          // bytes sitting in the pipe
+    off_t offset;               // next byte of fp to send
+    int copy_fallback;          // sendfile unsupported for fp; read and queue instead
+    int unlink_on_close;        // delete filepath when the command ends
+    uint64_t remaining;         // payload bytes left in the current frame
+    uint16_t flags;             // flags of the current frame
+    uint64_t payload_size;      // upload: bytes announced so far
+    uint64_t committed;         // upload session: offset the append started at
+    char status[64];            // reply formatted for the request
+    int ranged;                 // download: only part of the file was asked for
+    uint64_t range_offset;
+    uint64_t range_length;      // 0 for the rest of the file
+    char key[MAX_PATH];         // metadata cache key of a node file, "" if none
+    int cache_fill;             // download: keep a copy of the relayed file in c->data
+    uint64_t cache_epoch;       // object cache epoch when the download started
+    const char *error;          // reply to send once the upload payload is drained
+    char *data;                 // node reply payload / combined file list
+    size_t data_len;
+    size_t data_cap;
+    size_t data_limit;          // larger replies are drained and flagged
+    int data_overflow;
+    struct listing *listing;    // dispfnames
+    struct multi *multi;        // removef / downlf of several files
+    step_fn on_relayed;
+    step_fn on_sent;            // runs after step_send_file instead of command_done
+    step_fn on_received;        // runs after step_upload_recv instead of storing filepath
+    struct tar_list tar;        // downltar .c: files still to archive
+    size_t tar_next;
+    uint64_t tar_written;       // archive bytes queued so far
+    struct backend backend;
+    struct flight *flight;      // shared fetch the command leads or follows
+    struct session *next_follower;
+    int flight_result;          // follower: FLIGHT_DONE or FLIGHT_RETRY once the leader is gone
+};
+
+// A client connection reads requests; each one is served by a session of its
+// own (sharing the connection's fd), so a client can pipeline requests and
+// have them answered in the order they finish, each reply tagged with its
+// req_id. Requests take turns writing to the client: the first with
+// something to send has the connection until its whole reply is out, so
+// replies never interleave. A request whose payload follows it (an upload)
+// reads the client until the payload is in; only then is the next request
+// read.
+struct session {
+    int fd;
+    int closed;
+    struct reactor *reactor;
+    struct session *next_closed;
+    struct session *next_ready;
+    int queued;                 // on the reactor's ready list
+    step_fn step;
+
+    struct session *conn;       // client connection the request came in on; itself for one
+    struct session *requests;   // connection: requests being served, linked by next_request
+    struct session *next_request;
+    int in_flight;
+    struct session *writer;     // connection: request whose reply is going out
+    struct session *reader;     // connection: request reading its payload from the client
+
+    // Request currently being read from the client
+    unsigned char hdr_buf[PROTO_HEADER_SIZE];
+    size_t hdr_len;
+    struct proto_header hdr;
+    char command_buf[BUFFER_SIZE];
+    size_t command_len;
+    uint32_t req_id;
+
+    struct buf out;             // bytes queued for the client
+    struct command *cmd;
+};
 
-void prcclient(int client_fd);
 void expand_path(const char *input_path, char *output_path, size_t size);
-int forward_to_s3(const char *filename, const char *destination, const char *filepath);
-int forward_to_s4(const char *filename, const char *destination, const char *filepath);
-
+void map_to_node_path(const char *path, const struct storage_node *node, char *out, size_t size);
+const struct storage_node *node_for_ext(const char *ext);
+int node_index(const struct storage_node *node);
+int cache_key(const struct storage_node *node, const char *node_path, char *key, size_t size);
+long cache_read_listing(int fd, int i);
+void cache_load(int i);
+int connect_to_node(const struct storage_node *node);
+int connect_unix(const struct storage_node *node);
+int ring_offer(struct session *s);
+int upload_ring_answer(struct session *s);
+int ring_watch(struct session *s, struct shmring *ring);
+struct shmring *node_ring(int fd);
+int pool_acquire(const struct storage_node *node, int *reused);
+void pool_release(const struct storage_node *node, int fd);
+void pool_discard(int fd);
+
+void *reactor_run(void *arg);
+void accept_clients(struct reactor *r);
+void session_run(struct session *s);
+void session_close(struct session *s);
+void session_wake(struct session *s);
+int session_may_write(struct session *s);
+int session_writer(struct session *s);
+int session_flush(struct session *s);
+void request_read(struct session *s);
+void request_finish(struct session *s);
+struct session *request_start(struct session *conn, step_fn first);
+void command_free(struct session *s);
+void backend_fail(struct session *s);
+void backend_release(struct session *s);
+void backend_discard(struct session *s);
+int backend_connect(struct session *s);
+int backend_attach(struct session *s);
+int node_conn_open(struct session *s, const struct storage_node *node, int *reused);
+void node_conn_close(struct session *s, const struct storage_node *node, int fd, int reusable);
+int backend_collect(struct session *s, step_fn on_done);
+int relay_keep(struct command *c, const char *data, size_t len);
+int flight_request(struct session *s, const struct storage_node *node, uint8_t type,
+                   const char *payload, step_fn on_done);
+void flight_fanout(struct session *s, const struct proto_header *hdr, const char *data, size_t len);
+int flight_backlogged(struct session *s);
+void flight_leave(struct session *s);
+void flight_handoff(struct session *s, struct flight *f);
+
+// Session steps
+int step_read_header(struct session *s);
+int step_read_command(struct session *s);
+int step_dispatch(struct session *s);
+int step_request_done(struct session *s);
+int step_skip_command(struct session *s);
+int step_send_file(struct session *s);
+int step_backend_send(struct session *s);
+int step_backend_reply(struct session *s);
+int step_backend_collect(struct session *s);
+int step_backend_relay(struct session *s);
+int step_flight_wait(struct session *s);
+int step_upload_recv(struct session *s);
+int step_upload_forward(struct session *s);
+int start_upload(struct session *s);
+int start_download(struct session *s);
+int start_remove(struct session *s);
+int start_tar(struct session *s);
+int start_list(struct session *s);
+int start_stats(struct session *s);
+int start_many(struct session *s);
+const char *many_route(struct multi *m, const char *path);
+int many_next(struct session *s);
+int many_answered(struct session *s);
+int many_failed(struct session *s);
+int many_frame(struct session *s, const struct proto_header *hdr);
+int step_many_relay(struct session *s);
+int step_remove_report(struct session *s);
+int remove_report_lines(struct session *s);
+int remove_many_local(struct session *s);
+int download_many_local(struct session *s);
+int collect_local(struct tar_list *list, const char *root, const char *paths);
+int add_local_match(const struct nsindex_entry *entry, void *arg);
+int tar_finish(struct session *s);
+int start_upload_session(struct session *s);
+int upload_session_local(struct session *s, uint64_t number);
+int upload_session_appended(struct session *s);
+int upload_session_answered(struct session *s);
+int download_cached(struct session *s);
+int upload_cut_through(struct session *s, const struct storage_node *node, uint8_t type,
+                       const char *payload, step_fn on_done);
+int upload_forward_failed(struct session *s);
+int upload_stored(struct session *s);
+int upload_forwarded(struct session *s);
+void upload_cache(struct session *s);
+int download_answered(struct session *s);
+int download_passed(struct session *s);
+int download_relayed(struct session *s);
+int download_failed(struct session *s);
+int download_not_found(struct session *s, const struct storage_node *node);
+int remove_answered(struct session *s);
+int step_tar_member(struct session *s);
+int tar_member_sent(struct session *s);
+int tar_answered(struct session *s);
+int tar_relayed(struct session *s);
+int step_list_gather(struct session *s);
+void list_stream_touch(struct list_stream *st);
+int list_stream_open(struct session *s, struct list_stream *st);
+void list_stream_run(struct session *s, struct list_stream *st);
+int list_stream_head(struct session *s, struct list_stream *st);
+void list_stream_fail(struct session *s, struct list_stream *st, const char *reason);
+int list_merge(struct session *s, int *moved);
+void listing_free(struct session *s);
+int timespec_passed(const struct timespec *now, const struct timespec *t);
+
+int main(int argc, char *argv[]) {
+    // Options: -n <idle connections per node> -t <idle timeout in seconds>
+    //          -b <listen backlog> -w <reactor threads>
+    //          -d <ms the storage nodes get to answer dispfnames>
+    //          -c <node files to cache metadata for, 0 to disable>
+    //          -o <MB of hot node files kept in memory, 0 to disable>
+    //          -p <requests served at once per client connection>
+    //          -u (reach the storage nodes over their Unix sockets)
+    //          -m <KB of shared-memory ring per node connection for uploads;
+    //              implies -u>
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt_char;
+    while ((opt_char = getopt(argc, argv, "n:t:b:w:d:c:o:p:um:")) != -1) {
+        switch (opt_char) {
+        case 'n':
+            pool_size = atoi(optarg);
+            if (pool_size < 0) pool_size = 0;
+            if (pool_size > POOL_MAX) pool_size = POOL_MAX;
+            break;
+        case 't':
+            pool_idle_timeout = atoi(optarg);
+            break;
+        case 'b':
+            listen_backlog = atoi(optarg);
+            break;
+        case 'w':
+            threads = atol(optarg);
+            break;
+        case 'd':
+            list_deadline_ms = atoi(optarg);
+            if (list_deadline_ms < 1) list_deadline_ms = 1;
+            break;
+        case 'c':
+            cache_entries = atol(optarg);
+            break;
+        case 'o':
+            object_cache_mb = atol(optarg);
+            break;
+        case 'p':
+            pipeline_depth = atoi(optarg);
+            if (pipeline_depth < 1) pipeline_depth = 1;
+            break;
+        case 'u':
+            node_unix = 1;
+            break;
+        case 'm':
+            ring_kb = atol(optarg);
+            if (ring_kb > 0) node_unix = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n pool_size] [-t idle_timeout_sec] [-b backlog] [-w threads] [-d list_deadline_ms] [-c cache_entries] [-o object_cache_mb] [-p pipeline_depth] [-u] [-m ring_kb]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (threads < 1) threads = 1;
 
-int main() {
-    int server_fd, client_fd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len = sizeof(client_addr);
+    // Writes to a client that went away must fail with EPIPE, not kill S1
+    signal(SIGPIPE, SIG_IGN);
 
-    // Step 1: Create socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1) {
-        perror("Socket creation failed.");
+    // Index S1's own .c files before taking requests
+    char root[MAX_PATH];
+    expand_path("~s1", root, sizeof(root));
+    if (nsindex_build(&local_files, root, ".c") == -1) {
+        fprintf(stderr, "[S1] Failed to index %s\n", root);
         exit(EXIT_FAILURE);
     }
+    printf("[S1] Indexed %zu files under %s\n", local_files.count, root);
 
-    // Step 2: Allow port reuse (FIX for "Address already in use")
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt(SO_REUSEADDR) failed");
+    // Learn what the storage nodes hold, so lookups of missing files can be
+    // answered without asking them
+    if (metacache_init(&metadata, cache_entries, CACHE_FILTER_BITS) == -1) {
+        perror("[S1] Metadata cache allocation failed");
         exit(EXIT_FAILURE);
     }
-
-    // Step 3: Configure server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
-
-    // Step 4: Bind socket to port
-    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
-        perror("Bind failed");
-        close(server_fd);
+    for (int i = 0; cache_entries > 0 && i < NUM_NODES; i++) {
+        cache_load(i);
+    }
+    if (objcache_init(&objects, object_cache_mb * 1024 * 1024, OBJECT_MAX) == -1) {
+        perror("[S1] Object cache allocation failed");
         exit(EXIT_FAILURE);
     }
 
-    // Step 5: Start listening
-    if (listen(server_fd, MAX_CLIENTS) == -1) {
-        perror("Listening failed");
-        close(server_fd);
+    struct reactor *reactors = calloc(threads, sizeof(*reactors));
+    pthread_t *tids = calloc(threads, sizeof(*tids));
+    if (!reactors || !tids) {
+        perror("Allocation failed");
         exit(EXIT_FAILURE);
     }
 
-    printf("S1 Server is listening on port %d...\n", PORT);
+    for (long i = 0; i < threads; i++) {
+        struct sockaddr_in server_addr;
 
-    while (1) {
-        // Step 6: Accept client connection
-        client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &addr_len);
-        if (client_fd == -1) {
-            perror("Accept failed");
-            continue;
+        // Step 1: Create socket
+        int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (server_fd == -1) {
+            perror("Socket creation failed.");
+            exit(EXIT_FAILURE);
+        }
+
+        // Step 2: Allow port reuse, and one listening socket per reactor
+        int opt = 1;
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+            setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            perror("setsockopt(SO_REUSEADDR/SO_REUSEPORT) failed");
+            exit(EXIT_FAILURE);
         }
 
-        printf("Client connected, now forking the child process.\n");
+        // Step 3: Configure server address
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(PORT);
 
-        // Step 7: Fork to handle client
-        pid_t pid = fork();
-        if (pid == 0) { // Child process
+        // Step 4: Bind socket to port
+        if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
+            perror("Bind failed");
             close(server_fd);
-            prcclient(client_fd);
-            close(client_fd);
-            exit(0);
-        } else if (pid > 0) { // Parent process
-            close(client_fd);
-        } else {
-            perror("Fork failed");
-            close(client_fd);
+            exit(EXIT_FAILURE);
+        }
+
+        // Step 5: Start listening
+        if (listen(server_fd, listen_backlog) == -1) {
+            perror("Listening failed");
+            close(server_fd);
+            exit(EXIT_FAILURE);
+        }
+
+        // Step 6: Register it with this reactor's epoll instance
+        reactors[i].listen_fd = server_fd;
+        reactors[i].epfd = epoll_create1(0);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (reactors[i].epfd == -1 ||
+            epoll_ctl(reactors[i].epfd, EPOLL_CTL_ADD, server_fd, &ev) == -1) {
+            perror("epoll setup failed");
+            exit(EXIT_FAILURE);
         }
     }
 
-    close(server_fd);
+    printf("S1 Server is listening on port %d with %ld reactor thread(s)...\n", PORT, threads);
+
+    // Step 7: Run one event loop per thread
+    for (long i = 1; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, reactor_run, &reactors[i]) != 0) {
+            perror("pthread_create failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    reactor_run(&reactors[0]);
     return 0;
 }
 
@@ -121,1231 +600,2939 @@ void expand_path(const char *input_path, char *output_path, size_t size) {
     }
 }
 
-int forward_to_s2(const char *filename, const char *destination, const char *filepath) {
-    int s2_fd;
-    struct sockaddr_in s2_addr;
-
-    // Create socket to connect to S2
-    s2_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (s2_fd == -1) {
-        perror("Socket creation for S2 failed");
-        return -1;
-    }
-
-    // Configure S2 address
-    memset(&s2_addr, 0, sizeof(s2_addr));
-    s2_addr.sin_family = AF_INET;
-    s2_addr.sin_port = htons(S2_PORT);  // S2's port
-    inet_pton(AF_INET, "127.0.0.1", &s2_addr.sin_addr);
-
-    // Connect to S2
-    if (connect(s2_fd, (struct sockaddr *)&s2_addr, sizeof(s2_addr)) == -1) {
-        perror("Connection to S2 failed");
-        close(s2_fd);
-        return -1;
+// Rewrite a client path (~s1/...) into a storage node's namespace (~s2/...)
+void map_to_node_path(const char *path, const struct storage_node *node, char *out, size_t size) {
+    if (strncmp(path, "~s1", 3) == 0) {
+        snprintf(out, size, "%s%s", node->tag, path + 3);
+        return;
+    }
+
+    // Absolute or ~/ paths: swap the s1 root directory under $HOME
+    char expanded[MAX_PATH];
+    expand_path(path, expanded, sizeof(expanded));
+    const char *home = getenv("HOME");
+    size_t home_len = home ? strlen(home) : 0;
+    if (home && strncmp(expanded, home, home_len) == 0 &&
+        strncmp(expanded + home_len, "/s1", 3) == 0 &&
+        (expanded[home_len + 3] == '/' || expanded[home_len + 3] == '\0')) {
+        snprintf(out, size, "%s%s", node->tag, expanded + home_len + 3);
+    } else {
+        strncpy(out, expanded, size - 1);
+        out[size - 1] = '\0';
     }
+}
 
-    // Prepare destination path for S2 (replace ~s1 with ~s2)
-    char expanded_dest[MAX_PATH];
-    expand_path(destination, expanded_dest, sizeof(expanded_dest));
-    
-    // Replace "s1" with "s2" in the path
-    char *s1_pos = strstr(expanded_dest, "s1");
-    if (s1_pos) {
-        memcpy(s1_pos, "s2", 2);
-    }
-
-    // Send destination path first
-    if (send(s2_fd, expanded_dest, strlen(expanded_dest), 0) == -1) {
-        perror("Failed to send destination path to S2");
-        close(s2_fd);
-        return -1;
+// Pick the storage node responsible for a file extension (NULL for .c / local)
+const struct storage_node *node_for_ext(const char *ext) {
+    if (ext == NULL) return NULL;
+    for (size_t i = 0; i < sizeof(storage_nodes) / sizeof(storage_nodes[0]); i++) {
+        if (strcmp(ext, storage_nodes[i].ext) == 0) return &storage_nodes[i];
     }
+    return NULL;
+}
 
-    // Small delay to ensure S2 receives the path first
-    usleep(10000);
+int node_index(const struct storage_node *node) {
+    return node - storage_nodes;
+}
 
-    // Send filename next
-    if (send(s2_fd, filename, strlen(filename), 0) == -1) {
-        perror("Failed to send filename to S2");
-        close(s2_fd);
-        return -1;
-    }
+// The metadata cache key for a path in the node's namespace: the path below
+// its root, e.g. "folder/b.pdf" for "~s2/folder//b.pdf"
+int cache_key(const struct storage_node *node, const char *node_path, char *key, size_t size) {
+    size_t tag_len = strlen(node->tag);
+    if (strncmp(node_path, node->tag, tag_len) != 0 || node_path[tag_len] != '/') return -1;
+    nsindex_prefix(node_path + tag_len, key, size);
+    size_t len = strlen(key);
+    if (len == 0) return -1;
+    key[len - 1] = '\0';
+    return 0;
+}
 
-    // Small delay to ensure S2 receives the filename
-    usleep(10000);
+// Read a LIST reply from fd into the metadata cache as files on node i.
+// Returns the number of files, -1 if the reply broke off.
+long cache_read_listing(int fd, int i) {
+    char in[2 * PATH_MAX], path[PATH_MAX] = "";
+    size_t have = 0;
+    long files = 0;
+    struct proto_header hdr;
+    do {
+        if (proto_recv_header(fd, &hdr) == -1 || hdr.type != PROTO_DATA) return -1;
+        uint64_t remaining = hdr.length;
+        while (remaining > 0) {
+            size_t want = remaining < sizeof(in) - have ? remaining : sizeof(in) - have;
+            if (recv_all(fd, in + have, want) == -1) return -1;
+            have += want;
+            remaining -= want;
+
+            size_t used = 0;
+            uint64_t size, mtime;
+            int n;
+            while ((n = proto_entry_decode(in + used, have - used, hdr.flags, path, sizeof(path),
+                                           &size, &mtime)) > 0) {
+                metacache_seen(&metadata, path, i, size, mtime);
+                used += n;
+                files++;
+            }
+            if (n == -1) return -1;
+            memmove(in, in + used, have - used);
+            have -= used;
+        }
+    } while (hdr.flags & PROTO_F_MORE);
+    return files;
+}
 
-    // Send file data
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp) {
-        perror("Failed to open file for S2 transfer");
-        close(s2_fd);
-        return -1;
-    }
+// Read the node's whole listing into the metadata cache at startup. A node
+// that cannot be listed is simply always asked.
+void cache_load(int i) {
+    const struct storage_node *node = &storage_nodes[i];
+    int fd = connect_to_node(node);
+    if (fd == -1) return;
+    struct timeval timeout = { list_deadline_ms / 1000, (list_deadline_ms % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    long files = -1;
+    if (proto_send_header(fd, PROTO_LIST, PROTO_F_FRONT | PROTO_F_STAT, 1, strlen(node->tag)) == 0 &&
+        send_all(fd, node->tag, strlen(node->tag)) == 0) {
+        files = cache_read_listing(fd, i);
+    }
+    pool_discard(fd);
+    if (files == -1) {
+        fprintf(stderr, "[S1] Could not list %s; lookups of its files always go to it\n", node->name);
+        return;
+    }
+    metacache_loaded(&metadata, i);
+    printf("[S1] Cached %ld files on %s\n", files, node->name);
+}
 
-    char buffer[BUFFER_SIZE];
-    int bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-        if (send(s2_fd, buffer, bytes_read, 0) == -1) {
-            perror("Failed to send file data to S2");
-            fclose(fp);
-            close(s2_fd);
-            return -1;
+int connect_to_node(const struct storage_node *node) {
+    int fd;
+    struct sockaddr_in addr;
+
+    if (node_unix) {
+        fd = connect_unix(node);
+        if (fd != -1) {
+            // The ring is offered with the connection's first upload
+            if (fd < MAX_RING_FD) ring_wanted[fd] = ring_kb > 0;
+            xfer_tune(fd, XFER_BULK);
+            return fd;
         }
+        fprintf(stderr, "[S1] Unix socket of %s unavailable, using TCP: %s\n", node->name, strerror(errno));
     }
 
-    fclose(fp);
-    close(s2_fd);
-    return 0;
-}
-int forward_to_s3(const char *filename, const char *destination, const char *filepath)
-{
-    int s3_fd;
-    struct sockaddr_in s3_addr;
-
-    // Create socket to connect to S3
-    s3_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (s3_fd == -1)
-    {
-        perror("Socket creation for S3 failed");
+    // Create socket to connect to the storage node
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        fprintf(stderr, "[S1] Socket creation for %s failed: %s\n", node->name, strerror(errno));
         return -1;
     }
 
-    // Configure S3 address
-    memset(&s3_addr, 0, sizeof(s3_addr));
-    s3_addr.sin_family = AF_INET;
-    s3_addr.sin_port = htons(S3_PORT);
-    inet_pton(AF_INET, "127.0.0.1", &s3_addr.sin_addr);
+    // Configure node address
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(node->port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
 
-    // Connect to S3
-    if (connect(s3_fd, (struct sockaddr *)&s3_addr, sizeof(s3_addr)) == -1)
-    {
-        perror("Connection to S3 failed");
-        close(s3_fd);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "[S1] Connection to %s failed: %s\n", node->name, strerror(errno));
+        close(fd);
         return -1;
     }
 
-    // Prepare destination path for S3 (replace ~s1 with ~s3)
-    char s3_destination[MAX_PATH];
-    strncpy(s3_destination, destination, MAX_PATH);
-    char *s1_pos = strstr(s3_destination, "~s1");
-    if (s1_pos)
-    {
-        memcpy(s1_pos, "~s3", 3);
-    }
+    xfer_tune(fd, XFER_BULK);
+    return fd;
+}
 
-    // Send command to S3
-    char s3_command[BUFFER_SIZE];
-    snprintf(s3_command, sizeof(s3_command), "STORE_TXT %s %s", filename, s3_destination);
-    if (send(s3_fd, s3_command, strlen(s3_command), 0) == -1)
-    {
-        perror("Failed to send command to S3");
-        close(s3_fd);
+// Connect to a node on the same machine through its Unix socket, which
+// skips loopback TCP and lets the node pass S1 the files it downloads
+int connect_unix(const struct storage_node *node) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", node->socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
         return -1;
     }
+    return fd;
+}
 
-    // Send file data to S3
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp)
-    {
-        perror("Failed to open file for S3 transfer");
-        close(s3_fd);
-        return -1;
+// The shared-memory ring of a node connection, NULL if it has none
+struct shmring *node_ring(int fd) {
+    return fd < MAX_RING_FD ? node_rings[fd] : NULL;
+}
+
+// An idle pooled connection is healthy if it has no pending error and nothing
+// to read: a readable idle socket means the node closed it or is out of sync.
+int pool_conn_healthy(int fd) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+        return 0;
     }
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    return poll(&pfd, 1, 0) == 0;
+}
 
-    char buffer[BUFFER_SIZE];
-    int bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0)
-    {
-        if (send(s3_fd, buffer, bytes_read, 0) == -1)
-        {
-            perror("Failed to send file data to S3");
-            fclose(fp);
-            close(s3_fd);
-            return -1;
+// Borrow a connection to node: the most recently returned healthy idle one,
+// or a new connection. *reused tells the caller whether a retry on a fresh
+// connection is worthwhile if the borrowed one fails.
+int pool_acquire(const struct storage_node *node, int *reused) {
+    struct node_pool *pool = &node_pools[node - storage_nodes];
+    time_t now = time(NULL);
+
+    while (pool->count > 0) {
+        struct pooled_conn conn = pool->idle[--pool->count];
+        if (now - conn.last_used <= pool_idle_timeout && pool_conn_healthy(conn.fd)) {
+            *reused = 1;
+            return conn.fd;
         }
+        pool_discard(conn.fd);
     }
 
-    fclose(fp);
+    *reused = 0;
+    return connect_to_node(node);
+}
 
-    // Wait for acknowledgment from S3
-    char ack[20];
-    int len = recv(s3_fd, ack, sizeof(ack) - 1, 0);
-    if (len <= 0)
-    {
-        perror("Failed to receive acknowledgment from S3");
-        close(s3_fd);
-        return -1;
+// Return a connection whose last reply was fully read; it stays open for the
+// next request unless the pool is already full.
+void pool_release(const struct storage_node *node, int fd) {
+    struct node_pool *pool = &node_pools[node - storage_nodes];
+    time_t now = time(NULL);
+
+    // Drop connections that sat idle past the timeout
+    int kept = 0;
+    for (int i = 0; i < pool->count; i++) {
+        if (now - pool->idle[i].last_used <= pool_idle_timeout) {
+            pool->idle[kept++] = pool->idle[i];
+        } else {
+            pool_discard(pool->idle[i].fd);
+        }
     }
+    pool->count = kept;
 
-    ack[len] = '\0';
-    close(s3_fd);
-
-    if (strcmp(ack, "STORE_SUCCESS") == 0)
-    {
-        return 0;
-    }
-    else
-    {
-        return -1;
+    if (pool->count >= pool_size) {
+        pool_discard(fd);
+        return;
     }
+    pool->idle[pool->count].fd = fd;
+    pool->idle[pool->count].last_used = now;
+    pool->count++;
 }
 
+// Close a connection left in an unknown state (error mid-request), or one
+// that is no longer wanted
+void pool_discard(int fd) {
+    struct shmring *ring = node_ring(fd);
+    if (ring) {
+        shmring_free(ring);
+        free(ring);
+        node_rings[fd] = NULL;
+    }
+    if (fd < MAX_RING_FD) ring_wanted[fd] = 0;
+    close(fd);
+}
 
-int forward_to_s4(const char *filename, const char *destination, const char *filepath)
-{
-    int s4_fd;
-    struct sockaddr_in s4_addr;
+// ===== Socket buffers =====
 
-    // Create socket to connect to S4
-    s4_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (s4_fd == -1)
-    {
-        perror("Socket creation for S4 failed");
-        return -1;
+int buf_append(struct buf *b, const void *data, size_t len) {
+    if (b->off == b->len) {
+        b->off = b->len = 0;
+    }
+    if (b->len + len > b->cap && b->off > 0) {
+        // Reclaim the space already written before growing
+        memmove(b->data, b->data + b->off, b->len - b->off);
+        b->len -= b->off;
+        b->off = 0;
+    }
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len) cap *= 2;
+        char *p = realloc(b->data, cap);
+        if (!p) return -1;
+        b->data = p;
+        b->cap = cap;
     }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
 
-    // Configure S4 address
-    memset(&s4_addr, 0, sizeof(s4_addr));
-    s4_addr.sin_family = AF_INET;
-    s4_addr.sin_port = htons(S4_PORT);
-    inet_pton(AF_INET, "127.0.0.1", &s4_addr.sin_addr);
+int buf_pending(const struct buf *b) {
+    return b->off < b->len;
+}
 
-    // Connect to S4
-    if (connect(s4_fd, (struct sockaddr *)&s4_addr, sizeof(s4_addr)) == -1)
-    {
-        perror("Connection to S4 failed");
-        close(s4_fd);
-        return -1;
+// Write out as much of b as the socket takes. Returns 1 once b is empty,
+// 0 if the socket is full, -1 on error.
+int buf_flush(int fd, struct buf *b) {
+    while (b->off < b->len) {
+        ssize_t n = send(fd, b->data + b->off, b->len - b->off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        b->off += n;
     }
+    b->off = b->len = 0;
+    return 1;
+}
 
-    // Prepare destination path for S4 (replace ~s1 with ~s4)
-    char s4_destination[MAX_PATH];
-    strncpy(s4_destination, destination, MAX_PATH);
-    char *s1_pos = strstr(s4_destination, "~s1");
-    if (s1_pos)
-    {
-        memcpy(s1_pos, "~s4", 3);
-    }
+void buf_free(struct buf *b) {
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+int queue_header(struct buf *b, uint8_t type, uint16_t flags, uint32_t req_id, uint64_t length) {
+    unsigned char hdr[PROTO_HEADER_SIZE];
+    proto_encode_header(hdr, type, flags, req_id, length);
+    return buf_append(b, hdr, sizeof(hdr));
+}
+
+int queue_frame(struct buf *b, uint8_t type, uint16_t flags, uint32_t req_id,
+                const void *payload, size_t len) {
+    if (queue_header(b, type, flags, req_id, len) == -1) return -1;
+    return (len > 0) ? buf_append(b, payload, len) : 0;
+}
+
+// Queue the start of a ranged DATA frame: its header and the file's size. The
+// length bytes of the range follow.
+int queue_range(struct buf *b, uint32_t req_id, uint64_t file_size, uint64_t length) {
+    unsigned char prefix[PROTO_RANGE_SIZE];
+    proto_put_u64(prefix, file_size);
+    if (queue_header(b, PROTO_DATA, PROTO_F_RANGE, req_id, sizeof(prefix) + length) == -1) return -1;
+    return buf_append(b, prefix, sizeof(prefix));
+}
 
-    // Send command to S4
-    char s4_command[BUFFER_SIZE];
-    snprintf(s4_command, sizeof(s4_command), "STORE_ZIP %s %s", filename, s4_destination);
-    if (send(s4_fd, s4_command, strlen(s4_command), 0) == -1)
-    {
-        perror("Failed to send command to S4");
-        close(s4_fd);
+// Non-blocking read. Returns the byte count, 0 if nothing is available yet,
+// or -1 on error or EOF (errno ECONNRESET).
+ssize_t recv_nb(int fd, void *buf, size_t len) {
+    while (1) {
+        ssize_t n = recv(fd, buf, len, 0);
+        if (n > 0) return n;
+        if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
         return -1;
     }
+}
 
-    // Send file data to S4
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp)
-    {
-        perror("Failed to open file for S4 transfer");
-        close(s4_fd);
-        return -1;
+// Read until *have reaches want. Returns 1 when complete, 0 if the socket ran
+// dry first, -1 on error or EOF.
+int recv_fill(int fd, void *dst, size_t want, size_t *have) {
+    while (*have < want) {
+        ssize_t n = recv_nb(fd, (char *)dst + *have, want - *have);
+        if (n <= 0) return (int)n;
+        *have += n;
     }
+    return 1;
+}
 
-    char buffer[BUFFER_SIZE];
-    int bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0)
-    {
-        if (send(s4_fd, buffer, bytes_read, 0) == -1)
-        {
-            perror("Failed to send file data to S4");
-            fclose(fp);
-            close(s4_fd);
+// Like recv_fill, also taking a descriptor passed along with the bytes
+// (SCM_RIGHTS) into *passed. One that arrives when *passed is already set is
+// closed.
+int recv_fill_fd(int fd, void *dst, size_t want, size_t *have, int *passed) {
+    while (*have < want) {
+        union {
+            struct cmsghdr hdr;
+            char space[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct iovec iov = { .iov_base = (char *)dst + *have, .iov_len = want - *have };
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.space,
+            .msg_controllen = sizeof(control.space),
+        };
+        ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            int got;
+            memcpy(&got, CMSG_DATA(cmsg), sizeof(got));
+            if (*passed == -1) {
+                *passed = got;
+            } else {
+                close(got);
+            }
+        }
+        if (n == 0) {
+            errno = ECONNRESET;
             return -1;
         }
+        *have += n;
     }
+    return 1;
+}
 
-    fclose(fp);
-
-    // Wait for acknowledgment from S4
-    char ack[20];
-    int len = recv(s4_fd, ack, sizeof(ack) - 1, 0);
-    if (len <= 0)
-    {
-        perror("Failed to receive acknowledgment from S4");
-        close(s4_fd);
-        return -1;
-    }
+// ===== Event loop =====
 
-    ack[len] = '\0';
-    close(s4_fd);
+void *reactor_run(void *arg) {
+    struct reactor *r = arg;
+    struct epoll_event events[MAX_EVENTS];
 
-    if (strcmp(ack, "STORE_SUCCESS") == 0)
-    {
-        return 0;
-    }
-    else
-    {
-        return -1;
-    }
-}
+    while (1) {
+        int n = epoll_wait(r->epfd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            exit(EXIT_FAILURE);
+        }
 
+        for (int i = 0; i < n; i++) {
+            struct session *s = events[i].data.ptr;
+            if (s == NULL) {
+                accept_clients(r);
+            } else if (!s->closed) {
+                // Client and node sockets both wake the session; its
+                // current step knows which one it is waiting on
+                session_run(s);
+            }
+        }
 
-int request_file_from_s2(const char *s1_path, char *file_data, size_t *file_size) {
-    int s2_fd;
-    struct sockaddr_in s2_addr;
+        // Followers of a shared fetch that were handed more bytes, or a
+        // leader a follower has stopped holding back
+        while (r->ready) {
+            struct session *s = r->ready;
+            r->ready = s->next_ready;
+            s->queued = 0;
+            if (!s->closed) session_run(s);
+        }
 
-    // Create socket to connect to S2
-    s2_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (s2_fd == -1) {
-        perror("Socket creation for S2 failed");
-        return -1;
+        // Sessions closed in this batch may still have had events queued in it
+        while (r->closed) {
+            struct session *s = r->closed;
+            r->closed = s->next_closed;
+            free(s);
+        }
     }
+    return NULL;
+}
 
-    // Configure S2 address
-    memset(&s2_addr, 0, sizeof(s2_addr));
-    s2_addr.sin_family = AF_INET;
-    s2_addr.sin_port = htons(S2_PORT);
-    inet_pton(AF_INET, "127.0.0.1", &s2_addr.sin_addr);
+void accept_clients(struct reactor *r) {
+    while (1) {
+        int client_fd = accept4(r->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (client_fd == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Accept failed");
+            }
+            return;
+        }
 
-    // Connect to S2
-    if (connect(s2_fd, (struct sockaddr *)&s2_addr, sizeof(s2_addr)) == -1) {
-        perror("Connection to S2 failed");
-        close(s2_fd);
-        return -1;
+        struct session *s = calloc(1, sizeof(*s));
+        if (!s) {
+            perror("Session allocation failed");
+            close(client_fd);
+            continue;
+        }
+        xfer_tune(client_fd, XFER_BULK);
+        s->fd = client_fd;
+        s->reactor = r;
+        s->conn = s;
+        s->step = step_read_header;
+
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP,
+            .data.ptr = s,
+        };
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+            perror("epoll_ctl failed");
+            close(client_fd);
+            free(s);
+            continue;
+        }
+        printf("Client connected.\n");
     }
+}
 
-    // Prepare the path for S2 (replace ~s1 with ~s2)
-    char expanded_path[MAX_PATH];
-    expand_path(s1_path, expanded_path, sizeof(expanded_path));
-    
-    // Replace "s1" with "s2" in the path
-    char *s1_pos = strstr(expanded_path, "s1");
-    if (s1_pos) {
-        memcpy(s1_pos, "s2", 2);
+// Run the session's steps until one has to wait for a socket. Sockets are
+// edge-triggered, so a step only waits after its I/O returned EAGAIN.
+void session_run(struct session *s) {
+    // The client's socket is registered for the connection; pass its events
+    // on to the requests using it
+    if (s->conn == s) {
+        if (s->writer) session_wake(s->writer);
+        if (s->reader) session_wake(s->reader);
     }
 
-    // Send request type to S2
-    char request[BUFFER_SIZE];
-    snprintf(request, sizeof(request), "DOWNLOAD %s", expanded_path);
-    if (send(s2_fd, request, strlen(request), 0) == -1) {
-        perror("Failed to send download request to S2");
-        close(s2_fd);
-        return -1;
-    }
+    while (1) {
+        if (session_flush(s) == -1) {
+            session_close(s);
+            return;
+        }
 
-    // Receive file data from S2
-    *file_size = 0;
-    int bytes_received;
-    while ((bytes_received = recv(s2_fd, file_data + *file_size, BUFFER_SIZE, 0)) > 0) {
-        *file_size += bytes_received;
-        if (bytes_received < BUFFER_SIZE) break;
+        int ret = s->step(s);
+        if (ret == STEP_CLOSE) {
+            session_close(s);
+            return;
+        }
+        if (s->closed) return;
+        if (ret == STEP_WAIT) {
+            // A step that stopped for client backpressure resumes as soon as
+            // the queued output is gone
+            int pending = buf_pending(&s->out);
+            int flushed = session_flush(s);
+            if (flushed == -1) {
+                session_close(s);
+                return;
+            }
+            if (!pending || flushed == 0) return;
+        }
     }
+}
 
-    close(s2_fd);
-    return (*file_size > 0) ? 0 : -1;
+// Close the client connection and drop every request on it. A request
+// cannot fail on its own: it leaves the connection out of sync.
+void session_close(struct session *s) {
+    struct session *conn = s->conn;
+    if (conn->closed) return;
+    while (conn->requests) {
+        struct session *r = conn->requests;
+        command_free(r);
+        request_finish(r);
+    }
+    epoll_ctl(conn->reactor->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    buf_free(&conn->out);
+    conn->closed = 1;
+    conn->next_closed = conn->reactor->closed;
+    conn->reactor->closed = conn;
 }
 
-int request_file_from_s3(const char *s1_path, char *file_data, size_t *file_size) {
-    int s3_fd;
-    struct sockaddr_in s3_addr;
+// Run s once the reactor is done with its current event batch
+void session_wake(struct session *s) {
+    if (s->queued || s->closed) return;
+    s->queued = 1;
+    s->next_ready = s->reactor->ready;
+    s->reactor->ready = s;
+}
 
-    // Create socket to connect to S3
-    s3_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (s3_fd == -1) {
-        perror("[S1] Socket creation for S3 failed");
-        return -1;
-    }
+// Whether s could write to its client now
+int session_may_write(struct session *s) {
+    return !s->conn->writer || s->conn->writer == s;
+}
 
-    // Configure S3 address
-    memset(&s3_addr, 0, sizeof(s3_addr));
-    s3_addr.sin_family = AF_INET;
-    s3_addr.sin_port = htons(S3_PORT);
-    inet_pton(AF_INET, "127.0.0.1", &s3_addr.sin_addr);
+// Whether s may write to its client now, taking its turn if nobody else has
+// it. A request keeps its turn until its reply is complete.
+int session_writer(struct session *s) {
+    if (!session_may_write(s)) return 0;
+    s->conn->writer = s;
+    return 1;
+}
 
-    // Connect to S3
-    if (connect(s3_fd, (struct sockaddr *)&s3_addr, sizeof(s3_addr)) == -1) {
-        perror("[S1] Connection to S3 failed");
-        close(s3_fd);
-        return -1;
-    }
+// Write out what s has queued for its client, if it is its turn. Returns 1
+// once nothing is left, 0 if it has to wait, -1 on error.
+int session_flush(struct session *s) {
+    if (!buf_pending(&s->out)) return 1;
+    if (!session_writer(s)) return 0;
+    return buf_flush(s->fd, &s->out);
+}
 
-    // Prepare the path for S3 (replace ~s1 with ~s3)
-    char expanded_path[MAX_PATH];
-    expand_path(s1_path, expanded_path, sizeof(expanded_path));
-    
-    // Replace "s1" with "s3" in the path
-    char *s1_pos = strstr(expanded_path, "s1");
-    if (s1_pos) {
-        memcpy(s1_pos, "s3", 2);
-    }
+// ===== Per-command state =====
 
-    // Send request type to S3
-    char request[BUFFER_SIZE];
-    snprintf(request, sizeof(request), "DOWNLOAD %s", expanded_path);
-    if (send(s3_fd, request, strlen(request), 0) == -1) {
-        perror("[S1] Failed to send download request to S3");
-        close(s3_fd);
+int command_begin(struct session *s) {
+    s->cmd = calloc(1, sizeof(*s->cmd));
+    if (!s->cmd) {
+        perror("[S1] Command allocation failed");
         return -1;
     }
+    s->cmd->backend.fd = -1;
+    s->cmd->backend.passed_fd = -1;
+    s->cmd->pipe[0] = s->cmd->pipe[1] = -1;
+    return 0;
+}
 
-    // Receive file data from S3
-    *file_size = 0;
-    int bytes_received;
-    while ((bytes_received = recv(s3_fd, file_data + *file_size, BUFFER_SIZE, 0)) > 0) {
-        *file_size += bytes_received;
-        if (*file_size >= 10 * BUFFER_SIZE) { // Prevent buffer overflow
-            fprintf(stderr, "[S1] File too large for buffer\n");
-            break;
-        }
-    }
+void command_free(struct session *s) {
+    struct command *c = s->cmd;
+    if (!c) return;
+
+    // Before the node connection is let go, as the fetch may live on
+    if (c->flight) flight_leave(s);
+
+    // A node exchange cut short leaves that connection out of sync
+    backend_discard(s);
+    buf_free(&c->backend.out);
+    if (c->backend.passed_fd != -1) close(c->backend.passed_fd);
+    if (c->fp) fclose(c->fp);
+    if (c->pipe[0] != -1) {
+        close(c->pipe[0]);
+        close(c->pipe[1]);
+    }
+    if (c->unlink_on_close) unlink(c->filepath);
+    tar_list_free(&c->tar);
+    if (c->listing) listing_free(s);
+    free(c->multi);
+    free(c->data);
+    free(c);
+    s->cmd = NULL;
+}
 
-    close(s3_fd);
-    return (*file_size > 0) ? 0 : -1;
+// Finish the current command; the request ends once its reply is out
+int command_done(struct session *s) {
+    command_free(s);
+    s->step = step_request_done;
+    return STEP_NEXT;
 }
-int request_file_from_s4(const char *s1_path, char *file_data, size_t *file_size) {
-    int s4_fd;
-    struct sockaddr_in s4_addr;
 
-    // Create socket to connect to S4
-    s4_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (s4_fd == -1) {
-        perror("[S1] Socket creation for S4 failed");
-        return -1;
-    }
+// Queue a status reply for the current request and finish the command
+int command_reply(struct session *s, uint8_t type, const char *str) {
+    if (queue_frame(&s->out, type, 0, s->req_id, str, strlen(str)) == -1) return STEP_CLOSE;
+    return command_done(s);
+}
 
-    // Configure S4 address
-    memset(&s4_addr, 0, sizeof(s4_addr));
-    s4_addr.sin_family = AF_INET;
-    s4_addr.sin_port = htons(S4_PORT);
-    inet_pton(AF_INET, "127.0.0.1", &s4_addr.sin_addr);
+// ===== Requests =====
+
+// Hand the request the connection has just read to a session of its own,
+// whose first step is first, and go on to read the next one. Returns NULL if
+// memory ran out.
+struct session *request_start(struct session *conn, step_fn first) {
+    struct session *s = calloc(1, sizeof(*s));
+    if (!s) {
+        perror("[S1] Request allocation failed");
+        return NULL;
+    }
+    s->fd = conn->fd;
+    s->reactor = conn->reactor;
+    s->conn = conn;
+    s->hdr = conn->hdr;
+    s->req_id = conn->req_id;
+    s->command_len = conn->command_len;
+    memcpy(s->command_buf, conn->command_buf, sizeof(s->command_buf));
+    if (command_begin(s) == -1) {
+        free(s);
+        return NULL;
+    }
+    s->step = first;
+
+    s->next_request = conn->requests;
+    conn->requests = s;
+    conn->in_flight++;
+    // The next request follows the payload
+    if (first != step_dispatch || s->hdr.type == PROTO_UPLOAD || s->hdr.type == PROTO_UPLOAD_APPEND) {
+        conn->reader = s;
+    }
+    session_wake(s);
+
+    conn->hdr_len = 0;
+    conn->step = step_read_header;
+    return s;
+}
 
-    // Connect to S4
-    if (connect(s4_fd, (struct sockaddr *)&s4_addr, sizeof(s4_addr)) == -1) {
-        perror("[S1] Connection to S4 failed");
-        close(s4_fd);
-        return -1;
-    }
+// The request has read its payload from the client
+void request_read(struct session *s) {
+    struct session *conn = s->conn;
+    if (conn->reader != s) return;
+    conn->reader = NULL;
+    session_wake(conn);
+}
 
-    // Prepare the path for S4 (replace ~s1 with ~s4)
-    char expanded_path[MAX_PATH];
-    expand_path(s1_path, expanded_path, sizeof(expanded_path));
-    
-    // Replace "s1" with "s4" in the path
-    char *s1_pos = strstr(expanded_path, "s1");
-    if (s1_pos) {
-        memcpy(s1_pos, "s4", 2);
-    }
+// Take a finished request off its connection. Freed after the event batch.
+void request_finish(struct session *s) {
+    struct session *conn = s->conn;
+    struct session **link = &conn->requests;
+    while (*link != s) link = &(*link)->next_request;
+    *link = s->next_request;
+    conn->in_flight--;
+
+    request_read(s);
+    if (conn->writer == s) {
+        // Anyone waiting to write gets a go
+        conn->writer = NULL;
+        for (struct session *r = conn->requests; r; r = r->next_request) session_wake(r);
+    }
+    session_wake(conn);
+
+    buf_free(&s->out);
+    s->closed = 1;
+    s->next_closed = s->reactor->closed;
+    s->reactor->closed = s;
+}
 
-    // Send request type to S4
-    char request[BUFFER_SIZE];
-    snprintf(request, sizeof(request), "DOWNLOAD %s", expanded_path);
-    if (send(s4_fd, request, strlen(request), 0) == -1) {
-        perror("[S1] Failed to send download request to S4");
-        close(s4_fd);
-        return -1;
-    }
+// Once the reply is out the request is done
+int step_request_done(struct session *s) {
+    if (buf_pending(&s->out)) return STEP_WAIT;
+    request_finish(s);
+    return STEP_WAIT;
+}
 
-    // Receive file data from S4
-    *file_size = 0;
-    int bytes_received;
-    while ((bytes_received = recv(s4_fd, file_data + *file_size, BUFFER_SIZE, 0)) > 0) {
-        *file_size += bytes_received;
-        if (*file_size >= 10 * BUFFER_SIZE) { // Prevent buffer overflow
-            fprintf(stderr, "[S1] File too large for buffer\n");
-            break;
+int step_read_header(struct session *s) {
+    // Not while a request reads its payload, or with enough on the go already
+    if (s->reader || s->in_flight >= pipeline_depth) return STEP_WAIT;
+
+    int ret = recv_fill(s->fd, s->hdr_buf, PROTO_HEADER_SIZE, &s->hdr_len);
+    if (ret == -1) {
+        if (errno == ECONNRESET) {
+            printf("[S1] Client disconnected\n");
+        } else {
+            perror("[S1] recv failed");
         }
+        return STEP_CLOSE;
     }
+    if (ret == 0) return STEP_WAIT;
 
-    close(s4_fd);
-    return (*file_size > 0) ? 0 : -1;
+    if (proto_decode_header(s->hdr_buf, &s->hdr) == -1) {
+        fprintf(stderr, "[S1] Malformed frame from client\n");
+        return STEP_CLOSE;
+    }
+    s->hdr_len = 0;
+    s->command_len = 0;
+    s->req_id = s->hdr.req_id;
+    s->step = step_read_command;
+    return STEP_NEXT;
 }
 
-int request_remove_from_s2(const char *filepath) {
-    int s2_fd;
-    struct sockaddr_in s2_addr;
+int step_read_command(struct session *s) {
+    if (s->hdr.length >= sizeof(s->command_buf)) {
+        // Too long to be a command: drain it and reply with an error
+        s->command_len = 0;
+        s->command_buf[0] = '\0';
+        struct session *r = request_start(s, step_skip_command);
+        if (!r) return STEP_CLOSE;
+        r->cmd->remaining = s->hdr.length;
+        return STEP_NEXT;
+    }
+
+    int ret = recv_fill(s->fd, s->command_buf, s->hdr.length, &s->command_len);
+    if (ret == -1) {
+        perror("[S1] recv failed");
+        return STEP_CLOSE;
+    }
+    if (ret == 0) return STEP_WAIT;
+    s->command_buf[s->hdr.length] = '\0';
+    return request_start(s, step_dispatch) ? STEP_NEXT : STEP_CLOSE;
+}
 
-    // Create socket to connect to S2
-    s2_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (s2_fd == -1) {
-        perror("[S1] Socket creation for S2 failed");
-        return -1;
+int step_dispatch(struct session *s) {
+    switch (s->hdr.type) {
+    case PROTO_UPLOAD:   return start_upload(s);
+    case PROTO_DOWNLOAD: return start_download(s);
+    case PROTO_REMOVE:   return start_remove(s);
+    case PROTO_TAR:      return start_tar(s);
+    case PROTO_LIST:     return start_list(s);
+    case PROTO_STATS:    return start_stats(s);
+    case PROTO_REMOVE_MANY:
+    case PROTO_DOWNLOAD_MANY:
+        return start_many(s);
+    case PROTO_UPLOAD_BEGIN:
+    case PROTO_UPLOAD_QUERY:
+    case PROTO_UPLOAD_APPEND:
+    case PROTO_UPLOAD_COMMIT:
+        return start_upload_session(s);
+    default:             return command_reply(s, PROTO_ERROR, "INVALID_COMMAND");
     }
+}
 
-    // Configure S2 address
-    memset(&s2_addr, 0, sizeof(s2_addr));
-    s2_addr.sin_family = AF_INET;
-    s2_addr.sin_port = htons(S2_PORT);
-    inet_pton(AF_INET, "127.0.0.1", &s2_addr.sin_addr);
-
-    // Connect to S2
-    if (connect(s2_fd, (struct sockaddr *)&s2_addr, sizeof(s2_addr)) == -1) {
-        perror("[S1] Connection to S2 failed");
-        close(s2_fd);
-        return -1;
+int step_skip_command(struct session *s) {
+    char chunk[IO_CHUNK];
+    struct command *c = s->cmd;
+    while (c->remaining > 0) {
+        size_t want = c->remaining < sizeof(chunk) ? c->remaining : sizeof(chunk);
+        ssize_t n = recv_nb(s->fd, chunk, want);
+        if (n == -1) {
+            perror("[S1] recv failed");
+            return STEP_CLOSE;
+        }
+        if (n == 0) return STEP_WAIT;
+        c->remaining -= n;
     }
+    request_read(s);
+    return command_reply(s, PROTO_ERROR, "INVALID_COMMAND");
+}
 
-    // Prepare the path for S2 (replace ~s1 with ~s2)
-    char expanded_path[MAX_PATH];
-    expand_path(filepath, expanded_path, sizeof(expanded_path));
-    char *s1_pos = strstr(expanded_path, "s1");
-    if (s1_pos) {
-        memcpy(s1_pos, "s2", 2);
-    }
+// Queue fp as one DATA frame of its remaining size and stream it out as the
+// client's socket drains
+int send_local_file(struct session *s) {
+    struct command *c = s->cmd;
+    struct stat st;
+    if (fstat(fileno(c->fp), &st) == -1) {
+        perror("[S1] Error sending file");
+        return STEP_CLOSE;
+    }
+    c->offset = ftello(c->fp);
+    c->remaining = st.st_size > c->offset ? (uint64_t)(st.st_size - c->offset) : 0;
+    if (queue_header(&s->out, PROTO_DATA, 0, s->req_id, c->remaining) == -1) return STEP_CLOSE;
+    s->step = step_send_file;
+    return STEP_NEXT;
+}
 
-    // Send remove request
-    char request[BUFFER_SIZE];
-    snprintf(request, sizeof(request), "REMOVE %s", expanded_path);
-    if (send(s2_fd, request, strlen(request), 0) == -1) {
-        perror("[S1] Failed to send remove request to S2");
-        close(s2_fd);
-        return -1;
-    }
+// Like send_local_file for the range the command asked for
+int send_local_range(struct session *s) {
+    struct command *c = s->cmd;
+    struct stat st;
+    if (fstat(fileno(c->fp), &st) == -1) {
+        perror("[S1] Error sending file");
+        return STEP_CLOSE;
+    }
+    uint64_t size = st.st_size;
+    if (c->range_offset > size) return command_reply(s, PROTO_ERROR, "DOWNLOAD_FAILED:INVALID_RANGE");
+    c->offset = c->range_offset;
+    c->remaining = size - c->range_offset;
+    if (c->range_length > 0 && c->range_length < c->remaining) c->remaining = c->range_length;
+    if (queue_range(&s->out, s->req_id, size, c->remaining) == -1) return STEP_CLOSE;
+    s->step = step_send_file;
+    return STEP_NEXT;
+}
 
-    // Wait for response
-    char response[20];
-    int len = recv(s2_fd, response, sizeof(response) - 1, 0);
-    if (len <= 0) {
-        perror("[S1] Failed to receive response from S2");
-        close(s2_fd);
-        return -1;
+// The file goes to the socket with sendfile, so its pages are never copied
+// through S1. Where sendfile is not supported the chunks are read and queued.
+int step_send_file(struct session *s) {
+    char chunk[IO_CHUNK];
+    struct command *c = s->cmd;
+    while (c->remaining > 0) {
+        if (buf_pending(&s->out) || !session_writer(s)) return STEP_WAIT;
+
+        ssize_t n = -1;
+        if (!c->copy_fallback) {
+            n = sendfile(s->fd, fileno(c->fp), &c->offset, c->remaining);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return STEP_WAIT;
+                if (errno != EINVAL && errno != ENOSYS) {
+                    perror("[S1] Error sending file");
+                    return STEP_CLOSE;
+                }
+                c->copy_fallback = 1;
+                continue;
+            }
+        } else {
+            size_t want = c->remaining < sizeof(chunk) ? c->remaining : sizeof(chunk);
+            n = pread(fileno(c->fp), chunk, want, c->offset);
+            if (n > 0) {
+                if (buf_append(&s->out, chunk, n) == -1) return STEP_CLOSE;
+                c->offset += n;
+            }
+        }
+        if (n <= 0) {
+            // The file shrank under us; the frame can no longer be completed
+            fprintf(stderr, "[S1] Error sending file: %s changed while being sent\n", c->filepath);
+            return STEP_CLOSE;
+        }
+        c->remaining -= n;
     }
-    response[len] = '\0';
-    close(s2_fd);
-
-    return (strcmp(response, "REMOVE_SUCCESS") == 0) ? 0 : -1;
+    if (c->on_sent) return c->on_sent(s);
+    return command_done(s);
 }
 
-int request_remove_from_s3(const char *filepath) {
-    int s3_fd;
-    struct sockaddr_in s3_addr;
+// ===== Storage node requests =====
+
+// Send type/payload (plus body as a DATA payload, if given) to node on a
+// pooled connection and read the reply header. on_done runs once the reply
+// payload is in c->data, straight after the header if backend.relay is set,
+// or with backend.failed set if the node could not be reached.
+int backend_request(struct session *s, const struct storage_node *node, uint8_t type,
+                    const char *payload, FILE *body, step_fn on_done) {
+    struct backend *b = &s->cmd->backend;
+    b->node = node;
+    b->req_type = type;
+    snprintf(b->req_payload, sizeof(b->req_payload), "%s", payload);
+    b->body = body;
+    b->on_done = on_done;
+    b->retried = 0;
+    b->failed = 0;
+    return backend_connect(s);
+}
 
-    // Create socket to connect to S3
-    s3_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (s3_fd == -1) {
-        perror("[S1] Socket creation for S3 failed");
-        return -1;
+int backend_connect(struct session *s) {
+    struct backend *b = &s->cmd->backend;
+    if (backend_attach(s) == -1) {
+        b->failed = 1;
+        s->step = b->on_done;
+        return STEP_NEXT;
     }
+    s->step = step_backend_send;
+    return STEP_NEXT;
+}
 
-    // Configure S3 address
-    memset(&s3_addr, 0, sizeof(s3_addr));
-    s3_addr.sin_family = AF_INET;
-    s3_addr.sin_port = htons(S3_PORT);
-    inet_pton(AF_INET, "127.0.0.1", &s3_addr.sin_addr);
+// Borrow a connection to backend.node, add it to the session's epoll set and
+// queue the request frame (and the body's DATA header, if there is a body)
+int backend_attach(struct session *s) {
+    struct backend *b = &s->cmd->backend;
 
-    // Connect to S3
-    if (connect(s3_fd, (struct sockaddr *)&s3_addr, sizeof(s3_addr)) == -1) {
-        perror("[S1] Connection to S3 failed");
-        close(s3_fd);
+    b->fd = node_conn_open(s, b->node, &b->reused);
+    if (b->fd == -1) {
+        b->connect_failed = 1;
         return -1;
     }
 
-    // Prepare the path for S3 (replace ~s1 with ~s3)
-    char expanded_path[MAX_PATH];
-    expand_path(filepath, expanded_path, sizeof(expanded_path));
-    char *s1_pos = strstr(expanded_path, "s1");
-    if (s1_pos) {
-        memcpy(s1_pos, "s3", 2);
+    b->out.off = b->out.len = 0;
+    b->hdr_len = 0;
+    b->body_left = 0;
+    b->req_id = next_node_req_id++;
+    uint32_t req_id = b->req_id;
+    int ret = queue_frame(&b->out, b->req_type, b->req_flags, req_id, b->req_payload, strlen(b->req_payload));
+    if (ret == 0 && b->body) {
+        struct stat st;
+        rewind(b->body);
+        if (fstat(fileno(b->body), &st) == -1) {
+            ret = -1;
+        } else {
+            b->body_left = st.st_size;
+            ret = queue_header(&b->out, PROTO_DATA, 0, req_id, b->body_left);
+        }
     }
-
-    // Send remove request
-    char request[BUFFER_SIZE];
-    snprintf(request, sizeof(request), "REMOVE %s", expanded_path);
-    if (send(s3_fd, request, strlen(request), 0) == -1) {
-        perror("[S1] Failed to send remove request to S3");
-        close(s3_fd);
+    if (ret == -1) {
+        backend_discard(s);
         return -1;
     }
+    return 0;
+}
 
-    // Wait for response
-    char response[20];
-    int len = recv(s3_fd, response, sizeof(response) - 1, 0);
-    if (len <= 0) {
-        perror("[S1] Failed to receive response from S3");
-        close(s3_fd);
+// Borrow a connection to node and add it to the session's epoll set, so its
+// events run the session's current step
+int node_conn_open(struct session *s, const struct storage_node *node, int *reused) {
+    int fd = pool_acquire(node, reused);
+    if (fd == -1) return -1;
+
+    // Node sockets are non-blocking while they are pooled too, so only
+    // the reactor threads ever use them
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP,
+        .data.ptr = s,
+    };
+    if (epoll_ctl(s->reactor->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("[S1] epoll_ctl failed");
+        pool_discard(fd);
         return -1;
     }
-    response[len] = '\0';
-    close(s3_fd);
+    return fd;
+}
 
-    return (strcmp(response, "REMOVE_SUCCESS") == 0) ? 0 : -1;
+// Take a node connection out of the session's epoll set. It goes back to the
+// pool only if its last reply was read in full.
+void node_conn_close(struct session *s, const struct storage_node *node, int fd, int reusable) {
+    epoll_ctl(s->reactor->epfd, EPOLL_CTL_DEL, fd, NULL);
+    struct shmring *ring = node_ring(fd);
+    if (ring) epoll_ctl(s->reactor->epfd, EPOLL_CTL_DEL, ring->space_fd, NULL);
+    if (reusable) {
+        pool_release(node, fd);
+    } else {
+        pool_discard(fd);
+    }
 }
 
-int request_remove_from_s4(const char *filepath) {
-    int s4_fd;
-    struct sockaddr_in s4_addr;
+// Give up on the node request; on_done sees backend.failed
+void backend_fail(struct session *s) {
+    struct backend *b = &s->cmd->backend;
+    fprintf(stderr, "[S1] Request to %s failed: %s\n", b->node->name, strerror(errno));
+    backend_discard(s);
+    b->failed = 1;
+    s->step = b->on_done;
+}
 
-    // Create socket to connect to S3
-    s4_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (s4_fd == -1) {
-        perror("[S1] Socket creation for S3 failed");
-        return -1;
-    }
+// The connection failed before the reply arrived. A pooled one may simply
+// have been closed by the node since, so try once more on a fresh one.
+int backend_retry(struct session *s) {
+    struct backend *b = &s->cmd->backend;
+    if (b->reused && !b->retried) {
+        backend_discard(s);
+        b->retried = 1;
+        return backend_connect(s);
+    }
+    backend_fail(s);
+    return STEP_NEXT;
+}
 
-    // Configure S3 address
-    memset(&s4_addr, 0, sizeof(s4_addr));
-    s4_addr.sin_family = AF_INET;
-    s4_addr.sin_port = htons(S4_PORT);
-    inet_pton(AF_INET, "127.0.0.1", &s4_addr.sin_addr);
+void backend_release(struct session *s) {
+    struct backend *b = &s->cmd->backend;
+    if (b->fd == -1) return;
+    node_conn_close(s, b->node, b->fd, 1);
+    b->fd = -1;
+}
 
-    // Connect to S3
-    if (connect(s4_fd, (struct sockaddr *)&s4_addr, sizeof(s4_addr)) == -1) {
-        perror("[S1] Connection to S3 failed");
-        close(s4_fd);
-        return -1;
+void backend_discard(struct session *s) {
+    struct backend *b = &s->cmd->backend;
+    if (b->ring_offer) {
+        shmring_free(b->ring_offer);
+        free(b->ring_offer);
+        b->ring_offer = NULL;
     }
+    if (b->fd == -1) return;
+    node_conn_close(s, b->node, b->fd, 0);
+    b->fd = -1;
+}
 
-    // Prepare the path for S3 (replace ~s1 with ~s3)
-    char expanded_path[MAX_PATH];
-    expand_path(filepath, expanded_path, sizeof(expanded_path));
-    char *s1_pos = strstr(expanded_path, "s1");
-    if (s1_pos) {
-        memcpy(s1_pos, "s4", 2);
+int step_backend_send(struct session *s) {
+    char chunk[IO_CHUNK];
+    struct backend *b = &s->cmd->backend;
+    while (1) {
+        int ret = buf_flush(b->fd, &b->out);
+        if (ret == -1) return backend_retry(s);
+        if (ret == 0) return STEP_WAIT;
+        if (b->body_left == 0) break;
+
+        size_t want = b->body_left < sizeof(chunk) ? b->body_left : sizeof(chunk);
+        size_t got = fread(chunk, 1, want, b->body);
+        if (got == 0) {
+            errno = EIO;
+            backend_fail(s);
+            return STEP_NEXT;
+        }
+        if (buf_append(&b->out, chunk, got) == -1) {
+            backend_fail(s);
+            return STEP_NEXT;
+        }
+        b->body_left -= got;
     }
+    s->step = step_backend_reply;
+    return STEP_NEXT;
+}
 
-    // Send remove request
-    char request[BUFFER_SIZE];
-    snprintf(request, sizeof(request), "REMOVE %s", expanded_path);
-    if (send(s4_fd, request, strlen(request), 0) == -1) {
-        perror("[S1] Failed to send remove request to S4");
-        close(s4_fd);
-        return -1;
+int step_backend_reply(struct session *s) {
+    struct command *c = s->cmd;
+    struct backend *b = &c->backend;
+
+    int ret = b->req_flags & PROTO_F_FD
+            ? recv_fill_fd(b->fd, b->hdr_buf, PROTO_HEADER_SIZE, &b->hdr_len, &b->passed_fd)
+            : recv_fill(b->fd, b->hdr_buf, PROTO_HEADER_SIZE, &b->hdr_len);
+    if (ret == -1) return backend_retry(s);
+    if (ret == 0) return STEP_WAIT;
+    b->hdr_len = 0;
+    if (proto_decode_header(b->hdr_buf, &b->reply) == -1) {
+        errno = EPROTO;
+        backend_fail(s);
+        return STEP_NEXT;
     }
 
-    // Wait for response
-    char response[20];
-    int len = recv(s4_fd, response, sizeof(response) - 1, 0);
-    if (len <= 0) {
-        perror("[S1] Failed to receive response from S4");
-        close(s4_fd);
-        return -1;
+    if (b->relay) {
+        s->step = b->on_done;
+        return STEP_NEXT;
     }
-    response[len] = '\0';
-    close(s4_fd);
+    return backend_collect(s, b->on_done);
+}
 
-    return (strcmp(response, "REMOVE_SUCCESS") == 0) ? 0 : -1;
+// Collect the payload of the reply whose header was just read; on_done runs
+// once it is in c->data (up to c->data_limit bytes)
+int backend_collect(struct session *s, step_fn on_done) {
+    struct command *c = s->cmd;
+    c->remaining = c->backend.reply.length;
+    c->flags = c->backend.reply.flags;
+    c->data_overflow = 0;
+    c->backend.on_done = on_done;
+    s->step = step_backend_collect;
+    return STEP_NEXT;
 }
 
-int request_file_list_from_s2(const char *path, char *file_list, size_t *list_size) {
-    int s2_fd;
-    struct sockaddr_in s2_addr;
+// Append the reply payload (and its continuation frames) to c->data, keeping
+// at most c->data_limit bytes; anything larger is drained and flagged.
+int step_backend_collect(struct session *s) {
+    char chunk[IO_CHUNK];
+    struct command *c = s->cmd;
+    struct backend *b = &c->backend;
 
-    s2_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (s2_fd == -1) {
-        perror("[S1] Socket creation for S2 failed");
-        return -1;
-    }
+    while (1) {
+        if (c->remaining == 0) {
+            if (!(c->flags & PROTO_F_MORE)) break;
+
+            int ret = recv_fill(b->fd, b->hdr_buf, PROTO_HEADER_SIZE, &b->hdr_len);
+            if (ret == 0) return STEP_WAIT;
+            struct proto_header hdr;
+            b->hdr_len = 0;
+            if (ret == -1 || proto_decode_header(b->hdr_buf, &hdr) == -1) {
+                backend_fail(s);
+                return STEP_NEXT;
+            }
+            c->remaining = hdr.length;
+            c->flags = hdr.flags;
+            continue;
+        }
 
-    memset(&s2_addr, 0, sizeof(s2_addr));
-    s2_addr.sin_family = AF_INET;
-    s2_addr.sin_port = htons(S2_PORT);
-    inet_pton(AF_INET, "127.0.0.1", &s2_addr.sin_addr);
+        size_t want = c->remaining < sizeof(chunk) ? c->remaining : sizeof(chunk);
+        char *dst = chunk;
+        if (!c->data_overflow && c->data_len + c->remaining > c->data_limit) {
+            c->data_overflow = 1;
+        }
+        if (!c->data_overflow) {
+            if (c->data_len + want > c->data_cap) {
+                size_t cap = c->data_cap ? c->data_cap * 2 : BUFFER_SIZE;
+                while (cap < c->data_len + want) cap *= 2;
+                char *p = realloc(c->data, cap);
+                if (!p) {
+                    backend_fail(s);
+                    return STEP_NEXT;
+                }
+                c->data = p;
+                c->data_cap = cap;
+            }
+            dst = c->data + c->data_len;
+        }
 
-    if (connect(s2_fd, (struct sockaddr *)&s2_addr, sizeof(s2_addr)) == -1) {
-        perror("[S1] Connection to S2 failed");
-        close(s2_fd);
-        return -1;
+        ssize_t n = recv_nb(b->fd, dst, want);
+        if (n == -1) {
+            backend_fail(s);
+            return STEP_NEXT;
+        }
+        if (n == 0) return STEP_WAIT;
+        if (!c->data_overflow) c->data_len += n;
+        c->remaining -= n;
     }
 
-    // Prepare the path for S2 (replace ~s1 with ~s2)
-    char expanded_path[MAX_PATH];
-    expand_path(path, expanded_path, sizeof(expanded_path));
-    char *s1_pos = strstr(expanded_path, "s1");
-    if (s1_pos) {
-        memcpy(s1_pos, "s2", 2);
-    }
+    backend_release(s);
+    s->step = b->on_done;
+    return STEP_NEXT;
+}
 
-    // Send LIST request to S2
-    char request[BUFFER_SIZE];
-    snprintf(request, sizeof(request), "LIST %s", expanded_path);
-    if (send(s2_fd, request, strlen(request), 0) == -1) {
-        perror("[S1] Failed to send list request to S2");
-        close(s2_fd);
-        return -1;
-    }
+// Pass the node's reply frames through to the client, re-tagged with the
+// client's req_id. The node is only read while the client keeps up.
+int step_backend_relay(struct session *s) {
+    char chunk[IO_CHUNK];
+    struct command *c = s->cmd;
+    struct backend *b = &c->backend;
+
+    while (1) {
+        // The slowest client sharing the fetch sets the pace
+        if (buf_pending(&s->out) || flight_backlogged(s)) return STEP_WAIT;
+
+        if (c->remaining == 0) {
+            if (!(c->flags & PROTO_F_MORE)) break;
+
+            int ret = recv_fill(b->fd, b->hdr_buf, PROTO_HEADER_SIZE, &b->hdr_len);
+            if (ret == 0) return STEP_WAIT;
+            struct proto_header hdr;
+            b->hdr_len = 0;
+            if (ret == -1 || proto_decode_header(b->hdr_buf, &hdr) == -1) {
+                fprintf(stderr, "[S1] Relay from %s failed\n", b->node->name);
+                if (c->flight) c->flight->broken = 1;
+                return STEP_CLOSE;
+            }
+            if (queue_header(&s->out, hdr.type, hdr.flags, s->req_id, hdr.length) == -1) return STEP_CLOSE;
+            flight_fanout(s, &hdr, NULL, 0);
+            c->remaining = hdr.length;
+            c->flags = hdr.flags;
+            continue;
+        }
 
-    // Receive file list from S2
-    *list_size = 0;
-    int bytes_received;
-    while ((bytes_received = recv(s2_fd, file_list + *list_size, BUFFER_SIZE, 0)) > 0) {
-        *list_size += bytes_received;
-        if (bytes_received < BUFFER_SIZE) break;
+        size_t want = c->remaining < sizeof(chunk) ? c->remaining : sizeof(chunk);
+        ssize_t n = recv_nb(b->fd, chunk, want);
+        if (n == -1) {
+            fprintf(stderr, "[S1] Relay from %s failed\n", b->node->name);
+            if (c->flight) c->flight->broken = 1;
+            return STEP_CLOSE;
+        }
+        if (n == 0) return STEP_WAIT;
+        if (buf_append(&s->out, chunk, n) == -1) return STEP_CLOSE;
+        if (c->cache_fill && relay_keep(c, chunk, n) == -1) c->cache_fill = 0;
+        flight_fanout(s, NULL, chunk, n);
+        c->remaining -= n;
     }
 
-    close(s2_fd);
-    return (*list_size > 0) ? 0 : -1;
+    if (c->flight) c->flight->finished = 1;
+    backend_release(s);
+    return c->on_relayed(s);
 }
-int request_file_list_from_s3(const char *path, char *file_list, size_t *list_size) {
-    int s3_fd;
-    struct sockaddr_in s3_addr;
 
-    s3_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (s3_fd == -1) {
-        perror("[S1] Socket creation for S2 failed");
-        return -1;
-    }
+// Keep a copy of relayed bytes in c->data
+int relay_keep(struct command *c, const char *data, size_t len) {
+    if (c->data_len + len > c->data_cap) {
+        size_t cap = c->data_cap ? c->data_cap * 2 : BUFFER_SIZE;
+        while (cap < c->data_len + len) cap *= 2;
+        char *p = realloc(c->data, cap);
+        if (!p) return -1;
+        c->data = p;
+        c->data_cap = cap;
+    }
+    memcpy(c->data + c->data_len, data, len);
+    c->data_len += len;
+    return 0;
+}
 
-    memset(&s3_addr, 0, sizeof(s3_addr));
-    s3_addr.sin_family = AF_INET;
-    s3_addr.sin_port = htons(S3_PORT);
-    inet_pton(AF_INET, "127.0.0.1", &s3_addr.sin_addr);
+// Start relaying a reply whose header step_backend_reply has just read
+int backend_start_relay(struct session *s, step_fn on_relayed) {
+    struct command *c = s->cmd;
+    struct proto_header *reply = &c->backend.reply;
+    if (queue_header(&s->out, reply->type, reply->flags, s->req_id, reply->length) == -1) return STEP_CLOSE;
+    if (c->flight) {
+        c->flight->relaying = 1;
+        flight_fanout(s, reply, NULL, 0);
+    }
+    c->remaining = reply->length;
+    c->flags = reply->flags;
+    c->on_relayed = on_relayed;
+    s->step = step_backend_relay;
+    return STEP_NEXT;
+}
 
-    if (connect(s3_fd, (struct sockaddr *)&s3_addr, sizeof(s3_addr)) == -1) {
-        perror("[S1] Connection to S3 failed");
-        close(s3_fd);
-        return -1;
+// ===== Shared node fetches =====
+
+// Like backend_request for a relayed reply, but joins a fetch of the same
+// request already in flight on this reactor if there is one. A fetch can be
+// joined until its reply starts going out, or later while the leader still
+// has a copy of everything relayed so far (a download kept for the object
+// cache).
+int flight_request(struct session *s, const struct storage_node *node, uint8_t type,
+                   const char *payload, step_fn on_done) {
+    struct command *c = s->cmd;
+    struct backend *b = &c->backend;
+
+    // Every session in a shared fetch waits on the others, so once one is
+    // joined, each must have its client to itself: one waiting for another
+    // request's turn to write could hold up the whole fetch, and that request
+    // in turn. A fetch nobody joined holds up nothing, so its leader only
+    // takes its turn when it has something to write.
+    struct flight *f;
+    for (f = flights; f; f = f->next) {
+        if (f->type != type || f->epoch != c->cache_epoch || strcmp(f->request, payload) != 0) continue;
+        if (f->relaying && !f->leader->cmd->cache_fill) continue;
+        if (f->leader->conn == s->conn || !session_may_write(s) || !session_may_write(f->leader)) continue;
+        break;
+    }
+
+    if (f == NULL) {
+        f = calloc(1, sizeof(*f));
+        if (f) {
+            f->type = type;
+            snprintf(f->request, sizeof(f->request), "%s", payload);
+            f->epoch = c->cache_epoch;
+            f->leader = s;
+            f->next = flights;
+            flights = f;
+            c->flight = f;
+        }
+        return backend_request(s, node, type, payload, NULL, on_done);
     }
 
-    // Prepare the path for S2 (replace ~s1 with ~s2)
-    char expanded_path[MAX_PATH];
-    expand_path(path, expanded_path, sizeof(expanded_path));
-    char *s1_pos = strstr(expanded_path, "s1");
-    if (s1_pos) {
-        memcpy(s1_pos, "s3", 2);
+    if (f->relaying) {
+        // Catch up on what the leader has relayed
+        struct command *lc = f->leader->cmd;
+        struct proto_header *reply = &lc->backend.reply;
+        if (queue_header(&s->out, reply->type, reply->flags, s->req_id, reply->length) == -1 ||
+            (lc->data_len > 0 && buf_append(&s->out, lc->data, lc->data_len) == -1)) {
+            return STEP_CLOSE;
+        }
     }
 
-    // Send LIST request to S2
-    char request[BUFFER_SIZE];
-    snprintf(request, sizeof(request), "LIST %s", expanded_path);
-    if (send(s3_fd, request, strlen(request), 0) == -1) {
-        perror("[S1] Failed to send list request to S3");
-        close(s3_fd);
-        return -1;
-    }
+    session_writer(s);
+    session_writer(f->leader);
+
+    // Kept in case the fetch ends without a reply to share
+    b->node = node;
+    b->req_type = type;
+    snprintf(b->req_payload, sizeof(b->req_payload), "%s", payload);
+    b->on_done = on_done;
+    c->flight = f;
+    c->next_follower = f->followers;
+    f->followers = s;
+    printf("[S1] Sharing the %s request to %s already in flight\n", payload, node->name);
+    s->step = step_flight_wait;
+    return STEP_NEXT;
+}
 
-    // Receive file list from S2
-    *list_size = 0;
-    int bytes_received;
-    while ((bytes_received = recv(s3_fd, file_list + *list_size, BUFFER_SIZE, 0)) > 0) {
-        *list_size += bytes_received;
-        if (bytes_received < BUFFER_SIZE) break;
+// Queue a relayed frame header (hdr) or payload bytes for every follower of
+// the session's fetch. A follower that cannot take them is dropped.
+void flight_fanout(struct session *s, const struct proto_header *hdr, const char *data, size_t len) {
+    struct flight *f = s->cmd->flight;
+    if (!f) return;
+    struct session *fs, *next;
+    for (fs = f->followers; fs; fs = next) {
+        next = fs->cmd->next_follower;
+        int ret = hdr ? queue_header(&fs->out, hdr->type, hdr->flags, fs->req_id, hdr->length)
+                      : buf_append(&fs->out, data, len);
+        if (ret == -1) {
+            session_close(fs);
+            continue;
+        }
+        session_wake(fs);
     }
+}
 
-    close(s3_fd);
-    return (*list_size > 0) ? 0 : -1;
+// 1 if a follower's client is more than FLIGHT_BACKLOG bytes behind; it wakes
+// the leader once it has caught up
+int flight_backlogged(struct session *s) {
+    struct flight *f = s->cmd->flight;
+    if (!f) return 0;
+    for (struct session *fs = f->followers; fs; fs = fs->cmd->next_follower) {
+        if (fs->out.len - fs->out.off > FLIGHT_BACKLOG) {
+            f->stalled = 1;
+            return 1;
+        }
+    }
+    return 0;
 }
-int request_file_list_from_s4(const char *path, char *file_list, size_t *list_size) {
-    int s4_fd;
-    struct sockaddr_in s4_addr;
 
-    s4_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (s4_fd == -1) {
-        perror("[S1] Socket creation for S4 failed");
-        return -1;
+int step_flight_wait(struct session *s) {
+    struct command *c = s->cmd;
+    if (c->flight_result == FLIGHT_DONE) {
+        printf("[S1] Shared %s reply sent to client\n", c->backend.node->name);
+        return command_done(s);
+    }
+    if (c->flight_result == FLIGHT_RETRY) {
+        c->flight_result = 0;
+        return backend_connect(s);
+    }
+
+    struct flight *f = c->flight;
+    if (f->stalled && s->out.len - s->out.off <= FLIGHT_BACKLOG) {
+        f->stalled = 0;
+        session_wake(f->leader);
+    }
+    return STEP_WAIT;
+}
+
+// The session's command is ending. A follower just leaves; when the leader
+// goes, its followers are done if the reply went out in full, carry on
+// without it if it only lost its client, and otherwise ask the node
+// themselves (or are dropped, if part of a reply they can no longer complete
+// was already queued for them).
+void flight_leave(struct session *s) {
+    struct command *c = s->cmd;
+    struct flight *f = c->flight;
+    c->flight = NULL;
+
+    if (f->leader != s) {
+        struct session **link = &f->followers;
+        while (*link != s) link = &(*link)->cmd->next_follower;
+        *link = c->next_follower;
+        return;
+    }
+
+    if (!f->finished && !f->broken && f->followers && c->backend.fd != -1) {
+        flight_handoff(s, f);
+        if (f->leader != s) return;
+    }
+
+    struct flight **link = &flights;
+    while (*link != f) link = &(*link)->next;
+    *link = f->next;
+
+    struct session *fs, *next;
+    for (fs = f->followers; fs; fs = next) {
+        next = fs->cmd->next_follower;
+        fs->cmd->flight = NULL;
+        if (f->finished) {
+            fs->cmd->flight_result = FLIGHT_DONE;
+        } else if (f->relaying) {
+            session_close(fs);
+            continue;
+        } else {
+            fs->cmd->flight_result = FLIGHT_RETRY;
+        }
+        session_wake(fs);
+    }
+    free(f);
+}
+
+// The leader's client went away mid-fetch: move the node exchange, and with
+// it the lead, to the first follower
+void flight_handoff(struct session *s, struct flight *f) {
+    struct command *c = s->cmd;
+    struct session *ns = f->followers;
+    struct command *nc = ns->cmd;
+
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP,
+        .data.ptr = ns,
+    };
+    if (epoll_ctl(s->reactor->epfd, EPOLL_CTL_MOD, c->backend.fd, &ev) == -1) return;
+
+    f->followers = nc->next_follower;
+    f->leader = ns;
+    nc->backend = c->backend;
+    c->backend.fd = -1;
+    memset(&c->backend.out, 0, sizeof(c->backend.out));
+    nc->remaining = c->remaining;
+    nc->flags = c->flags;
+    nc->on_relayed = c->on_relayed;
+    nc->data = c->data;
+    nc->data_len = c->data_len;
+    nc->data_cap = c->data_cap;
+    nc->data_limit = c->data_limit;
+    nc->data_overflow = c->data_overflow;
+    nc->cache_fill = c->cache_fill;
+    nc->cache_epoch = c->cache_epoch;
+    c->data = NULL;
+    c->data_len = c->data_cap = 0;
+    ns->step = s->step;
+    session_wake(ns);
+}
+
+// ===== UPLOAD COMMAND =====
+
+int start_upload(struct session *s) {
+    struct command *c = s->cmd;
+
+    // The file contents follow the command as a DATA payload; read its first
+    // header next
+    c->remaining = 0;
+    c->flags = PROTO_F_MORE;
+    s->hdr_len = 0;
+    s->step = step_upload_recv;
+
+    if (sscanf(s->command_buf, "%255s %255s", c->filename, c->destination) != 2) {
+        c->error = "UPLOAD_FAILED:INVALID_FORMAT";
+        return STEP_NEXT;
+    }
+
+    // Files that belong on a storage node go straight through to it; they are
+    // only staged on S1 when the node cannot be reached
+    char *ext = strrchr(c->filename, '.');
+    const struct storage_node *node = node_for_ext(ext);
+    if (node != NULL) {
+        char node_path[MAX_PATH + 256];
+        map_to_node_path(c->destination, node, node_path, sizeof(node_path));
+        size_t len = strlen(node_path);
+        snprintf(node_path + len, sizeof(node_path) - len, "/%s", c->filename);
+        if (cache_key(node, node_path, c->key, sizeof(c->key)) == 0) {
+            metacache_expect(&metadata, c->key);
+            objcache_drop(&objects, c->key);
+        }
+    }
+    if (node != NULL) {
+        // Prepare destination path for the node (replace ~s1 with ~sN)
+        char node_destination[MAX_PATH], request[MAX_FILE_PATH + 32];
+        map_to_node_path(c->destination, node, node_destination, sizeof(node_destination));
+        snprintf(request, sizeof(request), "%s %s", c->filename, node_destination);
+        if (upload_cut_through(s, node, PROTO_UPLOAD, request, upload_stored) == 0) {
+            s->step = step_upload_forward;
+            return STEP_NEXT;
+        }
+        printf("[S1] %s unavailable, staging %s on S1\n", node->name, c->filename);
+    }
+
+    char expanded_dest[MAX_PATH];
+    expand_path(c->destination, expanded_dest, sizeof(expanded_dest));
+
+    struct stat st;
+    if (stat(expanded_dest, &st) == -1) {
+        mkdir(expanded_dest, 0777);
+    }
+
+    // The payload goes to a temporary file that takes the name once complete
+    snprintf(c->target, sizeof(c->target), "%s/%s", expanded_dest, c->filename);
+    int fd = partfile_temp(expanded_dest, c->filename, c->filepath, sizeof(c->filepath));
+    c->fp = (fd != -1) ? fdopen(fd, "wb") : NULL;
+    if (c->fp) {
+        c->unlink_on_close = 1;
+    } else {
+        if (fd != -1) {
+            close(fd);
+            unlink(c->filepath);
+        }
+        c->error = "UPLOAD_FAILED:FILE_OPEN_ERROR";
     }
+    return STEP_NEXT;
+}
 
-    memset(&s4_addr, 0, sizeof(s4_addr));
-    s4_addr.sin_family = AF_INET;
-    s4_addr.sin_port = htons(S4_PORT);
-    inet_pton(AF_INET, "127.0.0.1", &s4_addr.sin_addr);
+// Offer the Unix socket connection of a cut-through upload a shared-memory
+// ring for its payloads (proto.h), the first time it carries one. The SHM_RING
+// frame goes out ahead of the queued request and the node's answer is read
+// by upload_ring_answer before any payload is sent, so the reactor never
+// waits on it. Returns -1 if the connection failed.
+int ring_offer(struct session *s) {
+    struct backend *b = &s->cmd->backend;
+    if (b->fd >= MAX_RING_FD || !ring_wanted[b->fd]) return 0;
+    ring_wanted[b->fd] = 0;
+    struct shmring *ring = malloc(sizeof(*ring));
+    if (!ring || shmring_create(ring, ring_kb * 1024) == -1) {
+        free(ring);
+        return 0;
+    }
 
-    if (connect(s4_fd, (struct sockaddr *)&s4_addr, sizeof(s4_addr)) == -1) {
-        perror("[S1] Connection to S2 failed");
-        close(s4_fd);
+    // Nothing else is in flight on the connection, so the one small frame
+    // fits in its socket buffer
+    int fds[3] = { ring->mem_fd, ring->data_fd, ring->space_fd };
+    if (proto_send_fds(b->fd, PROTO_SHM_RING, 0, 0, fds, 3) == -1) {
+        int err = errno;
+        shmring_free(ring);
+        free(ring);
+        errno = err;
         return -1;
     }
+    b->ring_offer = ring;
+    b->ring_have = 0;
+    b->hdr_len = 0;
+    return 0;
+}
+
+// Read the node's answer to the ring offered with this upload. A node that
+// will not take it is still used without one. Returns 1 once the answer is
+// in, 0 if it has not arrived yet and -1 if the connection failed.
+int upload_ring_answer(struct session *s) {
+    struct backend *b = &s->cmd->backend;
+    struct shmring *ring = b->ring_offer;
+    if (b->hdr_len < PROTO_HEADER_SIZE) {
+        int ret = recv_fill(b->fd, b->hdr_buf, PROTO_HEADER_SIZE, &b->hdr_len);
+        if (ret != 1) return ret;
+        if (proto_decode_header(b->hdr_buf, &b->reply) == -1 ||
+            b->reply.length >= sizeof(b->ring_answer)) {
+            errno = EPROTO;
+            return -1;
+        }
+    }
+    int ret = recv_fill(b->fd, b->ring_answer, b->reply.length, &b->ring_have);
+    if (ret != 1) return ret;
+    b->ring_answer[b->ring_have] = '\0';
+    b->hdr_len = 0;
+    b->ring_offer = NULL;
 
-    // Prepare the path for S2 (replace ~s1 with ~s2)
-    char expanded_path[MAX_PATH];
-    expand_path(path, expanded_path, sizeof(expanded_path));
-    char *s1_pos = strstr(expanded_path, "s1");
-    if (s1_pos) {
-        memcpy(s1_pos, "s4", 2);
+    if (b->reply.type == PROTO_OK) {
+        node_rings[b->fd] = ring;
+        if (ring_watch(s, ring) == 0) return 1;
+        node_rings[b->fd] = NULL;
+    } else {
+        fprintf(stderr, "[S1] %s refused a shared-memory ring: %s\n", b->node->name, b->ring_answer);
     }
+    // Only the node's side is left, and it goes with the connection
+    shmring_free(ring);
+    free(ring);
+    return b->reply.type == PROTO_OK ? -1 : 1;
+}
 
-    // Send LIST request to S2
-    char request[BUFFER_SIZE];
-    snprintf(request, sizeof(request), "LIST %s", expanded_path);
-    if (send(s4_fd, request, strlen(request), 0) == -1) {
-        perror("[S1] Failed to send list request to S4");
-        close(s4_fd);
+// Wait on the ring's space doorbell along with the session's other events
+int ring_watch(struct session *s, struct shmring *ring) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = s };
+    if (epoll_ctl(s->reactor->epfd, EPOLL_CTL_ADD, ring->space_fd, &ev) == -1) {
+        perror("[S1] epoll_ctl failed");
         return -1;
     }
+    return 0;
+}
 
-    // Receive file list from S2
-    *list_size = 0;
-    int bytes_received;
-    while ((bytes_received = recv(s4_fd, file_list + *list_size, BUFFER_SIZE, 0)) > 0) {
-        *list_size += bytes_received;
-        if (bytes_received < BUFFER_SIZE) break;
+// Open the node connection for a cut-through upload and send the request
+// (type/payload) that the client's DATA payload follows; on_done gets the
+// node's reply. Returns -1 if the node is unavailable.
+int upload_cut_through(struct session *s, const struct storage_node *node, uint8_t type,
+                       const char *payload, step_fn on_done) {
+    struct command *c = s->cmd;
+    struct backend *b = &c->backend;
+
+    snprintf(b->req_payload, sizeof(b->req_payload), "%s", payload);
+    b->node = node;
+    b->req_type = type;
+    b->body = NULL;
+    // Client bytes already passed on cannot be replayed on a fresh connection
+    b->retried = 1;
+    b->on_done = on_done;
+    if (backend_attach(s) == -1) return -1;
+    if (ring_offer(s) == -1) {
+        fprintf(stderr, "[S1] Request to %s failed: %s\n", node->name, strerror(errno));
+        backend_discard(s);
+        return -1;
     }
 
-    close(s4_fd);
-    return (*list_size > 0) ? 0 : -1;
+    // A connection with a ring takes the payload through it; the session
+    // waits on the ring's space doorbell when it is full
+    struct shmring *ring = node_ring(b->fd);
+    if (ring) {
+        if (ring_watch(s, ring) == -1) {
+            backend_discard(s);
+            return -1;
+        }
+    // Without a pipe the payload is copied through a buffer instead (a ring
+    // just offered may yet be refused)
+    } else if (pipe2(c->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        c->pipe[0] = c->pipe[1] = -1;
+    }
+    c->data_limit = 64;
+    return 0;
 }
 
-void list_files_recursive(const char *base_path, const char *path, char *file_list, size_t *list_size) {
-    DIR *dir;
-    struct dirent *ent;
-    char full_path[MAX_PATH];
-    
-    snprintf(full_path, sizeof(full_path), "%s/%s", base_path, path);
-    
-    if ((dir = opendir(full_path)) != NULL) {
-        while ((ent = readdir(dir)) != NULL) {
-            if (ent->d_type == DT_DIR) {
-                // Skip . and .. directories
-                if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
-                    continue;
-                }
-                
-                // Build relative path for subdirectory
-                char subdir_path[MAX_PATH];
-                if (strlen(path) == 0) {
-                    snprintf(subdir_path, sizeof(subdir_path), "%s", ent->d_name);
-                } else {
-                    snprintf(subdir_path, sizeof(subdir_path), "%s/%s", path, ent->d_name);
-                }
-                
-                // Recursively process subdirectories
-                list_files_recursive(base_path, subdir_path, file_list, list_size);
-            } else if (ent->d_type == DT_REG) {
-                char *ext = strrchr(ent->d_name, '.');
-                if (ext && strcmp(ext, ".c") == 0) {
-                    // Include relative path if in subdirectory
-                    if (strlen(path) == 0) {
-                        int len = snprintf(file_list + *list_size, 
-                                          BUFFER_SIZE * 10 - *list_size, 
-                                          "%s\n", ent->d_name);
-                        *list_size += len;
-                    } else {
-                        int len = snprintf(file_list + *list_size, 
-                                          BUFFER_SIZE * 10 - *list_size, 
-                                          "%s/%s\n", path, ent->d_name);
-                        *list_size += len;
-                    }
+// Pass the client's DATA frames on to the node, re-tagged with the node
+// request's id. The bytes are spliced socket -> pipe -> socket where the
+// kernel allows it, so they never enter S1's memory or touch its disk, and
+// the client is only read while the node keeps up. On a connection with a
+// shared-memory ring they are read from the client straight into the ring
+// instead, and only the frame headers go over the node's socket.
+int step_upload_forward(struct session *s) {
+    char chunk[IO_CHUNK];
+    struct command *c = s->cmd;
+    struct backend *b = &c->backend;
+    // The payload can only start once the node has answered a ring offer
+    if (b->ring_offer) {
+        int ret = upload_ring_answer(s);
+        if (ret == 0) return STEP_WAIT;
+        if (ret == -1) return upload_forward_failed(s);
+    }
+    struct shmring *ring = node_ring(b->fd);
+
+    while (1) {
+        // Bytes already taken from the client go out first, in order
+        int ret = buf_flush(b->fd, &b->out);
+        if (ret == -1) return upload_forward_failed(s);
+        if (ret == 0) return STEP_WAIT;
+        while (c->pipe_bytes > 0) {
+            ssize_t n = splice(c->pipe[0], NULL, b->fd, NULL, c->pipe_bytes,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN) return STEP_WAIT;
+                return upload_forward_failed(s);
+            }
+            c->pipe_bytes -= n;
+        }
+
+        if (c->remaining == 0) {
+            if (!(c->flags & PROTO_F_MORE)) break;
+
+            ret = recv_fill(s->fd, s->hdr_buf, PROTO_HEADER_SIZE, &s->hdr_len);
+            if (ret == 0) return STEP_WAIT;
+            struct proto_header data_hdr;
+            s->hdr_len = 0;
+            if (ret == -1 || proto_decode_header(s->hdr_buf, &data_hdr) == -1 ||
+                data_hdr.type != PROTO_DATA) {
+                fprintf(stderr, "[S1] Failed to receive upload data\n");
+                return STEP_CLOSE;
+            }
+            uint16_t flags = data_hdr.flags | (ring ? PROTO_F_RING : 0);
+            if (queue_header(&b->out, PROTO_DATA, flags, b->req_id, data_hdr.length) == -1) {
+                return STEP_CLOSE;
+            }
+            c->remaining = data_hdr.length;
+            c->payload_size += data_hdr.length;
+            c->flags = data_hdr.flags;
+            continue;
+        }
+
+        if (ring) {
+            char *dst;
+            size_t want = shmring_space(ring, &dst);
+            if (want == 0) {
+                if (shmring_wait_space(ring)) continue;
+                // Nothing is read from the node mid-upload unless it went away
+                struct pollfd pfd = { .fd = b->fd, .events = POLLRDHUP };
+                if (poll(&pfd, 1, 0) == 1) {
+                    errno = ECONNRESET;
+                    return upload_forward_failed(s);
                 }
+                return STEP_WAIT;
+            }
+            if (want > c->remaining) want = c->remaining;
+            ssize_t n = recv_nb(s->fd, dst, want);
+            if (n == -1) {
+                perror("[S1] Failed to receive upload");
+                return STEP_CLOSE;
             }
+            if (n == 0) return STEP_WAIT;
+            shmring_produce(ring, n);
+            c->remaining -= n;
+            continue;
         }
-        closedir(dir);
+
+        size_t want = c->remaining < sizeof(chunk) ? c->remaining : sizeof(chunk);
+        if (c->pipe[0] != -1) {
+            ssize_t n = splice(s->fd, NULL, c->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                c->pipe_bytes += n;
+                c->remaining -= n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            // The pipe is empty here, so EAGAIN means the client has nothing yet
+            if (n < 0 && errno == EAGAIN) return STEP_WAIT;
+            if (n < 0 && errno == EINVAL) {
+                close(c->pipe[0]);
+                close(c->pipe[1]);
+                c->pipe[0] = c->pipe[1] = -1;
+                continue;
+            }
+            perror("[S1] Failed to receive upload");
+            return STEP_CLOSE;
+        }
+
+        ssize_t n = recv_nb(s->fd, chunk, want);
+        if (n == -1) {
+            perror("[S1] Failed to receive upload");
+            return STEP_CLOSE;
+        }
+        if (n == 0) return STEP_WAIT;
+        if (buf_append(&b->out, chunk, n) == -1) return STEP_CLOSE;
+        c->remaining -= n;
     }
+
+    request_read(s);
+    s->step = step_backend_reply;
+    return STEP_NEXT;
 }
 
-int get_local_c_files(const char *path, char *file_list, size_t *list_size) {
-    char expanded_path[MAX_PATH];
-    expand_path(path, expanded_path, sizeof(expanded_path));
-    
-    *list_size = 0;
-    list_files_recursive(expanded_path, "", file_list, list_size); // Start with empty relative path
-    return 0;
+// The node went away mid-transfer. What it already got cannot be resent, so
+// drain the rest of the client's payload and report the failure.
+int upload_forward_failed(struct session *s) {
+    struct command *c = s->cmd;
+    fprintf(stderr, "[S1] Forwarding %s to %s failed: %s\n", c->filename, c->backend.node->name, strerror(errno));
+    backend_discard(s);
+    c->error = "UPLOAD_FAILED:TRANSFER_ERROR";
+    s->step = step_upload_recv;
+    return STEP_NEXT;
 }
 
+int upload_stored(struct session *s) {
+    struct command *c = s->cmd;
+    const struct storage_node *node = c->backend.node;
+    if (!c->backend.failed && c->backend.reply.type == PROTO_OK) {
+        printf("[S1] %s file forwarded to %s\n", node->ext, node->name);
+        upload_cache(s);
+        return command_reply(s, PROTO_OK, "UPLOAD_SUCCESS");
+    }
+    if (!c->backend.failed && c->data_len == 17 && memcmp(c->data, "STORE_NOT_DURABLE", 17) == 0) {
+        // The file is in place on the node, just not safely on its disk
+        fprintf(stderr, "[S1] %s stored %s but could not sync it\n", node->name, c->filename);
+        upload_cache(s);
+        return command_reply(s, PROTO_ERROR, "UPLOAD_FAILED:NOT_DURABLE");
+    }
+    fprintf(stderr, "[S1] %s did not store %s\n", node->name, c->filename);
+    return command_reply(s, PROTO_ERROR, "UPLOAD_FAILED:STORE_FAILED");
+}
 
-// Function to handle client requests
+int step_upload_recv(struct session *s) {
+    char chunk[IO_CHUNK];
+    struct command *c = s->cmd;
 
-void prcclient(int client_fd) {
     while (1) {
-        char command[BUFFER_SIZE];
-        char filename[256];
-        char destination[256];
-
-        memset(command, 0, sizeof(command));
-        memset(filename, 0, sizeof(filename));
-        memset(destination, 0, sizeof(destination));
-
-        // Receive command from client
-        int bytes_received = recv(client_fd, command, sizeof(command) - 1, 0);
-        if (bytes_received <= 0) {
-            if (bytes_received == 0) {
-                printf("[S1] Client disconnected\n");
-            } else {
-                perror("[S1] recv failed");
+        if (c->remaining == 0) {
+            if (!(c->flags & PROTO_F_MORE)) break;
+
+            int ret = recv_fill(s->fd, s->hdr_buf, PROTO_HEADER_SIZE, &s->hdr_len);
+            if (ret == 0) return STEP_WAIT;
+            struct proto_header data_hdr;
+            s->hdr_len = 0;
+            if (ret == -1 || proto_decode_header(s->hdr_buf, &data_hdr) == -1 ||
+                data_hdr.type != PROTO_DATA) {
+                fprintf(stderr, "[S1] Failed to receive upload data\n");
+                return STEP_CLOSE;
             }
-            break;
+            c->remaining = data_hdr.length;
+            c->payload_size += data_hdr.length;
+            c->flags = data_hdr.flags;
+            continue;
         }
 
-        // Remove trailing newline (if any)
-        command[strcspn(command, "\n")] = 0;
+        size_t want = c->remaining < sizeof(chunk) ? c->remaining : sizeof(chunk);
+        ssize_t n = recv_nb(s->fd, chunk, want);
+        if (n == -1) {
+            perror("[S1] Failed to receive upload");
+            return STEP_CLOSE;
+        }
+        if (n == 0) return STEP_WAIT;
+        // After a write error keep draining so the session stays usable
+        if (c->fp && !c->error && fwrite(chunk, 1, n, c->fp) != (size_t)n) {
+            perror("[S1] Failed to receive upload");
+            c->error = "UPLOAD_FAILED:TRANSFER_ERROR";
+        }
+        c->remaining -= n;
+    }
+    request_read(s);
 
+    if (c->fp) {
+        if (fclose(c->fp) != 0 && !c->error) c->error = "UPLOAD_FAILED:TRANSFER_ERROR";
+        c->fp = NULL;
+    }
+    if (c->error) return command_reply(s, PROTO_ERROR, c->error);
+    if (c->on_received) return c->on_received(s);
 
-// ===== UPLOAD COMMAND =====
-if (strncmp(command, "uploadf ", 8) == 0) {
-    if (sscanf(command, "uploadf %s %s", filename, destination) != 2) {
-        send(client_fd, "UPLOAD_FAILED:INVALID_FORMAT", 28, 0);
-        continue;
+    // Only a complete file takes the name
+    if (rename(c->filepath, c->target) == -1) {
+        perror("[S1] Failed to store upload");
+        return command_reply(s, PROTO_ERROR, "UPLOAD_FAILED:STORE_FAILED");
     }
+    snprintf(c->filepath, sizeof(c->filepath), "%s", c->target);
+    c->unlink_on_close = 0;
 
-    char expanded_dest[MAX_PATH];
-    expand_path(destination, expanded_dest, sizeof(expanded_dest));
+    // Handle forwarding
+    char *ext = strrchr(c->filename, '.');
+    const struct storage_node *node = node_for_ext(ext);
+    if (node == NULL) {
+        printf("[S1] .c file stored locally\n");
+        nsindex_update(&local_files, c->filepath);
+        return command_reply(s, PROTO_OK, "UPLOAD_SUCCESS");
+    }
 
-    struct stat st;
-    if (stat(expanded_dest, &st) == -1) {
-        mkdir(expanded_dest, 0777);
+    c->fp = fopen(c->filepath, "rb");
+    if (!c->fp) {
+        fprintf(stderr, "[S1] Failed to open file for %s transfer: %s\n", node->name, strerror(errno));
+        return command_reply(s, PROTO_OK, "UPLOAD_SUCCESS");
+    }
+
+    // Prepare destination path for the node (replace ~s1 with ~sN)
+    char node_destination[MAX_PATH];
+    char request[MAX_PATH + 256];
+    map_to_node_path(c->destination, node, node_destination, sizeof(node_destination));
+    snprintf(request, sizeof(request), "%s %s", c->filename, node_destination);
+
+    c->data_limit = 64;
+    return backend_request(s, node, PROTO_UPLOAD, request, c->fp, upload_forwarded);
+}
+
+// The staged copy is only dropped once the node has stored the file; if the
+// node is unavailable the upload still succeeds and the file stays on S1.
+// Remember the file the node just stored
+void upload_cache(struct session *s) {
+    struct command *c = s->cmd;
+    if (c->key[0]) {
+        metacache_stored(&metadata, c->key, node_index(c->backend.node), c->payload_size, time(NULL));
+        // Also stops downloads that fetched the old contents from caching them
+        objcache_drop(&objects, c->key);
     }
+}
 
-    char filepath[MAX_PATH];
-    snprintf(filepath, sizeof(filepath), "%s/%s", expanded_dest, filename);
+int upload_forwarded(struct session *s) {
+    struct command *c = s->cmd;
+    const struct storage_node *node = c->backend.node;
+    if (!c->backend.failed && c->backend.reply.type == PROTO_OK) {
+        c->unlink_on_close = 1;
+        printf("[S1] %s file forwarded to %s\n", node->ext, node->name);
+        upload_cache(s);
+    } else {
+        fprintf(stderr, "[S1] Failed to forward file to %s\n", node->name);
+    }
+    return command_reply(s, PROTO_OK, "UPLOAD_SUCCESS");
+}
 
-    FILE *fp = fopen(filepath, "wb");
-    if (!fp) {
-        send(client_fd, "UPLOAD_FAILED:FILE_OPEN_ERROR", 30, 0);
-        continue;
+// ===== UPLOAD SESSIONS =====
+
+// UPLOAD_BEGIN, _QUERY, _APPEND and _COMMIT (proto.h). A node file's session
+// lives on its node, which S1 passes the requests on to; unlike a plain
+// upload nothing is staged on S1 if the node is down, as the session
+// survives until the client can carry on.
+int start_upload_session(struct session *s) {
+    struct command *c = s->cmd;
+    uint8_t type = s->hdr.type;
+    unsigned long long number = 0;
+
+    if (type == PROTO_UPLOAD_APPEND) {
+        // The piece follows as a DATA payload whatever becomes of the request
+        c->remaining = 0;
+        c->flags = PROTO_F_MORE;
+        s->hdr_len = 0;
+        s->step = step_upload_recv;
+    }
+    int want = (type == PROTO_UPLOAD_APPEND || type == PROTO_UPLOAD_COMMIT) ? 3 : 2;
+    if (sscanf(s->command_buf, "%255s %255s %llu", c->filename, c->destination, &number) < want) {
+        c->error = "UPLOAD_FAILED:INVALID_FORMAT";
+        if (type == PROTO_UPLOAD_APPEND) return STEP_NEXT;
+        return command_reply(s, PROTO_ERROR, c->error);
+    }
+
+    char *ext = strrchr(c->filename, '.');
+    const struct storage_node *node = node_for_ext(ext);
+    if (node == NULL) return upload_session_local(s, number);
+
+    char node_destination[MAX_PATH], request[MAX_FILE_PATH + 32];
+    map_to_node_path(c->destination, node, node_destination, sizeof(node_destination));
+    if (want == 3) {
+        snprintf(request, sizeof(request), "%s %s %llu", c->filename, node_destination, number);
+    } else {
+        snprintf(request, sizeof(request), "%s %s", c->filename, node_destination);
     }
+    c->data_limit = 64;
 
-    char buffer[BUFFER_SIZE];
-    while ((bytes_received = recv(client_fd, buffer, sizeof(buffer), 0)) > 0) {
-        fwrite(buffer, 1, bytes_received, fp);
-        if (bytes_received < sizeof(buffer)) break;
+    if (type == PROTO_UPLOAD_APPEND) {
+        c->backend.req_flags = s->hdr.flags & PROTO_F_RANGE;
+        if (upload_cut_through(s, node, type, request, upload_session_answered) == -1) {
+            c->error = "UPLOAD_FAILED:NODE_UNAVAILABLE";
+            return STEP_NEXT;
+        }
+        s->step = step_upload_forward;
+        return STEP_NEXT;
+    }
+    if (type == PROTO_UPLOAD_COMMIT) {
+        // The file changes under its name once the node commits it
+        char node_path[MAX_PATH + 256];
+        snprintf(node_path, sizeof(node_path), "%s/%s", node_destination, c->filename);
+        if (cache_key(node, node_path, c->key, sizeof(c->key)) == 0) {
+            metacache_expect(&metadata, c->key);
+            objcache_drop(&objects, c->key);
+        }
+        c->payload_size = number;
     }
-    fclose(fp);
+    return backend_request(s, node, type, request, NULL, upload_session_answered);
+}
 
-    // Handle forwarding
-    char *ext = strrchr(filename, '.');
-    if (ext != NULL) {
-        if (strcmp(ext, ".pdf") == 0) {
-            if (forward_to_s2(filename, destination, filepath) == 0) {
-                remove(filepath);
-                printf("[S1] PDF file forwarded to S2\n");
-            }
-        } else if (strcmp(ext, ".txt") == 0) {
-            if (forward_to_s3(filename, destination, filepath) == 0) {
-                remove(filepath);
-                printf("[S1] TXT file forwarded to S3\n");
-            }
-        } else if (strcmp(ext, ".zip") == 0) {
-            if (forward_to_s4(filename, destination, filepath) == 0) {
-                remove(filepath);
-                printf("[S1] ZIP file forwarded to S4\n");
-            }
-        } else {
-            printf("[S1] .c file stored locally\n");
+// Pass the node's answer to a session request on to the client
+int upload_session_answered(struct session *s) {
+    struct command *c = s->cmd;
+    const struct storage_node *node = c->backend.node;
+    if (c->backend.failed || c->data_overflow ||
+        (c->backend.reply.type != PROTO_OK && c->backend.reply.type != PROTO_ERROR)) {
+        fprintf(stderr, "[S1] %s did not answer the upload session request for %s\n",
+                node->name, c->filename);
+        return command_reply(s, PROTO_ERROR, "UPLOAD_FAILED:NODE_UNAVAILABLE");
+    }
+    snprintf(c->status, sizeof(c->status), "%.*s", (int)c->data_len, c->data ? c->data : "");
+    if (c->backend.reply.type == PROTO_ERROR) {
+        // A commit the node could not sync still put the file in place
+        if (s->hdr.type == PROTO_UPLOAD_COMMIT && strcmp(c->status, "STORE_NOT_DURABLE") == 0) upload_cache(s);
+        return command_reply(s, PROTO_ERROR, c->status);
+    }
+
+    if (s->hdr.type == PROTO_UPLOAD_COMMIT) {
+        printf("[S1] %s committed %s\n", node->name, c->filename);
+        upload_cache(s);
+        return command_reply(s, PROTO_OK, "UPLOAD_SUCCESS");
+    }
+    return command_reply(s, PROTO_OK, c->status);
+}
+
+// S1's own .c files keep their sessions in the destination directory
+int upload_session_local(struct session *s, uint64_t number) {
+    struct command *c = s->cmd;
+    char dir[MAX_PATH];
+    uint64_t offset = number;
+    int ret = -1;
+    expand_path(c->destination, dir, sizeof(dir));
+
+    switch (s->hdr.type) {
+    case PROTO_UPLOAD_BEGIN:
+        ret = partfile_begin(dir, c->filename, &offset);
+        break;
+    case PROTO_UPLOAD_QUERY:
+        ret = partfile_query(dir, c->filename, &offset);
+        break;
+    case PROTO_UPLOAD_APPEND: {
+        int fd = (s->hdr.flags & PROTO_F_RANGE) ? partfile_write(dir, c->filename, offset)
+                                                : partfile_append(dir, c->filename, &offset);
+        if (fd == -1) break;
+        c->fp = fdopen(fd, "wb");
+        if (!c->fp) {
+            close(fd);
+            break;
+        }
+        c->committed = offset;
+        c->on_received = upload_session_appended;
+        return STEP_NEXT;
+    }
+    case PROTO_UPLOAD_COMMIT:
+        ret = partfile_commit(dir, c->filename, &offset, fsync);
+        if (ret == 0) {
+            snprintf(c->filepath, sizeof(c->filepath), "%s/%s", dir, c->filename);
+            nsindex_update(&local_files, c->filepath);
+            printf("[S1] .c file committed locally\n");
+            return command_reply(s, PROTO_OK, "UPLOAD_SUCCESS");
         }
+        break;
     }
 
-    send(client_fd, "UPLOAD_SUCCESS", 14, 0);
-    continue;
+    if (ret == 0) {
+        snprintf(c->status, sizeof(c->status), "%llu", (unsigned long long)offset);
+        return command_reply(s, PROTO_OK, c->status);
+    }
+    if (errno == ERANGE) {
+        snprintf(c->status, sizeof(c->status), "%s:%llu",
+                 s->hdr.type == PROTO_UPLOAD_COMMIT ? "SIZE_MISMATCH" : "OFFSET_MISMATCH",
+                 (unsigned long long)offset);
+        c->error = c->status;
+    } else if (errno == ENOENT) {
+        c->error = "NO_SESSION";
+    } else {
+        perror("[S1] Upload session failed");
+        c->error = "UPLOAD_FAILED:STORE_FAILED";
+    }
+    // An append still has its payload to drain
+    if (s->hdr.type == PROTO_UPLOAD_APPEND) return STEP_NEXT;
+    return command_reply(s, PROTO_ERROR, c->error);
 }
+
+// The piece is in the part file, which step_upload_recv has closed
+int upload_session_appended(struct session *s) {
+    struct command *c = s->cmd;
+    snprintf(c->status, sizeof(c->status), "%llu", (unsigned long long)(c->committed + c->payload_size));
+    return command_reply(s, PROTO_OK, c->status);
+}
+
 // ===== DOWNLOAD COMMAND =====
-else if (strncmp(command, "downlf ", 7) == 0) {
-    char requested_file[MAX_PATH];
-    sscanf(command + 7, "%s", requested_file);
 
-    char expanded_path[MAX_PATH];
-    expand_path(requested_file, expanded_path, sizeof(expanded_path));
+int start_download(struct session *s) {
+    struct command *c = s->cmd;
+    char path[MAX_PATH];
+    c->ranged = proto_parse_download(s->command_buf, path, sizeof(path), &c->range_offset, &c->range_length);
+    if (c->ranged == -1) return command_reply(s, PROTO_ERROR, "DOWNLOAD_FAILED:INVALID_RANGE");
+    sscanf(path, "%511s", c->path);
+    expand_path(c->path, c->filepath, sizeof(c->filepath));
 
     // Check file extension
-    char *ext = strrchr(requested_file, '.');
-    if (ext != NULL) {
-        if (strcmp(ext, ".pdf") == 0) {
-            // Handle PDF file - request from S2
-            char file_data[10 * BUFFER_SIZE]; // Buffer for file content
-            size_t file_size = 0;
-            
-            if (request_file_from_s2(requested_file, file_data, &file_size) == 0) {
-                // Send file to client
-                send(client_fd, file_data, file_size, 0);
-                printf("[S1] PDF file retrieved from S2 and sent to client\n");
-                continue;
-            } else {
-                send(client_fd, "DOWNLOAD_FAILED:FILE_NOT_FOUND_ON_S2", 35, 0);
-                continue;
-            }
+    char *ext = strrchr(c->path, '.');
+    const struct storage_node *node = node_for_ext(ext);
+    if (node != NULL) {
+        // Handle PDF/TXT/ZIP file - request from the storage node
+        char node_path[MAX_PATH], request[MAX_PATH + 64];
+        map_to_node_path(c->path, node, node_path, sizeof(node_path));
+        if (cache_key(node, node_path, c->key, sizeof(c->key)) == 0 &&
+            metacache_absent(&metadata, node_index(node), c->key)) {
+            // Never stored on the node, so there is no need to ask it
+            return download_not_found(s, node);
         }
-        //handle txt file
-        else if (strcmp(ext, ".txt") == 0) {
-            char file_data[10 * BUFFER_SIZE];
-            size_t file_size = 0;
-            
-            if (request_file_from_s3(requested_file, file_data, &file_size) == 0) {
-                send(client_fd, file_data, file_size, 0);
-                printf("[S1] TXT file retrieved from S3 and sent to client\n");
-                continue;
-            } else {
-                send(client_fd, "DOWNLOAD_FAILED:FILE_NOT_FOUND_ON_S3", 35, 0);
-                continue;
-            }
+        if (c->key[0]) {
+            int hit = download_cached(s);
+            if (hit == -1) return STEP_CLOSE;
+            if (hit) return command_done(s);
+            c->cache_epoch = objcache_epoch(&objects, c->key);
         }
-        else if (strcmp(ext, ".zip") == 0) {
-            char file_data[10 * BUFFER_SIZE];
-            size_t file_size = 0;
-            
-            if (request_file_from_s4(requested_file, file_data, &file_size) == 0) {
-                // First send success message to client
-                send(client_fd, "DOWNLOAD_SUCCESS", 16, 0);
-                // Then send the actual file data
-                send(client_fd, file_data, file_size, 0);
-                printf("[S1] ZIP file retrieved from S4 and sent to client\n");
-            } else {
-                send(client_fd, "DOWNLOAD_FAILED:FILE_NOT_FOUND_ON_S4", 35, 0);
-            }
-            continue;
+        if (c->ranged) {
+            snprintf(request, sizeof(request), "%s\n%llu %llu", node_path,
+                     (unsigned long long)c->range_offset, (unsigned long long)c->range_length);
+        } else {
+            snprintf(request, sizeof(request), "%s", node_path);
+        }
+        c->backend.relay = 1;
+        if (node_unix) {
+            // The node hands over the open file; there is nothing to share
+            c->backend.req_flags = PROTO_F_FD;
+            return backend_request(s, node, PROTO_DOWNLOAD, request, NULL, download_answered);
         }
+        return flight_request(s, node, PROTO_DOWNLOAD, request, download_answered);
     }
 
-    FILE *fp = fopen(expanded_path, "rb");
-    if (!fp) {
+    c->fp = fopen(c->filepath, "rb");
+    if (!c->fp) {
         perror("[S1] Requested file not found");
-        send(client_fd, "DOWNLOAD_FAILED", 15, 0);
-        continue;
+        return command_reply(s, PROTO_ERROR, "DOWNLOAD_FAILED");
     }
 
-    printf("[S1] Sending file to client: %s\n", expanded_path);
-    char buffer[BUFFER_SIZE];
-    int bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-        send(client_fd, buffer, bytes_read, 0);
+    printf("[S1] Sending file to client: %s\n", c->filepath);
+    return c->ranged ? send_local_range(s) : send_local_file(s);
+}
+
+// File contents are piped to the client as they arrive from the node, so
+// any size downloads with one chunk of memory per session. An error reply is
+// collected instead and reported in S1's own words.
+int download_answered(struct session *s) {
+    struct command *c = s->cmd;
+    if (!c->backend.failed && c->backend.reply.type == PROTO_DATA &&
+        (c->backend.reply.flags & PROTO_F_FD)) {
+        return download_passed(s);
+    }
+    if (!c->backend.failed && c->backend.reply.type == PROTO_DATA) {
+        if (c->key[0] && !c->ranged && !(c->backend.reply.flags & PROTO_F_MORE)) {
+            metacache_seen(&metadata, c->key, node_index(c->backend.node), c->backend.reply.length, 0);
+            // Small files are kept for the object cache as they pass through
+            c->cache_fill = objects.shards && c->backend.reply.length <= OBJECT_MAX;
+        }
+        return backend_start_relay(s, download_relayed);
     }
-    fclose(fp);
-    continue;
+    if (!c->backend.failed) {
+        c->data_limit = 64;
+        return backend_collect(s, download_failed);
+    }
+    return download_failed(s);
+}
+
+// The node passed the open file over its Unix socket. S1 sends it to the
+// client itself, with sendfile, so its bytes are never copied through either
+// process.
+int download_passed(struct session *s) {
+    struct command *c = s->cmd;
+    struct backend *b = &c->backend;
+    const struct storage_node *node = b->node;
+    struct stat st;
+    if (b->passed_fd == -1 || b->reply.length != 0 || fstat(b->passed_fd, &st) == -1) {
+        fprintf(stderr, "[S1] %s passed no usable file for %s\n", node->name, c->path);
+        return STEP_CLOSE;
+    }
+    backend_release(s);
+    c->fp = fdopen(b->passed_fd, "rb");
+    if (!c->fp) return STEP_CLOSE;
+    b->passed_fd = -1;
+
+    if (c->key[0]) {
+        metacache_seen(&metadata, c->key, node_index(node), st.st_size, st.st_mtime);
+        // Small files are read in for the object cache and sent from there
+        if (!c->ranged && objects.shards && st.st_size <= OBJECT_MAX) {
+            c->data = malloc(st.st_size ? st.st_size : 1);
+            if (c->data && pread(fileno(c->fp), c->data, st.st_size, 0) == st.st_size) {
+                objcache_put(&objects, c->key, c->data, st.st_size, c->cache_epoch);
+                if (queue_frame(&s->out, PROTO_DATA, 0, s->req_id, c->data, st.st_size) == -1) return STEP_CLOSE;
+                printf("[S1] %s file passed by %s and sent to client\n", node->ext, node->name);
+                return command_done(s);
+            }
+        }
+    }
+    printf("[S1] %s file passed by %s, sending to client\n", node->ext, node->name);
+    return c->ranged ? send_local_range(s) : send_local_file(s);
+}
+
+int download_relayed(struct session *s) {
+    struct command *c = s->cmd;
+    const struct storage_node *node = c->backend.node;
+    printf("[S1] %s file retrieved from %s and sent to client\n", node->ext, node->name);
+    if (c->cache_fill && c->data_len == c->backend.reply.length) {
+        objcache_put(&objects, c->key, c->data, c->data_len, c->cache_epoch);
+    }
+    return command_done(s);
+}
+
+// Queue the file from the object cache if it is there. Returns 1 if it was,
+// 0 on a miss and -1 if the reply could not be queued.
+int download_cached(struct session *s) {
+    struct command *c = s->cmd;
+    struct objcache_obj *obj = objcache_get(&objects, c->key);
+    if (!obj) return 0;
+    const char *data = objcache_data(obj);
+    size_t size = objcache_size(obj);
+    int ret;
+    if (!c->ranged) {
+        ret = queue_frame(&s->out, PROTO_DATA, 0, s->req_id, data, size);
+    } else if (c->range_offset > size) {
+        // Left for the node to reject
+        objcache_release(obj);
+        return 0;
+    } else {
+        size_t len = size - c->range_offset;
+        if (c->range_length > 0 && c->range_length < len) len = c->range_length;
+        ret = queue_range(&s->out, s->req_id, size, len);
+        if (ret == 0 && len > 0) ret = buf_append(&s->out, data + c->range_offset, len);
+    }
+    objcache_release(obj);
+    if (ret == -1) return -1;
+    printf("[S1] Sending cached file to client: %s\n", c->filepath);
+    return 1;
+}
+
+int download_failed(struct session *s) {
+    struct command *c = s->cmd;
+    if (!c->backend.failed) {
+        if (c->data_len == 13 && memcmp(c->data, "INVALID_RANGE", 13) == 0) {
+            return command_reply(s, PROTO_ERROR, "DOWNLOAD_FAILED:INVALID_RANGE");
+        }
+        if (c->key[0]) metacache_drop(&metadata, c->key);
+    }
+    return download_not_found(s, c->backend.node);
+}
+
+int download_not_found(struct session *s, const struct storage_node *node) {
+    char response[64];
+    snprintf(response, sizeof(response), "DOWNLOAD_FAILED:FILE_NOT_FOUND_ON_%s", node->name);
+    return command_reply(s, PROTO_ERROR, response);
 }
+
 // ===== REMOVE COMMAND =====
-else if (strncmp(command, "removef ", 8) == 0) {
-    char filepath[MAX_PATH];
-    sscanf(command + 8, "%s", filepath);
 
-    char expanded_path[MAX_PATH];
-    expand_path(filepath, expanded_path, sizeof(expanded_path));
+int start_remove(struct session *s) {
+    struct command *c = s->cmd;
+    sscanf(s->command_buf, "%511s", c->path);
+    expand_path(c->path, c->filepath, sizeof(c->filepath));
 
     // Check file extension
-    char *ext = strrchr(filepath, '.');
-    if (ext != NULL) {
-        if (strcmp(ext, ".c") == 0) {
-            // Handle .c file - delete locally
-            if (remove(expanded_path) == 0) {
-                printf("[S1] Deleted .c file: %s\n", expanded_path);
-                send(client_fd, "REMOVE_SUCCESS", 14, 0);
-            } else {
-                perror("[S1] Failed to delete .c file");
-                send(client_fd, "REMOVE_FAILED", 13, 0);
-            }
+    char *ext = strrchr(c->path, '.');
+    const struct storage_node *node = node_for_ext(ext);
+    if (ext == NULL) {
+        return command_reply(s, PROTO_ERROR, "REMOVE_FAILED:NO_EXTENSION");
+    }
+    if (strcmp(ext, ".c") == 0) {
+        // Handle .c file - delete locally
+        if (remove(c->filepath) == 0) {
+            printf("[S1] Deleted .c file: %s\n", c->filepath);
+            nsindex_update(&local_files, c->filepath);
+            return command_reply(s, PROTO_OK, "REMOVE_SUCCESS");
         }
-        else if (strcmp(ext, ".pdf") == 0) {
-            // Handle PDF file - request S2 to delete
-            if (request_remove_from_s2(filepath) == 0) {
-                printf("[S1] Requested S2 to delete PDF: %s\n", expanded_path);
-                send(client_fd, "REMOVE_SUCCESS", 14, 0);
-            } else {
-                printf("[S1] Failed to delete PDF via S2\n");
-                send(client_fd, "REMOVE_FAILED", 13, 0);
-            }
-        }
-        else if (strcmp(ext, ".txt") == 0) {
-            // Handle TXT file - request S3 to delete
-            if (request_remove_from_s3(filepath) == 0) {
-                printf("[S1] Requested S3 to delete TXT: %s\n", expanded_path);
-                send(client_fd, "REMOVE_SUCCESS", 14, 0);
-            } else {
-                printf("[S1] Failed to delete TXT via S3\n");
-                send(client_fd, "REMOVE_FAILED", 13, 0);
-            }
+        perror("[S1] Failed to delete .c file");
+        return command_reply(s, PROTO_ERROR, "REMOVE_FAILED");
+    }
+    if (node == NULL) {
+        return command_reply(s, PROTO_ERROR, "REMOVE_FAILED:INVALID_FILE_TYPE");
+    }
+
+    // Handle PDF/TXT/ZIP file - request the storage node to delete
+    char node_path[MAX_PATH];
+    map_to_node_path(c->path, node, node_path, sizeof(node_path));
+    if (cache_key(node, node_path, c->key, sizeof(c->key)) == 0 &&
+        metacache_absent(&metadata, node_index(node), c->key)) {
+        printf("[S1] %s is not on %s\n", c->filepath, node->name);
+        return command_reply(s, PROTO_ERROR, "REMOVE_FAILED");
+    }
+    if (c->key[0]) objcache_drop(&objects, c->key);
+    c->data_limit = 64;
+    return backend_request(s, node, PROTO_REMOVE, node_path, NULL, remove_answered);
+}
+
+int remove_answered(struct session *s) {
+    struct command *c = s->cmd;
+    const struct storage_node *node = c->backend.node;
+    // Either way the file is no longer on the node
+    if (!c->backend.failed && c->key[0]) {
+        metacache_drop(&metadata, c->key);
+        objcache_drop(&objects, c->key);
+    }
+    if (!c->backend.failed && c->backend.reply.type == PROTO_OK) {
+        printf("[S1] Requested %s to delete %s\n", node->name, c->filepath);
+        return command_reply(s, PROTO_OK, "REMOVE_SUCCESS");
+    }
+    printf("[S1] Failed to delete %s via %s\n", node->ext, node->name);
+    return command_reply(s, PROTO_ERROR, "REMOVE_FAILED");
+}
+
+// ===== DOWNLOAD TAR COMMAND =====
+
+int start_tar(struct session *s) {
+    struct command *c = s->cmd;
+    char filetype[10] = "";
+    sscanf(s->command_buf, "%9s", filetype);
+
+    if (strcmp(filetype, ".pdf") == 0 || strcmp(filetype, ".txt") == 0) {
+        // S2 builds the PDF archive, S3 the TXT one; relay whatever it sends
+        c->backend.relay = 1;
+        return flight_request(s, node_for_ext(filetype), PROTO_TAR, filetype, tar_answered);
+    }
+    if (strcmp(filetype, ".c") != 0) {
+        return command_reply(s, PROTO_ERROR, "TAR_FAILED:UNSUPPORTED_TYPE");
+    }
+
+    // Archive every .c file under ~/s1 as it is sent; each member is one
+    // DATA frame, so the first bytes go out without waiting for the rest
+    char root[MAX_PATH];
+    expand_path("~s1", root, sizeof(root));
+    if (tar_collect(&c->tar, root, ".c") == -1) {
+        perror("[S1] Failed to collect .c files");
+        return command_reply(s, PROTO_ERROR, "TAR_FAILED:TAR_CREATE");
+    }
+    printf("[S1] Sending cfiles.tar (%zu files) to client\n", c->tar.count);
+    c->on_sent = tar_member_sent;
+    s->step = step_tar_member;
+    return STEP_NEXT;
+}
+
+// Queue the next member's frame header and tar header, then send its body
+// with step_send_file; after the last member, queue the end of the archive
+int step_tar_member(struct session *s) {
+    unsigned char header[TAR_HEADER_MAX];
+    struct command *c = s->cmd;
+
+    while (c->tar_next < c->tar.count) {
+        // Let the headers of a run of empty files drain before queuing more
+        if (buf_pending(&s->out)) return STEP_WAIT;
+
+        // Files removed since the walk are left out
+        const char *path = c->tar.paths[c->tar_next++];
+        snprintf(c->filepath, sizeof(c->filepath), "%s", path);
+        c->fp = fopen(path, "rb");
+        if (!c->fp) continue;
+        struct stat st;
+        if (fstat(fileno(c->fp), &st) == -1 || !S_ISREG(st.st_mode)) {
+            fclose(c->fp);
+            c->fp = NULL;
+            continue;
         }
-        else if (strcmp(ext, ".zip") == 0) {
-            // Handle PDF file - request S2 to delete
-            if (request_remove_from_s4(filepath) == 0) {
-                printf("[S4] Requested S4 to delete PDF: %s\n", expanded_path);
-                send(client_fd, "REMOVE_SUCCESS", 14, 0);
-            } else {
-                printf("[S4] Failed to delete PDF via S2\n");
-                send(client_fd, "REMOVE_FAILED", 13, 0);
-            }
+
+        size_t header_len = tar_header(header, path + c->tar.strip, &st);
+        uint64_t member = header_len + st.st_size + tar_padding(st.st_size);
+        if (queue_header(&s->out, PROTO_DATA, PROTO_F_MORE, s->req_id, member) == -1 ||
+            buf_append(&s->out, header, header_len) == -1) {
+            return STEP_CLOSE;
         }
-        else {
-            send(client_fd, "REMOVE_FAILED:INVALID_FILE_TYPE", 31, 0);
+        c->tar_written += member;
+        c->offset = 0;
+        c->remaining = st.st_size;
+        s->step = step_send_file;
+        return STEP_NEXT;
+    }
+
+    // More members may follow from the storage nodes
+    if (c->multi) return many_next(s);
+    return tar_finish(s);
+}
+
+// Queue the end of the archive after the members queued so far
+int tar_finish(struct session *s) {
+    unsigned char header[TAR_HEADER_MAX];
+    struct command *c = s->cmd;
+    uint64_t trailer = tar_trailer(c->tar_written);
+    if (queue_header(&s->out, PROTO_DATA, 0, s->req_id, trailer) == -1) return STEP_CLOSE;
+    memset(header, 0, sizeof(header));
+    while (trailer > 0) {
+        size_t n = trailer < sizeof(header) ? trailer : sizeof(header);
+        if (buf_append(&s->out, header, n) == -1) return STEP_CLOSE;
+        trailer -= n;
+    }
+    return command_done(s);
+}
+
+// Pad the body to a whole block and move on to the next member
+int tar_member_sent(struct session *s) {
+    static const unsigned char zeros[TAR_BLOCK];
+    struct command *c = s->cmd;
+    fclose(c->fp);
+    c->fp = NULL;
+    // The body was sent from offset 0, so offset is its size
+    if (buf_append(&s->out, zeros, tar_padding(c->offset)) == -1) return STEP_CLOSE;
+    s->step = step_tar_member;
+    return STEP_NEXT;
+}
+
+int tar_answered(struct session *s) {
+    struct command *c = s->cmd;
+    if (c->backend.failed) {
+        char response[64];
+        snprintf(response, sizeof(response), "TAR_FAILED:%s_%s", c->backend.node->name,
+                 c->backend.connect_failed ? "CONNECTION" : "REQUEST");
+        return command_reply(s, PROTO_ERROR, response);
+    }
+    return backend_start_relay(s, tar_relayed);
+}
+
+int tar_relayed(struct session *s) {
+    printf("[S1] %s tar forwarded successfully\n", s->cmd->backend.node->ext);
+    return command_done(s);
+}
+
+// ===== SEVERAL FILES AT ONCE =====
+
+int start_many(struct session *s) {
+    struct command *c = s->cmd;
+    struct multi *m = c->multi = calloc(1, sizeof(*m));
+    if (!m) return STEP_CLOSE;
+
+    // Paths that can go nowhere are reported (removef) or left out (downlf)
+    // before anything else happens
+    struct buf report = {0};
+    char *save;
+    for (char *path = strtok_r(s->command_buf, "\n", &save); path; path = strtok_r(NULL, "\n", &save)) {
+        const char *error = many_route(m, path);
+        if (!error) continue;
+        printf("[S1] Leaving out %s: %s\n", path, error);
+        if (s->hdr.type != PROTO_REMOVE_MANY) continue;
+        char line[BUFFER_SIZE + 64];
+        int n = snprintf(line, sizeof(line), "REMOVE_FAILED:%s %s\n", error, path);
+        if (buf_append(&report, line, n) == -1) {
+            buf_free(&report);
+            return STEP_CLOSE;
         }
-    } else {
-        send(client_fd, "REMOVE_FAILED:NO_EXTENSION", 27, 0);
     }
-    continue;
+    int ret = 0;
+    if (report.len > 0) {
+        ret = queue_frame(&s->out, PROTO_DATA, PROTO_F_MORE, s->req_id, report.data, report.len);
+    }
+    buf_free(&report);
+    if (ret == -1) return STEP_CLOSE;
+    return many_next(s);
 }
-// ===== DOWNLOAD TAR COMMAND =====
 
-else if (strncmp(command, "downltar ", 9) == 0) {
-    char filetype[10];
-    sscanf(command + 9, "%s", filetype);
-    
-    if (strcmp(filetype, ".c") == 0) {
-        // Get the home directory
-        const char *home = getenv("HOME");
-        if (!home) {
-            perror("[S1] HOME environment variable not set");
-            send(client_fd, "TAR_FAILED:NO_HOME", 18, 0);
-            continue;
+// Add path to the list of every place its files can be. Returns why there
+// is none, NULL if there is one.
+const char *many_route(struct multi *m, const char *path) {
+    if (strncmp(path, "~s1/", 4) != 0) return "INVALID_PATH";
+    const char *base = strrchr(path, '/') + 1;
+    const char *ext = strrchr(base, '.');
+
+    int first = 0, last = NUM_NODES;
+    if (ext && !strpbrk(ext, "*?[\\")) {
+        const struct storage_node *node = node_for_ext(ext);
+        if (strcmp(ext, ".c") == 0) {
+            last = 0;
+        } else if (node) {
+            first = last = node_index(node) + 1;
+        } else {
+            return "INVALID_FILE_TYPE";
         }
+    } else if (!strpbrk(base, "*?[\\")) {
+        return "NO_EXTENSION";
+    }
 
-        // Create a temporary tar file
-        char tar_path[] = "/tmp/cfiles_XXXXXX.tar";
-        int fd = mkstemps(tar_path, 4); // Creates unique temp file with .tar extension
-        if (fd < 0) {
-            perror("[S1] Failed to create temp tar file");
-            send(client_fd, "TAR_FAILED:TEMP_FILE", 20, 0);
-            continue;
+    for (int i = first; i <= last; i++) {
+        char mapped[BUFFER_SIZE];
+        if (i == 0) {
+            snprintf(mapped, sizeof(mapped), "%s", path);
+        } else {
+            map_to_node_path(path, &storage_nodes[i - 1], mapped, sizeof(mapped));
         }
-        close(fd); // We'll use the path with system() commands
-
-        // Build the find and tar command
-        char cmd[1024];
-        snprintf(cmd, sizeof(cmd),
-            "find %s/s1 -type f -name \"*.c\" -print0 | "
-            "tar -cf %s --null -T - 2>/dev/null",
-            home, tar_path);
-
-        // Execute the command
-        int ret = system(cmd);
-        if (ret != 0) {
-            perror("[S1] Failed to create tar file");
-            unlink(tar_path); // Clean up
-            send(client_fd, "TAR_FAILED:TAR_CREATE", 22, 0);
-            continue;
+        // The paths all came in one request, so they fit in one again
+        size_t len = strlen(m->paths[i]);
+        snprintf(m->paths[i] + len, sizeof(m->paths[i]) - len, "%s\n", mapped);
+    }
+    return NULL;
+}
+
+// Ask the next place that has paths to look for; after the last one, end
+// the reply
+int many_next(struct session *s) {
+    struct command *c = s->cmd;
+    struct multi *m = c->multi;
+    while (m->next <= NUM_NODES && m->paths[m->next][0] == '\0') m->next++;
+    if (m->next > NUM_NODES) {
+        if (s->hdr.type == PROTO_REMOVE_MANY) return command_reply(s, PROTO_DATA, "");
+        return tar_finish(s);
+    }
+
+    int i = m->next++;
+    if (i == 0) {
+        return s->hdr.type == PROTO_REMOVE_MANY ? remove_many_local(s) : download_many_local(s);
+    }
+    const struct storage_node *node = &storage_nodes[i - 1];
+    printf("[S1] Sending the %s paths to %s in one request\n", node->ext, node->name);
+    c->backend.relay = 1;
+    c->data_len = 0;
+    return backend_request(s, node, s->hdr.type, m->paths[i], NULL, many_answered);
+}
+
+int many_answered(struct session *s) {
+    struct command *c = s->cmd;
+    struct backend *b = &c->backend;
+    if (!b->failed && b->reply.type == PROTO_DATA) {
+        if (s->hdr.type == PROTO_REMOVE_MANY) {
+            c->remaining = b->reply.length;
+            c->flags = b->reply.flags;
+            s->step = step_remove_report;
+            return STEP_NEXT;
         }
+        if (many_frame(s, &b->reply) == -1) return STEP_CLOSE;
+        s->step = step_many_relay;
+        return STEP_NEXT;
+    }
+    if (!b->failed) {
+        c->data_limit = 64;
+        return backend_collect(s, many_failed);
+    }
+    return many_failed(s);
+}
 
-        // Open and send the tar file
-        FILE *fp = fopen(tar_path, "rb");
-        if (!fp) {
-            perror("[S1] Failed to open tar file");
-            unlink(tar_path);
-            send(client_fd, "TAR_FAILED:FILE_OPEN", 21, 0);
-            continue;
+// The node could not be asked; the others still are
+int many_failed(struct session *s) {
+    struct command *c = s->cmd;
+    const struct storage_node *node = c->backend.node;
+    int i = node_index(node) + 1;
+    fprintf(stderr, "[S1] %s could not act on its files\n", node->name);
+    c->data_len = 0;
+    if (s->hdr.type != PROTO_REMOVE_MANY) return many_next(s);
+
+    struct buf report = {0};
+    char *save;
+    for (char *path = strtok_r(c->multi->paths[i], "\n", &save); path; path = strtok_r(NULL, "\n", &save)) {
+        char line[BUFFER_SIZE + 64];
+        int n = snprintf(line, sizeof(line), "REMOVE_FAILED:%s_UNAVAILABLE ~s1%s\n", node->name,
+                         path + strlen(node->tag));
+        if (buf_append(&report, line, n) == -1) {
+            buf_free(&report);
+            return STEP_CLOSE;
         }
+    }
+    int ret = queue_frame(&s->out, PROTO_DATA, PROTO_F_MORE, s->req_id, report.data, report.len);
+    buf_free(&report);
+    if (ret == -1) return STEP_CLOSE;
+    return many_next(s);
+}
 
-        // First send the actual tar file
-        char buffer[BUFFER_SIZE];
-        size_t bytes_read;
-        while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-            if (send(client_fd, buffer, bytes_read, 0) < 0) {
-                perror("[S1] Error sending tar file");
-                break;
+// Start passing on a frame of a node's archive. Its members go to the client
+// as they are; its end of archive is read but left out, as more members may
+// follow from the next place.
+int many_frame(struct session *s, const struct proto_header *hdr) {
+    struct command *c = s->cmd;
+    c->remaining = hdr->length;
+    c->flags = hdr->flags;
+    if (!(hdr->flags & PROTO_F_MORE)) return 0;
+    c->tar_written += hdr->length;
+    return queue_header(&s->out, PROTO_DATA, PROTO_F_MORE, s->req_id, hdr->length);
+}
+
+int step_many_relay(struct session *s) {
+    char chunk[IO_CHUNK];
+    struct command *c = s->cmd;
+    struct backend *b = &c->backend;
+
+    while (1) {
+        if (buf_pending(&s->out)) return STEP_WAIT;
+
+        // Between members, or in the end of the archive, the node can go
+        // without leaving a member cut short
+        int whole = c->remaining == 0 || !(c->flags & PROTO_F_MORE);
+        if (c->remaining == 0) {
+            if (!(c->flags & PROTO_F_MORE)) break;
+
+            int ret = recv_fill(b->fd, b->hdr_buf, PROTO_HEADER_SIZE, &b->hdr_len);
+            if (ret == 0) return STEP_WAIT;
+            struct proto_header hdr;
+            b->hdr_len = 0;
+            if (ret == -1 || proto_decode_header(b->hdr_buf, &hdr) == -1 || hdr.type != PROTO_DATA) {
+                fprintf(stderr, "[S1] Archive from %s broke off\n", b->node->name);
+                backend_discard(s);
+                return many_next(s);
             }
-        }
-        fclose(fp);
-        unlink(tar_path); // Clean up temp file
-
-        shutdown(client_fd, SHUT_WR); // Signal end of transfer
-        printf("[S1] Sent cfiles.tar to client\n");
-    }
-    else if (strcmp(filetype, ".pdf") == 0) {
-        // Connect to S2 for PDF files
-        int s2_fd = socket(AF_INET, SOCK_STREAM, 0);
-        struct sockaddr_in s2_addr;
-        memset(&s2_addr, 0, sizeof(s2_addr));
-        s2_addr.sin_family = AF_INET;
-        s2_addr.sin_port = htons(S2_PORT);
-        inet_pton(AF_INET, "127.0.0.1", &s2_addr.sin_addr);
-    
-        if (connect(s2_fd, (struct sockaddr *)&s2_addr, sizeof(s2_addr)) == -1) {
-            perror("[S1] Connection to S2 failed");
-            send(client_fd, "TAR_FAILED:S2_CONNECTION", 24, 0);
+            if (many_frame(s, &hdr) == -1) return STEP_CLOSE;
             continue;
         }
-    
-        // Send PDF tar request with explicit filename
-        if (send(s2_fd, "TAR_PDF:pdfiles.tar", 19, 0) == -1) {
-            perror("[S1] Failed to send request to S2");
-            close(s2_fd);
-            send(client_fd, "TAR_FAILED:S2_REQUEST", 22, 0);
-            continue;
+
+        size_t want = c->remaining < sizeof(chunk) ? c->remaining : sizeof(chunk);
+        ssize_t n = recv_nb(b->fd, chunk, want);
+        if (n == -1) {
+            fprintf(stderr, "[S1] Archive from %s broke off\n", b->node->name);
+            if (!whole) return STEP_CLOSE;
+            backend_discard(s);
+            return many_next(s);
         }
-    
-        // Forward the tar file to client
-        char buffer[BUFFER_SIZE];
-        int bytes_received;
-        while ((bytes_received = recv(s2_fd, buffer, sizeof(buffer), 0)) > 0) {
-            if (send(client_fd, buffer, bytes_received, 0) == -1) {
-                perror("[S1] Error forwarding PDF tar");
-                break;
+        if (n == 0) return STEP_WAIT;
+        if ((c->flags & PROTO_F_MORE) && buf_append(&s->out, chunk, n) == -1) return STEP_CLOSE;
+        c->remaining -= n;
+    }
+
+    printf("[S1] %s files retrieved from %s\n", b->node->ext, b->node->name);
+    backend_release(s);
+    return many_next(s);
+}
+
+// Pass a node's removal report on to the client a frame at a time, with the
+// paths in S1's namespace
+int step_remove_report(struct session *s) {
+    char chunk[IO_CHUNK];
+    struct command *c = s->cmd;
+    struct backend *b = &c->backend;
+
+    while (1) {
+        if (buf_pending(&s->out)) return STEP_WAIT;
+
+        if (c->remaining == 0) {
+            // Frames hold whole lines
+            if (c->data_len > 0 && remove_report_lines(s) == -1) return STEP_CLOSE;
+            if (!(c->flags & PROTO_F_MORE)) break;
+
+            int ret = recv_fill(b->fd, b->hdr_buf, PROTO_HEADER_SIZE, &b->hdr_len);
+            if (ret == 0) return STEP_WAIT;
+            struct proto_header hdr;
+            b->hdr_len = 0;
+            if (ret == -1 || proto_decode_header(b->hdr_buf, &hdr) == -1 || hdr.type != PROTO_DATA) {
+                fprintf(stderr, "[S1] Removal report from %s broke off\n", b->node->name);
+                backend_discard(s);
+                return many_next(s);
             }
-        }
-    
-        close(s2_fd);
-        shutdown(client_fd, SHUT_WR); // Signal end of transfer
-        printf("[S1] PDF tar (pdfiles.tar) forwarded successfully\n");
-    }
-    else if (strcmp(filetype, ".txt") == 0) {
-        // Connect to S3 for TXT files
-        int s3_fd = socket(AF_INET, SOCK_STREAM, 0);
-        struct sockaddr_in s3_addr;
-        memset(&s3_addr, 0, sizeof(s3_addr));
-        s3_addr.sin_family = AF_INET;
-        s3_addr.sin_port = htons(S3_PORT);
-        inet_pton(AF_INET, "127.0.0.1", &s3_addr.sin_addr);
-    
-        if (connect(s3_fd, (struct sockaddr *)&s3_addr, sizeof(s3_addr)) == -1) {
-            perror("[S1] Connection to S3 failed");
-            send(client_fd, "TAR_FAILED:S3_CONNECTION", 24, 0);
+            c->remaining = hdr.length;
+            c->flags = hdr.flags;
             continue;
         }
-    
-        // Send TXT tar request with explicit filename
-        if (send(s3_fd, "TAR_TXT:txtfiles.tar", 20, 0) == -1) {
-            perror("[S1] Failed to send request to S3");
-            close(s3_fd);
-            send(client_fd, "TAR_FAILED:S3_REQUEST", 22, 0);
-            continue;
+
+        size_t want = c->remaining < sizeof(chunk) ? c->remaining : sizeof(chunk);
+        ssize_t n = recv_nb(b->fd, chunk, want);
+        if (n == -1) {
+            fprintf(stderr, "[S1] Removal report from %s broke off\n", b->node->name);
+            backend_discard(s);
+            return many_next(s);
         }
-    
-        // Forward the tar file to client
-        char buffer[BUFFER_SIZE];
-        int bytes_received;
-        while ((bytes_received = recv(s3_fd, buffer, sizeof(buffer), 0)) > 0) {
-            if (send(client_fd, buffer, bytes_received, 0) == -1) {
-                perror("[S1] Error forwarding TXT tar");
-                break;
+        if (n == 0) return STEP_WAIT;
+        if (relay_keep(c, chunk, n) == -1) return STEP_CLOSE;
+        c->remaining -= n;
+    }
+
+    printf("[S1] Requested %s to delete its %s files\n", b->node->name, b->node->ext);
+    backend_release(s);
+    return many_next(s);
+}
+
+// Queue the report lines in c->data for the client, forgetting each file
+// they name
+int remove_report_lines(struct session *s) {
+    struct command *c = s->cmd;
+    const struct storage_node *node = c->backend.node;
+    size_t tag_len = strlen(node->tag);
+    struct buf lines = {0};
+    int ret = 0;
+
+    char *p = c->data, *end = c->data + c->data_len;
+    while (p < end && ret == 0) {
+        char *newline = memchr(p, '\n', end - p);
+        if (!newline) break;
+        *newline = '\0';
+        char *path = strchr(p, ' ');
+        if (path && strncmp(path + 1, node->tag, tag_len) == 0) {
+            char key[MAX_PATH], line[BUFFER_SIZE + 64];
+            if (cache_key(node, path + 1, key, sizeof(key)) == 0) {
+                metacache_drop(&metadata, key);
+                objcache_drop(&objects, key);
             }
+            int n = snprintf(line, sizeof(line), "%.*s ~s1%s\n", (int)(path - p), p, path + 1 + tag_len);
+            ret = buf_append(&lines, line, n);
         }
-    
-        close(s3_fd);
-        shutdown(client_fd, SHUT_WR); // Signal end of transfer
-        printf("[S1] TXT tar (txtfiles.tar) forwarded successfully\n");
+        p = newline + 1;
     }
-    else {
-        send(client_fd, "TAR_FAILED:UNSUPPORTED_TYPE", 28, 0);
+    if (ret == 0 && lines.len > 0) {
+        ret = queue_frame(&s->out, PROTO_DATA, PROTO_F_MORE, s->req_id, lines.data, lines.len);
     }
+    buf_free(&lines);
+    c->data_len = 0;
+    return ret;
 }
 
-// ===== DISPLAY FILENAMES COMMAND =====
-else if (strncmp(command, "dispfnames ", 11) == 0) {
+int add_local_match(const struct nsindex_entry *entry, void *arg) {
+    struct local_match *m = arg;
     char path[MAX_PATH];
-    sscanf(command + 11, "%s", path);
-    
-    char all_files[BUFFER_SIZE * 10] = {0};
-    size_t total_size = 0;
+    snprintf(path, sizeof(path), "%s/%s", m->root, entry->path);
+    if (tar_list_add(m->list, path) == -1) {
+        m->failed = 1;
+        return 1;
+    }
+    return 0;
+}
 
-    // 1. Get .c files from S1
-    char s1_files[BUFFER_SIZE] = {0};
-    size_t s1_size = 0;
-    if (get_local_c_files(path, s1_files, &s1_size) == 0) {
-        // Just copy the filenames without s1/ prefix
-        strncat(all_files, s1_files, sizeof(all_files) - total_size - 1);
-        total_size += s1_size;
+// Add S1's own files matching the paths (one per line, under ~s1) to list
+int collect_local(struct tar_list *list, const char *root, const char *paths) {
+    char copy[BUFFER_SIZE], *save;
+    snprintf(copy, sizeof(copy), "%s", paths);
+    for (char *path = strtok_r(copy, "\n", &save); path; path = strtok_r(NULL, "\n", &save)) {
+        char pattern[MAX_PATH];
+        if (nsindex_pattern(path + 3, pattern, sizeof(pattern)) == -1) continue;
+        struct local_match m = { list, root, 0 };
+        nsindex_match(&local_files, pattern, add_local_match, &m);
+        if (m.failed) return -1;
+    }
+    tar_list_sort(list);
+    return 0;
+}
+
+int remove_many_local(struct session *s) {
+    struct command *c = s->cmd;
+    char root[MAX_PATH];
+    expand_path("~s1", root, sizeof(root));
+    struct tar_list files = {0};
+    if (collect_local(&files, root, c->multi->paths[0]) == -1) {
+        tar_list_free(&files);
+        return STEP_CLOSE;
+    }
+
+    struct buf report = {0};
+    int ret = 0;
+    for (size_t i = 0; i < files.count && ret == 0; i++) {
+        const char *path = files.paths[i];
+        const char *status = "REMOVE_SUCCESS";
+        if (remove(path) == 0) {
+            printf("[S1] Deleted .c file: %s\n", path);
+            nsindex_update(&local_files, path);
+        } else {
+            perror("[S1] Failed to delete .c file");
+            status = "REMOVE_FAILED";
+        }
+        char line[BUFFER_SIZE + 64];
+        int n = snprintf(line, sizeof(line), "%s ~s1%s\n", status, path + strlen(root));
+        ret = buf_append(&report, line, n);
     }
+    if (ret == 0 && report.len > 0) {
+        ret = queue_frame(&s->out, PROTO_DATA, PROTO_F_MORE, s->req_id, report.data, report.len);
+    }
+    buf_free(&report);
+    tar_list_free(&files);
+    if (ret == -1) return STEP_CLOSE;
+    return many_next(s);
+}
+
+// Archive S1's own matching files as for downltar; the nodes' members follow
+int download_many_local(struct session *s) {
+    struct command *c = s->cmd;
+    char root[MAX_PATH];
+    expand_path("~s1", root, sizeof(root));
+    if (collect_local(&c->tar, root, c->multi->paths[0]) == -1) return STEP_CLOSE;
+    c->tar.strip = strlen(root) + 1;
+    printf("[S1] Sending %zu .c files to client\n", c->tar.count);
+    c->on_sent = tar_member_sent;
+    s->step = step_tar_member;
+    return STEP_NEXT;
+}
+
+// ===== DISPLAY FILENAMES COMMAND =====
+
+int start_list(struct session *s) {
+    struct command *c = s->cmd;
+    sscanf(s->command_buf, "%511s", c->path);
+    if (strncmp(c->path, "~s1", 3) != 0 || (c->path[3] != '/' && c->path[3] != '\0')) {
+        return command_reply(s, PROTO_ERROR, "LIST_FAILED:INVALID_PATH");
+    }
+
+    struct listing *l = c->listing = calloc(1, sizeof(*l));
+    if (!l) return STEP_CLOSE;
+    l->timer_fd = -1;
+    if (s->hdr.flags & PROTO_F_FRONT) l->format = s->hdr.flags & (PROTO_F_FRONT | PROTO_F_STAT);
+    nsindex_prefix(c->path + 3, l->prefix, sizeof(l->prefix));
+    for (int i = 0; i <= NUM_NODES; i++) {
+        l->streams[i].fd = -1;
+        // Sources are always read front-coded, and with sizes and times for
+        // the metadata cache
+        l->streams[i].flags = PROTO_F_FRONT | PROTO_F_STAT;
+    }
+
+    // 1. S1's own .c files are paged in from its index as the merge needs them
+    // 2-4. Ask S2, S3 and S4 for their .pdf, .txt and .zip files all at once
+    for (int i = 0; i < NUM_NODES; i++) {
+        struct list_stream *st = &l->streams[i + 1];
+        st->node = &storage_nodes[i];
+        if (list_stream_open(s, st) == -1) list_stream_fail(s, st, "no connection");
+    }
+
+    // Nodes that go quiet for longer than the deadline are left out of the
+    // list; the timer wakes the session when the earliest one is due
+    l->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = s };
+    if (l->timer_fd == -1 || epoll_ctl(s->reactor->epfd, EPOLL_CTL_ADD, l->timer_fd, &ev) == -1) {
+        // The deadline is then only checked when a node socket wakes us
+        perror("[S1] Listing deadline timer failed");
+        if (l->timer_fd != -1) close(l->timer_fd);
+        l->timer_fd = -1;
+    }
+
+    s->step = step_list_gather;
+    return STEP_NEXT;
+}
 
-    // 2. Get .pdf files from S2
-    char s2_files[BUFFER_SIZE] = {0};
-    size_t s2_size = 0;
-    if (request_file_list_from_s2(path, s2_files, &s2_size) == 0) {
-        // Just copy the filenames without s2/ prefix
-        strncat(all_files, s2_files, sizeof(all_files) - total_size - 1);
-        total_size += s2_size;
+// Push the stream's deadline list_deadline_ms into the future
+void list_stream_touch(struct list_stream *st) {
+    clock_gettime(CLOCK_MONOTONIC, &st->deadline);
+    st->deadline.tv_sec += list_deadline_ms / 1000;
+    st->deadline.tv_nsec += (list_deadline_ms % 1000) * 1000000L;
+    if (st->deadline.tv_nsec >= 1000000000L) {
+        st->deadline.tv_sec++;
+        st->deadline.tv_nsec -= 1000000000L;
     }
+}
+
+// Connect to the stream's node and queue its LIST request, continuing after
+// the last entry merged. Anything received past that is dropped and sent again.
+int list_stream_open(struct session *s, struct list_stream *st) {
+    char node_path[MAX_PATH], request[MAX_PATH + PATH_MAX];
+    map_to_node_path(s->cmd->path, st->node, node_path, sizeof(node_path));
+    int len = snprintf(request, sizeof(request), st->cursor[0] ? "%s\n%s" : "%s",
+                       node_path, st->cursor);
+
+    st->fd = node_conn_open(s, st->node, &st->reused);
+    if (st->fd == -1) return -1;
+    st->out.off = st->out.len = 0;
+    st->lines.off = st->lines.len = 0;
+    st->head_len = 0;
+    st->hdr_len = 0;
+    st->remaining = 0;
+    uint16_t format = st->flags & (PROTO_F_FRONT | PROTO_F_STAT);
+    st->flags = format | PROTO_F_MORE;
+    list_stream_touch(st);
+    return queue_frame(&st->out, PROTO_LIST, format, next_node_req_id++, request, len);
+}
+
+// Read the stream's entries as far as the socket (or for S1's own files, the
+// index) allows. Reading pauses while LIST_STREAM_MAX bytes wait to be merged,
+// which holds the node back through TCP flow control.
+void list_stream_run(struct session *s, struct list_stream *st) {
+    char chunk[IO_CHUNK];
+    while (!st->done) {
+        if (st->lines.len - st->lines.off >= LIST_STREAM_MAX) {
+            // Waiting on the merge, not on the node
+            list_stream_touch(st);
+            return;
+        }
+
+        if (st->node == NULL) {
+            size_t n = nsindex_page(&local_files, s->cmd->listing->prefix, st->page_cursor,
+                                    sizeof(st->page_cursor), st->flags, chunk, sizeof(chunk));
+            if (n == 0) {
+                st->done = 1;
+            } else if (buf_append(&st->lines, chunk, n) == -1) {
+                list_stream_fail(s, st, "out of memory");
+            }
+            continue;
+        }
+
+        int ret = buf_flush(st->fd, &st->out);
+        if (ret == 0) return;
 
-    // 3. Get .txt files from S3
-    char s3_files[BUFFER_SIZE] = {0};
-    size_t s3_size = 0;
-    if (request_file_list_from_s3(path, s3_files, &s3_size) == 0) {
-        // Just copy the filenames without s3/ prefix
-        strncat(all_files, s3_files, sizeof(all_files) - total_size - 1);
-        total_size += s3_size;
+        if (ret == 1 && st->remaining == 0) {
+            if (!(st->flags & PROTO_F_MORE)) {
+                // Whole reply read: the connection can serve the next request
+                node_conn_close(s, st->node, st->fd, 1);
+                st->fd = -1;
+                st->done = 1;
+                return;
+            }
+            ret = recv_fill(st->fd, st->hdr_buf, PROTO_HEADER_SIZE, &st->hdr_len);
+            if (ret == 0) return;
+            struct proto_header hdr;
+            if (ret == 1 && proto_decode_header(st->hdr_buf, &hdr) == 0 && hdr.type == PROTO_DATA) {
+                st->hdr_len = 0;
+                st->remaining = hdr.length;
+                st->flags = hdr.flags;
+                list_stream_touch(st);
+                continue;
+            }
+            if (ret == 1) {
+                list_stream_fail(s, st, "bad reply");
+                return;
+            }
+        } else if (ret == 1) {
+            size_t want = st->remaining < sizeof(chunk) ? st->remaining : sizeof(chunk);
+            ssize_t n = recv_nb(st->fd, chunk, want);
+            if (n == 0) return;
+            if (n > 0) {
+                if (buf_append(&st->lines, chunk, n) == -1) {
+                    list_stream_fail(s, st, "out of memory");
+                    return;
+                }
+                st->remaining -= n;
+                list_stream_touch(st);
+                continue;
+            }
+        }
+
+        // The connection failed. A pooled one may simply have been closed by
+        // the node since, so try once more on a fresh one, picking the listing
+        // up after the last entry merged.
+        if (st->reused && !st->retried) {
+            node_conn_close(s, st->node, st->fd, 0);
+            st->fd = -1;
+            st->retried = 1;
+            if (list_stream_open(s, st) == 0) continue;
+        }
+        list_stream_fail(s, st, strerror(errno));
     }
+}
 
-    // 4. Get .zip files from S4
-    char s4_files[BUFFER_SIZE] = {0};
-    size_t s4_size = 0;
-    if (request_file_list_from_s4(path, s4_files, &s4_size) == 0) {
-        // Just copy the filenames without s4/ prefix
-        strncat(all_files, s4_files, sizeof(all_files) - total_size - 1);
-        total_size += s4_size;
+// Stop reading from the stream's node; the whole entries it already sent are
+// still listed
+void list_stream_fail(struct session *s, struct list_stream *st, const char *reason) {
+    fprintf(stderr, "[S1] Listing from %s failed: %s\n", st->node ? st->node->name : "S1", reason);
+    if (st->fd != -1) {
+        node_conn_close(s, st->node, st->fd, 0);
+        st->fd = -1;
     }
+    st->done = 1;
+}
 
-    // Sort the combined list alphabetically by file type (.c first, then .pdf, etc.)
-    // This is already handled by the individual servers returning sorted lists
-    // and the order we concatenate them (.c first, then .pdf, etc.)
+// Decode the stream's next entry into st->head. Returns 1 if there is one, 0
+// if it has not fully arrived (or never will).
+int list_stream_head(struct session *s, struct list_stream *st) {
+    if (st->head_len > 0) return 1;
+    snprintf(st->head, sizeof(st->head), "%s", st->cursor);
+    int n = proto_entry_decode(st->lines.data + st->lines.off, st->lines.len - st->lines.off,
+                               st->flags, st->head, sizeof(st->head),
+                               &st->head_size, &st->head_mtime);
+    if (n == -1) {
+        if (!st->done) list_stream_fail(s, st, "bad listing entry");
+        st->lines.off = st->lines.len;
+        return 0;
+    }
+    st->head_len = n;
+    return n > 0;
+}
 
-    // Send the combined list to client
-    send(client_fd, all_files, total_size, 0);
+int timespec_passed(const struct timespec *now, const struct timespec *t) {
+    return now->tv_sec > t->tv_sec || (now->tv_sec == t->tv_sec && now->tv_nsec >= t->tv_nsec);
 }
 
-// ===== EXIT COMMAND =====
-else if (strcmp(command, "exit") == 0) {
-    send(client_fd, "GOODBYE", 7, 0);
-    break;
+int step_list_gather(struct session *s) {
+    struct listing *l = s->cmd->listing;
+
+    while (1) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (int i = 0; i <= NUM_NODES; i++) {
+            struct list_stream *st = &l->streams[i];
+            if (st->done) continue;
+            // A stream held back by the merge is waiting on S1, not its node
+            if (st->node && st->lines.len - st->lines.off < LIST_STREAM_MAX &&
+                timespec_passed(&now, &st->deadline)) {
+                list_stream_fail(s, st, "deadline passed");
+            } else {
+                list_stream_run(s, st);
+            }
+        }
+
+        int moved = 0;
+        int ret = list_merge(s, &moved);
+        if (ret == -1) return STEP_CLOSE;
+        if (ret == 1) return command_done(s);
+        // Streams held back by a full buffer can take more once lines have
+        // been merged out of them
+        if (!moved) break;
+    }
+
+    // Wake up when the first node still running reaches its deadline
+    if (l->timer_fd != -1) {
+        struct itimerspec its = {0};
+        for (int i = 1; i <= NUM_NODES; i++) {
+            struct list_stream *st = &l->streams[i];
+            if (st->done) continue;
+            if ((its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) ||
+                timespec_passed(&its.it_value, &st->deadline)) {
+                its.it_value = st->deadline;
+            }
+        }
+        timerfd_settime(l->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    }
+    return STEP_WAIT;
 }
-// ===== INVALID COMMAND =====
-else {
-    send(client_fd, "INVALID_COMMAND", 16, 0);
+
+// k-way merge of the sorted streams: pass on the smallest head entry for as
+// long as every stream still running has a whole entry to compare and the
+// client keeps up. The merged entries go to the client as DATA frames in the
+// format it asked for; *moved counts them. Returns 1 once every stream is
+// exhausted and the final frame is queued.
+int list_merge(struct session *s, int *moved) {
+    struct listing *l = s->cmd->listing;
+    struct buf merged = {0};
+    int finished = 0;
+
+    while (s->out.len - s->out.off + merged.len < LIST_STREAM_MAX) {
+        struct list_stream *min = NULL;
+        int blocked = 0;
+        for (int i = 0; i <= NUM_NODES; i++) {
+            struct list_stream *st = &l->streams[i];
+            if (!list_stream_head(s, st)) {
+                // A running stream's next entry could still sort first
+                if (!st->done) blocked = 1;
+                continue;
+            }
+            // Byte order, like the index and LC_ALL=C sort
+            if (min == NULL || strcmp(st->head, min->head) < 0) min = st;
+        }
+        if (blocked) break;
+        if (min == NULL) {
+            finished = 1;
+            break;
+        }
+
+        char entry[PATH_MAX + 4 * PROTO_VARINT_MAX];
+        size_t n = proto_entry_encode(entry, sizeof(entry), l->format, l->sent, min->head,
+                                      min->head_size, min->head_mtime);
+        if (buf_append(&merged, entry, n) == -1) {
+            buf_free(&merged);
+            return -1;
+        }
+        memcpy(l->sent, min->head, sizeof(l->sent));
+        memcpy(min->cursor, min->head, sizeof(min->cursor));
+        if (min->node) {
+            char key[2 * PATH_MAX];
+            snprintf(key, sizeof(key), "%s%s", l->prefix, min->head);
+            metacache_seen(&metadata, key, node_index(min->node), min->head_size, min->head_mtime);
+        }
+        min->lines.off += min->head_len;
+        min->head_len = 0;
+        (*moved)++;
+    }
+
+    int ret = 0;
+    if (merged.len > 0 || finished) {
+        uint16_t flags = l->format | (finished ? 0 : PROTO_F_MORE);
+        ret = queue_frame(&s->out, PROTO_DATA, flags, s->req_id,
+                          merged.len > 0 ? merged.data : "", merged.len);
+    }
+    buf_free(&merged);
+    if (ret == -1) return -1;
+    return finished;
 }
+
+void listing_free(struct session *s) {
+    struct listing *l = s->cmd->listing;
+    for (int i = 0; i <= NUM_NODES; i++) {
+        struct list_stream *st = &l->streams[i];
+        if (st->fd != -1) node_conn_close(s, st->node, st->fd, 0);
+        buf_free(&st->out);
+        buf_free(&st->lines);
+    }
+    if (l->timer_fd != -1) {
+        epoll_ctl(s->reactor->epfd, EPOLL_CTL_DEL, l->timer_fd, NULL);
+        close(l->timer_fd);
     }
+    free(l);
+    s->cmd->listing = NULL;
+}
+
+// ===== CACHE STATS COMMAND =====
+
+int start_stats(struct session *s) {
+    struct objcache_stats st;
+    objcache_stats(&objects, &st);
+    char response[BUFFER_SIZE];
+    snprintf(response, sizeof(response),
+             "hits=%llu misses=%llu inserts=%llu rejects=%llu evictions=%llu invalidations=%llu "
+             "objects=%zu bytes=%zu",
+             (unsigned long long)st.hits, (unsigned long long)st.misses,
+             (unsigned long long)st.inserts, (unsigned long long)st.rejects,
+             (unsigned long long)st.evictions, (unsigned long long)st.invalidations,
+             st.objects, st.bytes);
+    return command_reply(s, PROTO_OK, response);
 }
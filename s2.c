@@ -7,11 +7,34 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <errno.h>
+
+#include "proto.h"
+#include "node.h"
+#include "nsindex.h"
+#include "partfile.h"
+#include "tar.h"
 
 #define PORT 7082
+#define SOCKET_PATH "/tmp/w25_s2.sock"
 #define BUFFER_SIZE 1024
 #define MAX_PATH 512
-#define TAR_BUFFER_SIZE (10 * 1024 * 1024)  // 10MB buffer for tar files
+
+// Request handlers, called by the node core (node.h) on its worker threads
+int handle_download_request(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_upload_request(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_remove_request(int client_fd, uint32_t req_id, uint16_t flags, const char *filepath);
+int handle_tar_request(int client_fd, uint32_t req_id, uint16_t flags, const char *filetype);
+int handle_list_request(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_upload_begin(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_upload_query(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_upload_append(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_upload_commit(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_remove_many(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_download_many(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+
+// Files stored on this node, kept up to date for LIST
+static struct nsindex files;
 
 void expand_path(const char *input_path, char *output_path, size_t size) {
     if (input_path[0] == '~') {
@@ -37,309 +60,231 @@ void create_directory(const char *path) {
     system(cmd);
 }
 
-int handle_download_request(int client_fd, const char *filepath) {
-    char expanded_path[MAX_PATH];
+int handle_download_request(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    char filepath[MAX_PATH], expanded_path[MAX_PATH];
+    uint64_t offset, length;
+    int ranged = proto_parse_download(request, filepath, sizeof(filepath), &offset, &length);
+    if (ranged == -1) return proto_send_str(client_fd, PROTO_ERROR, req_id, "INVALID_RANGE");
     expand_path(filepath, expanded_path, sizeof(expanded_path));
 
     FILE *fp = fopen(expanded_path, "rb");
     if (!fp) {
         printf("[S2] Requested PDF not found: %s\n", expanded_path);
-        return -1;
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "FILE_NOT_FOUND");
     }
 
-    printf("[S2] Sending PDF file: %s\n", expanded_path);
-    char buffer[BUFFER_SIZE];
-    int bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-        if (send(client_fd, buffer, bytes_read, 0) == -1) {
+    // An S1 on the same machine can be handed the open file instead (node.h)
+    int passed = node_pass_file(client_fd, req_id, flags, fp);
+    if (passed == -1) perror("[S2] Failed to pass file");
+    if (passed == 1) printf("[S2] Passed PDF file to S1: %s\n", expanded_path);
+    if (passed != 0) {
+        fclose(fp);
+        return passed == 1 ? 0 : -1;
+    }
+
+    if (ranged) {
+        printf("[S2] Sending PDF file from byte %llu: %s\n", (unsigned long long)offset, expanded_path);
+        if (node_send_range(client_fd, req_id, fp, offset, length) == -1) {
+            if (errno == ERANGE) {
+                fclose(fp);
+                return proto_send_str(client_fd, PROTO_ERROR, req_id, "INVALID_RANGE");
+            }
             perror("[S2] Failed to send file data");
             fclose(fp);
             return -1;
         }
+        fclose(fp);
+        return 0;
+    }
+
+    printf("[S2] Sending PDF file: %s\n", expanded_path);
+    if (node_send_file(client_fd, req_id, fp) == -1) {
+        perror("[S2] Failed to send file data");
+        fclose(fp);
+        return -1;
     }
     fclose(fp);
     return 0;
 }
 
-int handle_upload_request(int client_fd) {
-    char dest_path[MAX_PATH], filename[256], buffer[BUFFER_SIZE];
+int handle_upload_request(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    char dest_path[MAX_PATH], filename[256];
+
+    // Request payload is "<filename> <destination>", the file data follows
+    int parsed = sscanf(request, "%255s %511s", filename, dest_path);
 
-    // Receive destination path
-    memset(dest_path, 0, sizeof(dest_path));
-    int len = recv(client_fd, dest_path, sizeof(dest_path), 0);
-    if (len <= 0) {
-        perror("[S2] Failed to receive destination path");
+    struct proto_header hdr;
+    if (proto_recv_header(client_fd, &hdr) == -1 || hdr.type != PROTO_DATA) {
+        perror("[S2] Failed to receive file data header");
         return -1;
     }
-    dest_path[len] = '\0';
 
-    // Receive filename
-    memset(filename, 0, sizeof(filename));
-    len = recv(client_fd, filename, sizeof(filename), 0);
-    if (len <= 0) {
-        perror("[S2] Failed to receive filename");
-        return -1;
+    if (parsed != 2) {
+        printf("[S2] Invalid upload request: %s\n", request);
+        if (node_recv_file(client_fd, &hdr, NULL) == -1) return -1;
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "STORE_FAILED");
     }
-    filename[len] = '\0';
 
     // Expand path (convert ~s2 to /home/user/s2)
     char expanded_path[MAX_PATH];
     expand_path(dest_path, expanded_path, sizeof(expanded_path));
 
     // Create directory structure
-    char dir_path[MAX_PATH];
-    strncpy(dir_path, expanded_path, MAX_PATH);
-    char *last_slash = strrchr(dir_path, '/');
-    if (last_slash) {
-        *last_slash = '\0';
-        create_directory(dir_path);
-    }
+    create_directory(expanded_path);
 
     // Create full path
     char filepath[MAX_PATH];
     snprintf(filepath, sizeof(filepath), "%s/%s", expanded_path, filename);
 
-    FILE *fp = fopen(filepath, "wb");
+    // Written next to its destination and renamed over it once complete, so
+    // a broken upload never leaves a truncated file behind
+    char tmppath[MAX_PATH];
+    int tmpfd = partfile_temp(expanded_path, filename, tmppath, sizeof(tmppath));
+    FILE *fp = (tmpfd != -1) ? fdopen(tmpfd, "wb") : NULL;
     if (!fp) {
         perror("[S2] File open failed");
-        return -1;
-    }
-
-    // Receive file content
-    int bytes_received;
-    while ((bytes_received = recv(client_fd, buffer, sizeof(buffer), 0)) > 0) {
-        fwrite(buffer, 1, bytes_received, fp);
-        if (bytes_received < sizeof(buffer)) break;
+        if (tmpfd != -1) {
+            close(tmpfd);
+            unlink(tmppath);
+        }
     }
 
-    fclose(fp);
-    printf("[S2] Received and saved PDF: %s\n", filepath);
-    return 0;
-}
-
-
-int create_pdf_tar(const char *output_path) {
-    char cmd[2 * MAX_PATH];
-    snprintf(cmd, sizeof(cmd), "find ~/s2 -type f -name \"*.pdf\" -print0 | tar -cf %s --null -T - 2>/dev/null", 
-             output_path);
-    
-    int ret = system(cmd);
-    if (ret != 0) {
-        fprintf(stderr, "[S2] Failed to create PDF tar archive at %s\n", output_path);
+    // Receive file content (drained even if the file could not be opened)
+    int ret = node_recv_file(client_fd, &hdr, fp);
+    if (ret == -1 && errno != EIO) {
+        perror("[S2] Failed to receive PDF");
+        if (fp) {
+            fclose(fp);
+            unlink(tmppath);
+        }
         return -1;
     }
-    return 0;
-}
-
-
-
-int handle_tar_request(int client_fd, const char *requested_name) {
-    // Create temporary tar file with the requested name
-    char temp_dir[] = "/tmp/s2_tar_XXXXXX";
-    if (mkdtemp(temp_dir) == NULL) {
-        perror("[S2] Failed to create temp directory");
-        return -1;
+    // Synced as the node's -d mode asks before it is acknowledged
+    if (fp && ret == 0) {
+        ret = node_store_file(fp, tmppath, filepath);
+    } else if (fp) {
+        fclose(fp);
+        unlink(tmppath);
     }
-
-    char tar_path[MAX_PATH];
-    snprintf(tar_path, sizeof(tar_path), "%s/%s", temp_dir, requested_name);
-
-    // Create the PDF tar archive
-    if (create_pdf_tar(tar_path) != 0) {
-        // Clean up
-        char cmd[MAX_PATH + 50];
-        snprintf(cmd, sizeof(cmd), "rm -rf %s", temp_dir);
-        system(cmd);
-        return -1;
+    // Keep the index in line with what is now on disk
+    if (fp && ret != -1 && nsindex_update(&files, filepath) == -1) {
+        fprintf(stderr, "[S2] Failed to index %s\n", filepath);
     }
-
-    // Open and send the tar file
-    FILE *fp = fopen(tar_path, "rb");
-    if (!fp) {
-        perror("[S2] Failed to open tar file");
-        // Clean up
-        char cmd[MAX_PATH + 50];
-        snprintf(cmd, sizeof(cmd), "rm -rf %s", temp_dir);
-        system(cmd);
-        return -1;
+    if (!fp || ret == -1) {
+        perror("[S2] Failed to store PDF");
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "STORE_FAILED");
     }
-
-    // Send file content directly
-    char buffer[BUFFER_SIZE];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-        if (send(client_fd, buffer, bytes_read, 0) == -1) {
-            perror("[S2] Error sending tar file");
-            break;
-        }
+    if (ret == 1) {
+        fprintf(stderr, "[S2] Stored %s but could not sync it\n", filepath);
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "STORE_NOT_DURABLE");
     }
 
-    fclose(fp);
-    
-    // Clean up
-    char cmd[MAX_PATH + 50];
-    snprintf(cmd, sizeof(cmd), "rm -rf %s", temp_dir);
-    system(cmd);
-    
-    return 0;
+    printf("[S2] Received and saved PDF: %s\n", filepath);
+    return proto_send_str(client_fd, PROTO_OK, req_id, "STORE_SUCCESS");
 }
 
-int main() {
-    int server_fd, client_fd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len = sizeof(client_addr);
 
-    // Create socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1) {
-        perror("[S2] Socket creation failed");
-        exit(1);
+// Stream every PDF file under ~/s2 to S1 as a tar archive, built on the fly
+int send_tar_archive(int client_fd, uint32_t req_id, const char *requested_name) {
+    char root[MAX_PATH];
+    expand_path("~s2", root, sizeof(root));
+
+    struct tar_list files;
+    if (tar_collect(&files, root, ".pdf") == -1) {
+        fprintf(stderr, "[S2] Failed to collect files for %s\n", requested_name);
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "TAR_FAILED:TAR_CREATE");
     }
 
-    // Reuse port
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("[S2] setsockopt failed");
-        exit(1);
+    int ret = tar_send(client_fd, req_id, &files);
+    if (ret == -1) {
+        perror("[S2] Error sending tar file");
+    } else {
+        printf("[S2] Sent PDF tar archive '%s' (%zu files) to client\n", requested_name, files.count);
     }
+    tar_list_free(&files);
+    return ret;
+}
 
-    // Configure server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
+int handle_remove_request(int client_fd, uint32_t req_id, uint16_t flags, const char *filepath) {
+    char expanded_path[MAX_PATH];
+    expand_path(filepath, expanded_path, sizeof(expanded_path));
 
-    // Bind
-    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
-        perror("[S2] Bind failed");
-        exit(1);
+    if (remove(expanded_path) == 0) {
+        nsindex_update(&files, expanded_path);
+        printf("[S2] Deleted file: %s\n", expanded_path);
+        return proto_send_str(client_fd, PROTO_OK, req_id, "REMOVE_SUCCESS");
+    } else {
+        perror("[S2] Failed to delete file");
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "REMOVE_FAILED");
     }
+}
 
-    // Listen
-    if (listen(server_fd, 5) == -1) {
-        perror("[S2] Listen failed");
-        exit(1);
+int handle_tar_request(int client_fd, uint32_t req_id, uint16_t flags, const char *filetype) {
+    // Handle PDF tar request; the archive is always named pdfiles.tar
+    if (strcmp(filetype, ".pdf") != 0) {
+        printf("[S2] Invalid TAR request: %s\n", filetype);
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "TAR_FAILED:UNSUPPORTED_TYPE");
     }
+    return send_tar_archive(client_fd, req_id, "pdfiles.tar");
+}
 
-    printf("[S2] Server is listening on port %d...\n", PORT);
+int handle_list_request(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_send_list(client_fd, req_id, flags, &files, "~s2", request);
+}
 
-    while (1) {
-        client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &addr_len);
-        if (client_fd == -1) {
-            perror("[S2] Accept failed");
-            continue;
-        }
+// Upload sessions, for files sent in pieces (node.h)
+int handle_upload_begin(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_upload_begin(client_fd, req_id, "~s2", request);
+}
 
-        // Determine request type (upload or download)
-        char request_type[20];
-        int len = recv(client_fd, request_type, sizeof(request_type) - 1, MSG_PEEK);
-        if (len <= 0) {
-            perror("[S2] Failed to determine request type");
-            close(client_fd);
-            continue;
-        }
-        request_type[len] = '\0';
-
-        if (strncmp(request_type, "DOWNLOAD ", 9) == 0) {
-            // Handle download request
-            char request[BUFFER_SIZE];
-            len = recv(client_fd, request, sizeof(request) - 1, 0);
-            if (len <= 0) {
-                perror("[S2] Failed to receive download request");
-                close(client_fd);
-                continue;
-            }
-            request[len] = '\0';
-
-            char *filepath = request + 9; // Skip "DOWNLOAD " prefix
-            handle_download_request(client_fd, filepath);
-        } 
-      
-        else if (strncmp(request_type, "REMOVE ", 7) == 0) {
-            // Handle remove request
-            char request[BUFFER_SIZE];
-            len = recv(client_fd, request, sizeof(request) - 1, 0);
-            if (len <= 0) {
-                perror("[S2] Failed to receive remove request");
-                close(client_fd);
-                continue;
-            }
-            request[len] = '\0';
-        
-            char *filepath = request + 7; // Skip "REMOVE " prefix
-            char expanded_path[MAX_PATH];
-            expand_path(filepath, expanded_path, sizeof(expanded_path));
-        
-            if (remove(expanded_path) == 0) {
-                printf("[S2] Deleted file: %s\n", expanded_path);
-                send(client_fd, "REMOVE_SUCCESS", 14, 0);
-            } else {
-                perror("[S2] Failed to delete file");
-                send(client_fd, "REMOVE_FAILED", 13, 0);
-            }
-        }
-        
+int handle_upload_query(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_upload_query(client_fd, req_id, "~s2", request);
+}
 
-        else if (strncmp(request_type, "TAR_PDF:", 8) == 0) {
-            // Handle PDF tar request with specific filename
-            char request[BUFFER_SIZE];
-            len = recv(client_fd, request, sizeof(request) - 1, 0);
-            if (len <= 0) {
-                perror("[S2] Failed to receive tar request");
-                close(client_fd);
-                continue;
-            }
-            request[len] = '\0';
-            
-            // Extract the requested filename (format is "TAR_PDF:filename.tar")
-            char *colon = strchr(request, ':');
-            if (!colon) {
-                printf("[S2] Invalid TAR_PDF request format\n");
-                close(client_fd);
-                continue;
-            }
-            char *requested_name = colon + 1;
-            
-            if (handle_tar_request(client_fd, requested_name) == 0) {
-                printf("[S2] Sent PDF tar archive '%s' to client\n", requested_name);
-            } else {
-                printf("[S2] Failed to create/send PDF tar archive\n");
-            }
-        }
- 
-        else if (strncmp(request_type, "LIST ", 5) == 0) {
-            char expanded_path[MAX_PATH];
-            expand_path("~s2/", expanded_path, sizeof(expanded_path)); // Always use root
-            
-            // Find files with relative paths from server root
-            char cmd[2 * MAX_PATH];
-            snprintf(cmd, sizeof(cmd), "find %s -type f -name \"*.pdf\" -printf \"%%P\\n\" | sort", expanded_path);
-            
-            FILE *fp = popen(cmd, "r");
-            char file_list[BUFFER_SIZE] = {0};
-            char line[256];
-            size_t list_size = 0;
-            
-            while (fgets(line, sizeof(line), fp)) {
-                line[strcspn(line, "\n")] = 0;
-                if (strlen(line) > 0) {
-                    list_size += snprintf(file_list + list_size,
-                                        sizeof(file_list) - list_size,
-                                        "%s\n", line);
-                }
-            }
-            pclose(fp);
-            send(client_fd, file_list, list_size, 0);
-        }
+int handle_upload_append(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_upload_append(client_fd, req_id, flags, "~s2", request);
+}
 
-        else {
-            // Handle upload request (original functionality)
-            handle_upload_request(client_fd);
-        }
+int handle_upload_commit(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_upload_commit(client_fd, req_id, &files, "~s2", request);
+}
 
-        close(client_fd);
+// Several files at once, named by paths and glob patterns (node.h)
+int handle_remove_many(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_remove_many(client_fd, req_id, &files, "~s2", request);
+}
+
+int handle_download_many(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_download_many(client_fd, req_id, &files, "~s2", request);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct node_handler handlers[] = {
+        { PROTO_DOWNLOAD,      handle_download_request },
+        { PROTO_UPLOAD,        handle_upload_request },
+        { PROTO_REMOVE,        handle_remove_request },
+        { PROTO_TAR,           handle_tar_request },
+        { PROTO_LIST,          handle_list_request },
+        { PROTO_UPLOAD_BEGIN,  handle_upload_begin },
+        { PROTO_UPLOAD_QUERY,  handle_upload_query },
+        { PROTO_UPLOAD_APPEND, handle_upload_append },
+        { PROTO_UPLOAD_COMMIT, handle_upload_commit },
+        { PROTO_REMOVE_MANY,   handle_remove_many },
+        { PROTO_DOWNLOAD_MANY, handle_download_many },
+    };
+    static const struct node_config config = {
+        "S2", PORT, SOCKET_PATH, handlers, sizeof(handlers) / sizeof(handlers[0]),
+    };
+
+    // Index the files already stored before taking requests
+    char root[MAX_PATH];
+    expand_path("~s2", root, sizeof(root));
+    if (nsindex_build(&files, root, ".pdf") == -1) {
+        fprintf(stderr, "[S2] Failed to index %s\n", root);
+        exit(EXIT_FAILURE);
     }
+    printf("[S2] Indexed %zu files under %s\n", files.count, root);
 
-    close(server_fd);
+    if (node_serve(&config, argc, argv) == -1) exit(1);
     return 0;
-}
\ No newline at end of file
+}
@@ -8,80 +8,69 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <errno.h>
+
+#include "proto.h"
+#include "node.h"
+#include "nsindex.h"
+#include "partfile.h"
+#include "tar.h"
 
 #define S3_PORT 3032
+#define S3_SOCKET "/tmp/w25_s3.sock"
 #define BUFFER_SIZE 1024
 #define MAX_PATH 512
 
-#define TAR_BUFFER_SIZE (10 * 1024 * 1024)  // 10MB buffer for tar files
-
-void handle_client(int client_fd);
+// Request handlers, called by the node core (node.h) on its worker threads
 void expand_path(const char *input_path, char *output_path, size_t size);
-int handle_download_request(int client_fd, const char *filepath);
-int handle_upload_request(int client_fd);
-
-int main()
+int handle_download_request(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_upload_request(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_remove_request(int client_fd, uint32_t req_id, uint16_t flags, const char *filepath);
+int handle_tar_request(int client_fd, uint32_t req_id, uint16_t flags, const char *filetype);
+int handle_list_request(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_upload_begin(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_upload_query(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_upload_append(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_upload_commit(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_remove_many(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_download_many(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+
+// Files stored on this node, kept up to date for LIST
+static struct nsindex files;
+
+int main(int argc, char *argv[])
 {
-    int server_fd, client_fd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-
-    // Create socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1)
-    {
-        perror("[S3] Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
-
-    // Allow port reuse
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+    static const struct node_handler handlers[] = {
+        { PROTO_DOWNLOAD,      handle_download_request },
+        { PROTO_UPLOAD,        handle_upload_request },
+        { PROTO_REMOVE,        handle_remove_request },
+        { PROTO_TAR,           handle_tar_request },
+        { PROTO_LIST,          handle_list_request },
+        { PROTO_UPLOAD_BEGIN,  handle_upload_begin },
+        { PROTO_UPLOAD_QUERY,  handle_upload_query },
+        { PROTO_UPLOAD_APPEND, handle_upload_append },
+        { PROTO_UPLOAD_COMMIT, handle_upload_commit },
+        { PROTO_REMOVE_MANY,   handle_remove_many },
+        { PROTO_DOWNLOAD_MANY, handle_download_many },
+    };
+    static const struct node_config config = {
+        "S3", S3_PORT, S3_SOCKET, handlers, sizeof(handlers) / sizeof(handlers[0]),
+    };
+
+    // Index the files already stored before taking requests
+    char root[MAX_PATH];
+    expand_path("~s3", root, sizeof(root));
+    if (nsindex_build(&files, root, ".txt") == -1)
     {
-        perror("[S3] setsockopt failed");
+        fprintf(stderr, "[S3] Failed to index %s\n", root);
         exit(EXIT_FAILURE);
     }
+    printf("[S3] Indexed %zu files under %s\n", files.count, root);
 
-    // Configure server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(S3_PORT);
-
-    // Bind socket to port
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1)
+    if (node_serve(&config, argc, argv) == -1)
     {
-        perror("[S3] Bind failed");
-        close(server_fd);
         exit(EXIT_FAILURE);
     }
-
-    // Start listening
-    if (listen(server_fd, 5) == -1)
-    {
-        perror("[S3] Listening failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
-    }
-
-    printf("[S3] Server is listening on port %d for .txt files...\n", S3_PORT);
-
-    while (1)
-    {
-        // Accept client connection (will be S1 in this case)
-        client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &addr_len);
-        if (client_fd == -1)
-        {
-            perror("[S3] Accept failed");
-            continue;
-        }
-
-        // printf("[S3] S1 connected to S3\n");
-        handle_client(client_fd);
-        close(client_fd);
-    }
-
-    close(server_fd);
     return 0;
 }
 
@@ -125,54 +114,73 @@ void expand_path(const char *input_path, char *output_path, size_t size)
 }
 
 // Function to handle download requests from S1
-int handle_download_request(int client_fd, const char *filepath) {
-    char expanded_path[MAX_PATH];
+int handle_download_request(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    char filepath[MAX_PATH], expanded_path[MAX_PATH];
+    uint64_t offset, length;
+    int ranged = proto_parse_download(request, filepath, sizeof(filepath), &offset, &length);
+    if (ranged == -1) return proto_send_str(client_fd, PROTO_ERROR, req_id, "INVALID_RANGE");
     expand_path(filepath, expanded_path, sizeof(expanded_path));
 
     FILE *fp = fopen(expanded_path, "rb");
     if (!fp) {
         printf("[S3] Requested TXT file not found: %s\n", expanded_path);
-        send(client_fd, "FILE_NOT_FOUND", 14, 0);
-        return -1;
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "FILE_NOT_FOUND");
     }
 
-    printf("[S3] Sending TXT file: %s\n", expanded_path);
-    char buffer[BUFFER_SIZE];
-    int bytes_read, total_sent = 0;
-    
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-        int sent = send(client_fd, buffer, bytes_read, 0);
-        if (sent == -1) {
+    // An S1 on the same machine can be handed the open file instead (node.h)
+    int passed = node_pass_file(client_fd, req_id, flags, fp);
+    if (passed == -1) perror("[S3] Failed to pass file");
+    if (passed == 1) printf("[S3] Passed TXT file to S1: %s\n", expanded_path);
+    if (passed != 0) {
+        fclose(fp);
+        return passed == 1 ? 0 : -1;
+    }
+
+    if (ranged) {
+        printf("[S3] Sending TXT file from byte %llu: %s\n", (unsigned long long)offset, expanded_path);
+        if (node_send_range(client_fd, req_id, fp, offset, length) == -1) {
+            if (errno == ERANGE) {
+                fclose(fp);
+                return proto_send_str(client_fd, PROTO_ERROR, req_id, "INVALID_RANGE");
+            }
             perror("[S3] Failed to send file data");
             fclose(fp);
             return -1;
         }
-        total_sent += sent;
+        fclose(fp);
+        return 0;
+    }
+
+    printf("[S3] Sending TXT file: %s\n", expanded_path);
+    struct stat st;
+    fstat(fileno(fp), &st);
+    if (node_send_file(client_fd, req_id, fp) == -1) {
+        perror("[S3] Failed to send file data");
+        fclose(fp);
+        return -1;
     }
     
     fclose(fp);
-    printf("[S3] Sent %d bytes\n", total_sent);
+    printf("[S3] Sent %lld bytes\n", (long long)st.st_size);
     return 0;
 }
 
 // Function to handle upload requests from S1
-int handle_upload_request(int client_fd) {
-    char command[BUFFER_SIZE];
+int handle_upload_request(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
     char filename[256], destination[256], filepath[MAX_PATH], expanded_dest[MAX_PATH];
 
-    // Receive command from S1 (format: "STORE_TXT <filename> <destination>")
-    int bytes_received = recv(client_fd, command, sizeof(command) - 1, 0);
-    if (bytes_received <= 0) {
-        perror("[S3] Failed to receive command from S1");
+    // Request payload from S1 is "<filename> <destination>", the file data follows
+    struct proto_header hdr;
+    if (proto_recv_header(client_fd, &hdr) == -1 || hdr.type != PROTO_DATA) {
+        perror("[S3] Failed to receive file data from S1");
         return -1;
     }
-    command[bytes_received] = '\0';
 
     // Parse command
-    if (sscanf(command, "STORE_TXT %s %s", filename, destination) != 2) {
-        perror("[S3] Invalid command format from S1");
-        send(client_fd, "STORE_FAILED", 12, 0);
-        return -1;
+    if (sscanf(request, "%255s %255s", filename, destination) != 2) {
+        printf("[S3] Invalid command format from S1\n");
+        if (node_recv_file(client_fd, &hdr, NULL) == -1) return -1;
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "STORE_FAILED");
     }
 
     // Expand destination path (convert ~s1 to ~s3)
@@ -196,203 +204,124 @@ int handle_upload_request(int client_fd) {
 
     printf("[S3] Receiving .txt file: %s, Destination: %s\n", filename, filepath);
 
-    // Open file for writing
-    FILE *fp = fopen(filepath, "wb");
+    // Written next to its destination and renamed over it once complete, so
+    // a broken upload never leaves a truncated file behind
+    char tmppath[MAX_PATH];
+    int tmpfd = partfile_temp(expanded_dest, filename, tmppath, sizeof(tmppath));
+    FILE *fp = (tmpfd != -1) ? fdopen(tmpfd, "wb") : NULL;
     if (!fp) {
         perror("[S3] File open failed");
-        send(client_fd, "STORE_FAILED", 12, 0);
-        return -1;
+        if (tmpfd != -1) {
+            close(tmpfd);
+            unlink(tmppath);
+        }
     }
 
-    // Receive file data and write to disk
-    char buffer[BUFFER_SIZE];
-    while ((bytes_received = recv(client_fd, buffer, sizeof(buffer), 0)) > 0) {
-        fwrite(buffer, 1, bytes_received, fp);
-        if (bytes_received < sizeof(buffer))
-            break;
+    // Receive file data and write to disk (drained even if the open failed)
+    int ret = node_recv_file(client_fd, &hdr, fp);
+    if (ret == -1 && errno != EIO) {
+        perror("[S3] Failed to receive file data");
+        if (fp) {
+            fclose(fp);
+            unlink(tmppath);
+        }
+        return -1;
+    }
+    // Synced as the node's -d mode asks before it is acknowledged
+    if (fp && ret == 0) {
+        ret = node_store_file(fp, tmppath, filepath);
+    } else if (fp) {
+        fclose(fp);
+        unlink(tmppath);
+    }
+    // Keep the index in line with what is now on disk
+    if (fp && ret != -1 && nsindex_update(&files, filepath) == -1) {
+        fprintf(stderr, "[S3] Failed to index %s\n", filepath);
+    }
+    if (!fp || ret == -1) {
+        perror("[S3] Failed to store file");
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "STORE_FAILED");
+    }
+    if (ret == 1) {
+        fprintf(stderr, "[S3] Stored %s but could not sync it\n", filepath);
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "STORE_NOT_DURABLE");
     }
 
-    fclose(fp);
     printf("[S3] File stored successfully: %s\n", filepath);
-    send(client_fd, "STORE_SUCCESS", 13, 0);
-    return 0;
+    return proto_send_str(client_fd, PROTO_OK, req_id, "STORE_SUCCESS");
 }
 
 
-int create_txt_tar(const char *output_path) {
-    char cmd[2 * MAX_PATH];
-    snprintf(cmd, sizeof(cmd), "find ~/s3 -type f -name \"*.txt\" | tar -cf %s --files-from - 2>/dev/null", 
-             output_path);
-    
-    int ret = system(cmd);
-    if (ret != 0) {
-        fprintf(stderr, "[S3] Failed to create TXT tar archive\n");
-        return -1;
-    }
-    return 0;
-}
+// Stream every TXT file under ~/s3 to S1 as a tar archive, built on the fly
+int send_tar_archive(int client_fd, uint32_t req_id, const char *requested_name) {
+    char root[MAX_PATH];
+    expand_path("~s3", root, sizeof(root));
 
+    struct tar_list files;
+    if (tar_collect(&files, root, ".txt") == -1) {
+        fprintf(stderr, "[S3] Failed to collect files for %s\n", requested_name);
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "TAR_FAILED:TAR_CREATE");
+    }
 
-int handle_tar_request(int client_fd, const char *requested_name) {
-    // Create temporary directory for tar file
-    char temp_dir[] = "/tmp/s3_tar_XXXXXX";
-    if (mkdtemp(temp_dir) == NULL) {
-        perror("[S3] Failed to create temp directory");
-        return -1;
+    int ret = tar_send(client_fd, req_id, &files);
+    if (ret == -1) {
+        perror("[S3] Error sending tar file");
+    } else {
+        printf("[S3] Sent TXT tar archive '%s' (%zu files) to client\n", requested_name, files.count);
     }
+    tar_list_free(&files);
+    return ret;
+}
 
-    // Create full path for tar file
-    char tar_path[MAX_PATH];
-    snprintf(tar_path, sizeof(tar_path), "%s/%s", temp_dir, requested_name);
+int handle_remove_request(int client_fd, uint32_t req_id, uint16_t flags, const char *filepath) {
+    char expanded_path[MAX_PATH];
+    expand_path(filepath, expanded_path, sizeof(expanded_path));
 
-    // Create the TXT tar archive
-    char cmd[2 * MAX_PATH];
-    snprintf(cmd, sizeof(cmd), "find ~/s3 -type f -name \"*.txt\" -print0 | tar -cf %s --null -T - 2>/dev/null", 
-             tar_path);
-    
-    int ret = system(cmd);
-    if (ret != 0) {
-        fprintf(stderr, "[S3] Failed to create TXT tar archive at %s\n", tar_path);
-        // Clean up
-        char cleanup_cmd[MAX_PATH + 50];
-        snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf %s", temp_dir);
-        system(cleanup_cmd);
-        return -1;
+    if (remove(expanded_path) == 0) {
+        nsindex_update(&files, expanded_path);
+        printf("[S3] Deleted file: %s\n", expanded_path);
+        return proto_send_str(client_fd, PROTO_OK, req_id, "REMOVE_SUCCESS");
+    } else {
+        perror("[S3] Failed to delete file");
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "REMOVE_FAILED");
     }
+}
 
-    // Open and send the tar file
-    FILE *fp = fopen(tar_path, "rb");
-    if (!fp) {
-        perror("[S3] Failed to open tar file");
-        // Clean up
-        char cleanup_cmd[MAX_PATH + 50];
-        snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf %s", temp_dir);
-        system(cleanup_cmd);
-        return -1;
+int handle_tar_request(int client_fd, uint32_t req_id, uint16_t flags, const char *filetype) {
+    // Handle TXT tar request; the archive is always named txtfiles.tar
+    if (strcmp(filetype, ".txt") != 0) {
+        printf("[S3] Invalid TAR request: %s\n", filetype);
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "TAR_FAILED:UNSUPPORTED_TYPE");
     }
+    return send_tar_archive(client_fd, req_id, "txtfiles.tar");
+}
 
-    // Send file content directly
-    char buffer[BUFFER_SIZE];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-        if (send(client_fd, buffer, bytes_read, 0) == -1) {
-            perror("[S3] Error sending tar file");
-            break;
-        }
-    }
+int handle_list_request(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_send_list(client_fd, req_id, flags, &files, "~s3", request);
+}
 
-    fclose(fp);
-    
-    // Clean up
-    char cleanup_cmd[MAX_PATH + 50];
-    snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf %s", temp_dir);
-    system(cleanup_cmd);
-    
-    return 0;
+// Upload sessions, for files sent in pieces (node.h)
+int handle_upload_begin(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_upload_begin(client_fd, req_id, "~s3", request);
 }
 
-// Main client handling function
-void handle_client(int client_fd) {
-    char request_type[20];
-    
-    // First determine if this is a download request
-    int len = recv(client_fd, request_type, sizeof(request_type) - 1, MSG_PEEK);
-    if (len <= 0) {
-        perror("[S3] Failed to determine request type");
-        return;
-    }
-    request_type[len] = '\0';
-
-    if (strncmp(request_type, "DOWNLOAD ", 9) == 0) {
-        // Handle download request
-        char request[BUFFER_SIZE];
-        len = recv(client_fd, request, sizeof(request) - 1, 0);
-        if (len <= 0) {
-            perror("[S3] Failed to receive download request");
-            return;
-        }
-        request[len] = '\0';
-
-        char *filepath = request + 9; // Skip "DOWNLOAD " prefix
-        handle_download_request(client_fd, filepath);
-    } 
-   
-
-    else if (strncmp(request_type, "TAR_TXT:", 8) == 0) {
-        // Handle TXT tar request with specific filename
-        char request[BUFFER_SIZE];
-        len = recv(client_fd, request, sizeof(request) - 1, 0);
-        if (len <= 0) {
-            perror("[S3] Failed to receive tar request");
-            close(client_fd);
-            return;
-        }
-        request[len] = '\0';
-        
-        // Extract the requested filename (format is "TAR_TXT:filename.tar")
-        char *colon = strchr(request, ':');
-        if (!colon) {
-            printf("[S3] Invalid TAR_TXT request format\n");
-            close(client_fd);
-            return;
-        }
-        char *requested_name = colon + 1;
-        
-        if (handle_tar_request(client_fd, requested_name) == 0) {
-            printf("[S3] Sent TXT tar archive '%s' to client\n", requested_name);
-        } else {
-            printf("[S3] Failed to create/send TXT tar archive\n");
-        }
-    }
+int handle_upload_query(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_upload_query(client_fd, req_id, "~s3", request);
+}
 
-    else if (strncmp(request_type, "REMOVE ", 7) == 0) {
-        // Handle remove request
-        char request[BUFFER_SIZE];
-        len = recv(client_fd, request, sizeof(request) - 1, 0);
-        if (len <= 0) {
-            perror("[S3] Failed to receive remove request");
-            return;  // Changed from continue to return
-        }
-        request[len] = '\0';
-    
-        char *filepath = request + 7; // Skip "REMOVE " prefix
-        char expanded_path[MAX_PATH];
-        expand_path(filepath, expanded_path, sizeof(expanded_path));
-    
-        if (remove(expanded_path) == 0) {
-            printf("[S3] Deleted file: %s\n", expanded_path);
-            send(client_fd, "REMOVE_SUCCESS", 14, 0);
-        } else {
-            perror("[S3] Failed to delete file");
-            send(client_fd, "REMOVE_FAILED", 13, 0);
-        }
-    }    
-    else if (strncmp(request_type, "LIST ", 5) == 0) {
-        char expanded_path[MAX_PATH];
-        expand_path("~s3/", expanded_path, sizeof(expanded_path)); // Always use root
-        
-        // Find files with relative paths from server root
-        char cmd[2 * MAX_PATH];
-        snprintf(cmd, sizeof(cmd), "find %s -type f -name \"*.txt\" -printf \"%%P\\n\" | sort", expanded_path);
-        
-        FILE *fp = popen(cmd, "r");
-        char file_list[BUFFER_SIZE] = {0};
-        char line[256];
-        size_t list_size = 0;
-        
-        while (fgets(line, sizeof(line), fp)) {
-            line[strcspn(line, "\n")] = 0;
-            if (strlen(line) > 0) {
-                list_size += snprintf(file_list + list_size,
-                                    sizeof(file_list) - list_size,
-                                    "%s\n", line);
-            }
-        }
-        pclose(fp);
-        send(client_fd, file_list, list_size, 0);
-    }    
-    else {
-        // Handle upload request
-        handle_upload_request(client_fd);
-    }
-}
\ No newline at end of file
+int handle_upload_append(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_upload_append(client_fd, req_id, flags, "~s3", request);
+}
+
+int handle_upload_commit(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_upload_commit(client_fd, req_id, &files, "~s3", request);
+}
+
+// Several files at once, named by paths and glob patterns (node.h)
+int handle_remove_many(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_remove_many(client_fd, req_id, &files, "~s3", request);
+}
+
+int handle_download_many(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_download_many(client_fd, req_id, &files, "~s3", request);
+}
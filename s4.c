@@ -8,71 +8,61 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <errno.h>
+
+#include "proto.h"
+#include "node.h"
+#include "nsindex.h"
+#include "partfile.h"
 
 #define S4_PORT 2022
+#define S4_SOCKET "/tmp/w25_s4.sock"
 #define BUFFER_SIZE 1024
 #define MAX_PATH 512
 
-void handle_client(int client_fd);
+// Request handlers, called by the node core (node.h) on its worker threads
 void expand_path(const char *input_path, char *output_path, size_t size);
-int handle_download_request(int client_fd, const char *filepath);
-int handle_upload_request(int client_fd);
-
-int main() {
-    int server_fd, client_fd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-
-    // Create socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1) {
-        perror("[S4] Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
-
-    // Allow port reuse
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("[S4] setsockopt failed");
-        exit(EXIT_FAILURE);
-    }
-
-    // Configure server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(S4_PORT);
-
-    // Bind socket to port
-    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
-        perror("[S4] Bind failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
-    }
-
-    // Start listening
-    if (listen(server_fd, 5) == -1) {
-        perror("[S4] Listening failed");
-        close(server_fd);
+int handle_download_request(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_upload_request(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_remove_request(int client_fd, uint32_t req_id, uint16_t flags, const char *filepath);
+int handle_list_request(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_upload_begin(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_upload_query(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_upload_append(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_upload_commit(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_remove_many(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+int handle_download_many(int client_fd, uint32_t req_id, uint16_t flags, const char *request);
+
+// Files stored on this node, kept up to date for LIST
+static struct nsindex files;
+
+int main(int argc, char *argv[]) {
+    static const struct node_handler handlers[] = {
+        { PROTO_DOWNLOAD,      handle_download_request },
+        { PROTO_UPLOAD,        handle_upload_request },
+        { PROTO_REMOVE,        handle_remove_request },
+        { PROTO_LIST,          handle_list_request },
+        { PROTO_UPLOAD_BEGIN,  handle_upload_begin },
+        { PROTO_UPLOAD_QUERY,  handle_upload_query },
+        { PROTO_UPLOAD_APPEND, handle_upload_append },
+        { PROTO_UPLOAD_COMMIT, handle_upload_commit },
+        { PROTO_REMOVE_MANY,   handle_remove_many },
+        { PROTO_DOWNLOAD_MANY, handle_download_many },
+    };
+    static const struct node_config config = {
+        "S4", S4_PORT, S4_SOCKET, handlers, sizeof(handlers) / sizeof(handlers[0]),
+    };
+
+    // Index the files already stored before taking requests
+    char root[MAX_PATH];
+    expand_path("~s4", root, sizeof(root));
+    if (nsindex_build(&files, root, ".zip") == -1) {
+        fprintf(stderr, "[S4] Failed to index %s\n", root);
         exit(EXIT_FAILURE);
     }
+    printf("[S4] Indexed %zu files under %s\n", files.count, root);
 
-    printf("[S4] Server is listening on port %d for .zip files...\n", S4_PORT);
-
-    while (1) {
-        // Accept client connection (will be S1 in this case)
-        client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &addr_len);
-        if (client_fd == -1) {
-            perror("[S4] Accept failed");
-            continue;
-        }
-
-        // printf("[S4] S1 connected to S4\n");
-        handle_client(client_fd);
-        close(client_fd);
-    }
-
-    close(server_fd);
+    if (node_serve(&config, argc, argv) == -1) exit(EXIT_FAILURE);
     return 0;
 }
 
@@ -102,54 +92,74 @@ void expand_path(const char *input_path, char *output_path, size_t size) {
 }
 
 
-int handle_download_request(int client_fd, const char *filepath) {
-    char expanded_path[MAX_PATH];
+int handle_download_request(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    char filepath[MAX_PATH], expanded_path[MAX_PATH];
+    uint64_t offset, length;
+    int ranged = proto_parse_download(request, filepath, sizeof(filepath), &offset, &length);
+    if (ranged == -1) return proto_send_str(client_fd, PROTO_ERROR, req_id, "INVALID_RANGE");
     expand_path(filepath, expanded_path, sizeof(expanded_path));
 
     FILE *fp = fopen(expanded_path, "rb");
     if (!fp) {
         printf("[S4] Requested ZIP file not found: %s\n", expanded_path);
-        send(client_fd, "FILE_NOT_FOUND", 14, 0);
-        return -1;
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "FILE_NOT_FOUND");
     }
 
-    printf("[S4] Sending ZIP file: %s\n", expanded_path);
-    
-    // Send file data directly
-    char buffer[BUFFER_SIZE];
-    int bytes_read, total_sent = 0;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-        int sent = send(client_fd, buffer, bytes_read, 0);
-        if (sent == -1) {
+    // An S1 on the same machine can be handed the open file instead (node.h)
+    int passed = node_pass_file(client_fd, req_id, flags, fp);
+    if (passed == -1) perror("[S4] Failed to pass file");
+    if (passed == 1) printf("[S4] Passed ZIP file to S1: %s\n", expanded_path);
+    if (passed != 0) {
+        fclose(fp);
+        return passed == 1 ? 0 : -1;
+    }
+
+    if (ranged) {
+        printf("[S4] Sending ZIP file from byte %llu: %s\n", (unsigned long long)offset, expanded_path);
+        if (node_send_range(client_fd, req_id, fp, offset, length) == -1) {
+            if (errno == ERANGE) {
+                fclose(fp);
+                return proto_send_str(client_fd, PROTO_ERROR, req_id, "INVALID_RANGE");
+            }
             perror("[S4] Failed to send file data");
             fclose(fp);
             return -1;
         }
-        total_sent += sent;
+        fclose(fp);
+        return 0;
+    }
+
+    printf("[S4] Sending ZIP file: %s\n", expanded_path);
+    
+    // Send file data directly
+    struct stat st;
+    fstat(fileno(fp), &st);
+    if (node_send_file(client_fd, req_id, fp) == -1) {
+        perror("[S4] Failed to send file data");
+        fclose(fp);
+        return -1;
     }
     
     fclose(fp);
-    printf("[S4] Sent %d bytes\n", total_sent);
+    printf("[S4] Sent %lld bytes\n", (long long)st.st_size);
     return 0;
 }
 
-int handle_upload_request(int client_fd) {
-    char command[BUFFER_SIZE];
+int handle_upload_request(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
     char filename[256], destination[256], filepath[MAX_PATH], expanded_dest[MAX_PATH];
 
-    // Receive command from S1 (format: "STORE_ZIP <filename> <destination>")
-    int bytes_received = recv(client_fd, command, sizeof(command) - 1, 0);
-    if (bytes_received <= 0) {
-        perror("[S4] Failed to receive command from S1");
+    // Request payload from S1 is "<filename> <destination>", the file data follows
+    struct proto_header hdr;
+    if (proto_recv_header(client_fd, &hdr) == -1 || hdr.type != PROTO_DATA) {
+        perror("[S4] Failed to receive file data from S1");
         return -1;
     }
-    command[bytes_received] = '\0';
 
     // Parse command
-    if (sscanf(command, "STORE_ZIP %s %s", filename, destination) != 2) {
-        perror("[S4] Invalid command format from S1");
-        send(client_fd, "STORE_FAILED", 12, 0);
-        return -1;
+    if (sscanf(request, "%255s %255s", filename, destination) != 2) {
+        printf("[S4] Invalid command format from S1\n");
+        if (node_recv_file(client_fd, &hdr, NULL) == -1) return -1;
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "STORE_FAILED");
     }
 
     // Expand destination path (convert ~s1 to ~s4)
@@ -173,102 +183,93 @@ int handle_upload_request(int client_fd) {
 
     printf("[S4] Receiving .zip file: %s, Destination: %s\n", filename, filepath);
 
-    // Open file for writing
-    FILE *fp = fopen(filepath, "wb");
+    // Written next to its destination and renamed over it once complete, so
+    // a broken upload never leaves a truncated file behind
+    char tmppath[MAX_PATH];
+    int tmpfd = partfile_temp(expanded_dest, filename, tmppath, sizeof(tmppath));
+    FILE *fp = (tmpfd != -1) ? fdopen(tmpfd, "wb") : NULL;
     if (!fp) {
         perror("[S4] File open failed");
-        send(client_fd, "STORE_FAILED", 12, 0);
-        return -1;
+        if (tmpfd != -1) {
+            close(tmpfd);
+            unlink(tmppath);
+        }
     }
 
-    // Receive file data and write to disk
-    char buffer[BUFFER_SIZE];
-    while ((bytes_received = recv(client_fd, buffer, sizeof(buffer), 0)) > 0) {
-        fwrite(buffer, 1, bytes_received, fp);
-        if (bytes_received < sizeof(buffer))
-            break;
+    // Receive file data and write to disk (drained even if the open failed)
+    int ret = node_recv_file(client_fd, &hdr, fp);
+    if (ret == -1 && errno != EIO) {
+        perror("[S4] Failed to receive file data");
+        if (fp) {
+            fclose(fp);
+            unlink(tmppath);
+        }
+        return -1;
+    }
+    // Synced as the node's -d mode asks before it is acknowledged
+    if (fp && ret == 0) {
+        ret = node_store_file(fp, tmppath, filepath);
+    } else if (fp) {
+        fclose(fp);
+        unlink(tmppath);
+    }
+    // Keep the index in line with what is now on disk
+    if (fp && ret != -1 && nsindex_update(&files, filepath) == -1) {
+        fprintf(stderr, "[S4] Failed to index %s\n", filepath);
+    }
+    if (!fp || ret == -1) {
+        perror("[S4] Failed to store file");
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "STORE_FAILED");
+    }
+    if (ret == 1) {
+        fprintf(stderr, "[S4] Stored %s but could not sync it\n", filepath);
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "STORE_NOT_DURABLE");
     }
 
-    fclose(fp);
     printf("[S4] File stored successfully: %s\n", filepath);
-    send(client_fd, "STORE_SUCCESS", 13, 0);
-    return 0;
+    return proto_send_str(client_fd, PROTO_OK, req_id, "STORE_SUCCESS");
 }
 
-void handle_client(int client_fd) {
-    char request_type[20];
-    
-    // First determine if this is a download request
-    int len = recv(client_fd, request_type, sizeof(request_type) - 1, MSG_PEEK);
-    if (len <= 0) {
-        perror("[S4] Failed to determine request type");
-        return;
-    }
-    request_type[len] = '\0';
-
-    if (strncmp(request_type, "DOWNLOAD ", 9) == 0) {
-        // Handle download request
-        char request[BUFFER_SIZE];
-        len = recv(client_fd, request, sizeof(request) - 1, 0);
-        if (len <= 0) {
-            perror("[S4] Failed to receive download request");
-            return;
-        }
-        request[len] = '\0';
-
-        char *filepath = request + 9; // Skip "DOWNLOAD " prefix
-        handle_download_request(client_fd, filepath);
-    } 
-    else if (strncmp(request_type, "REMOVE ", 7) == 0) {
-        // Handle remove request
-        char request[BUFFER_SIZE];
-        len = recv(client_fd, request, sizeof(request) - 1, 0);
-        if (len <= 0) {
-            perror("[S4] Failed to receive remove request");
-            return;  // Changed from continue to return
-        }
-        request[len] = '\0';
-    
-        char *filepath = request + 7; // Skip "REMOVE " prefix
-        char expanded_path[MAX_PATH];
-        expand_path(filepath, expanded_path, sizeof(expanded_path));
-    
-        if (remove(expanded_path) == 0) {
-            printf("[S4] Deleted file: %s\n", expanded_path);
-            send(client_fd, "REMOVE_SUCCESS", 14, 0);
-        } else {
-            perror("[S4] Failed to delete file");
-            send(client_fd, "REMOVE_FAILED", 13, 0);
-        }
-    }
-        
-    else if (strncmp(request_type, "LIST ", 5) == 0) {
-        char expanded_path[MAX_PATH];
-        expand_path("~s4/", expanded_path, sizeof(expanded_path)); // Always use root
-        
-        // Find files with relative paths from server root
-        char cmd[2 * MAX_PATH];
-        snprintf(cmd, sizeof(cmd), "find %s -type f -name \"*.zip\" -printf \"%%P\\n\" | sort", expanded_path);
-        
-        FILE *fp = popen(cmd, "r");
-        char file_list[BUFFER_SIZE] = {0};
-        char line[256];
-        size_t list_size = 0;
-        
-        while (fgets(line, sizeof(line), fp)) {
-            line[strcspn(line, "\n")] = 0;
-            if (strlen(line) > 0) {
-                list_size += snprintf(file_list + list_size,
-                                    sizeof(file_list) - list_size,
-                                    "%s\n", line);
-            }
-        }
-        pclose(fp);
-        send(client_fd, file_list, list_size, 0);
-    }
+int handle_remove_request(int client_fd, uint32_t req_id, uint16_t flags, const char *filepath) {
+    char expanded_path[MAX_PATH];
+    expand_path(filepath, expanded_path, sizeof(expanded_path));
 
-    else {
-        // Handle upload request
-        handle_upload_request(client_fd);
+    if (remove(expanded_path) == 0) {
+        nsindex_update(&files, expanded_path);
+        printf("[S4] Deleted file: %s\n", expanded_path);
+        return proto_send_str(client_fd, PROTO_OK, req_id, "REMOVE_SUCCESS");
+    } else {
+        perror("[S4] Failed to delete file");
+        return proto_send_str(client_fd, PROTO_ERROR, req_id, "REMOVE_FAILED");
     }
-}
\ No newline at end of file
+}
+
+int handle_list_request(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_send_list(client_fd, req_id, flags, &files, "~s4", request);
+}
+
+// Upload sessions, for files sent in pieces (node.h)
+int handle_upload_begin(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_upload_begin(client_fd, req_id, "~s4", request);
+}
+
+int handle_upload_query(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_upload_query(client_fd, req_id, "~s4", request);
+}
+
+int handle_upload_append(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_upload_append(client_fd, req_id, flags, "~s4", request);
+}
+
+int handle_upload_commit(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_upload_commit(client_fd, req_id, &files, "~s4", request);
+}
+
+// Several files at once, named by paths and glob patterns (node.h)
+int handle_remove_many(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_remove_many(client_fd, req_id, &files, "~s4", request);
+}
+
+int handle_download_many(int client_fd, uint32_t req_id, uint16_t flags, const char *request) {
+    return node_download_many(client_fd, req_id, &files, "~s4", request);
+}
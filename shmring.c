@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "shmring.h"
+
+#define HEADER_SIZE ((sizeof(struct shmring_shared) + 4095) & ~(size_t)4095)
+
+static int map_ring(struct shmring *r, size_t map_size) {
+    void *p = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, r->mem_fd, 0);
+    if (p == MAP_FAILED) return -1;
+    r->shared = p;
+    r->data = (char *)p + HEADER_SIZE;
+    r->map_size = map_size;
+    return 0;
+}
+
+static void close_fds(struct shmring *r) {
+    if (r->mem_fd != -1) close(r->mem_fd);
+    if (r->data_fd != -1) close(r->data_fd);
+    if (r->space_fd != -1) close(r->space_fd);
+    r->mem_fd = r->data_fd = r->space_fd = -1;
+}
+
+int shmring_create(struct shmring *r, size_t size) {
+    memset(r, 0, sizeof(*r));
+    r->mem_fd = memfd_create("w25-ring", MFD_CLOEXEC);
+    r->data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    r->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->mem_fd == -1 || r->data_fd == -1 || r->space_fd == -1 ||
+        ftruncate(r->mem_fd, HEADER_SIZE + size) == -1 || map_ring(r, HEADER_SIZE + size) == -1) {
+        int err = errno;
+        close_fds(r);
+        errno = err;
+        return -1;
+    }
+    r->size = size;
+    r->shared->size = size;
+    return 0;
+}
+
+int shmring_attach(struct shmring *r, int mem_fd, int data_fd, int space_fd) {
+    memset(r, 0, sizeof(*r));
+    r->mem_fd = mem_fd;
+    r->data_fd = data_fd;
+    r->space_fd = space_fd;
+    struct stat st;
+    if (fstat(mem_fd, &st) == -1 || (size_t)st.st_size <= HEADER_SIZE ||
+        map_ring(r, st.st_size) == -1) {
+        close_fds(r);
+        errno = EINVAL;
+        return -1;
+    }
+    // The size is read once; the other side cannot make us overrun the mapping
+    r->size = st.st_size - HEADER_SIZE;
+    if (r->shared->size != r->size) {
+        shmring_free(r);
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+void shmring_free(struct shmring *r) {
+    if (r->shared) munmap(r->shared, r->map_size);
+    r->shared = NULL;
+    close_fds(r);
+}
+
+static void ring(int fd) {
+    uint64_t one = 1;
+    ssize_t n = write(fd, &one, sizeof(one));
+    (void)n;
+}
+
+static void drain(int fd) {
+    uint64_t count;
+    ssize_t n = read(fd, &count, sizeof(count));
+    (void)n;
+}
+
+// ===== Producer =====
+
+size_t shmring_space(struct shmring *r, char **p) {
+    uint64_t head = r->shared->head;
+    uint64_t tail = __atomic_load_n(&r->shared->tail, __ATOMIC_ACQUIRE);
+    size_t room = r->size - (size_t)(head - tail);
+    size_t off = head % r->size;
+    if (room > r->size - off) room = r->size - off;
+    *p = r->data + off;
+    return room;
+}
+
+void shmring_produce(struct shmring *r, size_t n) {
+    __atomic_store_n(&r->shared->head, r->shared->head + n, __ATOMIC_RELEASE);
+    // Pairs with the fence in shmring_wait_data: either the consumer sees the
+    // new head or we see that it is waiting
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->shared->consumer_waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&r->shared->consumer_waiting, 0, __ATOMIC_ACQ_REL)) {
+        ring(r->data_fd);
+    }
+}
+
+int shmring_wait_space(struct shmring *r) {
+    drain(r->space_fd);
+    __atomic_store_n(&r->shared->producer_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    char *p;
+    if (shmring_space(r, &p) == 0) return 0;
+    __atomic_store_n(&r->shared->producer_waiting, 0, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// ===== Consumer =====
+
+size_t shmring_data(struct shmring *r, const char **p) {
+    uint64_t tail = r->shared->tail;
+    uint64_t head = __atomic_load_n(&r->shared->head, __ATOMIC_ACQUIRE);
+    size_t avail = (size_t)(head - tail);
+    size_t off = tail % r->size;
+    // A producer that got the positions wrong must not send us out of bounds
+    if (avail > r->size) avail = 0;
+    if (avail > r->size - off) avail = r->size - off;
+    *p = r->data + off;
+    return avail;
+}
+
+void shmring_consume(struct shmring *r, size_t n) {
+    __atomic_store_n(&r->shared->tail, r->shared->tail + n, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->shared->producer_waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&r->shared->producer_waiting, 0, __ATOMIC_ACQ_REL)) {
+        ring(r->space_fd);
+    }
+}
+
+int shmring_wait_data(struct shmring *r, int sock) {
+    const char *p;
+    while (shmring_data(r, &p) == 0) {
+        drain(r->data_fd);
+        __atomic_store_n(&r->shared->consumer_waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (shmring_data(r, &p) > 0) {
+            __atomic_store_n(&r->shared->consumer_waiting, 0, __ATOMIC_RELAXED);
+            break;
+        }
+
+        // The socket only matters if the producer goes away; the next frame
+        // header may already be waiting on it
+        struct pollfd pfd[2] = {
+            { .fd = r->data_fd, .events = POLLIN },
+            { .fd = sock, .events = POLLRDHUP },
+        };
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (pfd[1].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+            errno = ECONNRESET;
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Single-producer single-consumer byte ring in shared memory, for moving
+// upload payloads from S1 to a storage node on the same machine without
+// pushing them through a socket.
+//
+// The ring lives in a memfd that S1 creates and passes to the node over the
+// node's Unix socket (PROTO_SHM_RING, see proto.h), together with two
+// eventfd doorbells: data_fd is rung by the producer when it has written
+// bytes, space_fd by the consumer when it has freed some. Each side only
+// rings the other when that side has said it is about to sleep, so a
+// transfer that keeps both busy makes no system calls for the ring at all.
+//
+// Positions are byte counts since the ring was created; head - tail is the
+// number of bytes waiting. S1 (the producer) never blocks on the ring: it
+// polls space_fd with its other descriptors. The node's worker (the
+// consumer) sleeps in shmring_wait_data.
+//
+// Used by S1 and the storage nodes (node.c); build both with shmring.c.
+
+// Start of the mapping. The producer's and the consumer's fields are on
+// cache lines of their own.
+struct shmring_shared {
+    uint64_t size;                      // data bytes after this header
+    _Alignas(64) uint64_t head;         // written by the producer
+    uint32_t producer_waiting;          // producer sleeps until space_fd rings
+    _Alignas(64) uint64_t tail;         // written by the consumer
+    uint32_t consumer_waiting;          // consumer sleeps until data_fd rings
+};
+
+struct shmring {
+    struct shmring_shared *shared;
+    char *data;
+    size_t size;
+    size_t map_size;
+    int mem_fd;
+    int data_fd;
+    int space_fd;
+};
+
+// Create a ring with size data bytes. Returns -1 on error.
+int shmring_create(struct shmring *r, size_t size);
+
+// Map the ring created by the other side from its three descriptors, which
+// the ring then owns. Returns -1 (and closes them) if they are not a ring.
+int shmring_attach(struct shmring *r, int mem_fd, int data_fd, int space_fd);
+
+// Unmap the ring and close its descriptors
+void shmring_free(struct shmring *r);
+
+// Producer: free bytes that can be written in one piece at *p
+size_t shmring_space(struct shmring *r, char **p);
+
+// Producer: make n bytes written at the shmring_space pointer visible
+void shmring_produce(struct shmring *r, size_t n);
+
+// Producer: get ready to sleep on space_fd. Returns 1 if space turned up in
+// the meantime (carry on), 0 if the consumer will ring space_fd once it frees
+// some.
+int shmring_wait_space(struct shmring *r);
+
+// Consumer: bytes that can be read in one piece at *p
+size_t shmring_data(struct shmring *r, const char **p);
+
+// Consumer: release n bytes read at the shmring_data pointer
+void shmring_consume(struct shmring *r, size_t n);
+
+// Consumer: wait until there is data. sock is the connection the ring
+// belongs to; if the producer hangs up on it the wait fails with ECONNRESET.
+int shmring_wait_data(struct shmring *r, int sock);
+
+#endif
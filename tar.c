@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "proto.h"
+#include "xfer.h"
+#include "tar.h"
+
+#define TAR_RECORD (20 * TAR_BLOCK)         // archives end on a whole record, like tar(1)'s
+#define USTAR_MAX_SIZE 077777777777ULL      // largest value of the 12-byte size field
+#define USTAR_MAX_ID 07777777               // largest value of the 8-byte uid/gid fields
+
+static const unsigned char zeros[TAR_RECORD];
+
+int tar_list_add(struct tar_list *list, const char *path) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? 2 * list->cap : 64;
+        char **paths = realloc(list->paths, cap * sizeof(*paths));
+        if (!paths) return -1;
+        list->paths = paths;
+        list->cap = cap;
+    }
+    list->paths[list->count] = strdup(path);
+    if (!list->paths[list->count]) return -1;
+    list->count++;
+    return 0;
+}
+
+// Same match as find's -name "*<ext>"
+static int has_ext(const char *name, const char *ext) {
+    size_t len = strlen(name), ext_len = strlen(ext);
+    return len >= ext_len && strcmp(name + len - ext_len, ext) == 0;
+}
+
+static int collect_dir(struct tar_list *list, const char *dir, const char *ext) {
+    struct dirent **entries;
+    int n = scandir(dir, &entries, NULL, alphasort);
+    if (n == -1) return 0;
+
+    int ret = 0;
+    for (int i = 0; i < n; i++) {
+        const char *name = entries[i]->d_name;
+        char path[PATH_MAX];
+        struct stat st;
+        if (ret == 0 && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 &&
+            snprintf(path, sizeof(path), "%s/%s", dir, name) < (int)sizeof(path) &&
+            lstat(path, &st) == 0) {
+            // Symlinks are not followed, as with find -type f
+            if (S_ISDIR(st.st_mode)) {
+                ret = collect_dir(list, path, ext);
+            } else if (S_ISREG(st.st_mode) && has_ext(name, ext)) {
+                ret = tar_list_add(list, path);
+            }
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    return ret;
+}
+
+int tar_collect(struct tar_list *list, const char *root, const char *ext) {
+    memset(list, 0, sizeof(*list));
+    if (collect_dir(list, root, ext) == -1) {
+        tar_list_free(list);
+        return -1;
+    }
+    return 0;
+}
+
+void tar_list_free(struct tar_list *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+    memset(list, 0, sizeof(*list));
+}
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+void tar_list_sort(struct tar_list *list) {
+    if (list->count == 0) return;
+    qsort(list->paths, list->count, sizeof(list->paths[0]), compare_paths);
+    size_t kept = 1;
+    for (size_t i = 1; i < list->count; i++) {
+        if (strcmp(list->paths[i], list->paths[kept - 1]) == 0) {
+            free(list->paths[i]);
+        } else {
+            list->paths[kept++] = list->paths[i];
+        }
+    }
+    list->count = kept;
+}
+
+// Numeric fields are zero-padded octal ending in a NUL
+static void put_octal(unsigned char *field, size_t width, uint64_t value) {
+    char digits[24];
+    snprintf(digits, sizeof(digits), "%0*llo", (int)width - 1, (unsigned long long)value);
+    memcpy(field, digits, width - 1);
+}
+
+static void put_string(unsigned char *field, size_t width, const char *value) {
+    size_t len = strlen(value);
+    memcpy(field, value, len < width ? len : width);
+}
+
+static void ustar_block(unsigned char *block, const char *name, const char *prefix,
+                        const struct stat *st, uint64_t size, char type) {
+    put_string(block, 100, name);
+    put_octal(block + 100, 8, st->st_mode & 07777);
+    put_octal(block + 108, 8, st->st_uid <= USTAR_MAX_ID ? st->st_uid : 0);
+    put_octal(block + 116, 8, st->st_gid <= USTAR_MAX_ID ? st->st_gid : 0);
+    put_octal(block + 124, 12, size <= USTAR_MAX_SIZE ? size : 0);
+    put_octal(block + 136, 12, st->st_mtime > 0 ? (uint64_t)st->st_mtime : 0);
+    block[156] = type;
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    put_string(block + 345, 155, prefix);
+
+    // The checksum is taken with its own field set to spaces
+    unsigned int sum = 0;
+    memset(block + 148, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        sum += block[i];
+    }
+    char digits[8];
+    snprintf(digits, sizeof(digits), "%06o", sum);
+    memcpy(block + 148, digits, 7);
+}
+
+// ustar keeps a path as prefix (up to 155 bytes) + '/' + name (up to 100)
+static int split_name(const char *path, char *name, char *prefix) {
+    size_t len = strlen(path);
+    if (len <= 100) {
+        strcpy(name, path);
+        prefix[0] = '\0';
+        return 0;
+    }
+    for (size_t i = 0; i < len && i <= 155; i++) {
+        if (path[i] == '/' && len - i - 1 <= 100 && len - i - 1 > 0) {
+            memcpy(prefix, path, i);
+            prefix[i] = '\0';
+            strcpy(name, path + i + 1);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// A pax record is "<length> <key>=<value>\n", where length counts itself
+static size_t pax_record(char *out, size_t size, const char *key, const char *value) {
+    size_t body = strlen(key) + strlen(value) + 3;
+    size_t len = body + 1;
+    while (1) {
+        char digits[24];
+        size_t total = body + snprintf(digits, sizeof(digits), "%zu", len);
+        if (total == len) break;
+        len = total;
+    }
+    if (len >= size) return 0;
+    snprintf(out, size, "%zu %s=%s\n", len, key, value);
+    return len;
+}
+
+size_t tar_header(unsigned char *buf, const char *path, const struct stat *st) {
+    // Members are stored relative to the root, like tar(1) does
+    while (*path == '/') path++;
+
+    char name[101], prefix[156];
+    char pax[TAR_HEADER_MAX - 2 * TAR_BLOCK];
+    size_t pax_len = 0;
+    if (split_name(path, name, prefix) == -1) {
+        pax_len += pax_record(pax + pax_len, sizeof(pax) - pax_len, "path", path);
+        snprintf(name, sizeof(name), "%s", path);
+        prefix[0] = '\0';
+    }
+    if ((uint64_t)st->st_size > USTAR_MAX_SIZE) {
+        char size[24];
+        snprintf(size, sizeof(size), "%llu", (unsigned long long)st->st_size);
+        pax_len += pax_record(pax + pax_len, sizeof(pax) - pax_len, "size", size);
+    }
+
+    memset(buf, 0, TAR_HEADER_MAX);
+    size_t len = 0;
+    if (pax_len > 0) {
+        const char *base = strrchr(path, '/');
+        char pax_name[101];
+        snprintf(pax_name, sizeof(pax_name), "PaxHeaders/%s", base ? base + 1 : path);
+        ustar_block(buf, pax_name, "", st, pax_len, 'x');
+        memcpy(buf + TAR_BLOCK, pax, pax_len);
+        len = TAR_BLOCK + pax_len + tar_padding(pax_len);
+    }
+    ustar_block(buf + len, name, prefix, st, st->st_size, '0');
+    return len + TAR_BLOCK;
+}
+
+static uint64_t get_octal(const unsigned char *field, size_t width) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < width && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+static void get_string(char *out, const unsigned char *field, size_t width) {
+    size_t len = strnlen((const char *)field, width);
+    memcpy(out, field, len);
+    out[len] = '\0';
+}
+
+long tar_parse_header(const unsigned char *buf, size_t len, char *path, size_t path_size,
+                      uint64_t *size) {
+    if (len < TAR_BLOCK) return TAR_BLOCK;
+    if (memcmp(buf + 257, "ustar", 5) != 0) return -1;
+
+    // A pax header comes first when the path or size did not fit
+    const unsigned char *block = buf;
+    long header_len = TAR_BLOCK;
+    char pax_path[PATH_MAX] = "";
+    const char *pax_size = NULL;
+    char records[TAR_HEADER_MAX];
+    if (buf[156] == 'x') {
+        uint64_t pax_len = get_octal(buf + 124, 12);
+        if (pax_len >= sizeof(records)) return -1;
+        header_len = TAR_BLOCK + pax_len + tar_padding(pax_len) + TAR_BLOCK;
+        if (header_len > TAR_HEADER_MAX) return -1;
+        if (len < (size_t)header_len) return header_len;
+
+        memcpy(records, buf + TAR_BLOCK, pax_len);
+        records[pax_len] = '\0';
+        for (char *rec = records; *rec; ) {
+            char *end;
+            unsigned long rec_len = strtoul(rec, &end, 10);
+            if (rec_len == 0 || *end != ' ' || rec_len > strlen(rec)) return -1;
+            rec[rec_len - 1] = '\0';
+            if (strncmp(end + 1, "path=", 5) == 0) {
+                snprintf(pax_path, sizeof(pax_path), "%s", end + 6);
+            } else if (strncmp(end + 1, "size=", 5) == 0) {
+                pax_size = end + 6;
+            }
+            rec += rec_len;
+        }
+        block = buf + header_len - TAR_BLOCK;
+    }
+    if (block[156] != '0' && block[156] != '\0') return -1;
+
+    if (pax_path[0]) {
+        snprintf(path, path_size, "%s", pax_path);
+    } else {
+        char name[101], prefix[156];
+        get_string(name, block, 100);
+        get_string(prefix, block + 345, 155);
+        snprintf(path, path_size, prefix[0] ? "%s/%s" : "%s%s", prefix, name);
+    }
+    *size = pax_size ? strtoull(pax_size, NULL, 10) : get_octal(block + 124, 12);
+    return header_len;
+}
+
+uint64_t tar_padding(uint64_t size) {
+    return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+uint64_t tar_trailer(uint64_t written) {
+    uint64_t end = written + 2 * TAR_BLOCK;
+    return end + (TAR_RECORD - end % TAR_RECORD) % TAR_RECORD - written;
+}
+
+static int send_zeros(int fd, uint64_t len) {
+    while (len > 0) {
+        size_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+        if (send_all(fd, zeros, n) == -1) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+int tar_send(int fd, uint32_t req_id, const struct tar_list *list) {
+    unsigned char header[TAR_HEADER_MAX];
+    uint64_t written = 0;
+
+    for (size_t i = 0; i < list->count; i++) {
+        // Files removed since the walk are left out
+        int file = open(list->paths[i], O_RDONLY);
+        if (file == -1) continue;
+        struct stat st;
+        if (fstat(file, &st) == -1 || !S_ISREG(st.st_mode)) {
+            close(file);
+            continue;
+        }
+
+        size_t header_len = tar_header(header, list->paths[i] + list->strip, &st);
+        uint64_t padding = tar_padding(st.st_size);
+        uint64_t member = header_len + st.st_size + padding;
+        if (proto_send_header(fd, PROTO_DATA, PROTO_F_MORE, req_id, member) == -1 ||
+            send_all(fd, header, header_len) == -1 ||
+            sendfile_all(fd, file, 0, st.st_size) == -1 ||
+            send_zeros(fd, padding) == -1) {
+            close(file);
+            return -1;
+        }
+        close(file);
+        written += member;
+    }
+
+    uint64_t trailer = tar_trailer(written);
+    if (proto_send_header(fd, PROTO_DATA, 0, req_id, trailer) == -1) return -1;
+    return send_zeros(fd, trailer);
+}
@@ -0,0 +1,67 @@
+#ifndef TAR_H
+#define TAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// Streaming tar writer used for `downltar` by S1 (.c) and by S2/S3 (.pdf/.txt).
+//
+// The archive is produced while it is sent: each file becomes a ustar header
+// (preceded by a pax extended header when the path or the size does not fit
+// the ustar fields) followed by the file body, padded to a 512-byte block.
+// Bodies are sent with sendfile, so no temporary archive is ever written.
+//
+// On the wire every member is one DATA frame with PROTO_F_MORE set and the
+// end-of-archive blocks are the final frame, so the receiver can start writing
+// before the whole tree has been read.
+//
+// Member names are the file paths with the leading '/' removed, as tar(1)
+// stores them, or with a list's strip bytes removed. Link tar.c into every
+// program along with proto.c; the client only reads archives.
+
+#define TAR_BLOCK 512
+#define TAR_HEADER_MAX (12 * TAR_BLOCK)     // pax header + records + ustar header
+
+// Files to archive, in the order they are written
+struct tar_list {
+    char **paths;
+    size_t count;
+    size_t cap;
+    size_t strip;       // leading bytes of each path left out of its member name
+};
+
+// Collect every regular file under root whose name ends in ext, directory by
+// directory in name order. Unreadable directories are skipped, as find(1)
+// would. Returns -1 only when memory runs out.
+int tar_collect(struct tar_list *list, const char *root, const char *ext);
+void tar_list_free(struct tar_list *list);
+
+// Add path to the end of list. Returns -1 if memory runs out.
+int tar_list_add(struct tar_list *list, const char *path);
+
+// Put list in byte order and drop paths that are in it twice
+void tar_list_sort(struct tar_list *list);
+
+// Fill buf (TAR_HEADER_MAX bytes) with the header blocks for path and return
+// their length, a multiple of TAR_BLOCK
+size_t tar_header(unsigned char *buf, const char *path, const struct stat *st);
+
+// Zero bytes that follow a body of size bytes
+uint64_t tar_padding(uint64_t size);
+
+// Zero bytes that end an archive after written bytes of members
+uint64_t tar_trailer(uint64_t written);
+
+// Read the header blocks at the start of a member as tar_header writes them.
+// Returns their length; once len covers it, path and *size are set to the
+// member's. With less in buf (at least the first block) the length says how
+// much to read. Returns -1 if buf does not start with a file member.
+long tar_parse_header(const unsigned char *buf, size_t len, char *path, size_t path_size,
+                      uint64_t *size);
+
+// Send the archive of list to fd as DATA frames for req_id (blocking).
+// Returns -1 if the connection can no longer be used.
+int tar_send(int fd, uint32_t req_id, const struct tar_list *list);
+
+#endif
@@ -0,0 +1,364 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "uring.h"
+
+// IORING_OP_MSG_RING, by number: it stands for a 5.18 kernel (uring.h) and
+// older headers do not have it
+#define OP_MSG_RING 40
+
+// Indices of the transfer's descriptors in the registered file table
+#define FILE_SOCK 0
+#define FILE_DATA 1
+
+// What a completion is for: slot, operation and the bytes it was asked to move
+#define OP_RECV  0
+#define OP_WRITE 1
+#define OP_READ  2
+#define OP_SEND  3
+#define USER_DATA(slot, op, len) ((uint64_t)(len) << 16 | (uint64_t)(op) << 8 | (slot))
+#define UD_SLOT(ud) ((int)((ud) & 0xff))
+#define UD_OP(ud)   ((int)(((ud) >> 8) & 0xff))
+#define UD_LEN(ud)  ((int64_t)((ud) >> 16))
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Whether the ring supports every opcode in ops
+static int probe_ops(int fd, const uint8_t *ops, int count) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (!probe) return 0;
+    int ok = sys_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (int i = 0; ok && i < count; i++) {
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+// Create the ring and map it, if the kernel has the opcodes in ops
+static int setup_ring(struct uring *u, const uint8_t *ops, int count) {
+    memset(u, 0, sizeof(*u));
+    u->ring_map = MAP_FAILED;
+    u->sqes = MAP_FAILED;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->fd = sys_setup(URING_ENTRIES, &p);
+    if (u->fd == -1) return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !probe_ops(u->fd, ops, count)) {
+        uring_free(u);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // Submission and completion rings share one mapping; the entries have their own
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_map_size = sq_size > cq_size ? sq_size : cq_size;
+    u->ring_map = mmap(NULL, u->ring_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       u->fd, IORING_OFF_SQ_RING);
+    u->sqes_map_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->ring_map == MAP_FAILED || u->sqes == MAP_FAILED) {
+        uring_free(u);
+        return -1;
+    }
+    char *ring = u->ring_map;
+    u->sq_head = (unsigned *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(ring + p.sq_off.array);
+    u->cq_head = (unsigned *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    return 0;
+}
+
+int uring_init(struct uring *u, size_t chunk) {
+    static const uint8_t ops[] = {
+        IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+        IORING_OP_FSYNC, OP_MSG_RING
+    };
+    if (setup_ring(u, ops, sizeof(ops)) == -1) return -1;
+
+    // The buffers are pinned once here rather than on every operation
+    u->chunk = chunk;
+    u->buffers = aligned_alloc(4096, URING_SLOTS * chunk);
+    struct iovec iov[URING_SLOTS];
+    for (int i = 0; u->buffers && i < URING_SLOTS; i++) {
+        iov[i].iov_base = u->buffers + i * chunk;
+        iov[i].iov_len = chunk;
+    }
+    int files[2] = { -1, -1 };
+    if (!u->buffers || sys_register(u->fd, IORING_REGISTER_BUFFERS, iov, URING_SLOTS) == -1 ||
+        sys_register(u->fd, IORING_REGISTER_FILES, files, 2) == -1) {
+        int err = u->buffers ? errno : ENOMEM;
+        uring_free(u);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int uring_init_sync(struct uring *u) {
+    static const uint8_t ops[] = { IORING_OP_FSYNC };
+    return setup_ring(u, ops, sizeof(ops));
+}
+
+void uring_free(struct uring *u) {
+    if (u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_map_size);
+    if (u->ring_map != MAP_FAILED) munmap(u->ring_map, u->ring_map_size);
+    if (u->fd != -1) close(u->fd);
+    free(u->buffers);
+    u->sqes = MAP_FAILED;
+    u->ring_map = MAP_FAILED;
+    u->fd = -1;
+    u->buffers = NULL;
+}
+
+// Point the registered file table at this transfer's descriptors, or clear it
+// afterwards (-1s) so the ring does not keep them open
+static int set_files(struct uring *u, int sock, int fd) {
+    int files[2] = { sock, fd };
+    struct io_uring_files_update update = { .offset = 0, .fds = (uint64_t)(uintptr_t)files };
+    return sys_register(u->fd, IORING_REGISTER_FILES_UPDATE, &update, 2) == 2 ? 0 : -1;
+}
+
+// The next free submission entry, cleared. There is always one: a transfer
+// never has more than two per slot queued, and a batch of syncs no more than
+// URING_ENTRIES.
+static struct io_uring_sqe *get_sqe(struct uring *u) {
+    unsigned tail = *u->sq_tail;
+    unsigned index = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static void prep(struct io_uring_sqe *sqe, uint8_t opcode, int file, char *buf, size_t len,
+                 uint64_t offset, uint64_t user_data) {
+    sqe->opcode = opcode;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = file;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+}
+
+// Submit what is queued and wait for at least one completion. If that fails
+// the operations in flight can no longer be accounted for, so the ring is
+// freed.
+static int submit_and_wait(struct uring *u) {
+    while (1) {
+        unsigned pending = *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (sys_enter(u->fd, pending, 1, IORING_ENTER_GETEVENTS) >= 0) return 0;
+        if (errno != EINTR) break;
+    }
+    int err = errno;
+    uring_free(u);
+    errno = err;
+    return -1;
+}
+
+// Take the next completion, if there is one
+static int next_cqe(struct uring *u, uint64_t *user_data, int32_t *res) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int uring_recv_file(struct uring *u, int sock, int fd, off_t offset, uint64_t len, int *failed) {
+    // Nothing has been received yet: the caller can still use its own path
+    if (set_files(u, sock, fd) == -1) return 1;
+
+    int ops[URING_SLOTS] = { 0 };   // operations in flight per slot
+    int in_flight = 0;
+    int receiving = 0;
+    uint64_t queued = 0;
+    int err = 0;
+    while (1) {
+        int slot = -1;
+        for (int i = 0; i < URING_SLOTS && slot == -1; i++) {
+            if (ops[i] == 0) slot = i;
+        }
+        // One receive at a time keeps the bytes in order
+        if (!err && !receiving && queued < len && slot != -1) {
+            size_t n = len - queued < u->chunk ? len - queued : u->chunk;
+            char *buf = u->buffers + slot * u->chunk;
+            struct io_uring_sqe *sqe = get_sqe(u);
+            prep(sqe, IORING_OP_RECV, FILE_SOCK, buf, n, 0, USER_DATA(slot, OP_RECV, n));
+            sqe->msg_flags = MSG_WAITALL;
+            ops[slot]++;
+            if (!*failed) {
+                // Runs only once the receive has filled the whole buffer
+                sqe->flags |= IOSQE_IO_LINK;
+                sqe = get_sqe(u);
+                prep(sqe, IORING_OP_WRITE_FIXED, FILE_DATA, buf, n, offset + queued,
+                     USER_DATA(slot, OP_WRITE, n));
+                sqe->buf_index = slot;
+                ops[slot]++;
+            }
+            in_flight += ops[slot];
+            queued += n;
+            receiving = 1;
+            continue;
+        }
+        if (in_flight == 0) break;
+
+        if (submit_and_wait(u) == -1) {
+            errno = err ? err : errno;
+            return -1;
+        }
+        uint64_t ud;
+        int32_t res;
+        while (next_cqe(u, &ud, &res)) {
+            ops[UD_SLOT(ud)]--;
+            in_flight--;
+            if (UD_OP(ud) == OP_RECV) {
+                receiving = 0;
+                // Short only when the connection ended; its write is cancelled
+                if (res != UD_LEN(ud) && !err) err = res < 0 ? -res : ECONNRESET;
+            } else if (res != UD_LEN(ud) && res != -ECANCELED) {
+                *failed = 1;
+            }
+        }
+    }
+    set_files(u, -1, -1);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int uring_send_file(struct uring *u, int sock, int fd, off_t offset, uint64_t len) {
+    if (set_files(u, sock, fd) == -1) return 1;
+
+    enum { FREE, READING, READY, SENDING } state[URING_SLOTS] = { FREE };
+    uint64_t seq[URING_SLOTS] = { 0 };
+    uint64_t next_read = 0, next_send = 0;  // chunk numbers
+    uint64_t queued = 0;
+    int in_flight = 0;
+    int sending = 0;
+    int err = 0;
+    while (1) {
+        int progress = 0;
+        for (int i = 0; i < URING_SLOTS && !err; i++) {
+            char *buf = u->buffers + i * u->chunk;
+            if (state[i] == FREE && queued < len) {
+                size_t n = len - queued < u->chunk ? len - queued : u->chunk;
+                struct io_uring_sqe *sqe = get_sqe(u);
+                prep(sqe, IORING_OP_READ_FIXED, FILE_DATA, buf, n, offset + queued,
+                     USER_DATA(i, OP_READ, n));
+                sqe->buf_index = i;
+                state[i] = READING;
+                seq[i] = next_read++;
+                queued += n;
+                in_flight++;
+                if (!sending && seq[i] == next_send) {
+                    // The socket is idle: send the chunk as soon as it is read
+                    sqe->flags |= IOSQE_IO_LINK;
+                    sqe = get_sqe(u);
+                    prep(sqe, IORING_OP_SEND, FILE_SOCK, buf, n, 0, USER_DATA(i, OP_SEND, n));
+                    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+                    sending = 1;
+                    in_flight++;
+                }
+                progress = 1;
+            } else if (state[i] == READY && !sending && seq[i] == next_send) {
+                uint64_t left = len - seq[i] * u->chunk;
+                size_t n = left < u->chunk ? left : u->chunk;
+                struct io_uring_sqe *sqe = get_sqe(u);
+                prep(sqe, IORING_OP_SEND, FILE_SOCK, buf, n, 0, USER_DATA(i, OP_SEND, n));
+                sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+                state[i] = SENDING;
+                sending = 1;
+                in_flight++;
+                progress = 1;
+            }
+        }
+        if (progress) continue;
+        if (in_flight == 0) break;
+
+        if (submit_and_wait(u) == -1) {
+            errno = err ? err : errno;
+            return -1;
+        }
+        uint64_t ud;
+        int32_t res;
+        while (next_cqe(u, &ud, &res)) {
+            int i = UD_SLOT(ud);
+            in_flight--;
+            if (UD_OP(ud) == OP_READ) {
+                // A linked send that is still to come keeps the slot busy
+                if (state[i] == READING) state[i] = sending && seq[i] == next_send ? SENDING : READY;
+                if (res != UD_LEN(ud)) {
+                    if (!err) err = res < 0 ? -res : EIO;
+                    if (state[i] == READY) state[i] = FREE;
+                }
+            } else {
+                sending = 0;
+                next_send++;
+                state[i] = FREE;
+                if (res != UD_LEN(ud) && !err) err = res < 0 ? -res : EPIPE;
+            }
+        }
+    }
+    set_files(u, -1, -1);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int uring_sync(struct uring *u, const int *fds, const int *datasync, int *results, int count) {
+    for (int first = 0; first < count; first += URING_ENTRIES) {
+        int n = count - first < URING_ENTRIES ? count - first : URING_ENTRIES;
+        for (int i = first; i < first + n; i++) {
+            struct io_uring_sqe *sqe = get_sqe(u);
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = fds[i];
+            sqe->fsync_flags = datasync[i] ? IORING_FSYNC_DATASYNC : 0;
+            sqe->user_data = i;
+        }
+        for (int done = 0; done < n; ) {
+            if (submit_and_wait(u) == -1) return -1;
+            uint64_t ud;
+            int32_t res;
+            while (next_cqe(u, &ud, &res)) {
+                results[ud] = res < 0 ? -1 : 0;
+                done++;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,77 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+// io_uring transfers between a socket and a file, for the storage nodes'
+// upload and download paths, and batches of syncs for their group commits.
+// Each worker thread has a ring of its own; one transfer keeps several chunks
+// in flight on it, so the disk and the network work at the same time instead
+// of taking turns:
+//
+// - upload: a receive into a chunk buffer with the write of that buffer to
+//   the file linked behind it (IOSQE_IO_LINK). Receives go one at a time to
+//   keep the byte order; the writes they trigger overlap the next receive.
+// - download: file reads run ahead into the free buffers and the sends go
+//   out in order behind them; a read issued when the socket is idle has its
+//   send linked behind it.
+//
+// The chunk buffers are registered with the ring (READ_FIXED, WRITE_FIXED)
+// and so are the socket and the file for the length of a transfer.
+//
+// Talks to the kernel with the raw system calls; no liburing. uring_init
+// probes the kernel for the opcodes used (IORING_REGISTER_PROBE) and fails
+// without them; the caller keeps its blocking path then. Linked receives and
+// sends also rely on MSG_WAITALL being retried until complete, which came
+// with 5.18 and has no feature flag of its own; the probe asks for
+// IORING_OP_MSG_RING, new in the same release, for it.
+
+#define URING_SLOTS   4     // chunk buffers, so chunks in flight per transfer
+#define URING_ENTRIES 16    // submission queue entries, two per slot at most
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_map;
+    size_t ring_map_size;
+    size_t sqes_map_size;
+    char *buffers;          // URING_SLOTS registered buffers of chunk bytes
+    size_t chunk;
+};
+
+// Set up a ring with URING_SLOTS buffers of chunk bytes each. Returns -1 with
+// errno set if the kernel cannot do it (ENOSYS for a kernel that is too old).
+int uring_init(struct uring *u, size_t chunk);
+
+// Set up a ring for uring_sync alone: no buffers, and only IORING_OP_FSYNC
+// is asked of the kernel.
+int uring_init_sync(struct uring *u);
+
+// Also called on a ring whose system calls fail in the middle of a
+// transfer: the transfer fails and fd is -1 from then on.
+void uring_free(struct uring *u);
+
+// Receive len bytes from sock and write them to fd from offset on. After a
+// write error, or with *failed already set, the bytes are received and dropped
+// so the connection stays usable; *failed is then 1. Returns -1 only if the
+// connection broke, and 1 if the ring could not take the descriptors: nothing
+// has been received then, and the caller moves the bytes some other way.
+int uring_recv_file(struct uring *u, int sock, int fd, off_t offset, uint64_t len, int *failed);
+
+// Send len bytes of fd from offset on to sock. A file that shrinks before
+// they were read fails with EIO. Returns 1, with nothing sent, like
+// uring_recv_file.
+int uring_send_file(struct uring *u, int sock, int fd, off_t offset, uint64_t len);
+
+// Sync count descriptors at once, fdatasync for those with datasync set and
+// fsync for the rest, so the kernel can put them in the same journal commits.
+// Each result is 0 or -1. Returns -1 if the ring failed; the results are
+// unknown then.
+int uring_sync(struct uring *u, const int *fds, const int *datasync, int *results, int count);
+
+#endif
@@ -3,49 +3,148 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
-#include <errno.h>          
-#include <sys/time.h>       
+#include <errno.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <glob.h>
+#include <fnmatch.h>
+
+#include "proto.h"
+#include "xfer.h"
+#include "tar.h"
 
 #define SERVER_IP "127.0.0.1"
 #define PORT 5077
 #define BUFFER_SIZE 1024
+#define UPLOAD_CHUNK (4 * 1024 * 1024)  // bytes per piece of a resumable upload
+#define DEFAULT_CONNECTIONS 4           // connections a parallel transfer uses
+#define DEFAULT_PARALLEL_CHUNK_KB 8192  // bytes each of them moves per request
+#define DEFAULT_BATCH_DEPTH 16          // batch mode: requests kept in flight
+#define MAX_TARGETS 64                  // paths one removef / downlf / uploadf takes
+
+// A file moved in chunks over several connections at once. Each connection
+// claims the next chunk until there are none left; the chunks are written
+// into place in the local file (download) or the server's part file
+// (upload), in whatever order they come.
+struct parallel {
+    const char *path;           // download: file on the server
+    const char *filename;       // upload: local file, and where it goes
+    const char *destination;
+    int fd;                     // the local file
+    uint64_t size;
+    uint64_t next;              // offset of the next chunk to claim
+    int failed;
+};
 
 void upload_file(int sockfd, char *filename, char *destination);
-void download_file(int sockfd, char *filepath);
+int upload_parallel(int sockfd, const char *filename, const char *destination);
+int download_parallel(int sockfd, const char *path);
+int send_piece(int sockfd, const char *filename, const char *destination, int fd,
+               uint64_t offset, uint64_t len, uint16_t flags, char *response, size_t size);
+int recv_piece(int sockfd, const char *filename, int *fd, uint64_t offset, uint64_t *size);
+void *parallel_worker(void *arg);
+int run_parallel(struct parallel *p);
+int connect_to_server(void);
+int upload_resumable(int sockfd, const char *filename, const char *destination);
+int session_request(int sockfd, uint8_t type, const char *request, char *response, size_t size);
+void download_file(int sockfd, char *filepath, uint64_t offset);
+void save_download(int sockfd, const struct proto_header *reply, const char *filepath, uint64_t offset);
+const char *tar_name(const char *filetype);
+int run_batch(int sockfd, FILE *in, int depth);
+int batch_args(const char *command, int count);
+void *batch_receiver(void *arg);
+int request_range(int sockfd, const char *path, uint64_t offset, uint64_t length);
+const char *local_name(const char *path);
+int print_response(int sockfd);
+int list_files(int sockfd, const char *path, int long_format);
+int split_paths(char *args, char *paths[], int max);
+int has_pattern(const char *path);
+int send_many(int sockfd, uint8_t type, char *paths[], int count);
+int remove_many(int sockfd, char *paths[], int count);
+int download_many(int sockfd, char *paths[], int count);
+int save_member(int sockfd, const struct proto_header *hdr, char *paths[], int count, char *matched);
+void mark_matched(const char *path, char *paths[], int count, char *matched);
+void report_unmatched(char *paths[], int count, const char *matched);
+int upload_many(int sockfd, char *paths[], int count, int depth);
+
+static uint32_t next_req_id = 1;
+static int parallel_connections = DEFAULT_CONNECTIONS;
+static uint64_t parallel_chunk = DEFAULT_PARALLEL_CHUNK_KB * 1024;
+
+// Parallel transfers take request ids from several threads
+static uint32_t new_req_id(void) {
+    return __atomic_fetch_add(&next_req_id, 1, __ATOMIC_RELAXED);
+}
 
-int main() {
+int main(int argc, char *argv[]) {
     int sockfd;
-    struct sockaddr_in server_addr;
     char command[BUFFER_SIZE], filename[256], destination[256];
+    char args[BUFFER_SIZE], *paths[MAX_TARGETS];
+    unsigned long long offset, length;
+    const char *batch_file = NULL;
+    int batch_depth = DEFAULT_BATCH_DEPTH;
 
-    // Create socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd == -1) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
+    // Options: -j <connections for parallel transfers>
+    //          -k <KB each of them moves per request>
+    //          -b <file of commands to run as a batch, - for stdin>
+    //          -q <requests a batch keeps in flight>
+    //          -x <KB moved per step of a transfer>
+    int opt_char;
+    while ((opt_char = getopt(argc, argv, "j:k:b:q:x:")) != -1) {
+        switch (opt_char) {
+        case 'j':
+            parallel_connections = atoi(optarg);
+            if (parallel_connections < 1) parallel_connections = 1;
+            break;
+        case 'k':
+            parallel_chunk = strtoull(optarg, NULL, 10) * 1024;
+            if (parallel_chunk == 0) parallel_chunk = DEFAULT_PARALLEL_CHUNK_KB * 1024;
+            break;
+        case 'b':
+            batch_file = optarg;
+            break;
+        case 'q':
+            batch_depth = atoi(optarg);
+            if (batch_depth < 1) batch_depth = 1;
+            break;
+        case 'x':
+            xfer_set_chunk((size_t)strtoull(optarg, NULL, 10) * 1024);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-j connections] [-k chunk_kb] [-b batch_file] [-q batch_depth] [-x xfer_kb]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // Server details
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr);
+    // Uploads use sendfile, which raises SIGPIPE if S1 goes away mid-transfer
+    signal(SIGPIPE, SIG_IGN);
 
-    // Connect to server
-    if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
-        perror("Connection to S1 failed");
+    sockfd = connect_to_server();
+    if (sockfd == -1) exit(EXIT_FAILURE);
+
+    if (batch_file) {
+        FILE *in = strcmp(batch_file, "-") == 0 ? stdin : fopen(batch_file, "r");
+        if (!in) {
+            perror("Failed to open batch file");
+            exit(EXIT_FAILURE);
+        }
+        int ret = run_batch(sockfd, in, batch_depth);
         close(sockfd);
-        exit(EXIT_FAILURE);
+        return ret == 0 ? 0 : EXIT_FAILURE;
     }
 
     printf("Connected to S1.\n");
 
     while (1) {
         printf("Enter command (or 'exit' to quit):\n");
-        fgets(command, sizeof(command), stdin);
+        if (!fgets(command, sizeof(command), stdin)) break;
         command[strcspn(command, "\n")] = 0;  // Remove newline
 
         // Exit condition
@@ -54,67 +153,101 @@ int main() {
             break;
         }
 
+        // Several paths, or glob patterns, are handled in one go
+        int count = 0;
+        if (sscanf(command, "uploadf %1023[^\n]", args) == 1 ||
+            sscanf(command, "downlf %1023[^\n]", args) == 1 ||
+            sscanf(command, "removef %1023[^\n]", args) == 1) {
+            count = split_paths(args, paths, MAX_TARGETS);
+        }
+        // (an upload's last path is where the files go)
+        int upload = command[0] == 'u';
+        int many = count > 0 && paths[0][0] != '-' &&
+                   (count > 1 + upload || (count > upload && has_pattern(paths[0])));
+
         // Parse and handle upload command
-        if (sscanf(command, "uploadf %s %s", filename, destination) == 2) {
-            send(sockfd, command, strlen(command), 0);  // Send upload command
+        if (many && upload) {
+            if (upload_many(sockfd, paths, count, batch_depth) == -1) break;
+        }
+        else if (sscanf(command, "uploadf -c %255s %255s", filename, destination) == 2) {
+            if (upload_resumable(sockfd, filename, destination) == -1) break;
+        }
+        else if (sscanf(command, "uploadf -p %255s %255s", filename, destination) == 2) {
+            if (upload_parallel(sockfd, filename, destination) == -1) break;
+        }
+        else if (sscanf(command, "uploadf %s %s", filename, destination) == 2) {
             upload_file(sockfd, filename, destination);
-        } 
+        }
+        else if (sscanf(command, "downlf -p %255s", filename) == 1) {
+            if (download_parallel(sockfd, filename) == -1) break;
+        }
+        else if (sscanf(command, "downlf -c %255s", filename) == 1) {
+            // Pick up where an earlier download of the file stopped
+            struct stat st;
+            uint64_t have = stat(local_name(filename), &st) == 0 ? (uint64_t)st.st_size : 0;
+            if (request_range(sockfd, filename, have, 0) == -1) break;
+            download_file(sockfd, filename, have);
+        }
+        else if (sscanf(command, "downlf %255s %llu %llu", filename, &offset, &length) == 3) {
+            if (request_range(sockfd, filename, offset, length) == -1) break;
+            download_file(sockfd, filename, offset);
+        }
+        else if (many && command[0] == 'd') {
+            if (download_many(sockfd, paths, count) == -1) break;
+        }
+        else if (many && command[0] == 'r') {
+            if (remove_many(sockfd, paths, count) == -1) break;
+        }
         else if(sscanf(command, "downlf %s", filename) == 1) {
-            send(sockfd, command, strlen(command), 0);
-            download_file(sockfd, filename);
-            
+            if (proto_send_str(sockfd, PROTO_DOWNLOAD, new_req_id(), filename) == -1) {
+                perror("Failed to send download request");
+                break;
+            }
+            download_file(sockfd, filename, 0);
         }
-        
+
 else if (sscanf(command, "removef %s", filename) == 1) {
-    send(sockfd, command, strlen(command), 0);
-    
-    // Wait for response
-    char response[50];
-    int resp_len = recv(sockfd, response, sizeof(response) - 1, 0);
-    if (resp_len > 0) {
-        response[resp_len] = '\0';
-        printf("Server response: %s\n", response);
-    } else {
-        printf("No response received from server.\n");
+    if (proto_send_str(sockfd, PROTO_REMOVE, new_req_id(), filename) == -1) {
+        perror("Failed to send remove request");
+        break;
     }
+
+    // Wait for response
+    print_response(sockfd);
 }
 
 else if (sscanf(command, "downltar %s", filename) == 1) {
-    send(sockfd, command, strlen(command), 0);
-    
     // Determine correct output filename based on filetype
-    char *output_name;
-    if (strcmp(filename, ".c") == 0) {
-        output_name = "cfiles.tar";
-    } else if (strcmp(filename, ".pdf") == 0) {
-        output_name = "pdfiles.tar"; 
-    } else if (strcmp(filename, ".txt") == 0) {
-        output_name = "txtfiles.tar";
-    } else {
+    const char *output_name = tar_name(filename);
+    if (!output_name) {
         printf("Error: Unsupported file type for tar download\n");
         continue;
     }
-    
-    download_file(sockfd, output_name);
+
+    if (proto_send_str(sockfd, PROTO_TAR, new_req_id(), filename) == -1) {
+        perror("Failed to send tar request");
+        break;
+    }
+    download_file(sockfd, (char *)output_name, 0);
 }
 
 
 
-else if (sscanf(command, "dispfnames %s", filename) == 1) {
-    send(sockfd, command, strlen(command), 0);
-    
-    // Receive and display the file list
-    char file_list[BUFFER_SIZE * 10]; // Large buffer for file list
-    int bytes_received = recv(sockfd, file_list, sizeof(file_list) - 1, 0);
-    if (bytes_received > 0) {
-        file_list[bytes_received] = '\0';
-        printf("Files in %s:\n%s\n", filename, file_list);
-    } else {
-        printf("No files found or error receiving file list.\n");
+else if (sscanf(command, "dispfnames -l %255s", filename) == 1) {
+    if (list_files(sockfd, filename, 1) == -1) break;
+}
+else if (sscanf(command, "dispfnames %255s", filename) == 1) {
+    if (list_files(sockfd, filename, 0) == -1) break;
+}
+else if (strcmp(command, "cachestats") == 0) {
+    if (proto_send_str(sockfd, PROTO_STATS, new_req_id(), "") == -1) {
+        perror("Failed to send stats request");
+        break;
     }
+    print_response(sockfd);
 }
         else {
-            printf("Invalid command format! Use: uploadf <filename> <destination>\n");
+            printf("Invalid command format! Use: uploadf [-c|-p] <filename> <destination>\n");
         }
     }
 
@@ -122,8 +255,46 @@ else if (sscanf(command, "dispfnames %s", filename) == 1) {
     return 0;
 }
 
+// Open a connection to S1. Returns -1 on failure.
+int connect_to_server(void) {
+    struct sockaddr_in server_addr;
+
+    // Create socket
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd == -1) {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    // Server details
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(PORT);
+    inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr);
+
+    // Connect to server
+    if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
+        perror("Connection to S1 failed");
+        close(sockfd);
+        return -1;
+    }
+    xfer_tune(sockfd, XFER_BULK);
+    return sockfd;
+}
+
+// Print the OK/ERROR status string the server sends back for a request
+int print_response(int sockfd) {
+    struct proto_header hdr;
+    char response[BUFFER_SIZE];
+    if (proto_recv_msg(sockfd, &hdr, response, sizeof(response)) == -1) {
+        printf("No response received from server.\n");
+        return -1;
+    }
+    printf("Server response: %s\n", response);
+    return (hdr.type == PROTO_OK) ? 0 : -1;
+}
+
 void upload_file(int sockfd, char *filename, char *destination) {
-    char buffer[BUFFER_SIZE];
     FILE *fp = fopen(filename, "rb");
 
     if (!fp) {
@@ -133,45 +304,865 @@ void upload_file(int sockfd, char *filename, char *destination) {
 
     printf("Uploading %s...\n", filename);
 
-    int bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-        send(sockfd, buffer, bytes_read, 0);
+    // Upload request, then the file contents as one length-prefixed payload
+    char request[BUFFER_SIZE];
+    uint32_t req_id = new_req_id();
+    snprintf(request, sizeof(request), "%s %s", filename, destination);
+    if (proto_send_str(sockfd, PROTO_UPLOAD, req_id, request) == -1 ||
+        proto_send_file(sockfd, req_id, fp) == -1) {
+        perror("File upload failed");
+        fclose(fp);
+        return;
     }
 
     fclose(fp);
     printf("File upload complete!\n");
 
     // Receive acknowledgment only
-    memset(buffer, 0, sizeof(buffer));
-    int ack_len = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-    if (ack_len > 0) {
-        buffer[ack_len] = '\0';
-        printf("Server response: %s\n", buffer);
+    print_response(sockfd);
+}
+
+// Send an upload session request and read the reply into response. Returns
+// the reply type, or -1 if the connection broke.
+int session_request(int sockfd, uint8_t type, const char *request, char *response, size_t size) {
+    struct proto_header hdr;
+    if (proto_send_str(sockfd, type, new_req_id(), request) == -1 ||
+        proto_recv_msg(sockfd, &hdr, response, size) == -1) {
+        perror("Upload request failed");
+        return -1;
+    }
+    return hdr.type;
+}
+
+// Upload filename in pieces through an upload session. If an earlier upload
+// of it was cut off, only what the server does not have yet is sent. Returns
+// -1 if the connection broke; run it again to carry on.
+int upload_resumable(int sockfd, const char *filename, const char *destination) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror("File open failed");
+        if (fd != -1) close(fd);
+        return 0;
+    }
+    uint64_t size = st.st_size;
+
+    char request[BUFFER_SIZE], response[BUFFER_SIZE];
+    snprintf(request, sizeof(request), "%s %s", filename, destination);
+    int type = session_request(sockfd, PROTO_UPLOAD_BEGIN, request, response, sizeof(response));
+    if (type != PROTO_OK) {
+        if (type != -1) printf("Server response: %s\n", response);
+        close(fd);
+        return type == -1 ? -1 : 0;
+    }
+    uint64_t offset = strtoull(response, NULL, 10);
+    // What is there is not a start of this file; send all of it again
+    if (offset > size) offset = 0;
+    if (offset > 0) {
+        printf("Resuming %s at byte %llu of %llu...\n", filename, (unsigned long long)offset,
+               (unsigned long long)size);
     } else {
-        printf("No acknowledgment received.\n");
+        printf("Uploading %s...\n", filename);
+    }
+
+    int mismatches = 0;
+    while (offset < size) {
+        uint64_t len = size - offset < UPLOAD_CHUNK ? size - offset : UPLOAD_CHUNK;
+        type = send_piece(sockfd, filename, destination, fd, offset, len, 0, response, sizeof(response));
+        if (type == -1) {
+            perror("File upload failed");
+            close(fd);
+            return -1;
+        }
+        if (type == PROTO_OK) {
+            offset = strtoull(response, NULL, 10);
+            continue;
+        }
+        // The server has less than we thought; go back to where it is
+        unsigned long long have;
+        if (sscanf(response, "OFFSET_MISMATCH:%llu", &have) == 1 && ++mismatches <= 3) {
+            offset = have;
+            continue;
+        }
+        printf("Server response: %s\n", response);
+        close(fd);
+        return 0;
+    }
+    close(fd);
+
+    snprintf(request, sizeof(request), "%s %s %llu", filename, destination, (unsigned long long)size);
+    type = session_request(sockfd, PROTO_UPLOAD_COMMIT, request, response, sizeof(response));
+    if (type == -1) return -1;
+    if (type == PROTO_OK) printf("File upload complete!\n");
+    printf("Server response: %s\n", response);
+    return 0;
+}
+
+// Send len bytes of fd from offset as an UPLOAD_APPEND piece and read the
+// reply into response. Returns the reply type, or -1 if the connection broke.
+int send_piece(int sockfd, const char *filename, const char *destination, int fd,
+               uint64_t offset, uint64_t len, uint16_t flags, char *response, size_t size) {
+    char request[BUFFER_SIZE];
+    uint32_t req_id = new_req_id();
+    snprintf(request, sizeof(request), "%s %s %llu", filename, destination, (unsigned long long)offset);
+    // The request and the data frame's header go out in one write, held back
+    // until the first file bytes join them
+    unsigned char request_hdr[PROTO_HEADER_SIZE], data_hdr[PROTO_HEADER_SIZE];
+    proto_encode_header(request_hdr, PROTO_UPLOAD_APPEND, flags, req_id, strlen(request));
+    proto_encode_header(data_hdr, PROTO_DATA, 0, req_id, len);
+    struct iovec iov[3] = {
+        { .iov_base = request_hdr, .iov_len = sizeof(request_hdr) },
+        { .iov_base = request, .iov_len = strlen(request) },
+        { .iov_base = data_hdr, .iov_len = sizeof(data_hdr) },
+    };
+    xfer_cork(sockfd, 1);
+    int ret = xfer_sendv(sockfd, iov, 3);
+    if (ret == 0) ret = sendfile_all(sockfd, fd, offset, len);
+    xfer_cork(sockfd, 0);
+
+    struct proto_header hdr;
+    if (ret == -1 || proto_recv_msg(sockfd, &hdr, response, size) == -1) return -1;
+    return hdr.type;
+}
+
+// Upload filename in chunks over several connections at once. The first
+// chunk goes over sockfd and starts the server's part file afresh; the rest
+// are written at their offsets as they arrive.
+int upload_parallel(int sockfd, const char *filename, const char *destination) {
+    struct parallel p = { .filename = filename, .destination = destination };
+    struct stat st;
+    p.fd = open(filename, O_RDONLY);
+    if (p.fd == -1 || fstat(p.fd, &st) == -1) {
+        perror("File open failed");
+        if (p.fd != -1) close(p.fd);
+        return 0;
+    }
+    p.size = st.st_size;
+
+    char request[BUFFER_SIZE], response[BUFFER_SIZE];
+    snprintf(request, sizeof(request), "%s %s", filename, destination);
+    int type = session_request(sockfd, PROTO_UPLOAD_BEGIN, request, response, sizeof(response));
+    if (type == PROTO_OK) {
+        printf("Uploading %s over %d connections...\n", filename, parallel_connections);
+        // Without PROTO_F_RANGE the piece drops what an earlier upload left
+        p.next = p.size < parallel_chunk ? p.size : parallel_chunk;
+        type = send_piece(sockfd, filename, destination, p.fd, 0, p.next, 0, response, sizeof(response));
+    }
+    if (type == -1) {
+        perror("File upload failed");
+        close(p.fd);
+        return -1;
     }
+    if (type != PROTO_OK) {
+        printf("Server response: %s\n", response);
+        close(p.fd);
+        return 0;
+    }
+
+    int ret = run_parallel(&p);
+    close(p.fd);
+    if (ret == -1) {
+        printf("Upload of %s failed.\n", filename);
+        return 0;
+    }
+
+    snprintf(request, sizeof(request), "%s %s %llu", filename, destination, (unsigned long long)p.size);
+    type = session_request(sockfd, PROTO_UPLOAD_COMMIT, request, response, sizeof(response));
+    if (type == -1) return -1;
+    if (type == PROTO_OK) printf("File upload complete!\n");
+    printf("Server response: %s\n", response);
+    return 0;
+}
+
+// Move the chunks of p from p->next on over parallel_connections connections
+// of their own. Returns -1 if any chunk did not make it.
+int run_parallel(struct parallel *p) {
+    uint64_t chunks = (p->size - p->next + parallel_chunk - 1) / parallel_chunk;
+    int n = chunks < (uint64_t)parallel_connections ? (int)chunks : parallel_connections;
+    pthread_t tids[n > 0 ? n : 1];
+    int started = 0;
+    for (; started < n; started++) {
+        if (pthread_create(&tids[started], NULL, parallel_worker, p) != 0) break;
+    }
+    // Whatever could not be started is left to the others
+    if (started == 0 && n > 0) parallel_worker(p);
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    return p->failed ? -1 : 0;
+}
+
+void *parallel_worker(void *arg) {
+    struct parallel *p = arg;
+    int sockfd = connect_to_server();
+    if (sockfd == -1) {
+        __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    char response[BUFFER_SIZE];
+    while (!__atomic_load_n(&p->failed, __ATOMIC_RELAXED)) {
+        uint64_t offset = __atomic_fetch_add(&p->next, parallel_chunk, __ATOMIC_RELAXED);
+        if (offset >= p->size) break;
+        uint64_t len = p->size - offset < parallel_chunk ? p->size - offset : parallel_chunk;
+
+        int ok;
+        if (p->path) {
+            uint64_t size;
+            ok = request_range(sockfd, p->path, offset, len) == 0 &&
+                 recv_piece(sockfd, NULL, &p->fd, offset, &size) == 0 && size == p->size;
+        } else {
+            int type = send_piece(sockfd, p->filename, p->destination, p->fd, offset, len,
+                                  PROTO_F_RANGE, response, sizeof(response));
+            ok = type == PROTO_OK;
+            if (type == PROTO_ERROR) printf("Server response: %s\n", response);
+        }
+        if (!ok) __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+    }
+    close(sockfd);
+    return NULL;
 }
 
 // ========== Download ==========
-void download_file(int sockfd, char *filepath) {
-    char *slash = strrchr(filepath, '/');
-    const char *filename = (slash != NULL) ? slash + 1 : filepath;
 
-    FILE *fp = fopen(filename, "wb");
+// The local file a download of path is saved as
+const char *local_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return (slash != NULL) ? slash + 1 : path;
+}
+
+// Ask for length bytes of path from offset on (0 for the rest of the file)
+int request_range(int sockfd, const char *path, uint64_t offset, uint64_t length) {
+    char request[BUFFER_SIZE];
+    snprintf(request, sizeof(request), "%s\n%llu %llu", path,
+             (unsigned long long)offset, (unsigned long long)length);
+    if (proto_send_str(sockfd, PROTO_DOWNLOAD, new_req_id(), request) == -1) {
+        perror("Failed to send download request");
+        return -1;
+    }
+    return 0;
+}
+
+// The archive downltar saves the files of filetype in, NULL if there is none
+const char *tar_name(const char *filetype) {
+    if (strcmp(filetype, ".c") == 0) return "cfiles.tar";
+    if (strcmp(filetype, ".pdf") == 0) return "pdfiles.tar";
+    if (strcmp(filetype, ".txt") == 0) return "txtfiles.tar";
+    return NULL;
+}
+
+// Save the reply to a download
+void download_file(int sockfd, char *filepath, uint64_t offset) {
+    struct proto_header hdr;
+    if (proto_recv_header(sockfd, &hdr) == -1) {
+        printf("No response received from server.\n");
+        return;
+    }
+    save_download(sockfd, &hdr, filepath, offset);
+}
+
+// Save the download reply whose header is reply. A whole file replaces the
+// local copy; a range is written into it at offset, leaving the rest of it
+// alone.
+void save_download(int sockfd, const struct proto_header *reply, const char *filepath, uint64_t offset) {
+    const char *filename = local_name(filepath);
+    struct proto_header hdr = *reply;
+    if (hdr.type != PROTO_DATA) {
+        char response[BUFFER_SIZE];
+        proto_recv_payload(sockfd, &hdr, response, sizeof(response));
+        printf("Server response: %s\n", response);
+        return;
+    }
+
+    FILE *fp;
+    if (hdr.flags & PROTO_F_RANGE) {
+        unsigned char prefix[PROTO_RANGE_SIZE];
+        if (hdr.length < sizeof(prefix) || recv_all(sockfd, prefix, sizeof(prefix)) == -1) {
+            printf("Download of %s failed.\n", filename);
+            return;
+        }
+        hdr.length -= sizeof(prefix);
+        printf("Downloading %s (bytes %llu-%llu of %llu)...\n", filename, (unsigned long long)offset,
+               (unsigned long long)(offset + hdr.length), (unsigned long long)proto_get_u64(prefix));
+        int fd = open(filename, O_WRONLY | O_CREAT, 0644);
+        fp = fd != -1 ? fdopen(fd, "wb") : NULL;
+        if (fp && fseeko(fp, offset, SEEK_SET) == -1) {
+            fclose(fp);
+            fp = NULL;
+        }
+    } else {
+        fp = fopen(filename, "wb");
+        // A single frame announces the whole size up front
+        if (hdr.flags & PROTO_F_MORE) {
+            printf("Downloading %s...\n", filename);
+        } else {
+            printf("Downloading %s (%llu bytes)...\n", filename, (unsigned long long)hdr.length);
+        }
+    }
     if (!fp) {
         perror("Failed to create local file");
-        return;
     }
 
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
-    printf("Downloading %s...\n", filename);
+    // A NULL fp still drains the payload so the session stays in sync
+    int ret = proto_recv_file(sockfd, &hdr, fp);
+    if (fp && fclose(fp) != 0) ret = -1;
 
-    while ((bytes_received = recv(sockfd, buffer, sizeof(buffer), 0)) > 0) {
-        fwrite(buffer, 1, bytes_received, fp);
-        if (bytes_received < BUFFER_SIZE) break;
+    if (ret == 0 && fp) {
+        printf("Downloaded %s successfully.\n", filename);
+    } else {
+        printf("Download of %s failed.\n", filename);
     }
+}
 
-    fclose(fp);
-    printf("Downloaded %s successfully.\n", filename);
+// Read the reply to a ranged download and write it into *fd at offset, with
+// *size set to the size of the whole file. If *fd is -1, filename is created
+// for it once the reply turns out to be data. Returns 0 if the piece is in,
+// 1 if the server refused it or it could not be written, and -1 if the
+// connection broke.
+int recv_piece(int sockfd, const char *filename, int *fd, uint64_t offset, uint64_t *size) {
+    char response[BUFFER_SIZE];
+    struct proto_header hdr;
+    if (proto_recv_header(sockfd, &hdr) == -1) return -1;
+    if (hdr.type != PROTO_DATA || !(hdr.flags & PROTO_F_RANGE)) {
+        if (proto_recv_payload(sockfd, &hdr, response, sizeof(response)) == -1) return -1;
+        printf("Server response: %s\n", response);
+        return 1;
+    }
+
+    unsigned char prefix[PROTO_RANGE_SIZE];
+    if (hdr.length < sizeof(prefix) || recv_all(sockfd, prefix, sizeof(prefix)) == -1) return -1;
+    *size = proto_get_u64(prefix);
+    uint64_t left = hdr.length - sizeof(prefix);
+
+    int failed = 0;
+    if (*fd == -1) {
+        *fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (*fd == -1) {
+            perror("Failed to create local file");
+            failed = 1;
+        }
+    }
+    while (1) {
+        // Keeps reading after a failed write so the connection stays usable
+        int was_failed = failed;
+        if (xfer_recv_at(sockfd, *fd, offset, left, &failed) == -1) return -1;
+        if (failed && !was_failed) perror("Failed to write local file");
+        offset += left;
+        if (!(hdr.flags & PROTO_F_MORE)) break;
+        if (proto_recv_header(sockfd, &hdr) == -1 || hdr.type != PROTO_DATA) return -1;
+        left = hdr.length;
+    }
+    return failed;
+}
+
+// Download path in chunks over several connections at once. The first chunk
+// comes over sockfd and tells the file's size.
+int download_parallel(int sockfd, const char *path) {
+    const char *filename = local_name(path);
+    struct parallel p = { .path = path, .fd = -1, .next = parallel_chunk };
+    if (request_range(sockfd, path, 0, parallel_chunk) == -1) return -1;
+    int ret = recv_piece(sockfd, filename, &p.fd, 0, &p.size);
+    // Refused by the server, which has said why
+    if (p.fd == -1) return ret == -1 ? -1 : 0;
+
+    int ok = ret == 0;
+    if (ok) {
+        printf("Downloading %s (%llu bytes over %d connections)...\n", filename,
+               (unsigned long long)p.size, parallel_connections);
+        if (p.next < p.size && run_parallel(&p) == -1) ok = 0;
+    }
+    if (close(p.fd) != 0) ok = 0;
+    if (ok) {
+        printf("Downloaded %s successfully.\n", filename);
+    } else {
+        printf("Download of %s failed.\n", filename);
+    }
+    return ret == -1 ? -1 : 0;
+}
+
+// ========== Batch mode ==========
+
+// Batch mode sends the commands of a file without waiting for their replies,
+// up to depth of them at a time, and S1 serves them concurrently. Replies
+// come back in the order the requests finish, each tagged with its req_id; a
+// receiver thread matches them up while the main thread keeps sending, so
+// the two never wait on each other.
+struct batch_slot {
+    uint32_t req_id;            // 0 if free
+    int download;               // the reply is a file to save
+    uint64_t offset;            // where a ranged download goes in the file
+    char command[BUFFER_SIZE];
+    char local[256];            // downloads: file to save it in
+};
+
+struct batch {
+    int sockfd;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct batch_slot *slots;
+    int depth;
+    int in_flight;
+    int sent_all;
+    int broken;
+    int failed;                 // requests that got an ERROR
+};
+
+// Run the commands in `in` (uploadf, downlf with or without a range, removef
+// and downltar). Returns -1 if the connection broke, 1 if a request failed.
+int run_batch(int sockfd, FILE *in, int depth) {
+    struct batch b = { .sockfd = sockfd, .depth = depth };
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.changed, NULL);
+    b.slots = calloc(depth, sizeof(*b.slots));
+    pthread_t receiver;
+    if (!b.slots || pthread_create(&receiver, NULL, batch_receiver, &b) != 0) {
+        perror("Batch setup failed");
+        free(b.slots);
+        return -1;
+    }
+
+    char command[BUFFER_SIZE], filename[256], destination[256];
+    int sent = 0;
+    while (fgets(command, sizeof(command), in)) {
+        command[strcspn(command, "\n")] = 0;
+        if (command[0] == '\0' || command[0] == '#') continue;
+
+        uint8_t type;
+        int download = 0;
+        unsigned long long offset = 0, length;
+        const char *local = NULL;
+        char request[BUFFER_SIZE];
+        FILE *fp = NULL;
+        if (batch_args(command, 2) && sscanf(command, "uploadf %255s %255s", filename, destination) == 2) {
+            fp = fopen(filename, "rb");
+            if (!fp) {
+                perror(filename);
+                continue;
+            }
+            type = PROTO_UPLOAD;
+            snprintf(request, sizeof(request), "%s %s", filename, destination);
+        } else if (batch_args(command, 3) &&
+                   sscanf(command, "downlf %255s %llu %llu", filename, &offset, &length) == 3) {
+            type = PROTO_DOWNLOAD;
+            download = 1;
+            local = local_name(filename);
+            snprintf(request, sizeof(request), "%s\n%llu %llu", filename, offset, length);
+        } else if (batch_args(command, 1) && sscanf(command, "downlf %255s", filename) == 1) {
+            type = PROTO_DOWNLOAD;
+            download = 1;
+            local = local_name(filename);
+            snprintf(request, sizeof(request), "%s", filename);
+        } else if (batch_args(command, 1) && sscanf(command, "removef %255s", filename) == 1) {
+            type = PROTO_REMOVE;
+            snprintf(request, sizeof(request), "%s", filename);
+        } else if (sscanf(command, "downltar %255s", filename) == 1 && tar_name(filename)) {
+            type = PROTO_TAR;
+            download = 1;
+            local = tar_name(filename);
+            snprintf(request, sizeof(request), "%s", filename);
+        } else {
+            printf("Not supported in batch mode: %s\n", command);
+            continue;
+        }
+
+        // Wait for a free slot, and claim it before the reply can arrive
+        pthread_mutex_lock(&b.lock);
+        while (b.in_flight == b.depth && !b.broken) pthread_cond_wait(&b.changed, &b.lock);
+        struct batch_slot *slot = NULL;
+        for (int i = 0; !b.broken && i < b.depth && !slot; i++) {
+            if (b.slots[i].req_id == 0) slot = &b.slots[i];
+        }
+        uint32_t req_id = new_req_id();
+        if (slot) {
+            slot->req_id = req_id;
+            slot->download = download;
+            slot->offset = offset;
+            snprintf(slot->command, sizeof(slot->command), "%s", command);
+            snprintf(slot->local, sizeof(slot->local), "%s", local ? local : "");
+            b.in_flight++;
+            pthread_cond_broadcast(&b.changed);
+        }
+        pthread_mutex_unlock(&b.lock);
+        if (!slot) {
+            if (fp) fclose(fp);
+            break;
+        }
+
+        int ret = proto_send_str(sockfd, type, req_id, request);
+        if (ret == 0 && fp) ret = proto_send_file(sockfd, req_id, fp);
+        if (fp) fclose(fp);
+        if (ret == -1) {
+            perror("Failed to send request");
+            break;
+        }
+        sent++;
+    }
+    if (in != stdin) fclose(in);
+
+    pthread_mutex_lock(&b.lock);
+    b.sent_all = 1;
+    pthread_cond_broadcast(&b.changed);
+    pthread_mutex_unlock(&b.lock);
+    pthread_join(receiver, NULL);
+
+    printf("Batch done: %d requests, %d failed%s.\n", sent, b.failed,
+           b.broken ? ", connection lost" : "");
+    free(b.slots);
+    if (b.broken) return -1;
+    return b.failed ? 1 : 0;
+}
+
+// Whether command has exactly count arguments, none of them an option or a
+// glob pattern: batch mode sends each command as a single request and has no
+// such forms
+int batch_args(const char *command, int count) {
+    char copy[BUFFER_SIZE];
+    char *words[MAX_TARGETS + 1];
+    snprintf(copy, sizeof(copy), "%s", command);
+    if (split_paths(copy, words, MAX_TARGETS + 1) != count + 1) return 0;
+    for (int i = 1; i <= count; i++) {
+        if (words[i][0] == '-' || has_pattern(words[i])) return 0;
+    }
+    return 1;
+}
+
+// Read replies as they come and hand each to the request it answers
+void *batch_receiver(void *arg) {
+    struct batch *b = arg;
+    while (1) {
+        pthread_mutex_lock(&b->lock);
+        while (b->in_flight == 0 && !b->sent_all) pthread_cond_wait(&b->changed, &b->lock);
+        int done = b->in_flight == 0;
+        pthread_mutex_unlock(&b->lock);
+        if (done) break;
+
+        struct proto_header hdr;
+        struct batch_slot *slot = NULL;
+        if (proto_recv_header(b->sockfd, &hdr) == 0) {
+            pthread_mutex_lock(&b->lock);
+            for (int i = 0; i < b->depth && !slot; i++) {
+                if (b->slots[i].req_id != 0 && b->slots[i].req_id == hdr.req_id) slot = &b->slots[i];
+            }
+            pthread_mutex_unlock(&b->lock);
+        }
+        if (!slot) {
+            printf("Lost the connection to S1.\n");
+            pthread_mutex_lock(&b->lock);
+            b->broken = 1;
+            pthread_cond_broadcast(&b->changed);
+            pthread_mutex_unlock(&b->lock);
+            break;
+        }
+
+        // The slot is ours until it is freed below
+        printf("[%s] ", slot->command);
+        if (hdr.type == PROTO_ERROR) b->failed++;
+        if (slot->download) {
+            save_download(b->sockfd, &hdr, slot->local, slot->offset);
+        } else {
+            char response[BUFFER_SIZE];
+            if (proto_recv_payload(b->sockfd, &hdr, response, sizeof(response)) == -1) {
+                snprintf(response, sizeof(response), "(unreadable)");
+            }
+            printf("Server response: %s\n", response);
+        }
+        fflush(stdout);
+
+        pthread_mutex_lock(&b->lock);
+        slot->req_id = 0;
+        b->in_flight--;
+        pthread_cond_broadcast(&b->changed);
+        pthread_mutex_unlock(&b->lock);
+    }
+    return NULL;
+}
+
+// ========== Several files at once ==========
+
+// Split args at blanks into at most max paths; returns how many there are
+int split_paths(char *args, char *paths[], int max) {
+    int count = 0;
+    char *save;
+    for (char *p = strtok_r(args, " \t", &save); p && count < max; p = strtok_r(NULL, " \t", &save)) {
+        paths[count++] = p;
+    }
+    return count;
+}
+
+int has_pattern(const char *path) {
+    return strpbrk(path, "*?[") != NULL;
+}
+
+// Send one request naming all of paths, one per line. Returns -1 if the
+// connection broke.
+int send_many(int sockfd, uint8_t type, char *paths[], int count) {
+    char request[BUFFER_SIZE];
+    size_t len = 0;
+    for (int i = 0; i < count; i++) {
+        int n = snprintf(request + len, sizeof(request) - len, "%s%s", i ? "\n" : "", paths[i]);
+        if (n >= (int)(sizeof(request) - len)) {
+            printf("Too many paths for one request; the rest start at %s\n", paths[i]);
+            request[len] = '\0';
+            break;
+        }
+        len += n;
+    }
+    if (proto_send_str(sockfd, type, new_req_id(), request) == -1) {
+        perror("Failed to send request");
+        return -1;
+    }
+    return 0;
+}
+
+// Note which of paths (which may be patterns) a file the server named answers
+void mark_matched(const char *path, char *paths[], int count, char *matched) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(paths[i], path) == 0 || fnmatch(paths[i], path, FNM_PATHNAME) == 0) matched[i] = 1;
+    }
+}
+
+void report_unmatched(char *paths[], int count, const char *matched) {
+    for (int i = 0; i < count; i++) {
+        if (!matched[i]) printf("No files match %s\n", paths[i]);
+    }
+}
+
+// Remove every file paths name and print what became of each. Returns -1 if
+// the connection broke.
+int remove_many(int sockfd, char *paths[], int count) {
+    if (send_many(sockfd, PROTO_REMOVE_MANY, paths, count) == -1) return -1;
+
+    char matched[MAX_TARGETS] = {0};
+    int removed = 0, failed = 0;
+    struct proto_header hdr;
+    do {
+        if (proto_recv_header(sockfd, &hdr) == -1) {
+            printf("No response received from server.\n");
+            return -1;
+        }
+        if (hdr.type != PROTO_DATA) {
+            char response[BUFFER_SIZE];
+            if (proto_recv_payload(sockfd, &hdr, response, sizeof(response)) == -1) return -1;
+            printf("Server response: %s\n", response);
+            return 0;
+        }
+
+        // Each frame of the report holds whole lines, "<status> <path>"
+        char *report = malloc(hdr.length + 1);
+        if (!report || recv_all(sockfd, report, hdr.length) == -1) {
+            perror("Failed to receive removal report");
+            free(report);
+            return -1;
+        }
+        report[hdr.length] = '\0';
+        char *save;
+        for (char *line = strtok_r(report, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+            char *path = strchr(line, ' ');
+            if (!path) continue;
+            *path++ = '\0';
+            mark_matched(path, paths, count, matched);
+            if (strcmp(line, "REMOVE_SUCCESS") == 0) {
+                printf("Removed %s\n", path);
+                removed++;
+            } else {
+                printf("Failed to remove %s (%s)\n", path, line);
+                failed++;
+            }
+        }
+        free(report);
+    } while (hdr.flags & PROTO_F_MORE);
+
+    report_unmatched(paths, count, matched);
+    printf("Removed %d files, %d failed.\n", removed, failed);
+    return 0;
+}
+
+// Download every file paths name, each saved under its own name as downlf
+// would. They come as one tar archive, a member per frame. Returns -1 if the
+// connection broke.
+int download_many(int sockfd, char *paths[], int count) {
+    if (send_many(sockfd, PROTO_DOWNLOAD_MANY, paths, count) == -1) return -1;
+
+    char matched[MAX_TARGETS] = {0};
+    int files = 0, failed = 0;
+    struct proto_header hdr;
+    do {
+        if (proto_recv_header(sockfd, &hdr) == -1) {
+            printf("No response received from server.\n");
+            return -1;
+        }
+        if (hdr.type != PROTO_DATA) {
+            char response[BUFFER_SIZE];
+            if (proto_recv_payload(sockfd, &hdr, response, sizeof(response)) == -1) return -1;
+            printf("Server response: %s\n", response);
+            return 0;
+        }
+        if (!(hdr.flags & PROTO_F_MORE)) {
+            // The end of the archive
+            if (proto_skip(sockfd, hdr.length) == -1) return -1;
+            break;
+        }
+        int ret = save_member(sockfd, &hdr, paths, count, matched);
+        if (ret == -1) {
+            printf("Download failed: the connection broke.\n");
+            return -1;
+        }
+        if (ret == 0) files++; else failed++;
+    } while (1);
+
+    report_unmatched(paths, count, matched);
+    printf("Downloaded %d files%s.\n", files, failed ? ", some could not be saved" : "");
+    return 0;
+}
+
+// Save the archive member in the frame hdr announces. Returns 0 if it was
+// saved, 1 if it could not be, -1 if the connection broke.
+int save_member(int sockfd, const struct proto_header *hdr, char *paths[], int count, char *matched) {
+    unsigned char header[TAR_HEADER_MAX];
+    char name[PATH_MAX];
+    uint64_t size;
+    size_t have = 0;
+    long header_len = TAR_BLOCK;
+    while (1) {
+        if ((uint64_t)header_len > hdr->length) return -1;
+        if (recv_all(sockfd, header + have, header_len - have) == -1) return -1;
+        have = header_len;
+        header_len = tar_parse_header(header, have, name, sizeof(name), &size);
+        if (header_len == -1 || (size_t)header_len <= have) break;
+    }
+    if (header_len == -1 || (uint64_t)header_len + size > hdr->length) {
+        printf("Malformed archive member.\n");
+        return proto_skip(sockfd, hdr->length - have) == -1 ? -1 : 1;
+    }
+
+    char path[PATH_MAX + 8];
+    snprintf(path, sizeof(path), "~s1/%s", name);
+    mark_matched(path, paths, count, matched);
+    const char *filename = local_name(name);
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) perror("Failed to create local file");
+
+    // Written as it arrives; a NULL fp still drains it
+    int failed = fp == NULL;
+    if (xfer_recv_file(sockfd, fp, size, &failed) == -1) {
+        if (fp) fclose(fp);
+        return -1;
+    }
+    if (fp && fclose(fp) != 0) failed = 1;
+    if (proto_skip(sockfd, hdr->length - header_len - size) == -1) return -1;
+
+    if (failed) {
+        printf("Download of %s failed.\n", path);
+    } else {
+        printf("Downloaded %s as %s (%llu bytes).\n", path, filename, (unsigned long long)size);
+    }
+    return failed;
+}
+
+// Upload every local file paths name (all but the last, which may be glob
+// patterns) to the last one, the destination, as a batch
+int upload_many(int sockfd, char *paths[], int count, int depth) {
+    glob_t files;
+    int flags = 0;
+    for (int i = 0; i < count - 1; i++) {
+        int ret = glob(paths[i], flags, NULL, &files);
+        if (ret == GLOB_NOMATCH) printf("No files match %s\n", paths[i]);
+        if (ret == 0) flags = GLOB_APPEND;
+    }
+    if (!flags) return 0;
+
+    // The uploads go out as batch mode commands, so they are pipelined
+    char *commands = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&commands, &size);
+    if (!out) {
+        perror("Upload failed");
+        globfree(&files);
+        return 0;
+    }
+    for (size_t i = 0; i < files.gl_pathc; i++) {
+        fprintf(out, "uploadf %s %s\n", files.gl_pathv[i], paths[count - 1]);
+    }
+    fclose(out);
+    globfree(&files);
+
+    FILE *in = fmemopen(commands, size, "r");
+    int ret = 0;
+    if (in) {
+        ret = run_batch(sockfd, in, depth);
+    } else {
+        perror("Upload failed");
+    }
+    free(commands);
+    // Failed uploads have been reported; only a broken connection ends the client
+    return ret == -1 ? -1 : 0;
+}
+
+// Print the files under path as the listing arrives, with their size and
+// modification time if long_format is set. Returns -1 if the connection broke.
+int list_files(int sockfd, const char *path, int long_format) {
+    uint16_t format = PROTO_F_FRONT | (long_format ? PROTO_F_STAT : 0);
+    if (proto_send_header(sockfd, PROTO_LIST, format, new_req_id(), strlen(path)) == -1 ||
+        send_all(sockfd, path, strlen(path)) == -1) {
+        perror("Failed to send list request");
+        return -1;
+    }
+
+    struct proto_header hdr;
+    if (proto_recv_header(sockfd, &hdr) == -1) {
+        printf("No files found or error receiving file list.\n");
+        return -1;
+    }
+    if (hdr.type != PROTO_DATA) {
+        char response[BUFFER_SIZE];
+        proto_recv_payload(sockfd, &hdr, response, sizeof(response));
+        printf("Server response: %s\n", response);
+        return 0;
+    }
+    printf("Files in %s:\n", path);
+
+    // The list arrives a page at a time; show each page as soon as it is in.
+    // An entry can straddle two frames, so what is left undecoded carries over.
+    char in[2 * PATH_MAX], name[PATH_MAX] = "";
+    size_t have = 0;
+    int bad = 0;
+    while (1) {
+        uint64_t remaining = hdr.length;
+        while (remaining > 0) {
+            size_t want = remaining < sizeof(in) - have ? remaining : sizeof(in) - have;
+            if (recv_all(sockfd, in + have, want) == -1) {
+                perror("Failed to receive file list");
+                return -1;
+            }
+            have += want;
+            remaining -= want;
+
+            size_t used = 0;
+            uint64_t size, mtime;
+            int n;
+            while (!bad && (n = proto_entry_decode(in + used, have - used, hdr.flags, name,
+                                                   sizeof(name), &size, &mtime)) > 0) {
+                used += n;
+                if (hdr.flags & PROTO_F_STAT) {
+                    char when[32];
+                    time_t t = mtime;
+                    strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+                    printf("%12llu  %s  %s\n", (unsigned long long)size, when, name);
+                } else {
+                    printf("%s\n", name);
+                }
+            }
+            if (!bad && n == -1) {
+                printf("Malformed file list.\n");
+                bad = 1;
+            }
+            // Keep reading a bad list to the end so the connection stays usable
+            if (bad) used = have;
+            memmove(in, in + used, have - used);
+            have -= used;
+        }
+        fflush(stdout);
+        if (!(hdr.flags & PROTO_F_MORE)) break;
+        if (proto_recv_header(sockfd, &hdr) == -1 || hdr.type != PROTO_DATA) return -1;
+    }
+    printf("\n");
+    return 0;
 }
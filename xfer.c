@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "xfer.h"
+
+static size_t chunk_size = XFER_CHUNK_MIN;
+
+// Each thread keeps one chunk-sized buffer for the copying paths
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_once = PTHREAD_ONCE_INIT;
+
+void xfer_set_chunk(size_t bytes) {
+    if (bytes < XFER_CHUNK_MIN) bytes = XFER_CHUNK_MIN;
+    if (bytes > XFER_CHUNK_MAX) bytes = XFER_CHUNK_MAX;
+    chunk_size = bytes;
+}
+
+size_t xfer_chunk(void) {
+    return chunk_size;
+}
+
+static void make_buffer_key(void) {
+    pthread_key_create(&buffer_key, free);
+}
+
+// The calling thread's buffer of xfer_chunk() bytes, NULL if out of memory.
+// The size is stored ahead of the bytes so a later xfer_set_chunk is noticed.
+static char *chunk_buffer(void) {
+    pthread_once(&buffer_once, make_buffer_key);
+    size_t *buffer = pthread_getspecific(buffer_key);
+    if (buffer && buffer[0] >= chunk_size) return (char *)(buffer + 1);
+
+    free(buffer);
+    buffer = malloc(sizeof(size_t) + chunk_size);
+    pthread_setspecific(buffer_key, buffer);
+    if (!buffer) return NULL;
+    buffer[0] = chunk_size;
+    return (char *)(buffer + 1);
+}
+
+int xfer_tune(int fd, int profile) {
+    int one = 1;
+    int ret = 0;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1 && errno != EOPNOTSUPP) {
+        ret = -1;
+    }
+    if (profile != XFER_BULK) return ret;
+
+    // Only ever raised: the kernel may already have grown them further
+    int opts[] = { SO_SNDBUF, SO_RCVBUF };
+    for (int i = 0; i < 2; i++) {
+        int size = 0;
+        socklen_t len = sizeof(size);
+        if (getsockopt(fd, SOL_SOCKET, opts[i], &size, &len) == 0 && size >= XFER_SOCKBUF) continue;
+        size = XFER_SOCKBUF;
+        if (setsockopt(fd, SOL_SOCKET, opts[i], &size, sizeof(size)) == -1) ret = -1;
+    }
+    return ret;
+}
+
+void xfer_cork(int fd, int on) {
+    // Not a TCP socket: nothing is held back there anyway
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+// Write the whole buffer, retrying on short writes and EINTR.
+int send_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int xfer_sendv(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        // Skip what went out; a short write leaves the rest of one entry
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Read exactly len bytes. Returns -1 on error or if the peer closes early.
+int recv_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read what is there of the next want bytes (at least one) into buf
+static ssize_t recv_some(int fd, char *buf, size_t want) {
+    while (1) {
+        ssize_t n = recv(fd, buf, want, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0) errno = ECONNRESET;
+        return n > 0 ? n : -1;
+    }
+}
+
+// A pipe for splice as large as a chunk, so one splice moves one
+static int chunk_pipe(int pipefd[2]) {
+    if (pipe2(pipefd, O_CLOEXEC) == -1) return -1;
+    fcntl(pipefd[1], F_SETPIPE_SZ, (int)chunk_size);
+    return 0;
+}
+
+static void close_pipe(int pipefd[2]) {
+    close(pipefd[0]);
+    close(pipefd[1]);
+}
+
+// Plain copy through user space, for fd pairs neither sendfile nor splice
+// supports.
+static int copy_range(int sock, int fd, off_t offset, uint64_t len) {
+    char *buffer = chunk_buffer();
+    if (!buffer) return -1;
+    while (len > 0) {
+        size_t want = len < chunk_size ? len : chunk_size;
+        ssize_t got = pread(fd, buffer, want, offset);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (got == 0) {
+            errno = EIO;
+            return -1;
+        }
+        if (send_all(sock, buffer, got) == -1) return -1;
+        offset += got;
+        len -= got;
+    }
+    return 0;
+}
+
+// Move n bytes from the pipe to out (at *offset unless offset is NULL)
+static int splice_out(int pipe_fd, int out, loff_t *offset, size_t n) {
+    while (n > 0) {
+        ssize_t moved = splice(pipe_fd, NULL, out, offset, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (moved < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (moved == 0) {
+            errno = EIO;
+            return -1;
+        }
+        n -= moved;
+    }
+    return 0;
+}
+
+// Move file pages to the socket through a pipe with splice.
+static int splice_range(int sock, int fd, off_t offset, uint64_t len) {
+    int pipefd[2];
+    if (chunk_pipe(pipefd) == -1) return copy_range(sock, fd, offset, len);
+
+    int ret = 0;
+    int moved = 0;
+    while (len > 0) {
+        size_t want = len < chunk_size ? len : chunk_size;
+        ssize_t n = splice(fd, &offset, pipefd[1], NULL, want, SPLICE_F_MOVE);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL && !moved) {
+                close_pipe(pipefd);
+                return copy_range(sock, fd, offset, len);
+            }
+            ret = -1;
+            break;
+        }
+        if (n == 0) {
+            errno = EIO;
+            ret = -1;
+            break;
+        }
+        moved = 1;
+        len -= n;
+        if (splice_out(pipefd[0], sock, NULL, n) == -1) {
+            ret = -1;
+            break;
+        }
+    }
+    close_pipe(pipefd);
+    return ret;
+}
+
+int sendfile_all(int sock, int fd, off_t offset, uint64_t len) {
+    while (len > 0) {
+        ssize_t n = sendfile(sock, fd, &offset, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL || errno == ENOSYS) return splice_range(sock, fd, offset, len);
+            return -1;
+        }
+        if (n == 0) {
+            errno = EIO;
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+int xfer_recv_file(int sock, FILE *fp, uint64_t len, int *failed) {
+    char *buffer = chunk_buffer();
+    if (!buffer) return -1;
+    while (len > 0) {
+        size_t want = len < chunk_size ? len : chunk_size;
+        ssize_t n = recv_some(sock, buffer, want);
+        if (n == -1) return -1;
+        if (!*failed && fp && fwrite(buffer, 1, n, fp) != (size_t)n) *failed = 1;
+        len -= n;
+    }
+    return 0;
+}
+
+static int copy_at(int sock, int fd, off_t offset, uint64_t len, int *failed) {
+    char *buffer = chunk_buffer();
+    if (!buffer) return -1;
+    while (len > 0) {
+        size_t want = len < chunk_size ? len : chunk_size;
+        ssize_t n = recv_some(sock, buffer, want);
+        if (n == -1) return -1;
+        for (ssize_t done = 0; !*failed && done < n; ) {
+            ssize_t out = pwrite(fd, buffer + done, n - done, offset + done);
+            if (out < 0 && errno == EINTR) continue;
+            if (out <= 0) *failed = 1;
+            done += out > 0 ? out : 0;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Empty n bytes out of the pipe into the file, or drop them once it failed
+static int pipe_to_file(int pipe_fd, int fd, loff_t *offset, size_t n, int *failed) {
+    if (!*failed && splice_out(pipe_fd, fd, offset, n) == 0) return 0;
+    *failed = 1;
+    char scrap[4096];
+    // What is left in the pipe is less than n, never more
+    while (1) {
+        ssize_t got = read(pipe_fd, scrap, sizeof(scrap));
+        if (got < 0 && errno == EINTR) continue;
+        if (got < (ssize_t)sizeof(scrap)) return 0;
+    }
+}
+
+int xfer_recv_at(int sock, int fd, off_t offset, uint64_t len, int *failed) {
+    int pipefd[2];
+    if (*failed || fd == -1 || chunk_pipe(pipefd) == -1) {
+        if (fd == -1) *failed = 1;
+        return copy_at(sock, fd, offset, len, failed);
+    }
+    // Nonblocking reads so a failed file cannot leave us waiting on the pipe
+    fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+
+    loff_t pos = offset;
+    int moved = 0;
+    int ret = 0;
+    while (len > 0) {
+        size_t want = len < chunk_size ? len : chunk_size;
+        ssize_t n = splice(sock, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL && !moved) {
+                close_pipe(pipefd);
+                return copy_at(sock, fd, pos, len, failed);
+            }
+            ret = -1;
+            break;
+        }
+        if (n == 0) {
+            errno = ECONNRESET;
+            ret = -1;
+            break;
+        }
+        moved = 1;
+        len -= n;
+        pipe_to_file(pipefd[0], fd, &pos, n, failed);
+    }
+    close_pipe(pipefd);
+    return ret;
+}
+
+int xfer_relay(int from_fd, int to_fd, uint64_t len) {
+    int pipefd[2];
+    int spliced = chunk_pipe(pipefd) == 0;
+    while (len > 0) {
+        size_t want = len < chunk_size ? len : chunk_size;
+        if (!spliced) {
+            char *buffer = chunk_buffer();
+            if (!buffer || recv_all(from_fd, buffer, want) == -1 || send_all(to_fd, buffer, want) == -1) {
+                return -1;
+            }
+            len -= want;
+            continue;
+        }
+        ssize_t n = splice(from_fd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EINVAL) {
+            // Sockets splice can not read from: nothing has been moved yet
+            close_pipe(pipefd);
+            spliced = 0;
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) errno = ECONNRESET;
+            close_pipe(pipefd);
+            return -1;
+        }
+        len -= n;
+        if (splice_out(pipefd[0], to_fd, NULL, n) == -1) {
+            close_pipe(pipefd);
+            return -1;
+        }
+    }
+    if (spliced) close_pipe(pipefd);
+    return 0;
+}
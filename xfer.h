@@ -0,0 +1,61 @@
+#ifndef XFER_H
+#define XFER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Moving bytes between sockets and files, for all five programs: whole
+// buffers and iovecs out, exact lengths in, file ranges out with sendfile (or
+// splice), socket payloads into files with splice (or a copy), and the socket
+// options for each kind of connection. Every call carries on after short
+// transfers and EINTR. The framing on top of this is in proto.c; build every
+// program with both (see proto.h).
+
+#define XFER_CHUNK_MIN (64 * 1024)      // bytes moved per step, the default
+#define XFER_CHUNK_MAX (1024 * 1024)
+#define XFER_SOCKBUF   (2 * 1024 * 1024)    // socket buffers of XFER_BULK connections at least
+
+// Socket profiles for xfer_tune
+#define XFER_CONTROL 0   // requests and replies only: TCP_NODELAY
+#define XFER_BULK    1   // file payloads too: TCP_NODELAY and XFER_SOCKBUF buffers
+
+// Set the bytes moved per step, clamped to XFER_CHUNK_MIN..XFER_CHUNK_MAX.
+// Call it before starting threads.
+void xfer_set_chunk(size_t bytes);
+size_t xfer_chunk(void);
+
+// Apply a profile to a connected socket. Options the socket does not have (a
+// Unix socket has no TCP_NODELAY) are skipped. Returns -1 if one failed.
+int xfer_tune(int fd, int profile);
+
+// Hold back partial TCP segments while a frame header and its payload are
+// sent in separate calls (on), then push out what is left (off)
+void xfer_cork(int fd, int on);
+
+// Write the whole buffer / all of iov (which is used up on the way)
+int send_all(int fd, const void *buf, size_t len);
+int xfer_sendv(int fd, struct iovec *iov, int count);
+
+// Read exactly len bytes. Returns -1 on error or if the peer closes early.
+int recv_all(int fd, void *buf, size_t len);
+
+// Send len bytes of fd starting at offset without copying them through user
+// space: sendfile, or splice through a pipe where sendfile is not supported
+// for this pair of descriptors. The file position of fd is left alone.
+// A file that shrinks before len bytes were sent fails with EIO.
+int sendfile_all(int sock, int fd, off_t offset, uint64_t len);
+
+// Receive len bytes from sock into fp (at its position) or into fd at offset.
+// A NULL fp drops the bytes. So does a write error, which sets *failed, or
+// *failed set already: the connection stays usable. Returns -1 only if the
+// connection broke.
+int xfer_recv_file(int sock, FILE *fp, uint64_t len, int *failed);
+int xfer_recv_at(int sock, int fd, off_t offset, uint64_t len, int *failed);
+
+// Pass len bytes from one socket to another, through a pipe where splice
+// supports the pair
+int xfer_relay(int from_fd, int to_fd, uint64_t len);
+
+#endif